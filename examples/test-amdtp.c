@@ -264,6 +264,7 @@ int main (int argc, char *argv[])
 			if (f != stdout)
 				fclose (f);
 		}
+		iec61883_handle_release (handle);
 		raw1394_destroy_handle (handle);
 	} else {
 		fprintf (stderr, "Failed to get libraw1394 handle\n");
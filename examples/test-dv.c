@@ -29,6 +29,7 @@
 #include <stdlib.h>
 
 static int g_done = 0;
+static const char *g_filename = NULL;
 
 static int write_frame (unsigned char *data, int len, int complete, void *callback_data)
 {
@@ -93,7 +94,10 @@ static void dv_transmit( raw1394handle_t handle, FILE *f, int channel)
 	
 	fread (data, 480, 1, f);
 	ispal = (data[ 3 ] & 0x80) != 0;
-	dv = iec61883_dv_xmit_init (handle, ispal, read_frame, (void *)f );
+	if (g_filename)
+		dv = iec61883_dv_xmit_init_file (handle, g_filename);
+	else
+		dv = iec61883_dv_xmit_init (handle, ispal, read_frame, (void *)f );
 	
 	if (dv && iec61883_dv_xmit_start (dv, channel) == 0)
 	{
@@ -156,6 +160,7 @@ int main (int argc, char *argv[])
 				f = fopen (argv[i], "wb");
 			else {
 				f = fopen (argv[i], "rb");
+				g_filename = argv[i];
 				is_transmit = 1;
 			}
 		} else if (!node_specified) {
@@ -209,6 +214,7 @@ int main (int argc, char *argv[])
 			if (f != stdout)
 				fclose (f);
 		}
+		iec61883_handle_release (handle);
 		raw1394_destroy_handle (handle);
 	} else {
 		fprintf (stderr, "Failed to get libraw1394 handle\n");
@@ -29,6 +29,9 @@
 #include <stdlib.h>
 
 static int g_done = 0;
+static int g_packet_size = IEC61883_MPEG2_TSP_SIZE;
+static int g_program = -1;
+static const char *g_filename = NULL;
 
 static int write_packet (unsigned char *data, int len, unsigned int dropped, void *callback_data)
 {
@@ -42,7 +45,7 @@ static int write_packet (unsigned char *data, int len, unsigned int dropped, voi
 static int read_packet (unsigned char *data, int n_packets, unsigned int dropped, void *callback_data)
 {
 	FILE *f = (FILE*) callback_data;
-	return (fread (data, IEC61883_MPEG2_TSP_SIZE * n_packets, 1, f) < 1) ? -1 : 0;
+	return (fread (data, g_packet_size * n_packets, 1, f) < 1) ? -1 : 0;
 }
 
 static void sighandler (int sig)
@@ -87,7 +90,14 @@ static void mpeg2_transmit (raw1394handle_t handle, FILE *f, int pid, int channe
 {	
 	iec61883_mpeg2_t mpeg;
 	
-	mpeg = iec61883_mpeg2_xmit_init (handle, read_packet, (void *)f );
+	if (g_filename)
+		mpeg = iec61883_mpeg2_xmit_init_file (handle, g_filename);
+	else
+		mpeg = iec61883_mpeg2_xmit_init (handle, read_packet, (void *)f );
+	if (mpeg)
+		iec61883_mpeg2_set_program (mpeg, g_program);
+	if (mpeg && g_packet_size == IEC61883_MPEG2_TSP_SPH_SIZE)
+		iec61883_mpeg2_set_timestamp_mode (mpeg, IEC61883_MPEG2_TIMESTAMP_M2TS);
 	if ( mpeg && iec61883_mpeg2_xmit_start (mpeg, pid, channel) == 0)
 	{
 		int fd = raw1394_get_fd (handle);
@@ -133,11 +143,14 @@ int main (int argc, char *argv[])
 			strncmp (argv[i], "--h", 3) == 0)
 		{
 			fprintf (stderr, 
-			"usage: %s [[-r | -t] node-id] [-p pid] [- | file]\n"
+			"usage: %s [[-r | -t] node-id] [-p pid | -P program] [-m] [- | file]\n"
 			"       Use - to transmit MPEG2-TS from stdin, or\n"
 			"       supply a filename to transmit from a MPEG2-TS file.\n"
 			"       Otherwise, capture MPEG2-TS to stdout.\n"
-			"       The default PID for transmit is -1 (use first found).\n",
+			"       The default PID for transmit is -1 (use the PCR of the\n"
+			"       program given with -P, or of the first program).\n"
+			"       Use -m to transmit 192-byte M2TS packets paced by\n"
+			"       their timestamps instead of the PCR.\n",
 				argv[0]);
 			raw1394_destroy_handle (handle);
 			return 1;
@@ -152,11 +165,18 @@ int main (int argc, char *argv[])
 		} else if (strncmp (argv[i], "-p", 2) == 0) {
 			pid = atoi (argv[++i]);
 			is_transmit = 1;
+		} else if (strncmp (argv[i], "-P", 2) == 0) {
+			g_program = atoi (argv[++i]);
+			is_transmit = 1;
+		} else if (strncmp (argv[i], "-m", 2) == 0) {
+			g_packet_size = IEC61883_MPEG2_TSP_SPH_SIZE;
+			is_transmit = 1;
 		} else if (strcmp (argv[i], "-") != 0) {
 			if (node_specified && !is_transmit)
 				f = fopen (argv[i], "wb");
 			else {
 				f = fopen (argv[i], "rb");
+				g_filename = argv[i];
 				is_transmit = 1;
 			}
 		} else if (!node_specified) {
@@ -210,6 +230,7 @@ int main (int argc, char *argv[])
 			if (f != stdout)
 				fclose (f);
 		}
+		iec61883_handle_release (handle);
 		raw1394_destroy_handle (handle);
 	} else {
 		fprintf (stderr, "Failed to get libraw1394 handle\n");
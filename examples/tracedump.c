@@ -0,0 +1,140 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Dan Dennedy
+ *
+ * This example decodes a packet trace written by one of the dump_trace
+ * functions, or by a stream that failed with an error file set, and
+ * prints a line per packet followed by a summary.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "../src/iec61883.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+
+static const char *
+disposition_name (int disposition)
+{
+	switch (disposition) {
+	case RAW1394_ISO_OK:
+		return "ok";
+	case RAW1394_ISO_DEFER:
+		return "defer";
+	case RAW1394_ISO_ERROR:
+		return "ERROR";
+	case RAW1394_ISO_STOP:
+		return "stop";
+	case RAW1394_ISO_STOP_NOSYNC:
+		return "stop-nosync";
+	case RAW1394_ISO_AGAIN:
+		return "again";
+	default:
+		return "?";
+	}
+}
+
+static void
+print_record (struct iec61883_trace_record *r, unsigned long long start)
+{
+	unsigned long long t = r->time - start;
+
+	printf ("%10u %4llu.%06llu %s ch %2d cycle %4d len %4d tag %d",
+		r->sequence, t / 1000000000, (t / 1000) % 1000000,
+		(r->flags & IEC61883_TRACE_XMIT) ? "xmit" : "recv",
+		r->channel, r->cycle, r->len, r->tag);
+	if (r->flags & IEC61883_TRACE_CIP) {
+		unsigned int q0 = ntohl (r->cip[0]);
+		unsigned int q1 = ntohl (r->cip[1]);
+
+		printf (" sid %2d dbs %3d dbc %3d fmt 0x%02x fdf 0x%02x syt 0x%04x",
+			(q0 >> 24) & 0x3f, (q0 >> 16) & 0xff, q0 & 0xff,
+			(q1 >> 24) & 0x3f, (q1 >> 16) & 0xff, q1 & 0xffff);
+	}
+	if (r->flags & IEC61883_TRACE_DROPPED)
+		printf (" dropped %u", r->dropped);
+	printf (" %s\n", disposition_name (r->disposition));
+}
+
+int main (int argc, char *argv[])
+{
+	struct iec61883_trace_header header;
+	struct iec61883_trace_record record;
+	unsigned long long start = 0;
+	unsigned int i, dropped = 0, errors = 0, dbc_breaks = 0, cycle_breaks = 0;
+	int dbc_next = -1, cycle_next = -1;
+	FILE *file;
+
+	if (argc != 2) {
+		fprintf (stderr, "usage: %s trace-file\n", argv[0]);
+		return 1;
+	}
+	file = fopen (argv[1], "rb");
+	if (!file) {
+		perror (argv[1]);
+		return 1;
+	}
+	if (fread (&header, sizeof (header), 1, file) != 1 ||
+		memcmp (header.magic, IEC61883_TRACE_MAGIC, sizeof (header.magic)) != 0) {
+		fprintf (stderr, "%s: not a packet trace\n", argv[1]);
+		return 1;
+	}
+	if (header.version != IEC61883_TRACE_VERSION ||
+		header.record_size != sizeof (struct iec61883_trace_record)) {
+		fprintf (stderr, "%s: trace version %u with %u byte records not supported "
+			"(written on a host of other byte order?)\n", argv[1],
+			header.version, header.record_size);
+		return 1;
+	}
+
+	printf ("%u of %u packets\n", header.records, header.packets);
+	for (i = 0; i < header.records; i++) {
+		if (fread (&record, sizeof (record), 1, file) != 1) {
+			fprintf (stderr, "%s: truncated after %u records\n", argv[1], i);
+			break;
+		}
+		if (i == 0)
+			start = record.time;
+		if (record.cycle < 8000) {
+			if (cycle_next >= 0 && record.cycle != cycle_next)
+				cycle_breaks++;
+			cycle_next = (record.cycle + 1) % 8000;
+		}
+		if ((record.flags & IEC61883_TRACE_CIP) && record.len >= 8) {
+			unsigned int q0 = ntohl (record.cip[0]);
+			unsigned int dbs = (q0 >> 16) & 0xff, dbc = q0 & 0xff;
+
+			if (dbs > 0) {
+				if (dbc_next >= 0 && dbc != dbc_next)
+					dbc_breaks++;
+				// an empty packet carries the count of the next data block
+				dbc_next = (dbc + (record.len - 8) / (dbs * 4)) & 0xff;
+			}
+		}
+		if (record.flags & IEC61883_TRACE_DROPPED)
+			dropped++;
+		if (record.disposition == RAW1394_ISO_ERROR)
+			errors++;
+		print_record (&record, start);
+	}
+	printf ("%u records, %u DBC and %u cycle discontinuities, "
+		"%u with packets dropped, %u errors\n",
+		i, dbc_breaks, cycle_breaks, dropped, errors);
+	fclose (file);
+
+	return 0;
+}
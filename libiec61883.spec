@@ -20,7 +20,7 @@ functionality, this library acts as a filter that accepts DV-frames,
 MPEG-2 frames or audio samples from the application and breaks these
 down to isochronous packets, which are transmitted using libraw1394.
 
-Requires: libraw1394 >= 1.2.0
+Requires: libraw1394 >= 1.3.0
 
 %package devel
 Summary:  Development libs for libiec61883
@@ -47,6 +47,7 @@ iec61883_amdtp_xmit_init (raw1394handle_t handle,
 	int fdf, syt_interval;
 	struct iec61883_amdtp *amdtp;
 
+	iec61883_log_start ();
 	amdtp = malloc (sizeof (struct iec61883_amdtp));
 	if (!amdtp) {
 		errno = ENOMEM;
@@ -126,6 +127,10 @@ iec61883_amdtp_xmit_init (raw1394handle_t handle,
 	amdtp->buffer_packets = 1000;
 	amdtp->prebuffer_packets = 1000;
 	amdtp->irq_interval = 250;
+	amdtp->dma_mode = RAW1394_DMA_PACKET_PER_BUFFER;
+	amdtp->ring = NULL;
+	amdtp->trace = NULL;
+	iec61883_stats_init (&amdtp->stats);
 	amdtp->synch = 0;
 	amdtp->speed = RAW1394_ISO_SPEED_100;
 
@@ -144,8 +149,9 @@ amdtp_xmit_handler (raw1394handle_t handle,
 		unsigned char *tag, unsigned char *sy,
 		int cycle, unsigned int dropped)
 {
-	struct iec61883_amdtp *amdtp = raw1394_get_userdata (handle);
+	struct iec61883_amdtp *amdtp = iec61883_dispatch_get (handle);
 	struct iec61883_packet *packet = (struct iec61883_packet *) data;
+	unsigned long long start;
 	int nevents;
 	quadlet_t *event = (quadlet_t *) packet->data;
 	enum raw1394_iso_disposition result = RAW1394_ISO_OK;
@@ -153,6 +159,7 @@ amdtp_xmit_handler (raw1394handle_t handle,
 	int diff_sync;
 	
 	assert (amdtp != NULL);
+	iec61883_stats_packet_begin (&amdtp->stats, handle, cycle);
 	amdtp->total_dropped += dropped;
 
 	/* If packets got dropped, we have to resynchronize the generation
@@ -165,6 +172,7 @@ amdtp_xmit_handler (raw1394handle_t handle,
 	if (dropped) {
 		DEBUG ("dropped packets detected.");
 		iec61883_cip_resync(&amdtp->cip, cycle);
+		amdtp->stats.work.resyncs++;
 	}
 
 	/* The following is a workaround for a possible bug in the kernel
@@ -177,6 +185,7 @@ amdtp_xmit_handler (raw1394handle_t handle,
 	if (diff_sync > 5) {
 		DEBUG ("lost SYT sync, resynchronizing.");
 		iec61883_cip_resync(&amdtp->cip, cycle);
+		amdtp->stats.work.resyncs++;
 	}
 
 	nevents = iec61883_cip_fill_header (handle, &amdtp->cip, packet);
@@ -196,10 +205,12 @@ amdtp_xmit_handler (raw1394handle_t handle,
 	memset (packet->data, '\0', nsamples * amdtp->dimension * sizeof (quadlet_t));
 
 	if (nevents > 0) {
+		start = iec61883_now_ns ();
 		if( amdtp->get_data (amdtp, packet->data, nevents, packet->dbc, dropped, 
 				     amdtp->callback_data) < 0 ) {
 			result = RAW1394_ISO_ERROR;
 		}
+		iec61883_stats_callback_end (&amdtp->stats, start, result == RAW1394_ISO_ERROR);
 	}
 
 	if (result == RAW1394_ISO_OK ) {
@@ -290,6 +301,11 @@ amdtp_xmit_handler (raw1394handle_t handle,
 		*tag = IEC61883_TAG_WITH_CIP;
 		*sy = 0;
 	}
+	iec61883_stats_packet_end (&amdtp->stats, result == RAW1394_ISO_OK ? *len : 0, dropped);
+	if (amdtp->trace)
+		iec61883_trace_packet (amdtp->trace, amdtp->stats.last_packet, data,
+			result == RAW1394_ISO_OK ? *len : 0, amdtp->channel, IEC61883_TAG_WITH_CIP,
+			cycle, dropped, IEC61883_TRACE_XMIT, result);
 
 	return result;
 }
@@ -303,6 +319,8 @@ iec61883_amdtp_xmit_start (struct iec61883_amdtp *amdtp, int channel)
 	assert (amdtp != NULL);
 	max_packet_size = iec61883_cip_get_max_packet_size (&amdtp->cip);
 
+	if (iec61883_dispatch_attach (amdtp->handle, amdtp) < 0)
+		return -1;
 	result = raw1394_iso_xmit_init (amdtp->handle, amdtp_xmit_handler,
 					amdtp->buffer_packets,
 					max_packet_size, channel,
@@ -312,17 +330,58 @@ iec61883_amdtp_xmit_start (struct iec61883_amdtp *amdtp, int channel)
 		amdtp->channel = channel;
 		result = raw1394_iso_xmit_start (amdtp->handle, 0,
 						 amdtp->prebuffer_packets);
+		if (result != 0)
+			raw1394_iso_shutdown (amdtp->handle);
 	}
+	if (result != 0)
+		iec61883_dispatch_detach (amdtp->handle, amdtp);
 
 	return result;
 }
 
+static int
+amdtp_ring_get (iec61883_amdtp_t amdtp, unsigned char *data, int nevents,
+	unsigned int dbc, unsigned int dropped, void *callback_data)
+{
+	return iec61883_ring_get (data, nevents, dropped, callback_data);
+}
+
+iec61883_amdtp_t
+iec61883_amdtp_xmit_init_ring (raw1394handle_t handle,
+		int rate,
+		int format,
+		int sample_format,
+		int mode,
+		int dimension,
+		unsigned int size,
+		unsigned int watermark)
+{
+	iec61883_ring_t ring;
+	struct iec61883_amdtp *amdtp;
+
+	ring = iec61883_ring_open (size, watermark, sizeof (quadlet_t));
+	if (!ring)
+		return NULL;
+	amdtp = iec61883_amdtp_xmit_init (handle, rate, format, sample_format, mode,
+		dimension, amdtp_ring_get, ring);
+	if (!amdtp) {
+		iec61883_ring_close (ring);
+		return NULL;
+	}
+	/* an event is a quadlet per audio channel, of which IEC958 has two */
+	iec61883_ring_set_unit (ring, amdtp->dimension * sizeof (quadlet_t));
+	amdtp->ring = ring;
+
+	return amdtp;
+}
+
 iec61883_amdtp_t
 iec61883_amdtp_recv_init (raw1394handle_t handle,
 		iec61883_amdtp_recv_t put_data, void *callback_data)
 {
 	struct iec61883_amdtp *amdtp;
 	
+	iec61883_log_start ();
 	amdtp = malloc (sizeof (struct iec61883_amdtp));
 	if (!amdtp) {
 		errno = ENOMEM;
@@ -335,6 +394,10 @@ iec61883_amdtp_recv_init (raw1394handle_t handle,
 	amdtp->callback_data = callback_data;
 	amdtp->buffer_packets = 1000;
 	amdtp->irq_interval = 250;
+	amdtp->dma_mode = RAW1394_DMA_PACKET_PER_BUFFER;
+	amdtp->ring = NULL;
+	amdtp->trace = NULL;
+	iec61883_stats_init (&amdtp->stats);
 	amdtp->synch = 0;
 
 	raw1394_set_userdata (handle, amdtp);
@@ -342,8 +405,35 @@ iec61883_amdtp_recv_init (raw1394handle_t handle,
 	return amdtp;
 }
 
+static int
+amdtp_ring_put (iec61883_amdtp_t amdtp, unsigned char *data, int nsamples,
+	unsigned int dbc, unsigned int dropped, void *callback_data)
+{
+	return iec61883_ring_put (data, nsamples * sizeof (quadlet_t), dropped, callback_data);
+}
+
+iec61883_amdtp_t
+iec61883_amdtp_recv_init_ring (raw1394handle_t handle, unsigned int size,
+		unsigned int watermark)
+{
+	iec61883_ring_t ring;
+	struct iec61883_amdtp *amdtp;
+
+	ring = iec61883_ring_open (size, watermark, sizeof (quadlet_t));
+	if (!ring)
+		return NULL;
+	amdtp = iec61883_amdtp_recv_init (handle, amdtp_ring_put, ring);
+	if (!amdtp) {
+		iec61883_ring_close (ring);
+		return NULL;
+	}
+	amdtp->ring = ring;
+
+	return amdtp;
+}
+
 static enum raw1394_iso_disposition
-amdtp_recv_handler (raw1394handle_t handle,
+amdtp_recv_packet (struct iec61883_amdtp *amdtp,
 		unsigned char *data,
 		unsigned int len,
 		unsigned char channel,
@@ -352,12 +442,11 @@ amdtp_recv_handler (raw1394handle_t handle,
 		unsigned int cycle, 
 		unsigned int dropped)
 {
-	struct iec61883_amdtp *amdtp = raw1394_get_userdata (handle);
 	enum raw1394_iso_disposition result = RAW1394_ISO_OK;
 	struct iec61883_packet *packet = (struct iec61883_packet *) data;
+	unsigned long long start;
 	int label;
 
-	assert (amdtp != NULL);
 	amdtp->total_dropped += dropped;
 	
 	/* We only support AM824 data for the moment. */
@@ -452,9 +541,12 @@ amdtp_recv_handler (raw1394handle_t handle,
 			for (i = 0; i < nsamples; i++)
 				event[i] = ntohl (event[i]);
 				
+			start = iec61883_now_ns ();
 			if (amdtp->put_data (amdtp, packet->data, nsamples, packet->dbc, dropped,
 				amdtp->callback_data) < 0)
 				result = RAW1394_ISO_ERROR;
+			iec61883_stats_callback_end (&amdtp->stats, start,
+				result == RAW1394_ISO_ERROR);
 		}
 	}
 	if (result == RAW1394_ISO_OK && dropped)
@@ -463,18 +555,58 @@ amdtp_recv_handler (raw1394handle_t handle,
 	return result;
 }
 
+enum raw1394_iso_disposition
+iec61883_amdtp_recv_packet (struct iec61883_amdtp *amdtp,
+		unsigned char *data,
+		unsigned int len,
+		unsigned char channel,
+		unsigned char tag,
+		unsigned char sy,
+		unsigned int cycle,
+		unsigned int dropped)
+{
+	enum raw1394_iso_disposition result;
+
+	assert (amdtp != NULL);
+	iec61883_stats_packet_begin (&amdtp->stats, amdtp->handle, cycle);
+	if (tag == IEC61883_TAG_WITH_CIP)
+		iec61883_stats_dbc (&amdtp->stats, data, len);
+	result = amdtp_recv_packet (amdtp, data, len, channel, tag, sy, cycle, dropped);
+	iec61883_stats_packet_end (&amdtp->stats, len, dropped);
+	if (amdtp->trace)
+		iec61883_trace_packet (amdtp->trace, amdtp->stats.last_packet, data, len,
+			channel, tag, cycle, dropped, 0, result);
+	return result;
+}
+
+static enum raw1394_iso_disposition
+amdtp_recv_handler (raw1394handle_t handle,
+		unsigned char *data,
+		unsigned int len,
+		unsigned char channel,
+		unsigned char tag,
+		unsigned char sy,
+		unsigned int cycle, 
+		unsigned int dropped)
+{
+	return iec61883_amdtp_recv_packet (iec61883_dispatch_get (handle), data, len, channel,
+		tag, sy, cycle, dropped);
+}
+
 int
 iec61883_amdtp_recv_start (struct iec61883_amdtp *amdtp, int channel)
 {
 	int result = 0;
 
 	assert (amdtp != NULL);
+	if (iec61883_dispatch_attach (amdtp->handle, amdtp) < 0)
+		return -1;
 	result = raw1394_iso_recv_init (amdtp->handle,
 		amdtp_recv_handler,
 		amdtp->buffer_packets,
 		AMDTP_MAX_PACKET_SIZE,
 		channel,
-		RAW1394_DMA_PACKET_PER_BUFFER,
+		amdtp->dma_mode,
 		amdtp->irq_interval);
 
 	if (result == 0) {
@@ -485,7 +617,11 @@ iec61883_amdtp_recv_start (struct iec61883_amdtp *amdtp, int channel)
 					 * packet. */
 
 		result = raw1394_iso_recv_start (amdtp->handle, -1, -1, 0);
+		if (result != 0)
+			raw1394_iso_shutdown (amdtp->handle);
 	}
+	if (result != 0)
+		iec61883_dispatch_detach (amdtp->handle, amdtp);
 	return result;
 }
 
@@ -493,18 +629,28 @@ void
 iec61883_amdtp_recv_stop (struct iec61883_amdtp *amdtp)
 {
 	assert (amdtp != NULL);
+	if (iec61883_dispatch_get (amdtp->handle) != amdtp)
+		return;
 	if (amdtp->synch)
 		raw1394_iso_recv_flush (amdtp->handle);
 	raw1394_iso_shutdown (amdtp->handle);
+	// the handler looks the stream up until the context is shut down
+	iec61883_dispatch_detach (amdtp->handle, amdtp);
+	iec61883_trace_flush (amdtp->trace);
 }
 
 void
 iec61883_amdtp_xmit_stop (struct iec61883_amdtp *amdtp)
 {
 	assert (amdtp != NULL);
+	if (iec61883_dispatch_get (amdtp->handle) != amdtp)
+		return;
 	if (amdtp->synch)
 		raw1394_iso_xmit_sync (amdtp->handle);
 	raw1394_iso_shutdown (amdtp->handle);
+	// the handler looks the stream up until the context is shut down
+	iec61883_dispatch_detach (amdtp->handle, amdtp);
+	iec61883_trace_flush (amdtp->trace);
 }
 
 void
@@ -515,6 +661,10 @@ iec61883_amdtp_close (struct iec61883_amdtp *amdtp)
 		iec61883_amdtp_recv_stop (amdtp);
 	if (amdtp->get_data)
 		iec61883_amdtp_xmit_stop (amdtp);
+	if (amdtp->ring)
+		iec61883_ring_close (amdtp->ring);
+	if (amdtp->trace)
+		iec61883_trace_close (amdtp->trace);
 	free (amdtp);
 }
 
@@ -560,6 +710,108 @@ iec61883_amdtp_set_irq_interval (iec61883_amdtp_t amdtp, unsigned int packets)
 	amdtp->irq_interval = packets;
 }
 
+enum raw1394_iso_dma_recv_mode
+iec61883_amdtp_get_dma_mode (iec61883_amdtp_t amdtp)
+{
+	assert (amdtp != NULL);
+	return amdtp->dma_mode;
+}
+
+void
+iec61883_amdtp_set_dma_mode (iec61883_amdtp_t amdtp, enum raw1394_iso_dma_recv_mode mode)
+{
+	assert (amdtp != NULL);
+	amdtp->dma_mode = mode;
+}
+
+int
+iec61883_amdtp_read (iec61883_amdtp_t amdtp, void *data, unsigned int len, int timeout)
+{
+	assert (amdtp != NULL);
+	if (!amdtp->ring || !amdtp->put_data) {
+		errno = EINVAL;
+		return -1;
+	}
+	return iec61883_ring_read (amdtp->ring, data, len, timeout);
+}
+
+int
+iec61883_amdtp_write (iec61883_amdtp_t amdtp, const void *data, unsigned int len, int timeout)
+{
+	assert (amdtp != NULL);
+	if (!amdtp->ring || !amdtp->get_data) {
+		errno = EINVAL;
+		return -1;
+	}
+	return iec61883_ring_write (amdtp->ring, data, len, timeout);
+}
+
+int
+iec61883_amdtp_get_ring_stats (iec61883_amdtp_t amdtp, struct iec61883_ring_stats *stats)
+{
+	assert (amdtp != NULL);
+	assert (stats != NULL);
+	if (!amdtp->ring) {
+		errno = EINVAL;
+		return -1;
+	}
+	iec61883_ring_get_stats (amdtp->ring, stats);
+	return 0;
+}
+
+int
+iec61883_amdtp_get_stats (iec61883_amdtp_t amdtp, struct iec61883_stats *stats, int reset)
+{
+	assert (amdtp != NULL);
+	assert (stats != NULL);
+	iec61883_stats_get (&amdtp->stats, stats, reset);
+	return 0;
+}
+
+void
+iec61883_amdtp_set_profiling (iec61883_amdtp_t amdtp, int enable)
+{
+	assert (amdtp != NULL);
+	iec61883_stats_set_profiling (&amdtp->stats, enable, amdtp->irq_interval);
+}
+
+void
+iec61883_amdtp_get_profile (iec61883_amdtp_t amdtp, struct iec61883_profile *profile, int reset)
+{
+	assert (amdtp != NULL);
+	assert (profile != NULL);
+	iec61883_stats_get_profile (&amdtp->stats, profile, reset);
+}
+
+int
+iec61883_amdtp_set_trace (iec61883_amdtp_t amdtp, unsigned int records, const char *error_file)
+{
+	iec61883_trace_t trace = NULL;
+
+	assert (amdtp != NULL);
+	if (records > 0) {
+		trace = iec61883_trace_open (records, error_file);
+		if (!trace)
+			return -1;
+	}
+	if (amdtp->trace)
+		iec61883_trace_close (amdtp->trace);
+	amdtp->trace = trace;
+	return 0;
+}
+
+int
+iec61883_amdtp_dump_trace (iec61883_amdtp_t amdtp, const char *filename)
+{
+	assert (amdtp != NULL);
+	assert (filename != NULL);
+	if (!amdtp->trace) {
+		errno = EINVAL;
+		return -1;
+	}
+	return iec61883_trace_dump (amdtp->trace, filename);
+}
+
 int
 iec61883_amdtp_get_synch (iec61883_amdtp_t amdtp)
 {
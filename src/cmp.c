@@ -26,10 +26,30 @@
 #include "cooked.h"
 
 #include <stdio.h>
+#include <errno.h>
+#include <assert.h>
 #include <libraw1394/csr.h>
 #include <netinet/in.h>
 
 
+/* bandwidth allocation units of a stream, from the IEC 61883-1 oPCR fields */
+static int
+bandwidth_units (int overhead_id, int payload, int speed)
+{
+	if (overhead_id > 0)
+		return (overhead_id * 32) + (payload + 3) * (1 << (2 - speed)) * 4;
+	else
+		return 512 + (payload + 3) * (1 << (2 - speed)) * 4;
+}
+
+int
+iec61883_cmp_pcr_bandwidth (const struct iec61883_oPCR *opcr, int speed)
+{
+	if (speed < 0 || speed > 2)
+		speed = opcr->data_rate;
+	return bandwidth_units (opcr->overhead_id, opcr->payload, speed);
+}
+
 int
 iec61883_cmp_calc_bandwidth (raw1394handle_t handle, nodeid_t from, int plug,
 		int speed)
@@ -49,94 +69,272 @@ iec61883_cmp_calc_bandwidth (raw1394handle_t handle, nodeid_t from, int plug,
 			WARN ("%s: Failed to get the oPCR[%d] plug for node %d.", __FUNCTION__,
 				plug, (int) from & 0x3f);
 		} else {
-			if (speed < 0 || speed > 2)
-				speed = opcr.data_rate;
-			if (opcr.overhead_id > 0)
-				bwu = (opcr.overhead_id * 32) + (opcr.payload + 3) * (1 << (2 - speed)) * 4;
-			else
-				bwu = 512 + (opcr.payload + 3) * (1 << (2 - speed)) * 4;
+			bwu = iec61883_cmp_pcr_bandwidth (&opcr, speed);
 		}
 	}
 	
 	return bwu;
 }
 
+/* the largest payload in quadlets, CIP header included, a stream sends */
+static int
+stream_payload (const struct iec61883_stream_plan *stream)
+{
+	int samples;
+
+	switch (stream->type) {
+	case IEC61883_STREAM_AMDTP:
+		if (stream->dimension < 1)
+			return -1;
+		switch (stream->rate) {
+		case 32000:
+		case 44100:
+		case 48000:
+			samples = 8;
+			break;
+		case 88200:
+		case 96000:
+			samples = 16;
+			break;
+		case 176400:
+		case 192000:
+			samples = 32;
+			break;
+		default:
+			return -1;
+		}
+		// non-blocking packets carry the samples of one cycle, rounded up
+		if (stream->mode == IEC61883_MODE_NON_BLOCKING)
+			samples = (stream->rate + 7999) / 8000;
+		return 2 + samples * stream->dimension;
+
+	case IEC61883_STREAM_DV:
+		// one DIF block sequence per packet, for 525-60 and 625-50 alike
+		return 2 + 480 / 4;
+
+	case IEC61883_STREAM_MPEG2:
+		if (stream->bitrate == 0)
+			return -1;
+		// whole 192 byte source packets, enough for the transport stream rate
+		return 2 + 48 * ((stream->bitrate + 8000 * 188 * 8 - 1) / (8000 * 188 * 8));
+	}
+	return -1;
+}
+
 int
-iec61883_cmp_create_p2p (raw1394handle_t handle, 
-		nodeid_t output_node, int output_plug,
-		nodeid_t input_node, int input_plug,	
-		unsigned int channel, unsigned int speed)
+iec61883_cmp_plan_bandwidth (struct iec61883_stream_plan *streams, int n_streams)
 {
-	struct iec61883_oPCR opcr, save_opcr;
-	struct iec61883_iPCR ipcr;
-	
-	DEBUG ("%s", __FUNCTION__);
-	
-	if (iec61883_get_oPCRX (handle, output_node, &opcr, output_plug) < 0) {
-		WARN ("%s: Failed to get the oPCR[%d] plug for node %d.", __FUNCTION__,
+	int i, payload, total = 0;
+
+	assert (streams != NULL || n_streams == 0);
+	for (i = 0; i < n_streams; i++) {
+		payload = stream_payload (&streams[i]);
+		if (payload < 0 || payload >> 10 != 0 || streams[i].speed < 0 ||
+			streams[i].speed > 2 || streams[i].overhead_id >> 4 != 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		streams[i].payload = payload;
+		streams[i].bandwidth = bandwidth_units (streams[i].overhead_id, payload,
+			streams[i].speed);
+		total += streams[i].bandwidth;
+	}
+	return total;
+}
+
+int
+iec61883_cmp_admit (raw1394handle_t handle, struct iec61883_stream_plan *streams,
+		int n_streams, int *available)
+{
+	quadlet_t bandwidth;
+	int total;
+
+	assert (handle != NULL);
+	total = iec61883_cmp_plan_bandwidth (streams, n_streams);
+	if (total < 0)
+		return -1;
+	if (iec61883_cooked_read (handle, raw1394_get_irm_id (handle),
+		CSR_REGISTER_BASE + CSR_BANDWIDTH_AVAILABLE, sizeof (quadlet_t), &bandwidth) < 0)
+		return -1;
+	bandwidth = ntohl (bandwidth) & 0x1fff;
+	if (available)
+		*available = bandwidth;
+	return total <= bandwidth;
+}
+
+/* maximum number of compare-swap attempts on a contended register */
+#define MAX_LOCK_TRIES 20
+
+/*
+ * A change of a PCR by connection management. The fields used here are at
+ * the same bits in an iPCR as in an oPCR; data_rate only exists in an oPCR.
+ */
+struct pcr_change {
+	int channel;        /* the new channel, or -1 to keep it */
+	int data_rate;      /* the new data rate, or -1 to keep it */
+	int bcast;          /* set the broadcast connection */
+	int p2p;            /* add a point-to-point connection */
+	int overlay;        /* add it only if there is no broadcast connection */
+};
+
+static void
+pcr_apply (struct iec61883_oPCR *pcr, const struct pcr_change *change)
+{
+	if (change->channel >= 0)
+		pcr->channel = change->channel;
+	if (change->data_rate >= 0)
+		pcr->data_rate = change->data_rate;
+	if (change->p2p && !(change->overlay && pcr->bcast_connection) &&
+		pcr->n_p2p_connections < 63)
+		pcr->n_p2p_connections++;
+	if (change->bcast)
+		pcr->bcast_connection = 1;
+}
+
+/*
+ * Read-modify-write a PCR. The compare-swap fails if the register changed
+ * since it was read, and then the cache holds the current value, so the
+ * change is made again on that, unless somebody else has connected the
+ * plug on another channel meanwhile. *save receives the value replaced.
+ */
+static int
+pcr_modify (raw1394handle_t handle, nodeid_t node, nodeaddr_t addr,
+	const struct pcr_change *change, struct iec61883_oPCR *save)
+{
+	struct iec61883_oPCR pcr;
+	int i, result;
+
+	for (i = 0; i < MAX_LOCK_TRIES; i++) {
+		if (iec61883_plug_get_cached (handle, node, addr, (quadlet_t *) &pcr) < 0)
+			return -1;
+		if (i > 0 && change->channel >= 0 && pcr.channel != change->channel &&
+			(pcr.n_p2p_connections > 0 || pcr.bcast_connection)) {
+			errno = EBUSY;
+			return -1;
+		}
+		*save = pcr;
+		pcr_apply (&pcr, change);
+		if (*((quadlet_t *) &pcr) == *((quadlet_t *) save))
+			return 0;
+		result = iec61883_plug_compare_swap (handle, node, addr,
+			*((quadlet_t *) save), *((quadlet_t *) &pcr));
+		if (result != -EAGAIN)
+			return result;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+/*
+ * Take back a change made by pcr_modify() from save, keeping what others
+ * changed since.
+ */
+static void
+pcr_undo (raw1394handle_t handle, nodeid_t node, nodeaddr_t addr,
+	const struct pcr_change *change, const struct iec61883_oPCR *save)
+{
+	struct iec61883_oPCR done = *save, pcr, old;
+	int i, result = -1;
+
+	pcr_apply (&done, change);
+	for (i = 0; i < MAX_LOCK_TRIES; i++) {
+		if (iec61883_plug_get_cached (handle, node, addr, (quadlet_t *) &pcr) < 0)
+			break;
+		old = pcr;
+		if (change->channel >= 0 && pcr.channel == done.channel)
+			pcr.channel = save->channel;
+		if (change->data_rate >= 0 && pcr.data_rate == done.data_rate)
+			pcr.data_rate = save->data_rate;
+		if (done.n_p2p_connections != save->n_p2p_connections && pcr.n_p2p_connections > 0)
+			pcr.n_p2p_connections--;
+		if (done.bcast_connection != save->bcast_connection)
+			pcr.bcast_connection = 0;
+		result = iec61883_plug_compare_swap (handle, node, addr,
+			*((quadlet_t *) &old), *((quadlet_t *) &pcr));
+		if (result != -EAGAIN)
+			break;
+	}
+	if (result < 0)
+		WARN ("%s: Failed to undo changes on the PCR at 0x%x for node %d.", __FUNCTION__,
+			(unsigned int) addr, (int) node & 0x3f);
+}
+
+/* change an oPCR and then an iPCR, taking back the first if the second fails */
+static int
+pcr_modify_pair (raw1394handle_t handle,
+		nodeid_t output_node, int output_plug, const struct pcr_change *ochange,
+		nodeid_t input_node, int input_plug, const struct pcr_change *ichange,
+		const char *function)
+{
+	struct iec61883_oPCR save_opcr, save_ipcr;
+
+	if (pcr_modify (handle, output_node, CSR_O_PCR_0 + 4 * output_plug, ochange,
+		&save_opcr) < 0) {
+		WARN ("%s: Failed to set the oPCR[%d] plug for node %d.", function,
 			output_plug, (int) output_node & 0x3f);
 		return -1;
 	}
-	if (iec61883_get_iPCRX (handle, input_node, &ipcr, input_plug) < 0) {
-		WARN ("%s: Failed to get the iPCR[%d] plug for node %d.", __FUNCTION__,
+	if (pcr_modify (handle, input_node, CSR_I_PCR_0 + 4 * input_plug, ichange,
+		&save_ipcr) < 0) {
+		WARN ("%s: Failed to set the iPCR[%d] plug for node %d.", function,
 			input_plug, (int) input_node & 0x3f);
+		pcr_undo (handle, output_node, CSR_O_PCR_0 + 4 * output_plug, ochange, &save_opcr);
 		return -1;
 	}
+	return 0;
+}
 
-	save_opcr = opcr;
-	opcr.channel = ipcr.channel = channel;
-	opcr.data_rate = speed;
-	if (opcr.n_p2p_connections < 63)
-		opcr.n_p2p_connections++;
-	if (ipcr.n_p2p_connections < 63)
-		ipcr.n_p2p_connections++;
-	
-	if (iec61883_set_oPCRX (handle, output_node, opcr, output_plug) < 0) {
-		WARN ("%s: Failed to set the oPCR[%d] plug for node %d.", __FUNCTION__,
+static int
+pcr_modify_output (raw1394handle_t handle, nodeid_t output_node, int output_plug,
+	const struct pcr_change *change, const char *function)
+{
+	struct iec61883_oPCR save;
+
+	if (pcr_modify (handle, output_node, CSR_O_PCR_0 + 4 * output_plug, change, &save) < 0) {
+		WARN ("%s: Failed to set the oPCR[%d] plug for node %d.", function,
 			output_plug, (int) output_node & 0x3f);
 		return -1;
 	}
-	if (iec61883_set_iPCRX (handle, input_node, ipcr, input_plug) < 0) {
-		WARN ("%s: Failed to set the iPCR[%d] plug for node %d.", __FUNCTION__,
-			input_plug,	(int) input_node & 0x3f);
-		// Undo changes on the oPCR
-		if (iec61883_set_oPCRX (handle, output_node, save_opcr, output_plug) < 0) {
-			WARN ("%s: Failed to undo changes on the oPCR[%d] plug for node %d.",
-				__FUNCTION__, output_plug, (int) output_node & 0x3f);
-		}
+	return 0;
+}
+
+static int
+pcr_modify_input (raw1394handle_t handle, nodeid_t input_node, int input_plug,
+	const struct pcr_change *change, const char *function)
+{
+	struct iec61883_oPCR save;
+
+	if (pcr_modify (handle, input_node, CSR_I_PCR_0 + 4 * input_plug, change, &save) < 0) {
+		WARN ("%s: Failed to set the iPCR[%d] plug for node %d.", function,
+			input_plug, (int) input_node & 0x3f);
 		return -1;
 	}
-	
 	return 0;
 }
 
 int
-iec61883_cmp_create_p2p_output (raw1394handle_t handle, 
+iec61883_cmp_create_p2p (raw1394handle_t handle, 
 		nodeid_t output_node, int output_plug,
+		nodeid_t input_node, int input_plug,	
 		unsigned int channel, unsigned int speed)
 {
-	struct iec61883_oPCR opcr;
-	
+	struct pcr_change ochange = { channel, speed, 0, 1, 0 };
+	struct pcr_change ichange = { channel, -1, 0, 1, 0 };
+
 	DEBUG ("%s", __FUNCTION__);
-	
-	if (iec61883_get_oPCRX (handle, output_node, &opcr, output_plug) < 0) {
-		WARN ("%s: Failed to get the oPCR[%d] plug for node %d.", __FUNCTION__,
-			output_plug, (int) output_node & 0x3f);
-		return -1;
-	}
+	return pcr_modify_pair (handle, output_node, output_plug, &ochange,
+		input_node, input_plug, &ichange, __FUNCTION__);
+}
 
-	opcr.channel = channel;
-	opcr.data_rate = speed;
-	if (opcr.n_p2p_connections < 63)
-		opcr.n_p2p_connections++;
-	
-	if (iec61883_set_oPCRX (handle, output_node, opcr, output_plug) < 0) {
-		WARN ("%s: Failed to set the oPCR[%d] plug for node %d.", __FUNCTION__,
-			output_plug, (int) output_node & 0x3f);
-		return -1;
-	}
-	
-	return 0;
+int
+iec61883_cmp_create_p2p_output (raw1394handle_t handle, 
+		nodeid_t output_node, int output_plug,
+		unsigned int channel, unsigned int speed)
+{
+	struct pcr_change change = { channel, speed, 0, 1, 0 };
+
+	DEBUG ("%s", __FUNCTION__);
+	return pcr_modify_output (handle, output_node, output_plug, &change, __FUNCTION__);
 }
 
 int
@@ -144,27 +342,10 @@ iec61883_cmp_create_p2p_input (raw1394handle_t handle,
 		nodeid_t input_node, int input_plug,
 		unsigned int channel)
 {
-	struct iec61883_iPCR ipcr;
-	
-	DEBUG ("%s", __FUNCTION__);
-	
-	if (iec61883_get_iPCRX (handle, input_node, &ipcr, input_plug) < 0) {
-		WARN ("%s: Failed to get the iPCR[%d] plug for node %d.", __FUNCTION__,
-			input_plug, (int) input_node & 0x3f);
-		return -1;
-	}
+	struct pcr_change change = { channel, -1, 0, 1, 0 };
 
-	ipcr.channel = channel;
-	if (ipcr.n_p2p_connections < 63)
-		ipcr.n_p2p_connections++;
-	
-	if (iec61883_set_iPCRX (handle, input_node, ipcr, input_plug) < 0) {
-		WARN ("%s: Failed to set the iPCR[%d] plug for node %d.", __FUNCTION__,
-			input_plug, (int) input_node & 0x3f);
-		return -1;
-	}
-	
-	return 0;
+	DEBUG ("%s", __FUNCTION__);
+	return pcr_modify_input (handle, input_node, input_plug, &change, __FUNCTION__);
 }
 
 int
@@ -173,45 +354,12 @@ iec61883_cmp_create_bcast (raw1394handle_t handle,
 		nodeid_t input_node, int input_plug,
 		unsigned int channel, unsigned int speed)
 {
-	struct iec61883_oPCR opcr, save_opcr;
-	struct iec61883_iPCR ipcr;
-	
-	DEBUG ("%s", __FUNCTION__);
-	
-	if (iec61883_get_oPCRX (handle, output_node, &opcr, output_plug) < 0) {
-		WARN ("%s: Failed to get the oPCR[%d] plug for node %d.", __FUNCTION__,
-			output_plug, (int) output_node & 0x3f);
-		return -1;
-	}
-	if (iec61883_get_iPCRX (handle, input_node, &ipcr, input_plug) < 0) {
-		WARN ("%s: Failed to get the iPCR[%d] plug for node %d.", __FUNCTION__,
-			input_plug, (int) input_node & 0x3f);
-		return -1;
-	}
+	struct pcr_change ochange = { channel, speed, 1, 0, 0 };
+	struct pcr_change ichange = { channel, -1, 1, 0, 0 };
 
-	save_opcr = opcr;
-	opcr.channel = ipcr.channel = channel;
-	opcr.data_rate = speed;
-	opcr.bcast_connection = 1;
-	ipcr.bcast_connection = 1;
-	
-	if (iec61883_set_oPCRX (handle, output_node, opcr, output_plug) < 0) {
-		WARN ("%s: Failed to set the oPCR[%d] plug for node %d.", __FUNCTION__,
-			output_plug, (int) output_node & 0x3f);
-		return -1;
-	}
-	if (iec61883_set_iPCRX (handle, input_node, ipcr, input_plug) < 0) {
-		WARN ("%s: Failed to set the iPCR[%d] plug for node %d.", __FUNCTION__,
-			input_plug,	(int) input_node & 0x3f);
-		// Undo changes on the oPCR
-		if (iec61883_set_oPCRX (handle, output_node, save_opcr, output_plug) < 0) {
-			WARN ("%s: Failed to undo changes on the oPCR[%d] plug for node %d.", 
-				__FUNCTION__, output_plug, (int) output_node & 0x3f);
-		}
-		return -1;
-	}
-	
-	return 0;
+	DEBUG ("%s", __FUNCTION__);
+	return pcr_modify_pair (handle, output_node, output_plug, &ochange,
+		input_node, input_plug, &ichange, __FUNCTION__);
 }
 
 int
@@ -219,27 +367,10 @@ iec61883_cmp_create_bcast_output (raw1394handle_t handle,
 		nodeid_t output_node, int output_plug,
 		unsigned int channel, unsigned int speed)
 {
-	struct iec61883_oPCR opcr;
-	
-	DEBUG ("%s", __FUNCTION__);
-	
-	if (iec61883_get_oPCRX (handle, output_node, &opcr, output_plug) < 0) {
-		WARN ("%s: Failed to get the oPCR[%d] plug for node %d.", __FUNCTION__,
-			output_plug, (int) output_node & 0x3f);
-		return -1;
-	}
+	struct pcr_change change = { channel, speed, 1, 0, 0 };
 
-	opcr.channel = channel;
-	opcr.data_rate = speed;
-	opcr.bcast_connection  = 1;
-	
-	if (iec61883_set_oPCRX (handle, output_node, opcr, output_plug) < 0) {
-		WARN ("%s: Failed to set the oPCR[%d] plug for node %d.", __FUNCTION__,
-			output_plug, (int) output_node & 0x3f);
-		return -1;
-	}
-	
-	return 0;
+	DEBUG ("%s", __FUNCTION__);
+	return pcr_modify_output (handle, output_node, output_plug, &change, __FUNCTION__);
 }
 
 int
@@ -247,26 +378,10 @@ iec61883_cmp_create_bcast_input (raw1394handle_t handle,
 		nodeid_t input_node, int input_plug,
 		unsigned int channel)
 {
-	struct iec61883_iPCR ipcr;
-	
-	DEBUG ("%s", __FUNCTION__);
-	
-	if (iec61883_get_iPCRX (handle, input_node, &ipcr, input_plug) < 0) {
-		WARN ("%s: Failed to get the iPCR[%d] plug for node %d.", __FUNCTION__,
-			input_plug,	(int) input_node & 0x3f);
-		return -1;
-	}
+	struct pcr_change change = { channel, -1, 1, 0, 0 };
 
-	ipcr.channel = channel;
-	ipcr.bcast_connection = 1;
-	
-	if (iec61883_set_iPCRX (handle, input_node, ipcr, input_plug) < 0) {
-		WARN ("%s: Failed to set the iPCR[%d] plug for node %d.", __FUNCTION__,
-			input_plug, (int) input_node & 0x3f);
-		return -1;
-	}
-	
-	return 0;
+	DEBUG ("%s", __FUNCTION__);
+	return pcr_modify_input (handle, input_node, input_plug, &change, __FUNCTION__);
 }
 
 int
@@ -274,104 +389,31 @@ iec61883_cmp_overlay_p2p (raw1394handle_t handle,
 		nodeid_t output_node, int output_plug,
 		nodeid_t input_node, int input_plug)
 {
-	struct iec61883_oPCR opcr, save_opcr;
-	struct iec61883_iPCR ipcr;
-	
-	DEBUG ("%s", __FUNCTION__);
-	
-	if (iec61883_get_oPCRX (handle, output_node, &opcr, output_plug) < 0) {
-		WARN ("%s: Failed to get the oPCR[%d] plug for node %d.", __FUNCTION__,
-			output_plug, (int) output_node & 0x3f);
-		return -1;
-	}
-	if (iec61883_get_iPCRX (handle, input_node, &ipcr, input_plug) < 0) {
-		WARN ("%s: Failed to get the iPCR[%d] plug for node %d.", __FUNCTION__,
-			input_plug,	(int) input_node & 0x3f);
-		return -1;
-	}
+	struct pcr_change change = { -1, -1, 0, 1, 1 };
 
-	if (opcr.bcast_connection == 0) {
-		save_opcr = opcr;
-		if (opcr.n_p2p_connections < 63)
-			opcr.n_p2p_connections++;
-	}
-	if (ipcr.bcast_connection == 0)
-		if (ipcr.n_p2p_connections < 63)
-			ipcr.n_p2p_connections++;
-	
-	if (iec61883_set_oPCRX (handle, output_node, opcr, output_plug) < 0) {
-		WARN ("%s: Failed to set the oPCR[%d] plug for node %d.", __FUNCTION__,
-			output_plug, (int) output_node & 0x3f);
-		return -1;
-	}
-	if (iec61883_set_iPCRX (handle, input_node, ipcr, input_plug) < 0) {
-		WARN ("%s: Failed to set the iPCR[%d] plug for node %d.", __FUNCTION__,
-			input_plug,	(int) input_node & 0x3f);
-		// Undo changes on the oPCR
-		if (iec61883_set_oPCRX (handle, output_node, save_opcr, output_plug) < 0) {
-			WARN ("%s: Failed to undo changes on the oPCR[%d] plug for node %d.", 
-				__FUNCTION__, output_plug, (int) output_node & 0x3f);
-		}
-		return -1;
-	}
-	
-	return 0;
+	DEBUG ("%s", __FUNCTION__);
+	return pcr_modify_pair (handle, output_node, output_plug, &change,
+		input_node, input_plug, &change, __FUNCTION__);
 }
 
 int
 iec61883_cmp_overlay_p2p_output (raw1394handle_t handle, 
 		nodeid_t output_node, int output_plug)
 {
-	struct iec61883_oPCR opcr;
-	
-	DEBUG ("%s", __FUNCTION__);
-	
-	if (iec61883_get_oPCRX (handle, output_node, &opcr, output_plug) < 0) {
-		WARN ("%s: Failed to get the oPCR[%d] plug for node %d.", __FUNCTION__,
-			output_plug, (int) output_node & 0x3f);
-		return -1;
-	}
+	struct pcr_change change = { -1, -1, 0, 1, 1 };
 
-	if (opcr.bcast_connection == 0) {
-		if (opcr.n_p2p_connections < 63)
-			opcr.n_p2p_connections++;
-		
-		if (iec61883_set_oPCRX (handle, output_node, opcr, output_plug) < 0) {
-			WARN ("%s: Failed to set the oPCR[%d] plug for node %d.", __FUNCTION__,
-				output_plug, (int) output_node & 0x3f);
-			return -1;
-		}
-	}
-	
-	return 0;
+	DEBUG ("%s", __FUNCTION__);
+	return pcr_modify_output (handle, output_node, output_plug, &change, __FUNCTION__);
 }
 
 int
 iec61883_cmp_overlay_p2p_input (raw1394handle_t handle,
 		nodeid_t input_node, int input_plug)
 {
-	struct iec61883_iPCR ipcr;
-	
-	DEBUG ("%s", __FUNCTION__);
-	
-	if (iec61883_get_iPCRX (handle, input_node, &ipcr, input_plug) < 0) {
-		WARN ("%s: Failed to get the iPCR[%d] plug for node %d.", __FUNCTION__,
-			input_plug, (int) input_node & 0x3f);
-		return -1;
-	}
+	struct pcr_change change = { -1, -1, 0, 1, 1 };
 
-	if (ipcr.bcast_connection == 0) {
-		if (ipcr.n_p2p_connections < 63)
-			ipcr.n_p2p_connections++;
-		
-		if (iec61883_set_iPCRX (handle, input_node, ipcr, input_plug) < 0) {
-			WARN ("%s: Failed to set the iPCR[%d] plug for node %d.", __FUNCTION__,
-				input_plug,	(int) input_node & 0x3f);
-			return -1;
-		}
-	}
-	
-	return 0;
+	DEBUG ("%s", __FUNCTION__);
+	return pcr_modify_input (handle, input_node, input_plug, &change, __FUNCTION__);
 }
 
 int
@@ -379,55 +421,176 @@ iec61883_cmp_overlay_bcast (raw1394handle_t handle,
 		nodeid_t output_node, int output_plug,
 		nodeid_t input_node, int input_plug)
 {
-	struct iec61883_oPCR opcr, save_opcr;
-	struct iec61883_iPCR ipcr;
-	
+	// We still need this function because only one of the plugs might have the
+	// bcast_connection set.
+	struct pcr_change change = { -1, -1, 1, 0, 0 };
+
 	DEBUG ("%s", __FUNCTION__);
-	
-	if (iec61883_get_oPCRX (handle, output_node, &opcr, output_plug) < 0) {
-		WARN ("%s: Failed to get the oPCR[%d] plug for node %d.", __FUNCTION__,
-			output_plug, (int) output_node & 0x3f);
-		return -1;
+	return pcr_modify_pair (handle, output_node, output_plug, &change,
+		input_node, input_plug, &change, __FUNCTION__);
+}
+
+/*
+ * Change an IRM channels available register from *value to
+ * (*value & ~clear) | set with compare-swap. On contention *value is
+ * updated from the lock response and the swap retried, as long as the bits
+ * to clear are still set. Returns 0 on success, 1 if a bit to clear has been
+ * taken by someone else, or -1 on error.
+ */
+static int
+irm_channels_swap (raw1394handle_t handle, nodeaddr_t addr, quadlet_t *value,
+	quadlet_t clear, quadlet_t set)
+{
+	quadlet_t compare, swap, new;
+	int i;
+
+	for (i = 0; i < MAX_LOCK_TRIES; i++) {
+		if ((*value & clear) != clear)
+			return 1;
+		compare = htonl (*value);
+		swap = htonl ((*value & ~clear) | set);
+		if (iec61883_cooked_lock (handle, raw1394_get_irm_id (handle), CSR_REGISTER_BASE + addr,
+				EXTCODE_COMPARE_SWAP, swap, compare, &new) < 0)
+			return -1;
+		if (new == compare) {
+			*value = ntohl (swap);
+			return 0;
+		}
+		*value = ntohl (new);
 	}
-	if (iec61883_get_iPCRX (handle, input_node, &ipcr, input_plug) < 0) {
-		WARN ("%s: Failed to get the iPCR[%d] plug for node %d.", __FUNCTION__,
-			input_plug, (int) input_node & 0x3f);
+	errno = EAGAIN;
+	return -1;
+}
+
+static int
+irm_channels_get (raw1394handle_t handle, quadlet_t *avail)
+{
+	if (iec61883_cooked_read (handle, raw1394_get_irm_id (handle),
+			CSR_REGISTER_BASE + CSR_CHANNELS_AVAILABLE_HI, sizeof (quadlet_t), &avail[0]) < 0 ||
+		iec61883_cooked_read (handle, raw1394_get_irm_id (handle),
+			CSR_REGISTER_BASE + CSR_CHANNELS_AVAILABLE_LO, sizeof (quadlet_t), &avail[1]) < 0)
 		return -1;
-	}
+	avail[0] = ntohl (avail[0]);
+	avail[1] = ntohl (avail[1]);
+	return 0;
+}
 
-	save_opcr = opcr;
-	// We still need this function because only one of the plugs might have the
-	// bcast_connection set.
-	opcr.bcast_connection = 1;
-	ipcr.bcast_connection = 1;
-	
-	if (iec61883_set_oPCRX (handle, output_node, opcr, output_plug) < 0) {
-		WARN ("%s: Failed to set the oPCR[%d] plug for node %d.", __FUNCTION__,
-			output_plug, (int) output_node & 0x3f);
+/* channel c is bit 31 - (c % 32) of CHANNELS_AVAILABLE_HI (c < 32) or _LO */
+#define CHANNEL_REG(c)  ((c) / 32)
+#define CHANNEL_BIT(c)  (1U << (31 - (c) % 32))
+
+/*
+ * Allocate count channels out of 0 to 62 with a compare-swap on each of the
+ * two IRM registers, preferring channel preferred if it is free.
+ * The channels available registers are read only once; contention is
+ * resolved from the lock responses.
+ */
+static int
+cmp_allocate_channels (raw1394handle_t handle, int count, int preferred,
+	int *channels)
+{
+	static const nodeaddr_t addr[2] = {
+		CSR_CHANNELS_AVAILABLE_HI, CSR_CHANNELS_AVAILABLE_LO
+	};
+	quadlet_t avail[2];
+	int tries, c, n, r;
+
+	if (count < 1 || count > 63) {
+		errno = EINVAL;
 		return -1;
 	}
-	if (iec61883_set_iPCRX (handle, input_node, ipcr, input_plug) < 0) {
-		WARN ("%s: Failed to set the iPCR[%d] plug for node %d.", __FUNCTION__,
-			input_plug,	(int) input_node & 0x3f);
-		// Undo changes on the oPCR
-		if (iec61883_set_oPCRX (handle, output_node, save_opcr, output_plug) < 0) {
-			WARN ("%s: Failed to undo changes on the oPCR[%d] plug for node %d.", 
-				__FUNCTION__, output_plug, (int) output_node & 0x3f);
+	if (irm_channels_get (handle, avail) < 0)
+		FAIL ("Failed to get channels available.");
+
+	for (tries = 0; tries < MAX_LOCK_TRIES; tries++) {
+		quadlet_t want[2] = { 0, 0 };
+
+		n = 0;
+		if (preferred >= 0 && preferred < 63 &&
+			(avail[CHANNEL_REG (preferred)] & CHANNEL_BIT (preferred))) {
+			want[CHANNEL_REG (preferred)] |= CHANNEL_BIT (preferred);
+			channels[n++] = preferred;
+		}
+		for (c = 0; c < 63 && n < count; c++) {
+			if ((avail[CHANNEL_REG (c)] & CHANNEL_BIT (c)) &&
+				!(want[CHANNEL_REG (c)] & CHANNEL_BIT (c))) {
+				want[CHANNEL_REG (c)] |= CHANNEL_BIT (c);
+				channels[n++] = c;
+			}
+		}
+		if (n < count) {
+			errno = ENOSPC;
+			return -1;
+		}
+
+		r = want[0] ? irm_channels_swap (handle, addr[0], &avail[0], want[0], 0) : 0;
+		if (r < 0)
+			return -1;
+		if (r > 0)
+			continue;
+		r = want[1] ? irm_channels_swap (handle, addr[1], &avail[1], want[1], 0) : 0;
+		if (r == 0) {
+			DEBUG ("%s: %d channels from %d", __FUNCTION__, count, channels[0]);
+			return 0;
 		}
+		// give back what was claimed in the first register
+		if (want[0] && irm_channels_swap (handle, addr[0], &avail[0], 0, want[0]) < 0)
+			WARN ("Failed to release channels 0x%08x", want[0]);
+		if (r < 0)
+			return -1;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+int
+iec61883_cmp_allocate_channel (raw1394handle_t handle, int preferred)
+{
+	int channel;
+
+	assert (handle != NULL);
+	if (cmp_allocate_channels (handle, 1, preferred, &channel) < 0)
 		return -1;
+	return channel;
+}
+
+int
+iec61883_cmp_allocate_channels (raw1394handle_t handle, int count, int *channels)
+{
+	assert (handle != NULL);
+	assert (channels != NULL);
+	return cmp_allocate_channels (handle, count, -1, channels);
+}
+
+int
+iec61883_cmp_free_channels (raw1394handle_t handle, int count, const int *channels)
+{
+	static const nodeaddr_t addr[2] = {
+		CSR_CHANNELS_AVAILABLE_HI, CSR_CHANNELS_AVAILABLE_LO
+	};
+	quadlet_t avail[2], release[2] = { 0, 0 };
+	int i, r;
+
+	assert (handle != NULL);
+	for (i = 0; i < count; i++) {
+		if (channels[i] < 0 || channels[i] > 63) {
+			errno = EINVAL;
+			return -1;
+		}
+		release[CHANNEL_REG (channels[i])] |= CHANNEL_BIT (channels[i]);
 	}
-	
+	if (irm_channels_get (handle, avail) < 0)
+		FAIL ("Failed to get channels available.");
+	for (r = 0; r < 2; r++)
+		if (release[r] && irm_channels_swap (handle, addr[r], &avail[r], 0, release[r]) < 0)
+			FAIL ("Failed to release channels 0x%08x", release[r]);
 	return 0;
 }
 
 static int
 allocate_channel (raw1394handle_t handle)
 {
-	int c = -1;
-	
-	for (c = 0; c < 63; c++)
-		if (raw1394_channel_modify (handle, c, RAW1394_MODIFY_ALLOC) == 0)
-			break;
+	int c = iec61883_cmp_allocate_channel (handle, -1);
 	
 	DEBUG ("%s: %d", __FUNCTION__, c);
 	
@@ -469,6 +632,7 @@ cmp_connect (raw1394handle_t handle, nodeid_t output, int *oplug,
 	struct iec61883_iMPR impr;
 	struct iec61883_oPCR opcr;
 	struct iec61883_iPCR ipcr;
+	quadlet_t oregs[IEC61883_PCR_MAX + 1], iregs[IEC61883_PCR_MAX + 1];
 	int oplug_online = -1, iplug_online = -1;
 	int skip_bandwidth = (*bandwidth == 0);
 	int failure = 0;
@@ -478,13 +642,17 @@ cmp_connect (raw1394handle_t handle, nodeid_t output, int *oplug,
 	
 	*bandwidth = 0;
 		
-	// Check for plugs on output
-	if (iec61883_get_oMPR (handle, output, &ompr) < 0)
+	// Check for plugs on output; which plug is free must not come from the cache
+	if (iec61883_plug_read_outputs (handle, output, oregs) < 0)
 		ompr.n_plugs = 0;
+	else
+		*((quadlet_t *) &ompr) = oregs[0];
 	
 	// Check for plugs on input
-	if (iec61883_get_iMPR (handle, input, &impr) < 0)
+	if (iec61883_plug_read_inputs (handle, input, iregs) < 0)
 		impr.n_plugs = 0;
+	else
+		*((quadlet_t *) &impr) = iregs[0];
 	
 	DEBUG ("output node %d #plugs=%d, input node %d #plugs=%d", output & 0x3f,
 		ompr.n_plugs, input & 0x3f, impr.n_plugs);
@@ -499,13 +667,12 @@ cmp_connect (raw1394handle_t handle, nodeid_t output, int *oplug,
 		// determine if output has plug available
 		if (*oplug < 0) {
 			for (*oplug = 0; *oplug < ompr.n_plugs; (*oplug)++) {
-				if (iec61883_get_oPCRX (handle, output, &opcr, *oplug) == 0) {
-					// get first online plug
-					if (oplug_online == -1 && opcr.online)
-						oplug_online = *oplug;
-					if (opcr.online && opcr.n_p2p_connections == 0)
-						break;
-				}
+				*((quadlet_t *) &opcr) = oregs[1 + *oplug];
+				// get first online plug
+				if (oplug_online == -1 && opcr.online)
+					oplug_online = *oplug;
+				if (opcr.online && opcr.n_p2p_connections == 0)
+					break;
 			}
 		} else if (iec61883_get_oPCRX (handle, output, &opcr, *oplug) < 0)
 			FAIL ("Failed to get plug %d for output node", *oplug);
@@ -513,13 +680,12 @@ cmp_connect (raw1394handle_t handle, nodeid_t output, int *oplug,
 		// determine if input has plug available
 		if (*iplug < 0) {
 			for (*iplug = 0; *iplug < impr.n_plugs; (*iplug)++) {
-				if (iec61883_get_iPCRX (handle, input, &ipcr, *iplug) == 0) {
-					// get first online plug
-					if (iplug_online == -1 && ipcr.online)
-						iplug_online = *iplug;
-					if (ipcr.online && ipcr.n_p2p_connections == 0)
-						break;
-				}
+				*((quadlet_t *) &ipcr) = iregs[1 + *iplug];
+				// get first online plug
+				if (iplug_online == -1 && ipcr.online)
+					iplug_online = *iplug;
+				if (ipcr.online && ipcr.n_p2p_connections == 0)
+					break;
 			}
 		} else if (iec61883_get_iPCRX (handle, input, &ipcr, *iplug) < 0)
 			FAIL ("Failed to get plug %d for input node", *iplug);
@@ -547,7 +713,10 @@ cmp_connect (raw1394handle_t handle, nodeid_t output, int *oplug,
 					} else {
 						raw1394_channel_modify (handle, channel, RAW1394_MODIFY_ALLOC);
 					}
-					if (iec61883_cmp_create_p2p (handle, output, *oplug, input, *iplug, 
+					if (channel < 0) {
+						WARN ("Failed to allocate a channel.");
+						raw1394_bandwidth_modify (handle, *bandwidth, RAW1394_MODIFY_FREE);
+					} else if (iec61883_cmp_create_p2p (handle, output, *oplug, input, *iplug, 
 						channel, speed) < 0) {
 						// release channel and bandwidth
 						failure = raw1394_channel_modify (handle, channel, RAW1394_MODIFY_FREE);
@@ -595,13 +764,12 @@ cmp_connect (raw1394handle_t handle, nodeid_t output, int *oplug,
 		// determine if output has plug available
 		if (*oplug < 0) {
 			for (*oplug = 0; *oplug < ompr.n_plugs; (*oplug)++) {
-				if (iec61883_get_oPCRX (handle, output, &opcr, *oplug) == 0) {
-					// get first online plug
-					if (oplug_online == -1 && opcr.online)
-						oplug_online = *oplug;
-					if (opcr.online && opcr.n_p2p_connections == 0)
-						break;
-				}
+				*((quadlet_t *) &opcr) = oregs[1 + *oplug];
+				// get first online plug
+				if (oplug_online == -1 && opcr.online)
+					oplug_online = *oplug;
+				if (opcr.online && opcr.n_p2p_connections == 0)
+					break;
 			}
 		} else if (iec61883_get_oPCRX (handle, output, &opcr, *oplug) < 0)
 			FAIL ("Failed to get plug %d for output node", *oplug);
@@ -636,7 +804,10 @@ cmp_connect (raw1394handle_t handle, nodeid_t output, int *oplug,
 					} else {
 						raw1394_channel_modify (handle, channel, RAW1394_MODIFY_ALLOC);
 					}
-					if (iec61883_cmp_create_p2p_output (handle, output, *oplug, 
+					if (channel < 0) {
+						WARN ("Failed to allocate a channel.");
+						raw1394_bandwidth_modify (handle, *bandwidth, RAW1394_MODIFY_FREE);
+					} else if (iec61883_cmp_create_p2p_output (handle, output, *oplug, 
 						channel, ompr.data_rate) == 0) {
 						DEBUG ("Established connection on channel %d.\n"
 							  "You may need to manually set the channel on the receiving node.",
@@ -692,13 +863,12 @@ cmp_connect (raw1394handle_t handle, nodeid_t output, int *oplug,
 		// determine if input has plug available
 		if (*iplug < 0) {
 			for (*iplug = 0; *iplug < impr.n_plugs; (*iplug)++) {
-				if (iec61883_get_iPCRX (handle, input, &ipcr, *iplug) == 0) {
-					// get first online plug
-					if (iplug_online == -1 && ipcr.online)
-						iplug_online = *iplug;
-					if (ipcr.online && ipcr.n_p2p_connections == 0)
-						break;
-				}
+				*((quadlet_t *) &ipcr) = iregs[1 + *iplug];
+				// get first online plug
+				if (iplug_online == -1 && ipcr.online)
+					iplug_online = *iplug;
+				if (ipcr.online && ipcr.n_p2p_connections == 0)
+					break;
 			}
 		} else if (iec61883_get_iPCRX (handle, input, &ipcr, *iplug) < 0)
 			FAIL ("Failed to get plug %d for input node", *iplug);
@@ -728,7 +898,10 @@ cmp_connect (raw1394handle_t handle, nodeid_t output, int *oplug,
 					} else {
 						raw1394_channel_modify (handle, channel, RAW1394_MODIFY_ALLOC);
 					}
-					if (iec61883_cmp_create_p2p_input (handle, input, *iplug, channel) == 0) {
+					if (channel < 0) {
+						WARN ("Failed to allocate a channel.");
+						raw1394_bandwidth_modify (handle, *bandwidth, RAW1394_MODIFY_FREE);
+					} else if (iec61883_cmp_create_p2p_input (handle, input, *iplug, channel) == 0) {
 						DEBUG ("Established connection on channel %d.\n"
 							  "You may need to manually set the channel on the transmitting node.",
 							  channel);
@@ -795,7 +968,10 @@ iec61883_cmp_reconnect (raw1394handle_t handle, nodeid_t output, int *oplug,
 		nodeid_t input, int *iplug, int *bandwidth, int channel)
 {
 	/* Passing an existing channel means it is a reconnection. */
-	return cmp_connect (handle, output, oplug, input, iplug, bandwidth, channel);
+	channel = cmp_connect (handle, output, oplug, input, iplug, bandwidth, channel);
+	if (channel >= 0)
+		iec61883_registry_add (handle, output, *oplug, input, *iplug, channel, *bandwidth);
+	return channel;
 }
 
 int
@@ -803,7 +979,52 @@ iec61883_cmp_connect (raw1394handle_t handle, nodeid_t output, int *oplug,
 		nodeid_t input, int *iplug, int *bandwidth)
 {
 	/* Passing "-1" as the channel means it is a new connection. */
-	return cmp_connect (handle, output, oplug, input, iplug, bandwidth, -1);
+	int channel = cmp_connect (handle, output, oplug, input, iplug, bandwidth, -1);
+
+	if (channel >= 0)
+		iec61883_registry_add (handle, output, *oplug, input, *iplug, channel, *bandwidth);
+	return channel;
+}
+
+/*
+ * Drop a connection from a PCR at *value, retrying on contention like
+ * pcr_modify(): a point-to-point one if there is one, else the broadcast
+ * one if bcast_channel is not negative; the channel then becomes
+ * bcast_channel. When the last point-to-point connection goes, the channel
+ * becomes idle_channel unless that is negative, and *last is set.
+ */
+static int
+pcr_drop (raw1394handle_t handle, nodeid_t node, nodeaddr_t addr, quadlet_t *value,
+	int idle_channel, int bcast_channel, int *last)
+{
+	struct iec61883_oPCR *pcr = (struct iec61883_oPCR *) value;
+	quadlet_t old;
+	int i, result;
+
+	for (i = 0; i < MAX_LOCK_TRIES; i++) {
+		old = *value;
+		*last = 0;
+		if (pcr->n_p2p_connections > 0) {
+			pcr->n_p2p_connections--;
+			if (pcr->n_p2p_connections == 0) {
+				*last = 1;
+				if (idle_channel >= 0)
+					pcr->channel = idle_channel;
+			}
+		} else if (bcast_channel >= 0 && pcr->bcast_connection) {
+			pcr->bcast_connection = 0;
+			pcr->channel = bcast_channel;
+		} else {
+			return 0;
+		}
+		result = iec61883_plug_compare_swap (handle, node, addr, old, *value);
+		if (result != -EAGAIN)
+			return result;
+		if (iec61883_plug_get_cached (handle, node, addr, value) < 0)
+			return -1;
+	}
+	errno = EAGAIN;
+	return -1;
 }
 
 int
@@ -814,18 +1035,23 @@ iec61883_cmp_disconnect (raw1394handle_t handle, nodeid_t output, int oplug,
 	struct iec61883_iMPR impr;
 	struct iec61883_oPCR opcr;
 	struct iec61883_iPCR ipcr;
-	int result = 0;
+	quadlet_t oregs[IEC61883_PCR_MAX + 1], iregs[IEC61883_PCR_MAX + 1];
+	int result = 0, last;
 	
 	DEBUG ("%s: oplug %d iplug %d channel %u bw %u", __FUNCTION__,
 		oplug, iplug, channel, bandwidth);
 	
 	// Check for plugs on output
-	if (iec61883_get_oMPR (handle, output, &ompr) < 0)
+	if (iec61883_plug_get_outputs (handle, output, oregs) < 0)
 		ompr.n_plugs = 0;
+	else
+		*((quadlet_t *) &ompr) = oregs[0];
 	
 	// Check for plugs on input
-	if (iec61883_get_iMPR (handle, input, &impr) < 0)
+	if (iec61883_plug_get_inputs (handle, input, iregs) < 0)
 		impr.n_plugs = 0;
+	else
+		*((quadlet_t *) &impr) = iregs[0];
 	
 	if (ompr.n_plugs > 0 && impr.n_plugs > 0) {
 		// establish or overlay point-to-point
@@ -833,10 +1059,9 @@ iec61883_cmp_disconnect (raw1394handle_t handle, nodeid_t output, int oplug,
 		// determine if output has plug available
 		if (oplug < 0) {
 			for (oplug = 0; oplug < ompr.n_plugs; oplug++) {
-				if (iec61883_get_oPCRX (handle, output, &opcr, oplug) == 0) {
-					if (opcr.online && opcr.channel == channel)
-						break;
-				}
+				*((quadlet_t *) &opcr) = oregs[1 + oplug];
+				if (opcr.online && opcr.channel == channel)
+					break;
 			}
 		} else if (iec61883_get_oPCRX (handle, output, &opcr, oplug) < 0)
 			FAIL ("Failed to get plug %d for output node", oplug);
@@ -844,40 +1069,27 @@ iec61883_cmp_disconnect (raw1394handle_t handle, nodeid_t output, int oplug,
 		// determine if input has plug available
 		if (iplug < 0) {
 			for (iplug = 0; iplug < impr.n_plugs; iplug++) {
-				if (iec61883_get_iPCRX (handle, input, &ipcr, iplug) == 0) {
-					if (ipcr.online && ipcr.channel == channel)
-						break;
-				}
+				*((quadlet_t *) &ipcr) = iregs[1 + iplug];
+				if (ipcr.online && ipcr.channel == channel)
+					break;
 			}
 		} else if (iec61883_get_iPCRX (handle, input, &ipcr, iplug) < 0)
 			FAIL ("Failed to get plug %d for input node", iplug);
 		
 		if (oplug != ompr.n_plugs) {
-			if (opcr.n_p2p_connections > 0) {
-				opcr.n_p2p_connections--;
-				if (opcr.n_p2p_connections == 0)
-					opcr.channel = ompr.bcast_channel;
-				result = iec61883_set_oPCRX (handle, output, opcr, oplug);
-				if (result == 0) {
-					if (opcr.n_p2p_connections == 0) {
-						// release channel and bandwidth
-						result = raw1394_channel_modify (handle, channel, RAW1394_MODIFY_FREE);
-						if (result == 0)
-							result = raw1394_bandwidth_modify (handle, bandwidth, RAW1394_MODIFY_FREE);
-					}
-				}
+			result = pcr_drop (handle, output, CSR_O_PCR_0 + 4 * oplug,
+				(quadlet_t *) &opcr, ompr.bcast_channel, -1, &last);
+			if (result == 0 && last) {
+				// release channel and bandwidth
+				result = raw1394_channel_modify (handle, channel, RAW1394_MODIFY_FREE);
+				if (result == 0)
+					result = raw1394_bandwidth_modify (handle, bandwidth, RAW1394_MODIFY_FREE);
 			}
 		}
 		if (iplug != impr.n_plugs) {
-			if (ipcr.n_p2p_connections > 0) {
-				ipcr.n_p2p_connections--;
-				// receiver connection count does not affect iso resource management
-				result = iec61883_set_iPCRX (handle, input, ipcr, iplug);
-			} else if (ipcr.bcast_connection == 1) {
-				ipcr.bcast_connection = 0;
-				ipcr.channel = ompr.bcast_channel;
-				result = iec61883_set_iPCRX (handle, input, ipcr, iplug);
-			}
+			// receiver connection count does not affect iso resource management
+			result = pcr_drop (handle, input, CSR_I_PCR_0 + 4 * iplug,
+				(quadlet_t *) &ipcr, -1, ompr.bcast_channel, &last);
 		}
 		if (oplug == ompr.n_plugs && iplug == impr.n_plugs)
 			result = -1;
@@ -888,26 +1100,21 @@ iec61883_cmp_disconnect (raw1394handle_t handle, nodeid_t output, int oplug,
 		// determine if output has plug available
 		if (oplug < 0) {
 			for (oplug = 0; oplug < ompr.n_plugs; oplug++) {
-				if (iec61883_get_oPCRX (handle, output, &opcr, oplug) == 0) {
-					if (opcr.online && opcr.channel == channel)
-						break;
-				}
+				*((quadlet_t *) &opcr) = oregs[1 + oplug];
+				if (opcr.online && opcr.channel == channel)
+					break;
 			}
 		} else if (iec61883_get_oPCRX (handle, output, &opcr, oplug) < 0)
 			FAIL ("Failed to get plug %d for output node", oplug);
 		
 		if (oplug != ompr.n_plugs) {
-			if (opcr.n_p2p_connections > 0) {
-				opcr.n_p2p_connections--;
-				if (opcr.n_p2p_connections == 0)
-					opcr.channel = ompr.bcast_channel;
-				result = iec61883_set_oPCRX (handle, output, opcr, oplug);
-				if (result == 0 && opcr.n_p2p_connections == 0) {
-					// release channel and bandwidth
-					result = raw1394_channel_modify (handle, channel, RAW1394_MODIFY_FREE);
-					if (result == 0)
-						result = raw1394_bandwidth_modify (handle, bandwidth, RAW1394_MODIFY_FREE);
-				}
+			result = pcr_drop (handle, output, CSR_O_PCR_0 + 4 * oplug,
+				(quadlet_t *) &opcr, ompr.bcast_channel, -1, &last);
+			if (result == 0 && last) {
+				// release channel and bandwidth
+				result = raw1394_channel_modify (handle, channel, RAW1394_MODIFY_FREE);
+				if (result == 0)
+					result = raw1394_bandwidth_modify (handle, bandwidth, RAW1394_MODIFY_FREE);
 			}
 		} else {
 			// release channel and bandwidth
@@ -922,30 +1129,25 @@ iec61883_cmp_disconnect (raw1394handle_t handle, nodeid_t output, int oplug,
 		// determine if input has plug available
 		if (iplug < 0) {
 			for (iplug = 0; iplug < impr.n_plugs; iplug++) {
-				if (iec61883_get_iPCRX (handle, input, &ipcr, iplug) == 0) {
-					if (ipcr.online && ipcr.channel == channel)
-						break;
-				}
+				*((quadlet_t *) &ipcr) = iregs[1 + iplug];
+				if (ipcr.online && ipcr.channel == channel)
+					break;
 			}
 		} else if (iec61883_get_iPCRX (handle, input, &ipcr, iplug) < 0)
 			FAIL ("Failed to get plug %d for input node", iplug);
 		
 		if (iplug != impr.n_plugs) {
-			if (ipcr.n_p2p_connections > 0) {
-				ipcr.n_p2p_connections--;
-				if (ipcr.n_p2p_connections == 0)
-					ipcr.channel = 63;
-				// Normally, changes on receiver connection count does not 
-				// affect iso resource management. However, in this special
-				// half-way management mode, we need to in order to allow
-				// multiple capture sessions.
-				result = iec61883_set_iPCRX (handle, input, ipcr, iplug);
-				if (result == 0 && ipcr.n_p2p_connections == 0) {
-					// release channel and bandwidth
-					result = raw1394_channel_modify (handle, channel, RAW1394_MODIFY_FREE);
-					if (result == 0)
-						result = raw1394_bandwidth_modify (handle, bandwidth, RAW1394_MODIFY_FREE);
-				}
+			// Normally, changes on receiver connection count does not 
+			// affect iso resource management. However, in this special
+			// half-way management mode, we need to in order to allow
+			// multiple capture sessions.
+			result = pcr_drop (handle, input, CSR_I_PCR_0 + 4 * iplug,
+				(quadlet_t *) &ipcr, 63, -1, &last);
+			if (result == 0 && last) {
+				// release channel and bandwidth
+				result = raw1394_channel_modify (handle, channel, RAW1394_MODIFY_FREE);
+				if (result == 0)
+					result = raw1394_bandwidth_modify (handle, bandwidth, RAW1394_MODIFY_FREE);
 			}
 		} else {
 			// release channel and bandwidth
@@ -960,6 +1162,10 @@ iec61883_cmp_disconnect (raw1394handle_t handle, nodeid_t output, int oplug,
 		result = raw1394_channel_modify (handle, 63, RAW1394_MODIFY_FREE);
 	}
 	
+	if (result == 0)
+		iec61883_registry_remove (handle, output,
+			oplug >= 0 && oplug < ompr.n_plugs ? oplug : -1, input,
+			iplug >= 0 && iplug < impr.n_plugs ? iplug : -1, channel);
 	return result;
 }
 
@@ -968,57 +1174,58 @@ iec61883_cmp_normalize_output (raw1394handle_t handle, nodeid_t node)
 {
 	struct iec61883_oMPR ompr;
 	struct iec61883_oPCR opcr;
+	quadlet_t oregs[IEC61883_PCR_MAX + 1];
 	int oplug;
 	int result = 0;
 
 	DEBUG ("iec61883_cmp_normalize_output: node %d\n", (int) node & 0x3f);
 
 	// Check for plugs on output
-	result = iec61883_get_oMPR (handle, node, &ompr);
+	result = iec61883_plug_get_outputs (handle, node, oregs);
 	if (result < 0)
 		return result;
+	*((quadlet_t *) &ompr) = oregs[0];
 	
 	// locate an ouput plug that has a connection
 	for (oplug = 0; oplug < ompr.n_plugs; oplug++) {
-		if (iec61883_get_oPCRX (handle, node, &opcr, oplug) == 0) {
-			if (opcr.online && (opcr.n_p2p_connections > 0 || 
-				                opcr.bcast_connection == 1)) {
-
-				// Make sure the plug's channel is allocated with IRM
-				quadlet_t buffer;
-				nodeaddr_t addr = CSR_REGISTER_BASE;
-				unsigned int c = opcr.channel;
-				quadlet_t compare, swap = 0;
-				quadlet_t new;
-				
-				if (c > 31 && c < 64) {
-					addr += CSR_CHANNELS_AVAILABLE_LO;
-					c -= 32;
-				} else if (c < 64)
-					addr += CSR_CHANNELS_AVAILABLE_HI;
-				else
-					FAIL ("Invalid channel");
-				c = 31 - c;
-
-				result = iec61883_cooked_read (handle, raw1394_get_irm_id (handle), addr, 
-					sizeof (quadlet_t), &buffer);
-				if (result < 0)
-					FAIL ("Failed to get channels available.");
-				
-				buffer = ntohl (buffer);
-				DEBUG ("channels available before: 0x%08x", buffer);
+		*((quadlet_t *) &opcr) = oregs[1 + oplug];
+		if (opcr.online && (opcr.n_p2p_connections > 0 || 
+			                opcr.bcast_connection == 1)) {
+
+			// Make sure the plug's channel is allocated with IRM
+			quadlet_t buffer;
+			nodeaddr_t addr = CSR_REGISTER_BASE;
+			unsigned int c = opcr.channel;
+			quadlet_t compare, swap = 0;
+			quadlet_t new;
+			
+			if (c > 31 && c < 64) {
+				addr += CSR_CHANNELS_AVAILABLE_LO;
+				c -= 32;
+			} else if (c < 64)
+				addr += CSR_CHANNELS_AVAILABLE_HI;
+			else
+				FAIL ("Invalid channel");
+			c = 31 - c;
 
-				if ((buffer & (1 << c)) != 0) {
-					swap = htonl (buffer & ~(1 << c));
-					compare = htonl (buffer);
+			result = iec61883_cooked_read (handle, raw1394_get_irm_id (handle), addr, 
+				sizeof (quadlet_t), &buffer);
+			if (result < 0)
+				FAIL ("Failed to get channels available.");
+			
+			buffer = ntohl (buffer);
+			DEBUG ("channels available before: 0x%08x", buffer);
 
-					result = raw1394_lock (handle, raw1394_get_irm_id (handle), addr,
-							   EXTCODE_COMPARE_SWAP, swap, compare, &new);
-					if ( (result < 0) || (new != compare) ) {
-						FAIL ("Failed to modify channel %d", opcr.channel);
-					}
-					DEBUG ("channels available after: 0x%08x", ntohl (swap));
+			if ((buffer & (1 << c)) != 0) {
+				swap = htonl (buffer & ~(1 << c));
+				compare = htonl (buffer);
+
+				result = iec61883_cooked_lock (handle, raw1394_get_irm_id (handle), addr,
+						   EXTCODE_COMPARE_SWAP, swap, compare, &new);
+				if ( (result < 0) || (new != compare) ) {
+					FAIL ("Failed to modify channel %d", opcr.channel);
 				}
+				DEBUG ("channels available after: 0x%08x", ntohl (swap));
 			}
 		}
 	}
@@ -0,0 +1,1424 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Asynchronous connection management
+ *
+ * Every request is a small state machine driven by transaction responses:
+ *
+ *   read plugs    block reads of the oMPR/oPCRs and iMPR/iPCRs, both nodes
+ *                 at once, falling back to quadlet reads
+ *   IRM           compare-swap of bandwidth and channels; one request at
+ *                 a time, the others wait in the IRM queue
+ *   set plugs     compare-swap of the oPCR and iPCR, both at once
+ *
+ * A disconnect sets the plugs before releasing IRM resources. The plug
+ * changes are the ones made by cmp.c, so synchronous and asynchronous
+ * connections can be mixed. A failed connect is rolled back the same way:
+ * compare-swaps take back its plug changes field by field, keeping what
+ * others changed since, then its IRM resources are released in the queue.
+ *
+ * A transaction acknowledged busy is sent again after a delay following
+ * the retry policy of the handle; meanwhile it waits in the retry list,
+ * which iec61883_cmp_async_iterate() serves.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "iec61883.h"
+#include "iec61883-private.h"
+#include "cooked.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <poll.h>
+#include <libraw1394/csr.h>
+#include <netinet/in.h>
+
+// attempts per IRM register or plug on contention
+#define MAX_TRIES 20
+
+// initial value of BANDWIDTH_AVAILABLE
+#define MAX_BANDWIDTH 4915
+
+#define IRM_NONE -1
+#define IRM_ANY  -2
+
+#define RELEASE_NONE   -2
+#define RELEASE_ALWAYS -1
+
+#define CHANNEL_REG(c)  ((c) / 32)
+#define CHANNEL_BIT(c)  (1U << (31 - (c) % 32))
+
+#define SIDE_MPR(s) ((s) ? CSR_I_MPR : CSR_O_MPR)
+
+// online, bcast_connection, n_p2p_connections and channel are at the same
+// place in oPCR and iPCR
+#define PCR(side) ((struct iec61883_iPCR *) &(side)->new_pcr)
+
+struct cmp_op;
+struct xfer;
+
+typedef void (*xfer_done_t) (struct cmp_op *op, struct xfer *x, int error);
+
+// one transaction; libraw1394 gets &reqhandle as its tag
+struct xfer {
+	struct raw1394_reqhandle reqhandle;
+	struct cmp_op *op;
+	xfer_done_t done;
+	int index;
+	int lock;
+	nodeid_t node;
+	nodeaddr_t addr;
+	size_t length;
+	quadlet_t data, arg;     // bus order
+	unsigned int tries;      // busy retries
+	unsigned int delay;      // before the next busy retry, microseconds
+	unsigned long long start, due;
+	struct xfer *next;       // retry list
+	quadlet_t buffer[IEC61883_PCR_MAX + 1];
+};
+
+// the plugs of one node of a request; [0] output, [1] input
+struct op_side {
+	nodeid_t node;
+	int n_plugs;
+	quadlet_t regs[IEC61883_PCR_MAX + 1];   // MPR and PCRs, host order
+	int plug;                 // PCR to compare-swap, or -1
+	quadlet_t old_pcr, new_pcr;
+	int set_channel;          // new_pcr takes the allocated channel
+	int swapped;
+	int tries;
+	int error;
+};
+
+struct cmp_op {
+	struct iec61883_cmp_async *cmp;
+	struct cmp_op *next;      // IRM queue
+	int disconnect;
+	int rollback;             // releasing what a failed connect allocated
+	int restart;              // start over once rolled back, see plugs_done()
+	int reconnect;
+	int restore;              // reclaim IRM resources first, see plan_restore()
+	int claim;
+	int skip_bandwidth;
+	int oplug, iplug;         // as requested
+	int channel;
+	int bandwidth;
+	int restarts;
+	int pending;              // transactions in flight
+	int error;                // first local error of those transactions
+	struct op_side side[2];
+	struct iec61883_cmp_async_result result;
+
+	// IRM work: allocation for a connect, release for a disconnect
+	int irm_bandwidth;
+	int irm_channel;          // IRM_NONE, IRM_ANY or a channel
+	int release_side;         // release if this side swapped, or RELEASE_*
+	int bandwidth_done;
+	int channel_done;
+	int channel_claimed;
+	int irm_tries;
+};
+
+struct iec61883_cmp_async {
+	raw1394handle_t handle;
+	iec61883_cmp_async_done_t done;
+	void *callback_data;
+	int next_id;
+	int pending;              // requests not completed
+	struct cmp_op *irm_head, *irm_tail;
+	struct xfer *retry_head;  // busy transactions, in order of due time
+	unsigned int retry_seed;
+
+	// IRM registers as last seen, host order: the compare values of the
+	// next lock, so most allocations take a single transaction
+	int irm_valid;
+	unsigned int irm_generation;
+	nodeid_t irm_node;
+	quadlet_t irm_bandwidth;
+	quadlet_t irm_channels[2];
+};
+
+static void plugs_ready (struct cmp_op *op);
+static void plugs_set (struct cmp_op *op);
+static void plugs_set_done (struct cmp_op *op, struct xfer *x, int error);
+static void irm_queue (struct cmp_op *op);
+static void irm_step (struct cmp_op *op);
+static void op_rollback (struct cmp_op *op, int error, int restart);
+static void op_restart (struct cmp_op *op);
+
+
+/* transactions */
+
+static int
+xfer_submit (struct xfer *x)
+{
+	raw1394handle_t handle = x->op->cmp->handle;
+	unsigned long tag = (unsigned long) &x->reqhandle;
+
+	if (x->lock)
+		return raw1394_start_lock (handle, x->node, x->addr, EXTCODE_COMPARE_SWAP,
+			x->data, x->arg, x->buffer, tag);
+	return raw1394_start_read (handle, x->node, x->addr, x->length, x->buffer, tag);
+}
+
+// busy: put the transaction in the retry list, as cooked_transaction()
+// would sleep; the other requests keep going meanwhile. Returns -1 when
+// the policy gives up.
+static int
+xfer_defer (struct xfer *x)
+{
+	struct iec61883_cmp_async *cmp = x->op->cmp;
+	struct iec61883_retry_policy policy;
+	unsigned long long now = iec61883_now_us ();
+	unsigned int sleep;
+	struct xfer **p;
+
+	iec61883_get_retry_policy (cmp->handle, &policy);
+	if (policy.max_tries && x->tries + 1 >= policy.max_tries)
+		return -1;
+	if (x->tries++ == 0)
+		x->delay = policy.initial_delay;
+	sleep = x->delay / 2 + rand_r (&cmp->retry_seed) % (x->delay / 2 + 1);
+	if (policy.deadline && now - x->start + sleep >= policy.deadline)
+		return -1;
+	x->delay = (x->delay * 2 > policy.max_delay) ? policy.max_delay : x->delay * 2;
+	x->due = now + sleep;
+
+	for (p = &cmp->retry_head; *p && (*p)->due <= x->due; p = &(*p)->next)
+		;
+	x->next = *p;
+	*p = x;
+	return 0;
+}
+
+static void
+xfer_complete (struct xfer *x, int error)
+{
+	struct cmp_op *op = x->op;
+
+	op->pending--;
+	x->done (op, x, error);
+	free (x);
+}
+
+static int
+xfer_callback (raw1394handle_t handle, void *data, raw1394_errcode_t err)
+{
+	struct xfer *x = data;
+	int error = raw1394_errcode_to_errno (err);
+
+	if (error == EAGAIN && xfer_defer (x) == 0)
+		return 0;
+	xfer_complete (x, error);
+	return 0;
+}
+
+// send the busy transactions whose delay has passed
+static void
+xfer_resend (struct iec61883_cmp_async *cmp)
+{
+	unsigned long long now = iec61883_now_us ();
+	struct xfer *x;
+
+	while ((x = cmp->retry_head) != NULL && x->due <= now) {
+		cmp->retry_head = x->next;
+		x->next = NULL;
+		if (xfer_submit (x) < 0)
+			xfer_complete (x, errno);
+	}
+}
+
+static struct xfer *
+xfer_new (struct cmp_op *op, xfer_done_t done, int index, nodeid_t node,
+	nodeaddr_t addr)
+{
+	struct xfer *x = calloc (1, sizeof (struct xfer));
+
+	if (x == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	x->reqhandle.callback = xfer_callback;
+	x->reqhandle.data = x;
+	x->op = op;
+	x->done = done;
+	x->index = index;
+	x->node = node;
+	x->addr = addr;
+	x->start = iec61883_now_us ();
+	return x;
+}
+
+static int
+xfer_issue (struct xfer *x)
+{
+	if (xfer_submit (x) < 0) {
+		free (x);
+		return -1;
+	}
+	x->op->pending++;
+	return 0;
+}
+
+static int
+start_read (struct cmp_op *op, xfer_done_t done, int index, nodeid_t node,
+	nodeaddr_t addr, size_t length)
+{
+	struct xfer *x = xfer_new (op, done, index, node, addr);
+
+	if (x == NULL)
+		return -1;
+	x->length = length;
+	return xfer_issue (x);
+}
+
+// compare and swap are in host order
+static int
+start_lock (struct cmp_op *op, xfer_done_t done, int index, nodeid_t node,
+	nodeaddr_t addr, quadlet_t compare, quadlet_t swap)
+{
+	struct xfer *x = xfer_new (op, done, index, node, addr);
+
+	if (x == NULL)
+		return -1;
+	x->lock = 1;
+	x->length = sizeof (quadlet_t);
+	x->arg = htonl (compare);
+	x->data = htonl (swap);
+	return xfer_issue (x);
+}
+
+
+/* requests */
+
+static struct cmp_op *
+op_new (struct iec61883_cmp_async *cmp, int disconnect, nodeid_t output, int oplug,
+	nodeid_t input, int iplug, int channel)
+{
+	struct cmp_op *op = calloc (1, sizeof (struct cmp_op));
+
+	if (op == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	op->cmp = cmp;
+	op->disconnect = disconnect;
+	op->oplug = oplug;
+	op->iplug = iplug;
+	op->channel = channel;
+	op->side[0].node = output;
+	op->side[1].node = input;
+	op->result.output = output;
+	op->result.input = input;
+	return op;
+}
+
+// back to the state before the plugs are read
+static void
+op_reset (struct cmp_op *op)
+{
+	int s;
+
+	for (s = 0; s < 2; s++) {
+		nodeid_t node = op->side[s].node;
+
+		memset (&op->side[s], 0, sizeof (struct op_side));
+		op->side[s].node = node;
+		op->side[s].plug = -1;
+	}
+	op->error = 0;
+	op->rollback = 0;
+	op->restart = 0;
+	op->irm_bandwidth = 0;
+	op->irm_channel = IRM_NONE;
+	op->release_side = RELEASE_NONE;
+	op->bandwidth_done = 0;
+	op->channel_done = 0;
+	op->channel_claimed = 0;
+	op->irm_tries = 0;
+	op->result.error = 0;
+	op->result.oplug = op->oplug;
+	op->result.iplug = op->iplug;
+	op->result.channel = op->channel;
+	op->result.bandwidth = op->bandwidth;
+}
+
+static void
+op_finish (struct cmp_op *op, int error)
+{
+	struct iec61883_cmp_async *cmp = op->cmp;
+
+	op->result.error = error;
+	if (error && !op->disconnect) {
+		op->result.oplug = -1;
+		op->result.iplug = -1;
+		op->result.channel = -1;
+		op->result.bandwidth = 0;
+	}
+	cmp->pending--;
+	cmp->done (cmp, &op->result, cmp->callback_data);
+	free (op);
+}
+
+
+/* read plugs */
+
+static void
+plugs_pcr_done (struct cmp_op *op, struct xfer *x, int error)
+{
+	struct op_side *side = &op->side[x->index / 32];
+	int i = x->index % 32;
+
+	if (error == 0) {
+		side->regs[i] = ntohl (x->buffer[0]);
+		iec61883_plug_cache_store (op->cmp->handle, side->node,
+			x->addr - CSR_REGISTER_BASE, side->regs[i]);
+	}
+	// else the plug appears offline, as in iec61883_plug_get_outputs()
+	if (op->pending == 0)
+		plugs_ready (op);
+}
+
+static void
+plugs_mpr_done (struct cmp_op *op, struct xfer *x, int error)
+{
+	struct op_side *side = &op->side[x->index];
+	nodeaddr_t mpr = SIDE_MPR (x->index);
+	int i;
+
+	if (error == 0) {
+		side->regs[0] = ntohl (x->buffer[0]);
+		side->n_plugs = side->regs[0] & 0x1f;
+		iec61883_plug_cache_store (op->cmp->handle, side->node, mpr, side->regs[0]);
+		for (i = 1; i <= side->n_plugs; i++) {
+			if (start_read (op, plugs_pcr_done, x->index * 32 + i, side->node,
+				CSR_REGISTER_BASE + mpr + 4 * i, sizeof (quadlet_t)) < 0) {
+				op->error = errno;
+				break;
+			}
+		}
+	}
+	if (op->pending == 0)
+		plugs_ready (op);
+}
+
+static void
+plugs_block_done (struct cmp_op *op, struct xfer *x, int error)
+{
+	struct op_side *side = &op->side[x->index];
+	nodeaddr_t mpr = SIDE_MPR (x->index);
+	int i;
+
+	if (error == 0) {
+		for (i = 0; i <= IEC61883_PCR_MAX; i++)
+			side->regs[i] = ntohl (x->buffer[i]);
+		side->n_plugs = side->regs[0] & 0x1f;
+		for (i = 0; i <= side->n_plugs; i++)
+			iec61883_plug_cache_store (op->cmp->handle, side->node, mpr + 4 * i,
+				side->regs[i]);
+	} else {
+		DEBUG ("block read of plugs on node %d failed; reading quadlets",
+			side->node & 0x3f);
+		if (start_read (op, plugs_mpr_done, x->index, side->node,
+			CSR_REGISTER_BASE + mpr, sizeof (quadlet_t)) < 0)
+			op->error = errno;
+	}
+	if (op->pending == 0)
+		plugs_ready (op);
+}
+
+static int
+plugs_read (struct cmp_op *op)
+{
+	int s;
+
+	for (s = 0; s < 2; s++) {
+		if (start_read (op, plugs_block_done, s, op->side[s].node,
+			CSR_REGISTER_BASE + SIDE_MPR (s), sizeof (op->side[s].regs)) < 0) {
+			if (op->pending == 0)
+				return -1;
+			op->error = errno;
+			break;
+		}
+	}
+	return 0;
+}
+
+
+/* plan the plug changes, following cmp_connect() and iec61883_cmp_disconnect() */
+
+// first online plug without point-to-point connections, or n_plugs
+static int
+find_free_plug (struct op_side *side, int plug, int *online)
+{
+	if (plug >= 0)
+		return plug;
+	for (plug = 0; plug < side->n_plugs; plug++) {
+		struct iec61883_iPCR *pcr = (struct iec61883_iPCR *) &side->regs[1 + plug];
+
+		if (*online == -1 && pcr->online)
+			*online = plug;
+		if (pcr->online && pcr->n_p2p_connections == 0)
+			break;
+	}
+	return plug;
+}
+
+// first online plug on channel, preferring one with connections, or n_plugs
+static int
+find_channel_plug (struct op_side *side, int plug, int channel)
+{
+	int found = side->n_plugs;
+
+	if (plug >= 0)
+		return plug;
+	for (plug = side->n_plugs - 1; plug >= 0; plug--) {
+		struct iec61883_iPCR *pcr = (struct iec61883_iPCR *) &side->regs[1 + plug];
+
+		if (pcr->online && pcr->channel == channel &&
+			(found == side->n_plugs || pcr->n_p2p_connections > 0 || pcr->bcast_connection))
+			found = plug;
+	}
+	return found;
+}
+
+static void
+plug_begin (struct op_side *side, int plug)
+{
+	side->plug = plug;
+	side->old_pcr = side->new_pcr = side->regs[1 + plug];
+}
+
+static void
+p2p_add (struct op_side *side, int overlay)
+{
+	if (overlay && PCR (side)->bcast_connection)
+		return;
+	if (PCR (side)->n_p2p_connections < 63)
+		PCR (side)->n_p2p_connections++;
+}
+
+// a new point-to-point connection on the plugs begun
+static void
+p2p_create (struct cmp_op *op, struct op_side *o, struct op_side *i, int speed)
+{
+	struct iec61883_oPCR *opcr;
+
+	op->irm_channel = op->reconnect ? op->result.channel : IRM_ANY;
+	if (o) {
+		opcr = (struct iec61883_oPCR *) &o->new_pcr;
+		if (!op->skip_bandwidth)
+			op->irm_bandwidth = iec61883_cmp_pcr_bandwidth (opcr, speed);
+		opcr->data_rate = speed;
+		p2p_add (o, 0);
+		o->set_channel = 1;
+	}
+	if (i) {
+		p2p_add (i, 0);
+		i->set_channel = 1;
+	}
+}
+
+static int
+plan_connect (struct cmp_op *op)
+{
+	struct op_side *o = &op->side[0], *i = &op->side[1];
+	struct iec61883_oMPR ompr;
+	struct iec61883_iMPR impr;
+	int oplug = op->result.oplug, iplug = op->result.iplug;
+	int oplug_online = -1, iplug_online = -1;
+	int channel = op->result.channel;
+
+	*((quadlet_t *) &ompr) = o->regs[0];
+	*((quadlet_t *) &impr) = i->regs[0];
+	if (oplug >= o->n_plugs && o->n_plugs > 0)
+		return EINVAL;
+	if (iplug >= i->n_plugs && i->n_plugs > 0)
+		return EINVAL;
+
+	if (o->n_plugs > 0 && i->n_plugs > 0) {
+		// establish or overlay point-to-point
+		unsigned int speed =
+			impr.data_rate < ompr.data_rate ? impr.data_rate : ompr.data_rate;
+
+		oplug = find_free_plug (o, oplug, &oplug_online);
+		iplug = find_free_plug (i, iplug, &iplug_online);
+
+		if (oplug < o->n_plugs && iplug < i->n_plugs) {
+			plug_begin (o, oplug);
+			plug_begin (i, iplug);
+			if (PCR (o)->bcast_connection) {
+				channel = PCR (o)->channel;
+				PCR (i)->bcast_connection = 1;
+			} else {
+				p2p_create (op, o, i, speed);
+			}
+		} else if (iplug < i->n_plugs && oplug_online > -1) {
+			// receive from the channel of the busy output plug
+			oplug = oplug_online;
+			plug_begin (o, oplug);
+			plug_begin (i, iplug);
+			channel = PCR (o)->channel;
+			if (PCR (o)->bcast_connection) {
+				PCR (i)->bcast_connection = 1;
+			} else {
+				PCR (i)->channel = channel;
+				p2p_add (i, 0);
+				p2p_add (o, 1);
+			}
+		} else if (oplug_online > -1 && iplug_online > -1) {
+			oplug = oplug_online;
+			iplug = iplug_online;
+			plug_begin (o, oplug);
+			plug_begin (i, iplug);
+			channel = PCR (o)->channel;
+			p2p_add (o, 1);
+			p2p_add (i, 1);
+		} else {
+			WARN ("All the plugs on both nodes are offline!");
+			return ENODEV;
+		}
+
+	} else if (o->n_plugs > 0) {
+		// establish or overlay half point-to-point on output
+		iplug = -1;
+		oplug = find_free_plug (o, oplug, &oplug_online);
+
+		if (oplug < o->n_plugs) {
+			plug_begin (o, oplug);
+			if (PCR (o)->bcast_connection) {
+				channel = PCR (o)->channel;
+				o->plug = -1;
+			} else {
+				p2p_create (op, o, NULL, ompr.data_rate);
+			}
+		} else if (oplug_online > -1) {
+			oplug = oplug_online;
+			plug_begin (o, oplug);
+			channel = PCR (o)->channel;
+			if (PCR (o)->bcast_connection)
+				o->plug = -1;
+			else
+				p2p_add (o, 1);
+		} else {
+			WARN ("Transmission node has no plugs online!");
+			// failover to broadcast, bandwidth based upon first out plug
+			oplug = -1;
+			if (!op->skip_bandwidth)
+				op->irm_bandwidth = iec61883_cmp_pcr_bandwidth (
+					(struct iec61883_oPCR *) &o->regs[1], ompr.data_rate);
+			op->irm_channel = ompr.bcast_channel;
+		}
+
+	} else if (i->n_plugs > 0) {
+		// establish or overlay half point-to-point on input; without an
+		// output plug there is nothing to base a bandwidth allocation on
+		oplug = -1;
+		iplug = find_free_plug (i, iplug, &iplug_online);
+
+		if (iplug < i->n_plugs) {
+			plug_begin (i, iplug);
+			if (PCR (i)->bcast_connection) {
+				channel = PCR (i)->channel;
+				i->plug = -1;
+			} else {
+				p2p_create (op, NULL, i, 0);
+			}
+		} else if (iplug_online > -1) {
+			iplug = iplug_online;
+			plug_begin (i, iplug);
+			channel = PCR (i)->channel;
+			if (PCR (i)->bcast_connection)
+				i->plug = -1;
+			else
+				p2p_add (i, 1);
+		} else {
+			WARN ("Receiving node has no plugs online!");
+			iplug = -1;
+			op->irm_channel = 63;
+		}
+
+	} else {
+		WARN ("No plugs exist on either node; using default broadcast channel 63.");
+		oplug = iplug = -1;
+		op->irm_channel = 63;
+	}
+
+	op->result.oplug = oplug;
+	op->result.iplug = iplug;
+	op->result.channel = op->irm_channel >= 0 ? op->irm_channel : channel;
+	return 0;
+}
+
+// select the plug of side s to disconnect and compute its new value;
+// returns 0 if no plug is on the channel
+static int
+disconnect_side (struct cmp_op *op, int s)
+{
+	struct op_side *side = &op->side[s];
+	struct iec61883_oMPR ompr;
+	int half = (op->side[0].n_plugs == 0);
+	int plug;
+
+	*((quadlet_t *) &ompr) = op->side[0].regs[0];
+	if (op->release_side == s)
+		op->release_side = RELEASE_NONE;
+	side->plug = -1;
+	plug = find_channel_plug (side, s ? op->iplug : op->oplug, op->channel);
+	if (plug == side->n_plugs)
+		return 0;
+	if (s)
+		op->result.iplug = plug;
+	else
+		op->result.oplug = plug;
+
+	plug_begin (side, plug);
+	if (PCR (side)->n_p2p_connections > 0) {
+		if (--PCR (side)->n_p2p_connections == 0) {
+			if (s == 0) {
+				PCR (side)->channel = ompr.bcast_channel;
+				op->release_side = 0;
+			} else if (half) {
+				// in half-way management the receiver holds the resources
+				PCR (side)->channel = 63;
+				op->release_side = 1;
+			}
+		}
+	} else if (s == 1 && !half && PCR (side)->bcast_connection) {
+		PCR (side)->bcast_connection = 0;
+		PCR (side)->channel = ompr.bcast_channel;
+	} else {
+		side->plug = -1;
+	}
+	return 1;
+}
+
+static int
+plan_disconnect (struct cmp_op *op)
+{
+	struct op_side *o = &op->side[0], *i = &op->side[1];
+	int found_o, found_i;
+
+	if (op->oplug >= o->n_plugs && o->n_plugs > 0)
+		return EINVAL;
+	if (op->iplug >= i->n_plugs && i->n_plugs > 0)
+		return EINVAL;
+
+	found_o = o->n_plugs > 0 && disconnect_side (op, 0);
+	found_i = i->n_plugs > 0 && disconnect_side (op, 1);
+
+	if (o->n_plugs > 0 && i->n_plugs > 0) {
+		if (!found_o && !found_i)
+			return ENOENT;
+	} else if (o->n_plugs > 0 ? !found_o : !found_i) {
+		// nobody holds the resources in the plugs, or there are no plugs
+		op->release_side = RELEASE_ALWAYS;
+	}
+	return 0;
+}
+
+// a plug of a connection restored after a bus reset: leave it alone if
+// it still carries the connection, otherwise connect it again
+static int
+restore_side (struct cmp_op *op, int s, int plug)
+{
+	struct op_side *side = &op->side[s];
+	struct iec61883_iPCR *pcr = (struct iec61883_iPCR *) &side->regs[1 + plug];
+
+	if (plug >= side->n_plugs)
+		return ENODEV;
+	if (pcr->n_p2p_connections > 0 || pcr->bcast_connection)
+		return pcr->channel == op->channel ? 0 : EBUSY;
+	plug_begin (side, plug);
+	PCR (side)->channel = op->channel;
+	p2p_add (side, 0);
+	return 0;
+}
+
+// the IRM resources were reclaimed before the plugs were read
+static int
+plan_restore (struct cmp_op *op)
+{
+	int error = 0;
+
+	if (op->oplug >= 0)
+		error = restore_side (op, 0, op->oplug);
+	if (error == 0 && op->iplug >= 0)
+		error = restore_side (op, 1, op->iplug);
+	return error;
+}
+
+static void
+plugs_ready (struct cmp_op *op)
+{
+	int error = op->error;
+
+	if (error == 0) {
+		if (op->disconnect)
+			error = plan_disconnect (op);
+		else if (op->restore)
+			error = plan_restore (op);
+		else
+			error = plan_connect (op);
+	}
+	if (error) {
+		if (op->restore)
+			op_rollback (op, error, 0);
+		else
+			op_finish (op, error);
+	} else if (!op->disconnect && !op->restore &&
+		(op->irm_bandwidth > 0 || op->irm_channel != IRM_NONE)) {
+		irm_queue (op);
+	} else {
+		plugs_set (op);
+	}
+}
+
+
+/* IRM */
+
+static void
+irm_queue (struct cmp_op *op)
+{
+	struct iec61883_cmp_async *cmp = op->cmp;
+
+	op->next = NULL;
+	op->error = 0;
+	if (cmp->irm_tail)
+		cmp->irm_tail->next = op;
+	else
+		cmp->irm_head = op;
+	cmp->irm_tail = op;
+	if (cmp->irm_head == op)
+		irm_step (op);
+}
+
+// take the head off the IRM queue and start the next request
+static void
+irm_dequeue (struct cmp_op *op)
+{
+	struct iec61883_cmp_async *cmp = op->cmp;
+
+	cmp->irm_head = op->next;
+	if (cmp->irm_head == NULL)
+		cmp->irm_tail = NULL;
+	else
+		irm_step (cmp->irm_head);
+}
+
+// the end of a rollback: report the error that caused it, or start over
+static void
+rollback_done (struct cmp_op *op)
+{
+	int error = op->result.error;
+
+	if (op->restart && ++op->restarts < MAX_TRIES)
+		op_restart (op);
+	else
+		op_finish (op, error);
+}
+
+// turn the IRM work of a failed connect into releasing what it has
+// allocated; returns 0 if there is nothing to release
+static int
+irm_rollback (struct cmp_op *op)
+{
+	if (!op->channel_claimed && !op->bandwidth_done)
+		return 0;
+	op->rollback = 1;
+	op->irm_channel = op->channel_claimed ? op->result.channel : IRM_NONE;
+	op->irm_bandwidth = op->bandwidth_done ? op->irm_bandwidth : 0;
+	op->channel_claimed = 0;
+	op->channel_done = 0;
+	op->bandwidth_done = 0;
+	op->irm_tries = 0;
+	return 1;
+}
+
+static void
+irm_fail (struct cmp_op *op, int error)
+{
+	op->cmp->irm_valid = 0;
+	if (op->rollback) {
+		WARN ("%s: request %d failed to release IRM resources: %s", __FUNCTION__,
+			op->result.id, strerror (error));
+		irm_dequeue (op);
+		rollback_done (op);
+		return;
+	}
+	if (!op->disconnect) {
+		op->result.error = error;
+		if (irm_rollback (op)) {
+			irm_step (op);
+			return;
+		}
+	}
+	irm_dequeue (op);
+	op_finish (op, error);
+}
+
+static void
+irm_read_done (struct cmp_op *op, struct xfer *x, int error)
+{
+	struct iec61883_cmp_async *cmp = op->cmp;
+
+	if (error) {
+		if (op->error == 0)
+			op->error = error;
+	} else if (x->index == 0) {
+		cmp->irm_bandwidth = ntohl (x->buffer[0]);
+	} else {
+		cmp->irm_channels[x->index - 1] = ntohl (x->buffer[0]);
+	}
+	if (op->pending > 0)
+		return;
+	if (op->error) {
+		irm_fail (op, op->error);
+	} else {
+		cmp->irm_valid = 1;
+		irm_step (op);
+	}
+}
+
+static void
+irm_bandwidth_done (struct cmp_op *op, struct xfer *x, int error)
+{
+	struct iec61883_cmp_async *cmp = op->cmp;
+
+	if (error) {
+		irm_fail (op, error);
+		return;
+	}
+	if (x->buffer[0] == x->arg) {
+		cmp->irm_bandwidth = ntohl (x->data);
+		op->bandwidth_done = 1;
+	} else {
+		cmp->irm_bandwidth = ntohl (x->buffer[0]);
+		if (++op->irm_tries == MAX_TRIES) {
+			irm_fail (op, EAGAIN);
+			return;
+		}
+	}
+	irm_step (op);
+}
+
+static void
+irm_channel_done (struct cmp_op *op, struct xfer *x, int error)
+{
+	struct iec61883_cmp_async *cmp = op->cmp;
+	int reg = CHANNEL_REG (x->index);
+
+	if (error) {
+		irm_fail (op, error);
+		return;
+	}
+	if (x->buffer[0] == x->arg) {
+		cmp->irm_channels[reg] = ntohl (x->data);
+		op->channel_done = 1;
+		op->channel_claimed = !op->disconnect && !op->rollback;
+	} else {
+		cmp->irm_channels[reg] = ntohl (x->buffer[0]);
+		if (++op->irm_tries == MAX_TRIES) {
+			irm_fail (op, EAGAIN);
+			return;
+		}
+	}
+	irm_step (op);
+}
+
+static void
+irm_step (struct cmp_op *op)
+{
+	struct iec61883_cmp_async *cmp = op->cmp;
+	raw1394handle_t handle = cmp->handle;
+	nodeid_t irm = raw1394_get_irm_id (handle);
+	unsigned int generation = raw1394_get_generation (handle);
+	quadlet_t avail, want;
+	int c;
+
+	if (!cmp->irm_valid || cmp->irm_generation != generation || cmp->irm_node != irm) {
+		cmp->irm_valid = 0;
+		cmp->irm_generation = generation;
+		cmp->irm_node = irm;
+		if (start_read (op, irm_read_done, 0, irm,
+				CSR_REGISTER_BASE + CSR_BANDWIDTH_AVAILABLE, sizeof (quadlet_t)) < 0 ||
+			start_read (op, irm_read_done, 1, irm,
+				CSR_REGISTER_BASE + CSR_CHANNELS_AVAILABLE_HI, sizeof (quadlet_t)) < 0 ||
+			start_read (op, irm_read_done, 2, irm,
+				CSR_REGISTER_BASE + CSR_CHANNELS_AVAILABLE_LO, sizeof (quadlet_t)) < 0) {
+			op->error = errno;
+			if (op->pending == 0)
+				irm_fail (op, op->error);
+		}
+		return;
+	}
+
+	if (op->irm_bandwidth > 0 && !op->bandwidth_done) {
+		avail = cmp->irm_bandwidth;
+		if (op->disconnect || op->rollback) {
+			want = avail + op->irm_bandwidth;
+			if (want > MAX_BANDWIDTH) {
+				irm_fail (op, EINVAL);
+				return;
+			}
+		} else if (avail < op->irm_bandwidth) {
+			irm_fail (op, ENOSPC);
+			return;
+		} else {
+			want = avail - op->irm_bandwidth;
+		}
+		if (start_lock (op, irm_bandwidth_done, 0, irm,
+			CSR_REGISTER_BASE + CSR_BANDWIDTH_AVAILABLE, avail, want) < 0)
+			irm_fail (op, errno);
+		return;
+	}
+
+	if (op->irm_channel != IRM_NONE && !op->channel_done) {
+		c = op->irm_channel;
+		if (c == IRM_ANY) {
+			// the broadcast channel 63 is never allocated
+			for (c = 0; c < 63; c++)
+				if (cmp->irm_channels[CHANNEL_REG (c)] & CHANNEL_BIT (c))
+					break;
+			if (c == 63) {
+				irm_fail (op, ENOSPC);
+				return;
+			}
+		}
+		op->result.channel = c;
+		avail = cmp->irm_channels[CHANNEL_REG (c)];
+		if (op->disconnect || op->rollback) {
+			want = avail | CHANNEL_BIT (c);
+		} else if ((avail & CHANNEL_BIT (c)) == 0) {
+			// a reconnection keeps its channel, as iec61883_cmp_reconnect()
+			if (!op->reconnect) {
+				irm_fail (op, EBUSY);
+				return;
+			}
+			want = avail;
+		} else {
+			want = avail & ~CHANNEL_BIT (c);
+		}
+		if (want == avail) {
+			op->channel_done = 1;
+			irm_step (op);
+		} else if (start_lock (op, irm_channel_done, c, irm, CSR_REGISTER_BASE +
+			(CHANNEL_REG (c) ? CSR_CHANNELS_AVAILABLE_LO : CSR_CHANNELS_AVAILABLE_HI),
+			avail, want) < 0) {
+			irm_fail (op, errno);
+		}
+		return;
+	}
+
+	irm_dequeue (op);
+	if (op->rollback) {
+		rollback_done (op);
+	} else if (op->disconnect) {
+		op_finish (op, op->result.error);
+	} else if (op->restore) {
+		op->result.bandwidth = op->irm_bandwidth;
+		if (plugs_read (op) < 0)
+			op_rollback (op, errno, 0);
+	} else {
+		op->result.bandwidth = op->irm_bandwidth;
+		plugs_set (op);
+	}
+}
+
+
+/* set plugs */
+
+// returns -1 if nothing could be started
+static int
+op_start (struct cmp_op *op)
+{
+	op_reset (op);
+	if (op->restore && op->claim) {
+		op->irm_channel = op->channel;
+		op->irm_bandwidth = op->bandwidth;
+		irm_queue (op);
+		return 0;
+	}
+	return plugs_read (op);
+}
+
+static void
+op_restart (struct cmp_op *op)
+{
+	DEBUG ("%s: request %d", __FUNCTION__, op->result.id);
+	if (op_start (op) < 0)
+		op_finish (op, errno);
+}
+
+static void
+plugs_done (struct cmp_op *op)
+{
+	int error = op->side[0].error ? op->side[0].error : op->side[1].error;
+
+	if (op->disconnect) {
+		if (op->release_side == RELEASE_ALWAYS ||
+			(op->release_side >= 0 && op->side[op->release_side].swapped)) {
+			if (op->side[0].n_plugs == 0 && op->side[1].n_plugs == 0) {
+				op->irm_channel = 63;
+			} else {
+				op->irm_channel = op->channel;
+				op->irm_bandwidth = op->bandwidth;
+			}
+			op->result.error = error;
+			irm_queue (op);
+		} else {
+			op_finish (op, error);
+		}
+		return;
+	}
+
+	if (error) {
+		// plugs changed by another request, such as a concurrent connection
+		// to the same node that picked the same free plug: start over
+		op_rollback (op, error, error == EAGAIN);
+		return;
+	}
+	op_finish (op, error);
+}
+
+static int
+plug_swap (struct cmp_op *op, int s)
+{
+	struct op_side *side = &op->side[s];
+
+	return start_lock (op, plugs_set_done, s, side->node,
+		CSR_REGISTER_BASE + SIDE_MPR (s) + 4 + 4 * side->plug,
+		side->old_pcr, side->new_pcr);
+}
+
+static void
+plugs_set_done (struct cmp_op *op, struct xfer *x, int error)
+{
+	struct op_side *side = &op->side[x->index];
+	nodeaddr_t addr = x->addr - CSR_REGISTER_BASE;
+
+	if (error == 0 && x->buffer[0] != x->arg) {
+		// the plug changed after it was read
+		iec61883_plug_cache_store (op->cmp->handle, side->node, addr,
+			ntohl (x->buffer[0]));
+		error = EAGAIN;
+		if (op->disconnect && ++side->tries < MAX_TRIES) {
+			// decide again from the current value; a concurrent disconnect
+			// may have emptied the plug, then another one is picked
+			side->regs[1 + side->plug] = ntohl (x->buffer[0]);
+			disconnect_side (op, x->index);
+			if (side->plug < 0)
+				error = 0;
+			else if (plug_swap (op, x->index) == 0)
+				return;
+			else
+				error = errno;
+		}
+	} else if (error == 0) {
+		iec61883_plug_cache_store (op->cmp->handle, side->node, addr, side->new_pcr);
+		side->swapped = 1;
+	}
+	side->error = error;
+	if (op->pending == 0)
+		plugs_done (op);
+}
+
+static void
+plugs_set (struct cmp_op *op)
+{
+	struct op_side *side;
+	int s;
+
+	for (s = 0; s < 2; s++) {
+		side = &op->side[s];
+		if (side->plug < 0)
+			continue;
+		if (side->set_channel)
+			PCR (side)->channel = op->result.channel;
+		if (plug_swap (op, s) < 0)
+			side->error = errno;
+	}
+	if (op->pending == 0)
+		plugs_done (op);
+}
+
+
+/* roll back a failed connect */
+
+// value with the change from old_pcr to new_pcr taken back, as pcr_undo()
+static quadlet_t
+plug_undo_value (struct op_side *side, quadlet_t value)
+{
+	struct iec61883_oPCR *save = (struct iec61883_oPCR *) &side->old_pcr;
+	struct iec61883_oPCR *done = (struct iec61883_oPCR *) &side->new_pcr;
+	struct iec61883_oPCR *pcr = (struct iec61883_oPCR *) &value;
+
+	if (done->channel != save->channel && pcr->channel == done->channel)
+		pcr->channel = save->channel;
+	if (done->data_rate != save->data_rate && pcr->data_rate == done->data_rate)
+		pcr->data_rate = save->data_rate;
+	if (done->n_p2p_connections != save->n_p2p_connections && pcr->n_p2p_connections > 0)
+		pcr->n_p2p_connections--;
+	if (done->bcast_connection != save->bcast_connection)
+		pcr->bcast_connection = 0;
+	return value;
+}
+
+// the plugs are back; release the IRM resources
+static void
+plugs_undone (struct cmp_op *op)
+{
+	if (irm_rollback (op))
+		irm_queue (op);
+	else
+		rollback_done (op);
+}
+
+static void
+plug_undo_done (struct cmp_op *op, struct xfer *x, int error)
+{
+	struct op_side *side = &op->side[x->index];
+	nodeaddr_t addr = x->addr - CSR_REGISTER_BASE;
+	quadlet_t value;
+
+	if (error == 0 && x->buffer[0] != x->arg) {
+		// changed by others since; take ours back from the current value
+		value = ntohl (x->buffer[0]);
+		iec61883_plug_cache_store (op->cmp->handle, side->node, addr, value);
+		error = EAGAIN;
+		if (++side->tries < MAX_TRIES) {
+			if (start_lock (op, plug_undo_done, x->index, side->node, x->addr,
+				value, plug_undo_value (side, value)) == 0)
+				return;
+			error = errno;
+		}
+	} else if (error == 0) {
+		iec61883_plug_cache_store (op->cmp->handle, side->node, addr, ntohl (x->data));
+	}
+	if (error)
+		WARN ("%s: Failed to undo changes on the PCR at 0x%x for node %d.", __FUNCTION__,
+			(unsigned int) addr, (int) side->node & 0x3f);
+	if (op->pending == 0)
+		plugs_undone (op);
+}
+
+// take back the plug changes and IRM allocations of a failed connect,
+// then report error or, with restart, start over
+static void
+op_rollback (struct cmp_op *op, int error, int restart)
+{
+	struct op_side *side;
+	int s;
+
+	op->result.error = error;
+	op->restart = restart;
+	for (s = 0; s < 2; s++) {
+		side = &op->side[s];
+		if (!side->swapped)
+			continue;
+		side->tries = 0;
+		if (start_lock (op, plug_undo_done, s, side->node,
+			CSR_REGISTER_BASE + SIDE_MPR (s) + 4 + 4 * side->plug,
+			side->new_pcr, plug_undo_value (side, side->new_pcr)) < 0)
+			WARN ("%s: Failed to undo changes on the PCR of node %d.", __FUNCTION__,
+				(int) side->node & 0x3f);
+	}
+	if (op->pending == 0)
+		plugs_undone (op);
+}
+
+
+/* public interface */
+
+iec61883_cmp_async_t
+iec61883_cmp_async_init (raw1394handle_t handle,
+	iec61883_cmp_async_done_t done, void *callback_data)
+{
+	struct iec61883_cmp_async *cmp;
+
+	assert (handle != NULL);
+	assert (done != NULL);
+
+	iec61883_log_start ();
+	cmp = calloc (1, sizeof (struct iec61883_cmp_async));
+	if (cmp == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	cmp->handle = handle;
+	cmp->done = done;
+	cmp->callback_data = callback_data;
+	cmp->retry_seed = (unsigned long) cmp ^ time (NULL);
+	return cmp;
+}
+
+static int
+cmp_async_queue (struct cmp_op *op)
+{
+	struct iec61883_cmp_async *cmp = op->cmp;
+	int id = cmp->next_id;
+
+	// the id is taken before the request starts, which may complete it
+	op->result.id = id;
+	cmp->next_id = (id + 1) & 0x7fffffff;
+	cmp->pending++;
+	if (op_start (op) < 0) {
+		cmp->next_id = id;
+		cmp->pending--;
+		free (op);
+		return -1;
+	}
+	return id;
+}
+
+int
+iec61883_cmp_async_connect (iec61883_cmp_async_t cmp, nodeid_t output, int oplug,
+	nodeid_t input, int iplug, int bandwidth, int channel)
+{
+	struct cmp_op *op;
+
+	assert (cmp != NULL);
+	if (oplug >= IEC61883_PCR_MAX || iplug >= IEC61883_PCR_MAX || channel > 63) {
+		errno = EINVAL;
+		return -1;
+	}
+	op = op_new (cmp, 0, output, oplug < 0 ? -1 : oplug, input, iplug < 0 ? -1 : iplug,
+		channel < 0 ? -1 : channel);
+	if (op == NULL)
+		return -1;
+	op->reconnect = (channel >= 0);
+	op->skip_bandwidth = (bandwidth == 0);
+	return cmp_async_queue (op);
+}
+
+int
+iec61883_cmp_async_disconnect (iec61883_cmp_async_t cmp, nodeid_t output, int oplug,
+	nodeid_t input, int iplug, unsigned int channel, unsigned int bandwidth)
+{
+	struct cmp_op *op;
+
+	assert (cmp != NULL);
+	if (oplug >= IEC61883_PCR_MAX || iplug >= IEC61883_PCR_MAX || channel > 63) {
+		errno = EINVAL;
+		return -1;
+	}
+	op = op_new (cmp, 1, output, oplug < 0 ? -1 : oplug, input, iplug < 0 ? -1 : iplug,
+		channel);
+	if (op == NULL)
+		return -1;
+	op->bandwidth = bandwidth;
+	return cmp_async_queue (op);
+}
+
+int
+iec61883_cmp_async_restore (iec61883_cmp_async_t cmp, nodeid_t output, int oplug,
+	nodeid_t input, int iplug, unsigned int channel, unsigned int bandwidth, int claim)
+{
+	struct cmp_op *op;
+
+	assert (cmp != NULL);
+	if (oplug >= IEC61883_PCR_MAX || iplug >= IEC61883_PCR_MAX || channel > 63) {
+		errno = EINVAL;
+		return -1;
+	}
+	op = op_new (cmp, 0, output, oplug < 0 ? -1 : oplug, input, iplug < 0 ? -1 : iplug,
+		channel);
+	if (op == NULL)
+		return -1;
+	op->restore = 1;
+	op->claim = claim;
+	op->bandwidth = claim ? bandwidth : 0;
+	return cmp_async_queue (op);
+}
+
+int
+iec61883_cmp_async_pending (iec61883_cmp_async_t cmp)
+{
+	assert (cmp != NULL);
+	return cmp->pending;
+}
+
+int
+iec61883_cmp_async_get_fd (iec61883_cmp_async_t cmp)
+{
+	assert (cmp != NULL);
+	return raw1394_get_fd (cmp->handle);
+}
+
+int
+iec61883_cmp_async_get_timeout (iec61883_cmp_async_t cmp)
+{
+	unsigned long long now;
+
+	assert (cmp != NULL);
+	if (cmp->retry_head == NULL)
+		return -1;
+	now = iec61883_now_us ();
+	if (cmp->retry_head->due <= now)
+		return 0;
+	return (cmp->retry_head->due - now + 999) / 1000;
+}
+
+int
+iec61883_cmp_async_iterate (iec61883_cmp_async_t cmp)
+{
+	struct pollfd pfd;
+	int timeout, n;
+
+	assert (cmp != NULL);
+	xfer_resend (cmp);
+	timeout = iec61883_cmp_async_get_timeout (cmp);
+	if (timeout >= 0) {
+		// wait for a response only until the next retry is due
+		pfd.fd = raw1394_get_fd (cmp->handle);
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		n = poll (&pfd, 1, timeout);
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			xfer_resend (cmp);
+			return 0;
+		}
+	}
+	return raw1394_loop_iterate (cmp->handle);
+}
+
+void
+iec61883_cmp_async_close (iec61883_cmp_async_t cmp)
+{
+	if (cmp) {
+		// the transactions in flight point into our requests
+		while (cmp->pending > 0)
+			if (iec61883_cmp_async_iterate (cmp) < 0 && errno != EINTR)
+				break;
+		if (cmp->pending == 0)
+			free (cmp);
+		else
+			WARN ("%s: leaking %d unfinished requests", __FUNCTION__, cmp->pending);
+	}
+}
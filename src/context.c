@@ -0,0 +1,140 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "iec61883.h"
+#include "iec61883-private.h"
+#include "cooked.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Library state kept per raw1394 handle
+ *
+ * The public API only takes raw1394 handles, and the handle's userdata
+ * belongs to the stream objects, so per-handle state is looked up in a
+ * list here. There are few handles per process; a list is fine.
+ *
+ * The state is opt-in: it lives from iec61883_handle_init() until
+ * iec61883_handle_release(), and without it the library reads plug
+ * registers uncached and uses the default retry policy, as it always did.
+ * A handle destroyed without release leaves its state behind, and a new
+ * handle may get the same address; such state is dropped when the new
+ * handle is initialized, or when the file descriptor of the handle no
+ * longer matches, without touching the handle.
+ */
+
+static pthread_mutex_t g_contexts_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct iec61883_context *g_contexts = NULL;
+
+/* with g_contexts_lock held */
+static struct iec61883_context *
+context_unlink (raw1394handle_t handle)
+{
+	struct iec61883_context **p, *ctx;
+
+	for (p = &g_contexts; *p; p = &(*p)->next) {
+		if ((*p)->handle == handle) {
+			ctx = *p;
+			*p = ctx->next;
+			return ctx;
+		}
+	}
+	return NULL;
+}
+
+static void
+context_free (struct iec61883_context *ctx)
+{
+	if (ctx)
+		iec61883_registry_release (ctx);
+	free (ctx);
+}
+
+struct iec61883_context *
+iec61883_context_get (raw1394handle_t handle)
+{
+	struct iec61883_context *ctx, *stale = NULL;
+	int fd;
+
+	assert (handle != NULL);
+	fd = raw1394_get_fd (handle);
+	pthread_mutex_lock (&g_contexts_lock);
+	for (ctx = g_contexts; ctx; ctx = ctx->next)
+		if (ctx->handle == handle)
+			break;
+	if (ctx && ctx->fd != fd) {
+		stale = context_unlink (handle);
+		stale->stale = 1;
+		ctx = NULL;
+	}
+	pthread_mutex_unlock (&g_contexts_lock);
+	context_free (stale);
+	if (!ctx)
+		errno = ENOENT;
+
+	return ctx;
+}
+
+int
+iec61883_handle_init (raw1394handle_t handle)
+{
+	struct iec61883_context *ctx, *stale;
+
+	assert (handle != NULL);
+	iec61883_log_start ();
+	ctx = calloc (1, sizeof (struct iec61883_context));
+	if (ctx == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	ctx->handle = handle;
+	ctx->fd = raw1394_get_fd (handle);
+	ctx->retry = iec61883_default_retry_policy;
+	ctx->retry_seed = (unsigned long) handle ^ time (NULL);
+
+	pthread_mutex_lock (&g_contexts_lock);
+	stale = context_unlink (handle);
+	if (stale)
+		stale->stale = 1;
+	ctx->next = g_contexts;
+	g_contexts = ctx;
+	pthread_mutex_unlock (&g_contexts_lock);
+	context_free (stale);
+
+	return 0;
+}
+
+void
+iec61883_handle_release (raw1394handle_t handle)
+{
+	struct iec61883_context *ctx;
+
+	pthread_mutex_lock (&g_contexts_lock);
+	ctx = context_unlink (handle);
+	pthread_mutex_unlock (&g_contexts_lock);
+	context_free (ctx);
+}
@@ -23,51 +23,210 @@
 #include <config.h>
 #endif
 
+#include "iec61883.h"
+#include "iec61883-private.h"
 #include "cooked.h"
 
+#include <assert.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
-/*
- * constants for use with raw1394 ARM
- * The following probably should be in raw1394.h
- */
+const struct iec61883_retry_policy iec61883_default_retry_policy = {
+	20,      /* max_tries */
+	2,       /* timeout_tries */
+	20,      /* initial_delay */
+	2000,    /* max_delay */
+	100000,  /* deadline */
+};
+
+enum cooked_kind {
+	COOKED_READ,
+	COOKED_WRITE,
+	COOKED_LOCK,
+};
+
+struct cooked_request {
+	enum cooked_kind kind;
+	nodeid_t node;
+	nodeaddr_t addr;
+	size_t length;
+	quadlet_t *data;
+	unsigned int extcode;
+	quadlet_t lock_data, arg;
+};
+
+static int
+cooked_attempt (raw1394handle_t handle, const struct cooked_request *r)
+{
+	switch (r->kind) {
+	case COOKED_READ:
+		return raw1394_read (handle, r->node, r->addr, r->length, r->data);
+	case COOKED_WRITE:
+		return raw1394_write (handle, r->node, r->addr, r->length, r->data);
+	default:
+		return raw1394_lock (handle, r->node, r->addr, r->extcode,
+			r->lock_data, r->arg, r->data);
+	}
+}
+
+static void
+cooked_account (struct iec61883_context *ctx, int failed, unsigned int busy,
+	unsigned int timeouts, int expired, unsigned int latency)
+{
+	struct iec61883_transaction_stats *stats = &ctx->stats;
 
+	iec61883_seq_write_begin (&ctx->stats_seq);
+	if (ctx->stats_reset) {
+		memset (stats, 0, sizeof (*stats));
+		ctx->stats_reset = 0;
+	}
+	stats->transactions++;
+	stats->failures += failed;
+	stats->busy_retries += busy;
+	stats->timeout_retries += timeouts;
+	stats->deadline_expired += expired;
+	stats->latency_total += latency;
+	stats->latency_last = latency;
+	if (latency > stats->latency_max)
+		stats->latency_max = latency;
+	iec61883_seq_write_end (&ctx->stats_seq);
+}
+
+static int
+cooked_transaction (raw1394handle_t handle, const struct cooked_request *r)
+{
+	struct iec61883_context *ctx = iec61883_context_get (handle);
+	const struct iec61883_retry_policy *policy =
+		ctx ? &ctx->retry : &iec61883_default_retry_policy;
+	unsigned long long start = iec61883_now_us (), elapsed;
+	unsigned int busy = 0, timeouts = 0, delay = policy->initial_delay, sleep;
+	int retval, error = 0, expired = 0;
+	struct timespec ts;
 
-/* maximum number of retry attempts on raw1394 async transactions */
-#define MAXTRIES 20
+	for (;;) {
+		retval = cooked_attempt (handle, r);
+		if (retval >= 0)
+			break;
+		error = errno;
 
-/* amount of delay in nanoseconds to wait before retrying raw1394 async transaction */
-#define RETRY_DELAY 20000
+		if (error == EAGAIN) {
+			// busy: the request was not performed
+			if (policy->max_tries && busy + 1 >= policy->max_tries)
+				break;
+			busy++;
+		} else if (error == ETIMEDOUT && r->kind != COOKED_LOCK) {
+			// no response: the node may be gone, retry sparingly
+			if (timeouts + 1 >= policy->timeout_tries)
+				break;
+			timeouts++;
+		} else {
+			break;
+		}
+
+		sleep = delay / 2 + (ctx ? rand_r (&ctx->retry_seed) : rand ()) % (delay / 2 + 1);
+		elapsed = iec61883_now_us () - start;
+		if (policy->deadline && elapsed + sleep >= policy->deadline) {
+			expired = 1;
+			break;
+		}
+		ts.tv_sec = sleep / 1000000;
+		ts.tv_nsec = (sleep % 1000000) * 1000;
+		nanosleep (&ts, NULL);
+		delay = (delay * 2 > policy->max_delay) ? policy->max_delay : delay * 2;
+	}
+
+	if (ctx)
+		cooked_account (ctx, retval < 0, busy, timeouts, expired, iec61883_now_us () - start);
+	if (retval < 0)
+		errno = error;
+	return retval;
+}
 
 int
 iec61883_cooked_read(raw1394handle_t handle, nodeid_t node, nodeaddr_t addr,
                     size_t length, quadlet_t *buffer)
 {
-    int retval, i;
-	struct timespec ts = {0, RETRY_DELAY};
-    for (i = 0; i < MAXTRIES; i++) {
-        retval = raw1394_read (handle, node, addr, length, buffer);
-        if (retval < 0 && errno == EAGAIN)
-            nanosleep(&ts, NULL);
-        else
-            return retval;
-    }
-    return -1;
+	struct cooked_request r = { COOKED_READ, node, addr, length, buffer };
+
+	return cooked_transaction (handle, &r);
 }
 
 int
 iec61883_cooked_write(raw1394handle_t handle, nodeid_t node, nodeaddr_t addr,
                      size_t length, quadlet_t *data)
 {
-    int retval, i;
-	struct timespec ts = {0, RETRY_DELAY};
-    for (i = 0; i < MAXTRIES; i++) {
-        retval = raw1394_write (handle, node, addr, length, data);
-        if (retval < 0 && errno == EAGAIN)
-            nanosleep(&ts, NULL);
-        else
-            return retval;
-    }
-    return -1;
+	struct cooked_request r = { COOKED_WRITE, node, addr, length, data };
+
+	return cooked_transaction (handle, &r);
+}
+
+int
+iec61883_cooked_lock(raw1394handle_t handle, nodeid_t node, nodeaddr_t addr,
+                    unsigned int extcode, quadlet_t data, quadlet_t arg,
+                    quadlet_t *result)
+{
+	struct cooked_request r = { COOKED_LOCK, node, addr, sizeof (quadlet_t), result,
+		extcode, data, arg };
+
+	return cooked_transaction (handle, &r);
+}
+
+int
+iec61883_set_retry_policy (raw1394handle_t handle,
+	const struct iec61883_retry_policy *policy)
+{
+	struct iec61883_context *ctx;
+
+	assert (handle != NULL);
+	if (policy == NULL)
+		policy = &iec61883_default_retry_policy;
+	// without a delay, busy retries would spin
+	if (policy->timeout_tries < 1 || policy->initial_delay < 1 ||
+		policy->max_delay < policy->initial_delay) {
+		errno = EINVAL;
+		return -1;
+	}
+	ctx = iec61883_context_get (handle);
+	if (ctx == NULL)
+		return -1;
+	ctx->retry = *policy;
+	return 0;
+}
+
+void
+iec61883_get_retry_policy (raw1394handle_t handle,
+	struct iec61883_retry_policy *policy)
+{
+	struct iec61883_context *ctx;
+
+	assert (handle != NULL);
+	assert (policy != NULL);
+	ctx = iec61883_context_get (handle);
+	*policy = ctx ? ctx->retry : iec61883_default_retry_policy;
+}
+
+void
+iec61883_get_transaction_stats (raw1394handle_t handle,
+	struct iec61883_transaction_stats *stats, int reset)
+{
+	struct iec61883_context *ctx;
+	unsigned int start;
+
+	assert (handle != NULL);
+	assert (stats != NULL);
+	ctx = iec61883_context_get (handle);
+	if (ctx == NULL) {
+		memset (stats, 0, sizeof (*stats));
+		return;
+	}
+	do {
+		start = iec61883_seq_read_begin (&ctx->stats_seq);
+		memcpy (stats, &ctx->stats, sizeof (*stats));
+	} while (iec61883_seq_read_retry (&ctx->stats_seq, start));
+
+	// carried out by the next transaction, which owns the counters
+	if (reset)
+		ctx->stats_reset = 1;
 }
@@ -18,6 +18,7 @@
  */
 
 #include <libraw1394/raw1394.h>
+#include "iec61883.h"
 
 int
 iec61883_cooked_read(raw1394handle_t handle, nodeid_t node, nodeaddr_t addr,
@@ -27,6 +28,13 @@ int
 iec61883_cooked_write(raw1394handle_t handle, nodeid_t node, nodeaddr_t addr,
             size_t length, quadlet_t *data);
 
+int
+iec61883_cooked_lock(raw1394handle_t handle, nodeid_t node, nodeaddr_t addr,
+            unsigned int extcode, quadlet_t data, quadlet_t arg, quadlet_t *result);
+
+/* the retry policy of a handle that has not set one */
+extern const struct iec61883_retry_policy iec61883_default_retry_policy;
+
 /*
  * constants for use with raw1394 ARM
  * The following probably should be in raw1394.h
@@ -0,0 +1,150 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Stream dispatch
+ *
+ * The isochronous handlers of a stream find their object here rather
+ * than in the handle's userdata, which any other stream created on the
+ * handle, or the application, would overwrite. A stream is attached
+ * while it owns the handle's isochronous context, from start to stop.
+ *
+ * Handlers look up their stream for every packet, so lookups take no
+ * lock: a slot is published by storing its handle last, and unpublished
+ * by clearing the handle first. The table grows by blocks of slots that
+ * are linked once filled and never freed, so a lookup never sees a slot
+ * move.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "iec61883.h"
+#include "iec61883-private.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define DISPATCH_SLOTS 64
+
+struct dispatch_slot {
+	raw1394handle_t volatile handle;
+	void * volatile stream;
+};
+
+static struct dispatch_block {
+	struct dispatch_slot slots[DISPATCH_SLOTS];
+	volatile int used;                       /* slots above this were never used */
+	struct dispatch_block * volatile next;
+} g_blocks;
+
+static pthread_mutex_t g_dispatch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int
+iec61883_dispatch_attach (raw1394handle_t handle, void *stream)
+{
+	struct dispatch_block *b, *last = NULL, *free_block = NULL;
+	struct dispatch_slot *slot;
+	int i, free_slot = -1;
+
+	pthread_mutex_lock (&g_dispatch_lock);
+	for (b = &g_blocks; b; b = b->next) {
+		for (i = 0; i < b->used; i++) {
+			if (b->slots[i].handle == handle) {
+				pthread_mutex_unlock (&g_dispatch_lock);
+				errno = EBUSY;
+				return -1;
+			}
+			if (b->slots[i].handle == NULL && free_block == NULL) {
+				free_block = b;
+				free_slot = i;
+			}
+		}
+		last = b;
+	}
+	if (free_block == NULL && last->used < DISPATCH_SLOTS) {
+		free_block = last;
+		free_slot = last->used;
+	}
+
+	if (free_block == NULL) {
+		b = calloc (1, sizeof (struct dispatch_block));
+		if (b == NULL) {
+			pthread_mutex_unlock (&g_dispatch_lock);
+			errno = ENOMEM;
+			return -1;
+		}
+		b->slots[0].stream = stream;
+		b->slots[0].handle = handle;
+		b->used = 1;
+		__sync_synchronize ();
+		last->next = b;
+		pthread_mutex_unlock (&g_dispatch_lock);
+		return 0;
+	}
+
+	slot = &free_block->slots[free_slot];
+	slot->stream = stream;
+	__sync_synchronize ();
+	slot->handle = handle;
+	if (free_slot == free_block->used)
+		free_block->used = free_slot + 1;
+	pthread_mutex_unlock (&g_dispatch_lock);
+	return 0;
+}
+
+void *
+iec61883_dispatch_get (raw1394handle_t handle)
+{
+	struct dispatch_block *b;
+	int i, n;
+
+	for (b = &g_blocks; b; b = b->next) {
+		n = b->used;
+		for (i = 0; i < n; i++)
+			if (b->slots[i].handle == handle)
+				return b->slots[i].stream;
+	}
+	return NULL;
+}
+
+int
+iec61883_dispatch_detach (raw1394handle_t handle, void *stream)
+{
+	struct dispatch_block *b;
+	int i;
+
+	pthread_mutex_lock (&g_dispatch_lock);
+	for (b = &g_blocks; b; b = b->next) {
+		for (i = 0; i < b->used; i++) {
+			if (b->slots[i].handle == handle && b->slots[i].stream == stream) {
+				b->slots[i].handle = NULL;
+				__sync_synchronize ();
+				b->slots[i].stream = NULL;
+				pthread_mutex_unlock (&g_dispatch_lock);
+				return 0;
+			}
+		}
+	}
+	pthread_mutex_unlock (&g_dispatch_lock);
+	errno = ENOENT;
+	return -1;
+}
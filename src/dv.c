@@ -49,6 +49,7 @@ iec61883_dv_xmit_init (raw1394handle_t handle,
 	struct iec61883_dv *dv;
 
 	assert (handle != NULL);
+	iec61883_log_start ();
 	dv = malloc (sizeof (struct iec61883_dv));
 	if (!dv) {
 		errno = ENOMEM;
@@ -63,8 +64,13 @@ iec61883_dv_xmit_init (raw1394handle_t handle,
 	dv->buffer_packets = 1000;
 	dv->prebuffer_packets = 1000;
 	dv->irq_interval = 250;
+	dv->dma_mode = RAW1394_DMA_PACKET_PER_BUFFER;
 	dv->synch = 0;
 	dv->speed = RAW1394_ISO_SPEED_100;
+	dv->source = NULL;
+	dv->ring = NULL;
+	dv->trace = NULL;
+	iec61883_stats_init (&dv->stats);
 
 	iec61883_cip_init (&dv->cip, IEC61883_FMT_DV, fdf, rate, dbs, syt_interval);
 
@@ -75,6 +81,55 @@ iec61883_dv_xmit_init (raw1394handle_t handle,
 	return dv;
 }
 
+iec61883_dv_t
+iec61883_dv_xmit_init_file (raw1394handle_t handle, const char *filename)
+{
+	iec61883_filesrc_t source;
+	const unsigned char *header;
+	struct iec61883_dv *dv;
+
+	assert (filename != NULL);
+	source = iec61883_filesrc_open (filename, DIF_BLOCK_SIZE);
+	if (!source)
+		return NULL;
+
+	/* DSF flag of the header DIF block: 0 = 525-60, 1 = 625-50 */
+	header = iec61883_filesrc_peek (source, DIF_BLOCK_SIZE);
+	if (!header) {
+		iec61883_filesrc_close (source);
+		errno = EINVAL;
+		return NULL;
+	}
+	dv = iec61883_dv_xmit_init (handle, header[3] & 0x80, iec61883_filesrc_read, source);
+	if (!dv) {
+		iec61883_filesrc_close (source);
+		return NULL;
+	}
+	dv->source = source;
+
+	return dv;
+}
+
+iec61883_dv_t
+iec61883_dv_xmit_init_ring (raw1394handle_t handle, int is_pal, unsigned int size,
+		unsigned int watermark)
+{
+	iec61883_ring_t ring;
+	struct iec61883_dv *dv;
+
+	ring = iec61883_ring_open (size, watermark, DIF_BLOCK_SIZE);
+	if (!ring)
+		return NULL;
+	dv = iec61883_dv_xmit_init (handle, is_pal, iec61883_ring_get, ring);
+	if (!dv) {
+		iec61883_ring_close (ring);
+		return NULL;
+	}
+	dv->ring = ring;
+
+	return dv;
+}
+
 iec61883_dv_t
 iec61883_dv_recv_init (raw1394handle_t handle, 
 		iec61883_dv_recv_t put_data,
@@ -83,6 +138,7 @@ iec61883_dv_recv_init (raw1394handle_t handle,
 	struct iec61883_dv *dv;
 
 	assert (handle != NULL);
+	iec61883_log_start ();
 	dv = malloc (sizeof (struct iec61883_dv));
 	if (!dv) {
 		errno = ENOMEM;
@@ -96,8 +152,13 @@ iec61883_dv_recv_init (raw1394handle_t handle,
 	dv->callback_data = callback_data;
 	dv->buffer_packets = 1000;
 	dv->irq_interval = 250;
+	dv->dma_mode = RAW1394_DMA_PACKET_PER_BUFFER;
 	dv->synch = 0;
 	dv->speed = RAW1394_ISO_SPEED_100;
+	dv->source = NULL;
+	dv->ring = NULL;
+	dv->trace = NULL;
+	iec61883_stats_init (&dv->stats);
 
 	raw1394_set_userdata (handle, dv);
 	
@@ -113,12 +174,14 @@ dv_xmit_handler (raw1394handle_t handle,
 		int cycle,
 		unsigned int dropped)
 {
-	struct iec61883_dv *dv = raw1394_get_userdata (handle);
+	struct iec61883_dv *dv = iec61883_dispatch_get (handle);
 	struct iec61883_packet *packet;
+	unsigned long long start;
 	int n_dif_blocks;
 	int result = RAW1394_ISO_OK;
 
 	assert (dv != NULL);
+	iec61883_stats_packet_begin (&dv->stats, handle, cycle);
 	packet = (struct iec61883_packet *) data;
 	n_dif_blocks = iec61883_cip_fill_header (handle, &dv->cip, packet);
 
@@ -168,9 +231,16 @@ dv_xmit_handler (raw1394handle_t handle,
 	*tag = IEC61883_TAG_WITH_CIP;
 	*sy = 0;
 		 
-	if (dv->get_data != NULL &&
-		dv->get_data (packet->data, n_dif_blocks, dropped, dv->callback_data) < 0)
+	if (dv->get_data != NULL) {
+		start = iec61883_now_ns ();
+		if (dv->get_data (packet->data, n_dif_blocks, dropped, dv->callback_data) < 0)
 			result = RAW1394_ISO_ERROR;
+		iec61883_stats_callback_end (&dv->stats, start, result == RAW1394_ISO_ERROR);
+	}
+	iec61883_stats_packet_end (&dv->stats, *len, dropped);
+	if (dv->trace)
+		iec61883_trace_packet (dv->trace, dv->stats.last_packet, data, *len,
+			dv->channel, *tag, cycle, dropped, IEC61883_TRACE_XMIT, result);
 
 	return result;
 }
@@ -182,6 +252,8 @@ iec61883_dv_xmit_start (struct iec61883_dv *dv, int channel)
 	assert (dv != NULL);
 	unsigned int max_packet_size = iec61883_cip_get_max_packet_size (&dv->cip);
 	
+	if (iec61883_dispatch_attach (dv->handle, dv) < 0)
+		return -1;
 	result = raw1394_iso_xmit_init (dv->handle,
 		dv_xmit_handler,
 		dv->buffer_packets,
@@ -195,13 +267,37 @@ iec61883_dv_xmit_start (struct iec61883_dv *dv, int channel)
 		dv->total_dropped = 0;
 		dv->channel = channel;
 		result = raw1394_iso_xmit_start (dv->handle, -1, dv->prebuffer_packets);
+		if (result != 0)
+			raw1394_iso_shutdown (dv->handle);
 	}
+	if (result != 0)
+		iec61883_dispatch_detach (dv->handle, dv);
 	
 	return result;
 }
 
+iec61883_dv_t
+iec61883_dv_recv_init_ring (raw1394handle_t handle, unsigned int size,
+		unsigned int watermark)
+{
+	iec61883_ring_t ring;
+	struct iec61883_dv *dv;
+
+	ring = iec61883_ring_open (size, watermark, DIF_BLOCK_SIZE);
+	if (!ring)
+		return NULL;
+	dv = iec61883_dv_recv_init (handle, iec61883_ring_put, ring);
+	if (!dv) {
+		iec61883_ring_close (ring);
+		return NULL;
+	}
+	dv->ring = ring;
+
+	return dv;
+}
+
 static enum raw1394_iso_disposition
-dv_recv_handler (raw1394handle_t handle, 
+dv_recv_packet (struct iec61883_dv *dv, 
 		unsigned char *data,
 		unsigned int len, 
 		unsigned char channel,
@@ -210,18 +306,19 @@ dv_recv_handler (raw1394handle_t handle,
 		unsigned int cycle, 
 		unsigned int dropped)
 {
-	struct iec61883_dv *dv = raw1394_get_userdata (handle);
 	enum raw1394_iso_disposition result = RAW1394_ISO_OK;
+	unsigned long long start;
 	
-	assert (dv != NULL);
 	dv->total_dropped += dropped;
 	
 	if (dv->put_data != NULL && /* only if callback registered */
 		channel == dv->channel &&    /* only for selected channel */
 		len == DIF_BLOCK_SIZE + 8)   /* not empty packets */
 	{
+		start = iec61883_now_ns ();
 		if (dv->put_data (data + 8, DIF_BLOCK_SIZE, dropped, dv->callback_data) < 0)
 			result = RAW1394_ISO_ERROR;
+		iec61883_stats_callback_end (&dv->stats, start, result == RAW1394_ISO_ERROR);
 	}
 	if (result == RAW1394_ISO_OK && dropped)
 		result = RAW1394_ISO_DEFER;
@@ -229,25 +326,69 @@ dv_recv_handler (raw1394handle_t handle,
 	return result;
 }
 
+enum raw1394_iso_disposition
+iec61883_dv_recv_packet (struct iec61883_dv *dv,
+		unsigned char *data,
+		unsigned int len,
+		unsigned char channel,
+		unsigned char tag,
+		unsigned char sy,
+		unsigned int cycle,
+		unsigned int dropped)
+{
+	enum raw1394_iso_disposition result;
+
+	assert (dv != NULL);
+	iec61883_stats_packet_begin (&dv->stats, dv->handle, cycle);
+	if (tag == IEC61883_TAG_WITH_CIP)
+		iec61883_stats_dbc (&dv->stats, data, len);
+	result = dv_recv_packet (dv, data, len, channel, tag, sy, cycle, dropped);
+	iec61883_stats_packet_end (&dv->stats, len, dropped);
+	if (dv->trace)
+		iec61883_trace_packet (dv->trace, dv->stats.last_packet, data, len,
+			channel, tag, cycle, dropped, 0, result);
+	return result;
+}
+
+static enum raw1394_iso_disposition
+dv_recv_handler (raw1394handle_t handle, 
+		unsigned char *data,
+		unsigned int len, 
+		unsigned char channel,
+		unsigned char tag, 
+		unsigned char sy,
+		unsigned int cycle, 
+		unsigned int dropped)
+{
+	return iec61883_dv_recv_packet (iec61883_dispatch_get (handle), data, len, channel,
+		tag, sy, cycle, dropped);
+}
+
 int
 iec61883_dv_recv_start (struct iec61883_dv *dv, int channel)
 {
 	int result = 0;
 	
 	assert (dv != NULL);
+	if (iec61883_dispatch_attach (dv->handle, dv) < 0)
+		return -1;
 	result = raw1394_iso_recv_init (dv->handle, 
 		dv_recv_handler,
 		dv->buffer_packets, 
 		DIF_BLOCK_SIZE + 8,
 		channel,
-		RAW1394_DMA_PACKET_PER_BUFFER,
+		dv->dma_mode,
 		dv->irq_interval);
 	
 	if (result == 0) {
 		dv->total_dropped = 0;
 		dv->channel = channel;
 		result = raw1394_iso_recv_start (dv->handle, -1, -1, 0);
+		if (result != 0)
+			raw1394_iso_shutdown (dv->handle);
 	}
+	if (result != 0)
+		iec61883_dispatch_detach (dv->handle, dv);
 	return result;
 }
 
@@ -255,18 +396,28 @@ void
 iec61883_dv_recv_stop (iec61883_dv_t dv)
 {
 	assert (dv != NULL);
+	if (iec61883_dispatch_get (dv->handle) != dv)
+		return;
 	if (dv->synch)
 		raw1394_iso_recv_flush (dv->handle);
 	raw1394_iso_shutdown (dv->handle);
+	// the handler looks the stream up until the context is shut down
+	iec61883_dispatch_detach (dv->handle, dv);
+	iec61883_trace_flush (dv->trace);
 }
 
 void
 iec61883_dv_xmit_stop (iec61883_dv_t dv)
 {
 	assert (dv != NULL);
+	if (iec61883_dispatch_get (dv->handle) != dv)
+		return;
 	if (dv->synch)
 		raw1394_iso_xmit_sync (dv->handle);
 	raw1394_iso_shutdown (dv->handle);
+	// the handler looks the stream up until the context is shut down
+	iec61883_dispatch_detach (dv->handle, dv);
+	iec61883_trace_flush (dv->trace);
 }
 
 void
@@ -277,6 +428,12 @@ iec61883_dv_close (iec61883_dv_t dv)
 		iec61883_dv_recv_stop (dv);
 	if (dv->get_data)
 		iec61883_dv_xmit_stop (dv);
+	if (dv->source)
+		iec61883_filesrc_close (dv->source);
+	if (dv->ring)
+		iec61883_ring_close (dv->ring);
+	if (dv->trace)
+		iec61883_trace_close (dv->trace);
 	free (dv);
 }
 
@@ -435,6 +592,108 @@ iec61883_dv_set_irq_interval (iec61883_dv_t dv, unsigned int packets)
 	dv->irq_interval = packets;
 }
 
+enum raw1394_iso_dma_recv_mode
+iec61883_dv_get_dma_mode (iec61883_dv_t dv)
+{
+	assert (dv != NULL);
+	return dv->dma_mode;
+}
+
+void
+iec61883_dv_set_dma_mode (iec61883_dv_t dv, enum raw1394_iso_dma_recv_mode mode)
+{
+	assert (dv != NULL);
+	dv->dma_mode = mode;
+}
+
+int
+iec61883_dv_read (iec61883_dv_t dv, void *data, unsigned int len, int timeout)
+{
+	assert (dv != NULL);
+	if (!dv->ring || !dv->put_data) {
+		errno = EINVAL;
+		return -1;
+	}
+	return iec61883_ring_read (dv->ring, data, len, timeout);
+}
+
+int
+iec61883_dv_write (iec61883_dv_t dv, const void *data, unsigned int len, int timeout)
+{
+	assert (dv != NULL);
+	if (!dv->ring || !dv->get_data) {
+		errno = EINVAL;
+		return -1;
+	}
+	return iec61883_ring_write (dv->ring, data, len, timeout);
+}
+
+int
+iec61883_dv_get_ring_stats (iec61883_dv_t dv, struct iec61883_ring_stats *stats)
+{
+	assert (dv != NULL);
+	assert (stats != NULL);
+	if (!dv->ring) {
+		errno = EINVAL;
+		return -1;
+	}
+	iec61883_ring_get_stats (dv->ring, stats);
+	return 0;
+}
+
+int
+iec61883_dv_get_stats (iec61883_dv_t dv, struct iec61883_stats *stats, int reset)
+{
+	assert (dv != NULL);
+	assert (stats != NULL);
+	iec61883_stats_get (&dv->stats, stats, reset);
+	return 0;
+}
+
+void
+iec61883_dv_set_profiling (iec61883_dv_t dv, int enable)
+{
+	assert (dv != NULL);
+	iec61883_stats_set_profiling (&dv->stats, enable, dv->irq_interval);
+}
+
+void
+iec61883_dv_get_profile (iec61883_dv_t dv, struct iec61883_profile *profile, int reset)
+{
+	assert (dv != NULL);
+	assert (profile != NULL);
+	iec61883_stats_get_profile (&dv->stats, profile, reset);
+}
+
+int
+iec61883_dv_set_trace (iec61883_dv_t dv, unsigned int records, const char *error_file)
+{
+	iec61883_trace_t trace = NULL;
+
+	assert (dv != NULL);
+	if (records > 0) {
+		trace = iec61883_trace_open (records, error_file);
+		if (!trace)
+			return -1;
+	}
+	if (dv->trace)
+		iec61883_trace_close (dv->trace);
+	dv->trace = trace;
+	return 0;
+}
+
+int
+iec61883_dv_dump_trace (iec61883_dv_t dv, const char *filename)
+{
+	assert (dv != NULL);
+	assert (filename != NULL);
+	if (!dv->trace) {
+		errno = EINVAL;
+		return -1;
+	}
+	return iec61883_trace_dump (dv->trace, filename);
+}
+
 int
 iec61883_dv_get_synch (iec61883_dv_t dv)
 {
@@ -0,0 +1,314 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Event loop for many handles
+ *
+ * A handle has one isochronous context, so N streams need N handles.
+ * This services them all from one epoll set on one thread.
+ * Every ready handle gets one raw1394_loop_iterate() per wakeup, starting
+ * from a different one each time, so a busy handle cannot starve the
+ * others. The time from the wakeup until a handle is serviced, and the
+ * time servicing it takes, are accounted per handle.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "iec61883.h"
+#include "iec61883-private.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define LOOP_STOP_ID 0xffffffff
+
+struct loop_entry {
+	raw1394handle_t handle;
+	unsigned int serial;           // tells a reused slot from its predecessor
+	volatile unsigned int seq;
+	struct iec61883_loop_stats stats;
+	volatile int reset_request;
+};
+
+struct iec61883_loop {
+	int epoll_fd;
+	int stop_fd;
+	volatile int stop;
+	unsigned int round;
+	unsigned int serial;
+	struct loop_entry *entries[IEC61883_LOOP_MAX];
+};
+
+iec61883_loop_t
+iec61883_loop_init (void)
+{
+	struct iec61883_loop *loop;
+	struct epoll_event event;
+
+	loop = calloc (1, sizeof (struct iec61883_loop));
+	if (!loop) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	loop->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+	loop->stop_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	memset (&event, 0, sizeof (event));
+	event.events = EPOLLIN;
+	event.data.u64 = LOOP_STOP_ID;
+	if (loop->epoll_fd < 0 || loop->stop_fd < 0 ||
+		epoll_ctl (loop->epoll_fd, EPOLL_CTL_ADD, loop->stop_fd, &event) < 0) {
+		int err = errno;
+
+		if (loop->epoll_fd >= 0)
+			close (loop->epoll_fd);
+		if (loop->stop_fd >= 0)
+			close (loop->stop_fd);
+		free (loop);
+		errno = err;
+		return NULL;
+	}
+	return loop;
+}
+
+static uint64_t
+entry_key (int id, struct loop_entry *entry)
+{
+	return ((uint64_t) entry->serial << 32) | id;
+}
+
+int
+iec61883_loop_add (iec61883_loop_t loop, raw1394handle_t handle)
+{
+	struct loop_entry *entry;
+	struct epoll_event event;
+	int id;
+
+	assert (loop != NULL);
+	assert (handle != NULL);
+	for (id = 0; id < IEC61883_LOOP_MAX && loop->entries[id]; id++)
+		;
+	if (id == IEC61883_LOOP_MAX) {
+		errno = ENOSPC;
+		return -1;
+	}
+	entry = calloc (1, sizeof (struct loop_entry));
+	if (!entry) {
+		errno = ENOMEM;
+		return -1;
+	}
+	entry->handle = handle;
+	entry->serial = ++loop->serial;
+
+	memset (&event, 0, sizeof (event));
+	event.events = EPOLLIN | EPOLLPRI;
+	event.data.u64 = entry_key (id, entry);
+	if (epoll_ctl (loop->epoll_fd, EPOLL_CTL_ADD, raw1394_get_fd (handle), &event) < 0) {
+		free (entry);
+		return -1;
+	}
+	loop->entries[id] = entry;
+	return id;
+}
+
+int
+iec61883_loop_add_amdtp (iec61883_loop_t loop, iec61883_amdtp_t amdtp)
+{
+	assert (amdtp != NULL);
+	return iec61883_loop_add (loop, amdtp->handle);
+}
+
+int
+iec61883_loop_add_dv (iec61883_loop_t loop, iec61883_dv_t dv)
+{
+	assert (dv != NULL);
+	return iec61883_loop_add (loop, dv->handle);
+}
+
+int
+iec61883_loop_add_dv_fb (iec61883_loop_t loop, iec61883_dv_fb_t fb)
+{
+	assert (fb != NULL);
+	return iec61883_loop_add (loop, fb->dv->handle);
+}
+
+int
+iec61883_loop_add_mpeg2 (iec61883_loop_t loop, iec61883_mpeg2_t mpeg2)
+{
+	assert (mpeg2 != NULL);
+	return iec61883_loop_add (loop, mpeg2->handle);
+}
+
+static struct loop_entry *
+loop_entry (struct iec61883_loop *loop, int id)
+{
+	if (id < 0 || id >= IEC61883_LOOP_MAX || !loop->entries[id]) {
+		errno = ENOENT;
+		return NULL;
+	}
+	return loop->entries[id];
+}
+
+int
+iec61883_loop_remove (iec61883_loop_t loop, int id)
+{
+	struct loop_entry *entry;
+
+	assert (loop != NULL);
+	entry = loop_entry (loop, id);
+	if (!entry)
+		return -1;
+	// the handle may already be destroyed, which removes it from the set
+	epoll_ctl (loop->epoll_fd, EPOLL_CTL_DEL, raw1394_get_fd (entry->handle), NULL);
+	loop->entries[id] = NULL;
+	free (entry);
+	return 0;
+}
+
+static void
+loop_service (struct iec61883_loop *loop, int id, struct loop_entry *entry,
+	unsigned long long woken)
+{
+	unsigned long long start = iec61883_now_us ();
+	unsigned int wait = start - woken, service;
+	int result;
+
+	errno = 0;
+	result = raw1394_loop_iterate (entry->handle);
+	service = iec61883_now_us () - start;
+
+	iec61883_seq_write_begin (&entry->seq);
+	if (entry->reset_request) {
+		memset (&entry->stats, 0, sizeof (entry->stats));
+		entry->reset_request = 0;
+	}
+	entry->stats.iterations++;
+	entry->stats.wait_total += wait;
+	if (wait > entry->stats.wait_max)
+		entry->stats.wait_max = wait;
+	entry->stats.service_total += service;
+	if (service > entry->stats.service_max)
+		entry->stats.service_max = service;
+	if (result != 0)
+		entry->stats.error = errno ? errno : EIO;
+	iec61883_seq_write_end (&entry->seq);
+
+	// stop polling a failed handle rather than spinning on it
+	if (result != 0)
+		epoll_ctl (loop->epoll_fd, EPOLL_CTL_DEL, raw1394_get_fd (entry->handle), NULL);
+}
+
+int
+iec61883_loop_iterate (iec61883_loop_t loop, int timeout)
+{
+	struct epoll_event events[IEC61883_LOOP_MAX + 1];
+	unsigned long long woken;
+	uint64_t count;
+	int i, n, serviced = 0;
+
+	assert (loop != NULL);
+	n = epoll_wait (loop->epoll_fd, events, IEC61883_LOOP_MAX + 1, timeout);
+	if (n < 0)
+		return errno == EINTR ? 0 : -1;
+	woken = iec61883_now_us ();
+
+	loop->round++;
+	for (i = 0; i < n; i++) {
+		struct epoll_event *event = &events[(i + loop->round) % n];
+		unsigned int id = event->data.u64 & 0xffffffff;
+		struct loop_entry *entry;
+
+		if (id == LOOP_STOP_ID) {
+			if (read (loop->stop_fd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+				return -1;
+			continue;
+		}
+		// skip handles removed, and slots reused, by a callback this round
+		entry = loop->entries[id];
+		if (!entry || entry->serial != event->data.u64 >> 32)
+			continue;
+		loop_service (loop, id, entry, woken);
+		serviced++;
+	}
+	return serviced;
+}
+
+int
+iec61883_loop_run (iec61883_loop_t loop)
+{
+	assert (loop != NULL);
+	loop->stop = 0;
+	while (!loop->stop)
+		if (iec61883_loop_iterate (loop, -1) < 0)
+			return -1;
+	return 0;
+}
+
+int
+iec61883_loop_stop (iec61883_loop_t loop)
+{
+	uint64_t one = 1;
+
+	assert (loop != NULL);
+	loop->stop = 1;
+	if (write (loop->stop_fd, &one, sizeof (one)) < 0 && errno != EAGAIN)
+		return -1;
+	return 0;
+}
+
+int
+iec61883_loop_get_stats (iec61883_loop_t loop, int id, struct iec61883_loop_stats *stats,
+	int reset)
+{
+	struct loop_entry *entry;
+	unsigned int start;
+
+	assert (loop != NULL);
+	assert (stats != NULL);
+	entry = loop_entry (loop, id);
+	if (!entry)
+		return -1;
+	do {
+		start = iec61883_seq_read_begin (&entry->seq);
+		memcpy (stats, &entry->stats, sizeof (*stats));
+	} while (iec61883_seq_read_retry (&entry->seq, start));
+	if (reset)
+		entry->reset_request = 1;
+	return 0;
+}
+
+void
+iec61883_loop_close (iec61883_loop_t loop)
+{
+	int id;
+
+	assert (loop != NULL);
+	for (id = 0; id < IEC61883_LOOP_MAX; id++)
+		free (loop->entries[id]);
+	close (loop->stop_fd);
+	close (loop->epoll_fd);
+	free (loop);
+}
@@ -0,0 +1,144 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "filesrc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct iec61883_filesrc
+{
+	int fd;
+	unsigned char *map;
+	size_t size;
+	size_t pos;
+	unsigned int unit;
+};
+
+iec61883_filesrc_t
+iec61883_filesrc_open( const char *filename, unsigned int unit )
+{
+	struct iec61883_filesrc *self;
+	struct stat st;
+	int fd;
+
+	fd = open( filename, O_RDONLY );
+	if ( fd < 0 )
+		return NULL;
+	if ( fstat( fd, &st ) < 0 )
+		goto fail_fd;
+	if ( st.st_size == 0 || (off_t)(size_t) st.st_size != st.st_size )
+	{
+		errno = st.st_size == 0 ? EINVAL : EFBIG;
+		goto fail_fd;
+	}
+
+	self = calloc( 1, sizeof( struct iec61883_filesrc ) );
+	if ( self == NULL )
+	{
+		errno = ENOMEM;
+		goto fail_fd;
+	}
+	self->map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	if ( self->map == MAP_FAILED )
+	{
+		free( self );
+		goto fail_fd;
+	}
+	// the kernel reads ahead aggressively and drops pages behind us
+	madvise( self->map, st.st_size, MADV_SEQUENTIAL );
+
+	self->fd = fd;
+	self->size = st.st_size;
+	self->pos = 0;
+	self->unit = unit;
+
+	return self;
+
+fail_fd:
+	{
+		int err = errno;
+		close( fd );
+		errno = err;
+	}
+	return NULL;
+}
+
+void
+iec61883_filesrc_close( iec61883_filesrc_t self )
+{
+	if ( self )
+	{
+		munmap( self->map, self->size );
+		close( self->fd );
+		free( self );
+	}
+}
+
+void
+iec61883_filesrc_set_unit( iec61883_filesrc_t self, unsigned int unit )
+{
+	self->unit = unit;
+}
+
+const unsigned char *
+iec61883_filesrc_peek( iec61883_filesrc_t self, size_t len )
+{
+	return len <= self->size ? self->map : NULL;
+}
+
+unsigned char *
+iec61883_filesrc_next( iec61883_filesrc_t self, int n )
+{
+	size_t len = (size_t) n * self->unit;
+	unsigned char *data;
+
+	if ( len > self->size - self->pos )
+		return NULL;
+	data = self->map + self->pos;
+	self->pos += len;
+
+	return data;
+}
+
+int
+iec61883_filesrc_read( unsigned char *data, int n, unsigned int dropped,
+	void *callback_data )
+{
+	iec61883_filesrc_t self = callback_data;
+	unsigned char *src;
+
+	if ( n == 0 )
+		return 0;
+	src = iec61883_filesrc_next( self, n );
+	if ( src == NULL )
+		return -1;
+	memcpy( data, src, (size_t) n * self->unit );
+
+	return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _IEC61883_FILESRC_H
+#define _IEC61883_FILESRC_H
+
+#include <stddef.h>
+
+typedef struct iec61883_filesrc* iec61883_filesrc_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// map a file for sequential transmission in units of unit bytes
+iec61883_filesrc_t iec61883_filesrc_open( const char *filename, unsigned int unit );
+void iec61883_filesrc_close( iec61883_filesrc_t self );
+void iec61883_filesrc_set_unit( iec61883_filesrc_t self, unsigned int unit );
+
+// first bytes of the file, for format detection; NULL if shorter than len
+const unsigned char *iec61883_filesrc_peek( iec61883_filesrc_t self, size_t len );
+
+// return a pointer into the mapping for the next n units and advance,
+// or NULL at the end of the file
+unsigned char *iec61883_filesrc_next( iec61883_filesrc_t self, int n );
+
+// transmit callback (iec61883_mpeg2_xmit_t and iec61883_dv_xmit_t) that
+// copies n units from the mapping; callback_data is the filesrc
+int iec61883_filesrc_read( unsigned char *data, int n, unsigned int dropped,
+	void *callback_data );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _IEC61883_FILESRC_H */
@@ -22,23 +22,109 @@
 
 #include <libraw1394/raw1394.h>
 #include <endian.h>
+#include <sched.h>
+#include <time.h>
 #include "tsbuffer.h"
+#include "tsanalyzer.h"
+#include "filesrc.h"
+#include "ring.h"
+#include "trace.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*
+ * Messages are queued for the log sink, see log.c; each place that logs
+ * has its own rate limit.
+ */
+#define IEC61883_LOG_MAX 256
+
+struct iec61883_log_site {
+	volatile unsigned int second;
+	volatile unsigned int count;
+	volatile unsigned int suppressed;
+};
+
+void
+iec61883_log_message (struct iec61883_log_site *site, int level, const char *format, ...)
+	__attribute__ ((format (printf, 3, 4)));
+
+/* start the drain thread unless disabled; from outside iso handlers only */
+void
+iec61883_log_start (void);
+
+#define IEC61883_LOG(level, s, args...) {static struct iec61883_log_site log_site_; iec61883_log_message(&log_site_, level, s, ## args);}
+
 #ifdef IEC61883_DEBUG
-#define DEBUG(s, args...) fprintf(stderr, "libiec61883 debug: " s "\n", ## args)
+#define DEBUG(s, args...) IEC61883_LOG(IEC61883_LOG_DEBUG, s, ## args)
 #else
 #define DEBUG(s, args...)
 #endif
 #ifndef QUIET
-#define WARN(s, args...) {fprintf(stderr, "libiec61883 warning: " s "\n", ## args);}
+#define WARN(s, args...) IEC61883_LOG(IEC61883_LOG_WARNING, s, ## args)
 #else
 #define WARN(s, args...) {}
 #endif
-#define FAIL(s, args...) {fprintf(stderr, "libiec61883 error: " s "\n", ## args);return(-1);}
+#define FAIL(s, args...) {IEC61883_LOG(IEC61883_LOG_ERROR, s, ## args) return(-1);}
+
+/*
+ * Single writer sequence lock for counters that an iso handler publishes
+ * to readers on other threads. The count is odd while an update is in
+ * progress; a reader retries its copy if the count changed under it.
+ */
+
+static __inline__ void
+iec61883_seq_write_begin (volatile unsigned int *seq)
+{
+	(*seq)++;
+	__sync_synchronize ();
+}
+
+static __inline__ void
+iec61883_seq_write_end (volatile unsigned int *seq)
+{
+	__sync_synchronize ();
+	(*seq)++;
+}
+
+static __inline__ unsigned int
+iec61883_seq_read_begin (volatile unsigned int *seq)
+{
+	unsigned int start;
+
+	while ((start = *seq) & 1)
+		sched_yield ();
+	__sync_synchronize ();
+	return start;
+}
+
+static __inline__ int
+iec61883_seq_read_retry (volatile unsigned int *seq, unsigned int start)
+{
+	__sync_synchronize ();
+	return *seq != start;
+}
+
+/* monotonic time in microseconds */
+static __inline__ unsigned long long
+iec61883_now_us (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* monotonic time in nanoseconds */
+static __inline__ unsigned long long
+iec61883_now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
 /*
  * The TAG value is present in the isochronous header (first quadlet). It
@@ -229,6 +315,63 @@ struct iec60958_data {
 
 #endif
 
+/*
+ * Statistics of a stream, see stats.c. Only the handler writes work;
+ * snapshot is its copy as of the last packet, for readers.
+ */
+struct iec61883_stream_stats {
+	volatile unsigned int seq;
+	volatile int reset;
+	struct iec61883_stats snapshot;
+	struct iec61883_stats work;
+	unsigned long long last_packet;    /* nanoseconds, to find batches */
+	unsigned int batch;
+	int dbc_next;                      /* -1 until a CIP packet was seen */
+
+	/* profiling, off unless asked for */
+	volatile int profiling;
+	unsigned long long deadline;       /* the interrupt interval in nanoseconds */
+	unsigned long long batch_start;
+	unsigned long long packet_start;
+	unsigned long long packet_callback;
+	struct iec61883_profile profile_snapshot;
+	struct iec61883_profile profile_work;
+};
+
+void
+iec61883_stats_init (struct iec61883_stream_stats *s);
+
+/* around the handling of each packet */
+void
+iec61883_stats_packet_begin (struct iec61883_stream_stats *s, raw1394handle_t handle,
+	int cycle);
+
+void
+iec61883_stats_packet_end (struct iec61883_stream_stats *s, unsigned int len,
+	unsigned int dropped);
+
+/* check the data block count of a received CIP packet */
+void
+iec61883_stats_dbc (struct iec61883_stream_stats *s, const unsigned char *data,
+	unsigned int len);
+
+/* after a callback started at iec61883_now_ns() start */
+void
+iec61883_stats_callback_end (struct iec61883_stream_stats *s, unsigned long long start,
+	int failed);
+
+void
+iec61883_stats_get (struct iec61883_stream_stats *s, struct iec61883_stats *stats,
+	int reset);
+
+void
+iec61883_stats_set_profiling (struct iec61883_stream_stats *s, int enable,
+	unsigned int irq_interval);
+
+void
+iec61883_stats_get_profile (struct iec61883_stream_stats *s,
+	struct iec61883_profile *profile, int reset);
+
 struct iec61883_amdtp {
 	struct iec61883_cip cip;
 	int dimension;
@@ -246,9 +389,13 @@ struct iec61883_amdtp {
 	unsigned int buffer_packets;
 	unsigned int prebuffer_packets;
 	unsigned int irq_interval;
+	enum raw1394_iso_dma_recv_mode dma_mode;
 	int synch;
 	int speed;
 	unsigned int total_dropped;
+	struct iec61883_stream_stats stats;
+	iec61883_ring_t ring;
+	iec61883_trace_t trace;
 };
 
 
@@ -266,9 +413,14 @@ struct iec61883_dv {
 	unsigned int buffer_packets;
 	unsigned int prebuffer_packets;
 	unsigned int irq_interval;
+	enum raw1394_iso_dma_recv_mode dma_mode;
 	int synch;
 	int speed;
 	unsigned int total_dropped;
+	struct iec61883_stream_stats stats;
+	iec61883_filesrc_t source;
+	iec61883_ring_t ring;
+	iec61883_trace_t trace;
 };
 
 struct iec61883_dv_fb {
@@ -295,12 +447,20 @@ struct iec61883_mpeg2 {
 	raw1394handle_t handle;
 	int channel;
 	struct tsbuffer *tsbuffer;
+	struct tsanalyzer *analyzer;
+	int timestamp_mode;
+	int program;
+	iec61883_filesrc_t source;
+	iec61883_ring_t ring;
+	iec61883_trace_t trace;
 	unsigned int buffer_packets;
 	unsigned int prebuffer_packets;
 	unsigned int irq_interval;
+	enum raw1394_iso_dma_recv_mode dma_mode;
 	int synch;
 	int speed;
 	unsigned int total_dropped;
+	struct iec61883_stream_stats stats;
 };
 
 
@@ -433,22 +593,223 @@ iec61883_plug_get(raw1394handle_t h, nodeid_t n, nodeaddr_t a, quadlet_t *value)
 int
 iec61883_plug_set(raw1394handle_t h, nodeid_t n, nodeaddr_t a, quadlet_t value);
 
+/**
+ * iec61883_plug_get_outputs - Read a node's oMPR and all of its oPCRs.
+ * @h: A raw1394 handle.
+ * @n: The node id of the node to read
+ * @regs: An array of IEC61883_PCR_MAX + 1 quadlets that receives the oMPR
+ * followed by oPCR[0] to oPCR[30] in host byte order.
+ *
+ * This uses one block read where the node supports it and falls back to
+ * reading the oMPR and each of its plugs one quadlet at a time. Only the
+ * first n_plugs PCRs are valid; PCRs that could not be read are zero.
+ * Registers cached since the last bus reset are not read again.
+ *
+ * Returns:
+ * 0 for success or -1 for failure.
+ **/
+int
+iec61883_plug_get_outputs(raw1394handle_t h, nodeid_t n, quadlet_t *regs);
+
+/**
+ * iec61883_plug_get_inputs - Read a node's iMPR and all of its iPCRs.
+ * @h: A raw1394 handle.
+ * @n: The node id of the node to read
+ * @regs: An array of IEC61883_PCR_MAX + 1 quadlets that receives the iMPR
+ * followed by iPCR[0] to iPCR[30] in host byte order.
+ *
+ * See iec61883_plug_get_outputs().
+ *
+ * Returns:
+ * 0 for success or -1 for failure.
+ **/
+int
+iec61883_plug_get_inputs(raw1394handle_t h, nodeid_t n, quadlet_t *regs);
+
+/* like iec61883_plug_get_outputs() and _inputs(), but always read the
+   registers, for decisions that must not rest on cached values */
+int
+iec61883_plug_read_outputs(raw1394handle_t h, nodeid_t n, quadlet_t *regs);
+
+int
+iec61883_plug_read_inputs(raw1394handle_t h, nodeid_t n, quadlet_t *regs);
+
+/*
+ * Plug register cache
+ *
+ * Remote MPR/PCR values as last read or written by this handle, valid
+ * until the bus generation changes. Index 0 is the MPR, 1 + x is PCR x.
+ */
+struct iec61883_plug_cache {
+	nodeid_t node;
+	unsigned int generation;
+	quadlet_t valid[2];   /* bit per register; [0] output, [1] input */
+	quadlet_t regs[2][IEC61883_PCR_MAX + 1];
+};
+
+/*
+ * Library state per raw1394 handle, see context.c
+ */
+struct iec61883_context {
+	raw1394handle_t handle;
+	int fd;               /* of handle, to tell a reused handle address */
+	int stale;            /* handle destroyed unreleased; do not touch it */
+	struct iec61883_context *next;
+	struct iec61883_plug_cache plugs[64];
+
+	/* cooked transactions, see cooked.c */
+	struct iec61883_retry_policy retry;
+	unsigned int retry_seed;
+	volatile unsigned int stats_seq;
+	struct iec61883_transaction_stats stats;
+	volatile int stats_reset;
+
+	/* connection registry, see registry.c */
+	int registry_enabled;
+	struct iec61883_connection *connections;
+	bus_reset_handler_t registry_prev_reset;
+	iec61883_cmp_restore_report_t registry_report;
+	void *registry_data;
+	int restoring;
+	int restore_again;
+};
+
+/*
+ * The stream owning the isochronous context of a handle, see dispatch.c.
+ * Attaching fails with EBUSY while another stream owns it; detaching a
+ * stream that is not attached fails with ENOENT.
+ */
+int
+iec61883_dispatch_attach (raw1394handle_t handle, void *stream);
+
+void *
+iec61883_dispatch_get (raw1394handle_t handle);
+
+int
+iec61883_dispatch_detach (raw1394handle_t handle, void *stream);
+
+/*
+ * Depacketize one received packet for a stream; the receive handlers of
+ * the streams and the multichannel receiver of mcrecv.c share these.
+ */
+enum raw1394_iso_disposition
+iec61883_amdtp_recv_packet (struct iec61883_amdtp *amdtp, unsigned char *data,
+	unsigned int len, unsigned char channel, unsigned char tag, unsigned char sy,
+	unsigned int cycle, unsigned int dropped);
+
+enum raw1394_iso_disposition
+iec61883_dv_recv_packet (struct iec61883_dv *dv, unsigned char *data,
+	unsigned int len, unsigned char channel, unsigned char tag, unsigned char sy,
+	unsigned int cycle, unsigned int dropped);
+
+enum raw1394_iso_disposition
+iec61883_mpeg2_recv_packet (struct iec61883_mpeg2 *mpeg, unsigned char *data,
+	unsigned int len, unsigned char channel, unsigned char tag, unsigned char sy,
+	unsigned int cycle, unsigned int dropped);
+
+/* the state of handle from iec61883_handle_init(), dropping state left by
+   a destroyed handle at the same address; NULL with errno ENOENT if none */
+struct iec61883_context *
+iec61883_context_get (raw1394handle_t handle);
+
+/* record and forget connections made by cmp.c, see registry.c */
+void
+iec61883_registry_add (raw1394handle_t handle, nodeid_t output, int oplug,
+	nodeid_t input, int iplug, int channel, int bandwidth);
+
+void
+iec61883_registry_remove (raw1394handle_t handle, nodeid_t output, int oplug,
+	nodeid_t input, int iplug, int channel);
+
+void
+iec61883_registry_release (struct iec61883_context *ctx);
+
+/**
+ * iec61883_plug_get_cached - Read a node's plug register through the cache.
+ * @h: A raw1394 handle.
+ * @n: The node id of the node to read
+ * @a: The CSR offset address (relative to base) of the register to read.
+ * @value: A pointer to a quadlet where the plug register's value will be stored.
+ *
+ * Like iec61883_plug_get(), but a value read or written by this handle
+ * since the last bus reset is returned without a bus transaction.
+ *
+ * Returns:
+ * 0 for success or -1 for error (errno available).
+ **/
+int
+iec61883_plug_get_cached(raw1394handle_t h, nodeid_t n, nodeaddr_t a, quadlet_t *value);
+
+/**
+ * iec61883_plug_update - Compare-swap a node's plug register.
+ * @h: A raw1394 handle.
+ * @n: The node id of the node to write
+ * @a: The CSR offset address (relative to CSR base) of the register to write.
+ * @value: A quadlet containing the new register value.
+ *
+ * Unlike iec61883_plug_set(), the register is not read first: the compare
+ * value is the one last returned by iec61883_plug_get_cached(), so a read-
+ * modify-write fails if anybody changed the register in the meantime.
+ * The cache then holds the current value and the caller may retry.
+ * If the register is not cached, this behaves like iec61883_plug_set().
+ *
+ * Returns:
+ * 0 for success, -EAGAIN if the register had changed, or -1 for error.
+ **/
+int
+iec61883_plug_update(raw1394handle_t h, nodeid_t n, nodeaddr_t a, quadlet_t value);
+
+/**
+ * iec61883_plug_compare_swap - Compare-swap a node's plug register.
+ * @h: A raw1394 handle.
+ * @n: The node id of the node to write
+ * @a: The CSR offset address (relative to CSR base) of the register to write.
+ * @compare: The value the register must have, in host byte order.
+ * @value: A quadlet containing the new register value.
+ *
+ * The cache follows the result, so after a mismatch
+ * iec61883_plug_get_cached() returns the current value.
+ *
+ * Returns:
+ * 0 for success, -EAGAIN if the register did not hold @compare, or -1 for error.
+ **/
+int
+iec61883_plug_compare_swap(raw1394handle_t h, nodeid_t n, nodeaddr_t a,
+	quadlet_t compare, quadlet_t value);
+
+/* store a register value read or written outside of plug.c */
+void
+iec61883_plug_cache_store(raw1394handle_t h, nodeid_t n, nodeaddr_t a, quadlet_t value);
+
+/* bandwidth allocation units of an oPCR at speed, see iec61883_cmp_calc_bandwidth */
+int
+iec61883_cmp_pcr_bandwidth (const struct iec61883_oPCR *opcr, int speed);
+
+/*
+ * Queue the restoration of a connection after a bus reset, see registry.c.
+ * If claim is set, channel and bandwidth are allocated before the plugs
+ * are read; the plugs are only changed if they lost the connection.
+ */
+int
+iec61883_cmp_async_restore (iec61883_cmp_async_t cmp, nodeid_t output, int oplug,
+	nodeid_t input, int iplug, unsigned int channel, unsigned int bandwidth, int claim);
+
 /**
  * High level plug access macros
  */
 
-#define iec61883_get_oMPR(h,n,v) iec61883_plug_get((h), (n), CSR_O_MPR, (quadlet_t *)(v))
-#define iec61883_set_oMPR(h,n,v) iec61883_plug_set((h), (n), CSR_O_MPR, *((quadlet_t *)&(v)))
-#define iec61883_get_oPCR0(h,n,v) iec61883_plug_get((h), (n), CSR_O_PCR_0, (quadlet_t *)(v))
-#define iec61883_set_oPCR0(h,n,v) iec61883_plug_set((h), (n), CSR_O_PCR_0, *((quadlet_t *)&(v)))
-#define iec61883_get_oPCRX(h,n,v,x) iec61883_plug_get((h), (n), CSR_O_PCR_0+(4*(x)), (quadlet_t *)(v))
-#define iec61883_set_oPCRX(h,n,v,x) iec61883_plug_set((h), (n), CSR_O_PCR_0+(4*(x)), *((quadlet_t *)&(v)))
-#define iec61883_get_iMPR(h,n,v) iec61883_plug_get((h), (n), CSR_I_MPR, (quadlet_t *)(v))
-#define iec61883_set_iMPR(h,n,v) iec61883_plug_set((h), (n), CSR_I_MPR, *((quadlet_t *)&(v)))
-#define iec61883_get_iPCR0(h,n,v) iec61883_plug_get((h), (n), CSR_I_PCR_0, (quadlet_t *)(v))
-#define iec61883_set_iPCR0(h,n,v) iec61883_plug_set((h), (n), CSR_I_PCR_0, *((quadlet_t *)&(v)))
-#define iec61883_get_iPCRX(h,n,v,x) iec61883_plug_get((h), (n), CSR_I_PCR_0+(4*(x)), (quadlet_t *)(v))
-#define iec61883_set_iPCRX(h,n,v,x) iec61883_plug_set((h), (n), CSR_I_PCR_0+(4*(x)), *((quadlet_t *)&(v)))
+#define iec61883_get_oMPR(h,n,v) iec61883_plug_get_cached((h), (n), CSR_O_MPR, (quadlet_t *)(v))
+#define iec61883_set_oMPR(h,n,v) iec61883_plug_update((h), (n), CSR_O_MPR, *((quadlet_t *)&(v)))
+#define iec61883_get_oPCR0(h,n,v) iec61883_plug_get_cached((h), (n), CSR_O_PCR_0, (quadlet_t *)(v))
+#define iec61883_set_oPCR0(h,n,v) iec61883_plug_update((h), (n), CSR_O_PCR_0, *((quadlet_t *)&(v)))
+#define iec61883_get_oPCRX(h,n,v,x) iec61883_plug_get_cached((h), (n), CSR_O_PCR_0+(4*(x)), (quadlet_t *)(v))
+#define iec61883_set_oPCRX(h,n,v,x) iec61883_plug_update((h), (n), CSR_O_PCR_0+(4*(x)), *((quadlet_t *)&(v)))
+#define iec61883_get_iMPR(h,n,v) iec61883_plug_get_cached((h), (n), CSR_I_MPR, (quadlet_t *)(v))
+#define iec61883_set_iMPR(h,n,v) iec61883_plug_update((h), (n), CSR_I_MPR, *((quadlet_t *)&(v)))
+#define iec61883_get_iPCR0(h,n,v) iec61883_plug_get_cached((h), (n), CSR_I_PCR_0, (quadlet_t *)(v))
+#define iec61883_set_iPCR0(h,n,v) iec61883_plug_update((h), (n), CSR_I_PCR_0, *((quadlet_t *)&(v)))
+#define iec61883_get_iPCRX(h,n,v,x) iec61883_plug_get_cached((h), (n), CSR_I_PCR_0+(4*(x)), (quadlet_t *)(v))
+#define iec61883_set_iPCRX(h,n,v,x) iec61883_plug_update((h), (n), CSR_I_PCR_0+(4*(x)), *((quadlet_t *)&(v)))
 
 
 #ifdef __cplusplus
@@ -33,6 +33,94 @@ enum iec61883_datarate {
     IEC61883_DATARATE_400
 };
 
+/* state of the ring of a stream created with one of the init_ring functions */
+struct iec61883_ring_stats {
+	unsigned int size;          /* bytes, rounded up to a power of two */
+	unsigned int level;         /* bytes in the ring */
+	unsigned int watermark;
+	unsigned int overruns;      /* received payloads dropped for want of room */
+	unsigned int underruns;     /* payloads sent empty for want of data */
+};
+
+#define IEC61883_STATS_HISTOGRAM 16
+
+/* what a stream handled, see the get_stats function of each stream type */
+struct iec61883_stats {
+	unsigned long long packets;
+	unsigned long long bytes;          /* including CIP headers */
+	unsigned long empty_packets;       /* no data blocks */
+	unsigned long dropped;
+	unsigned long dbc_discontinuities; /* received packets out of sequence */
+	unsigned long resyncs;             /* SYT generation restarted */
+	unsigned long callbacks;
+	unsigned long callback_errors;
+	unsigned int callback_min;         /* nanoseconds */
+	unsigned int callback_max;
+	unsigned long long callback_total;
+	/* callbacks by duration: under 1 us in [0], then under 2, 4, ... us,
+	   and the rest in the last */
+	unsigned long callback_histogram[IEC61883_STATS_HISTOGRAM];
+	unsigned long batches;             /* packets handled back to back */
+	unsigned int batch_max;
+};
+
+#define IEC61883_PROFILE_BUCKETS 16
+
+/*
+ * Where the time of a stream goes, see the set_profiling function of each
+ * stream type. Histograms count 0 in bucket 0, then [1, 2), [2, 4) ...
+ * units, and the rest in the last bucket. The time in callbacks is in
+ * struct iec61883_stats.
+ */
+struct iec61883_profile {
+	unsigned long library[IEC61883_PROFILE_BUCKETS];  /* us per packet outside callbacks */
+	unsigned long long library_total;                 /* nanoseconds */
+	unsigned long long callback_total;
+	unsigned long cycle_overruns;      /* packets that took longer than a cycle */
+	unsigned long batch[IEC61883_PROFILE_BUCKETS];    /* us per batch */
+	unsigned long long batch_max;      /* nanoseconds */
+	unsigned long deadline_misses;     /* batches longer than the interrupt interval */
+	/* cycles from the cycle of a packet to the bus cycle when its batch
+	   started: received packets are late, transmitted ones normally early */
+	unsigned long late[IEC61883_PROFILE_BUCKETS];
+	unsigned long early[IEC61883_PROFILE_BUCKETS];
+	unsigned int late_max;
+};
+
+#define IEC61883_TRACE_MAGIC "61883TRC"
+#define IEC61883_TRACE_VERSION 1
+
+/* flags of a trace record */
+#define IEC61883_TRACE_XMIT    0x01
+#define IEC61883_TRACE_DROPPED 0x02
+#define IEC61883_TRACE_CIP     0x04  /* cip holds the CIP header */
+
+/*
+ * A packet as the handler of a stream left it, see the set_trace function
+ * of each stream type. A trace file is a struct iec61883_trace_header and
+ * its records, oldest first, in the byte order of the host that wrote it.
+ */
+struct iec61883_trace_record {
+	unsigned long long time;    /* monotonic, nanoseconds */
+	unsigned int sequence;      /* counts the packets of the stream */
+	unsigned int dropped;       /* as given to the handler */
+	unsigned int cip[2];        /* in bus byte order */
+	unsigned short len;         /* including the CIP header */
+	unsigned short cycle;
+	unsigned char channel;
+	unsigned char tag;
+	unsigned char flags;
+	unsigned char disposition;  /* enum raw1394_iso_disposition */
+};
+
+struct iec61883_trace_header {
+	char magic[8];              /* IEC61883_TRACE_MAGIC, not terminated */
+	unsigned int version;
+	unsigned int record_size;
+	unsigned int records;
+	unsigned int packets;       /* traced in all, older ones overwritten */
+};
+
 /*******************************************************************************
  * Audio and Music Data Transport Protocol 
  **/
@@ -129,6 +217,51 @@ iec61883_amdtp_t
 iec61883_amdtp_recv_init(raw1394handle_t handle,
 		iec61883_amdtp_recv_t put_data, void *callback_data);
 
+/**
+ * iec61883_amdtp_xmit_init_ring - setup transmission of AMDTP from a ring
+ * @handle: the libraw1394 handle to use for all operations
+ * @rate: one of enum iec61883_datarate
+ * @format: one of enum iec61883_amdtp_format to describe audio data format
+ * @sample_format: one of enum iec61883_amdtp_sample_format
+ * @mode: one of iec61883_cip_mode
+ * @dimension: the number of audio channels
+ * @size: the size of the ring in bytes
+ * @watermark: bytes of free space that wake a blocked writer, 0 for a
+ * quarter of the ring
+ *
+ * Instead of calling back for each packet, the stream takes its events,
+ * a quadlet per audio channel, from a ring the library owns and that
+ * the application fills with iec61883_amdtp_write() from a thread of its
+ * own. Events missing when a packet is due are sent as silence and
+ * counted as an underrun.
+ *
+ * Returns:
+ * A pointer to an iec61883_amdtp object upon success or NULL on failure.
+ **/
+iec61883_amdtp_t
+iec61883_amdtp_xmit_init_ring(raw1394handle_t handle,
+		int rate, int format, int sample_format, int mode, int dimension,
+		unsigned int size, unsigned int watermark);
+
+/**
+ * iec61883_amdtp_recv_init_ring - setup reception of AMDTP into a ring
+ * @handle: the libraw1394 handle to use for all operations
+ * @size: the size of the ring in bytes
+ * @watermark: bytes of data that wake a blocked reader, 0 for a quarter
+ * of the ring
+ *
+ * The samples, as the callback of iec61883_amdtp_recv_init() would get
+ * them, are stored in a ring the library owns and that the application
+ * drains with iec61883_amdtp_read() from a thread of its own. A packet
+ * that does not fit is dropped and counted as an overrun.
+ *
+ * Returns:
+ * A pointer to an iec61883_amdtp object upon success or NULL on failure.
+ **/
+iec61883_amdtp_t
+iec61883_amdtp_recv_init_ring(raw1394handle_t handle, unsigned int size,
+		unsigned int watermark);
+
 /** 
  * iec61883_amdtp_xmit_start - start transmission of AMDTP
  * @amdtp: pointer to iec61883_amdtp object
@@ -220,6 +353,151 @@ iec61883_amdtp_get_irq_interval(iec61883_amdtp_t amdtp);
 void
 iec61883_amdtp_set_irq_interval(iec61883_amdtp_t amdtp, unsigned int packets);
 
+/**
+ * iec61883_amdtp_get_dma_mode - get the DMA mode for reception
+ * @amdtp: pointer to iec61883_amdtp object
+ **/
+enum raw1394_iso_dma_recv_mode
+iec61883_amdtp_get_dma_mode(iec61883_amdtp_t amdtp);
+
+/**
+ * iec61883_amdtp_set_dma_mode - set the DMA mode for reception
+ * @amdtp: pointer to iec61883_amdtp object
+ * @mode: RAW1394_DMA_PACKET_PER_BUFFER, the default, or RAW1394_DMA_BUFFERFILL
+ *
+ * In buffer-fill mode the controller packs the received packets into the
+ * buffer back to back, rather than using a DMA descriptor per packet, and
+ * interrupts only when a whole interrupt interval of data arrived; raw1394
+ * splits the buffer into packets for the callback. Together with a larger
+ * interrupt interval this cuts the interrupt load of many streams. Drivers
+ * that do not support the mode make the recv_start function fail.
+ *
+ * This is an advanced option that can only be set after initialization and 
+ * before reception.
+ **/
+void
+iec61883_amdtp_set_dma_mode(iec61883_amdtp_t amdtp, enum raw1394_iso_dma_recv_mode mode);
+
+/**
+ * iec61883_amdtp_read - take received data from the ring
+ * @amdtp: pointer to an iec61883_amdtp object created with recv_init_ring
+ * @data: where to store the data
+ * @len: the most bytes to take
+ * @timeout: milliseconds to wait, -1 to wait without limit, 0 not to wait
+ *
+ * Waits until at least the watermark or @len bytes are in the ring, then
+ * takes what is there up to @len bytes. The handle must be serviced by
+ * another thread meanwhile, for example by an iec61883_runner_t.
+ *
+ * Returns:
+ * the number of bytes taken, or -1 (errno), EAGAIN if the ring stayed
+ * empty, EINVAL if the stream has no ring for reception
+ **/
+int
+iec61883_amdtp_read(iec61883_amdtp_t amdtp, void *data, unsigned int len, int timeout);
+
+/**
+ * iec61883_amdtp_write - put data to transmit into the ring
+ * @amdtp: pointer to an iec61883_amdtp object created with xmit_init_ring
+ * @data: the data
+ * @len: the bytes to put
+ * @timeout: milliseconds to wait, -1 to wait without limit, 0 not to wait
+ *
+ * Waits until the watermark or @len bytes are free, then puts as much as
+ * fits. Prefill the ring before starting transmission to avoid underruns.
+ *
+ * Returns:
+ * the number of bytes put, or -1 (errno), EAGAIN if the ring stayed
+ * full, EINVAL if the stream has no ring for transmission
+ **/
+int
+iec61883_amdtp_write(iec61883_amdtp_t amdtp, const void *data, unsigned int len, int timeout);
+
+/**
+ * iec61883_amdtp_get_ring_stats - get the fill level and error counts
+ * @amdtp: pointer to iec61883_amdtp object
+ * @stats: receives the state of the ring
+ *
+ * Returns:
+ * 0 for success or -1 (errno) if the stream has no ring
+ **/
+int
+iec61883_amdtp_get_ring_stats(iec61883_amdtp_t amdtp, struct iec61883_ring_stats *stats);
+
+/**
+ * iec61883_amdtp_get_stats - get what the stream handled so far
+ * @amdtp: pointer to iec61883_amdtp object
+ * @stats: receives a snapshot of the counters
+ * @reset: if non-zero, the counters restart from zero at the next packet
+ *
+ * The counters are updated by the stream without locks and may be read
+ * from any thread, for example once a second by a monitor.
+ *
+ * Returns:
+ * 0 for success
+ **/
+int
+iec61883_amdtp_get_stats(iec61883_amdtp_t amdtp, struct iec61883_stats *stats, int reset);
+
+/**
+ * iec61883_amdtp_set_profiling - measure the time budget of the stream
+ * @amdtp: pointer to iec61883_amdtp object
+ * @enable: non-zero to start measuring, 0 to stop
+ *
+ * While enabled, each packet also records the time spent in the library
+ * and in the callback, each batch its duration against the interrupt
+ * interval, and the first packet of each batch how many cycles it is from
+ * the bus cycle, which takes a read of the cycle timer. Disabled, this
+ * costs a test per packet. Set the interrupt interval first.
+ **/
+void
+iec61883_amdtp_set_profiling(iec61883_amdtp_t amdtp, int enable);
+
+/**
+ * iec61883_amdtp_get_profile - get the measurements of the stream
+ * @amdtp: pointer to iec61883_amdtp object
+ * @profile: receives a snapshot of the histograms
+ * @reset: if non-zero, the histograms and the statistics of the stream
+ * restart from zero at the next packet
+ *
+ * May be called from any thread.
+ **/
+void
+iec61883_amdtp_get_profile(iec61883_amdtp_t amdtp, struct iec61883_profile *profile, int reset);
+
+/**
+ * iec61883_amdtp_set_trace - keep a trace of the last packets of the stream
+ * @amdtp: pointer to iec61883_amdtp object
+ * @records: how many packets to keep, rounded up to a power of two, or 0
+ * to stop tracing. At 8000 packets a second, 32768 keep 4 seconds in 1 MB.
+ * @error_file: if not NULL, recording stops when a callback fails, and the
+ * trace is written to this file, as with iec61883_amdtp_dump_trace(), when
+ * the stream is stopped or closed
+ *
+ * Each packet is recorded as a struct iec61883_trace_record, overwriting
+ * the oldest one. Call this while the stream is stopped; the previous
+ * trace, if any, is discarded.
+ *
+ * Returns:
+ * 0 for success or -1 with errno set
+ **/
+int
+iec61883_amdtp_set_trace(iec61883_amdtp_t amdtp, unsigned int records, const char *error_file);
+
+/**
+ * iec61883_amdtp_dump_trace - write the trace of the stream to a file
+ * @amdtp: pointer to iec61883_amdtp object
+ * @filename: the file to create or replace
+ *
+ * May be called from any thread while the stream runs. The records the
+ * stream overwrites while they are copied are left out.
+ *
+ * Returns:
+ * 0 for success or -1 with errno set, EINVAL if tracing is off
+ **/
+int
+iec61883_amdtp_dump_trace(iec61883_amdtp_t amdtp, const char *filename);
+
 /**
  * iec61883_amdtp_get_synch - get behavior on close
  * @amdtp: pointer to iec61883_amdtp object
@@ -380,6 +658,61 @@ iec61883_dv_xmit_init(raw1394handle_t handle, int is_pal,
 		iec61883_dv_xmit_t get_data,
 		void *callback_data);
 
+/**
+ * iec61883_dv_xmit_init_file - setup transmission of a raw DV file
+ * @handle: the libraw1394 handle to use for all operations
+ * @filename: the DIF stream to transmit
+ *
+ * The file is memory mapped and DIF blocks are copied from the mapping
+ * straight into the isochronous packets; no callback is involved.
+ * PAL or NTSC is determined from the header of the first frame.
+ * Transmission ends with an error at the end of the file. The file is
+ * unmapped by iec61883_dv_close().
+ *
+ * Returns:
+ * A pointer to an iec61883_dv object upon success or NULL on failure.
+ **/
+iec61883_dv_t
+iec61883_dv_xmit_init_file(raw1394handle_t handle, const char *filename);
+
+/**
+ * iec61883_dv_xmit_init_ring - setup transmission of DV from a ring
+ * @handle: the libraw1394 handle to use for all operations
+ * @is_pal: set to non-zero if transmitting a PAL stream
+ * @size: the size of the ring in bytes
+ * @watermark: bytes of free space that wake a blocked writer, 0 for a
+ * quarter of the ring
+ *
+ * Instead of calling back for each packet, the stream takes its DIF
+ * blocks from a ring the library owns and that the application fills with
+ * iec61883_dv_write() from a thread of its own. DIF blocks missing when a
+ * packet is due are sent zeroed and counted as an underrun.
+ *
+ * Returns:
+ * A pointer to an iec61883_dv object upon success or NULL on failure.
+ **/
+iec61883_dv_t
+iec61883_dv_xmit_init_ring(raw1394handle_t handle, int is_pal, unsigned int size,
+		unsigned int watermark);
+
+/**
+ * iec61883_dv_recv_init_ring - setup reception of DV into a ring
+ * @handle: the libraw1394 handle to use for all operations
+ * @size: the size of the ring in bytes
+ * @watermark: bytes of data that wake a blocked reader, 0 for a quarter
+ * of the ring
+ *
+ * The DIF blocks received are stored in a ring the library owns and
+ * that the application drains with iec61883_dv_read() from a thread of its
+ * own. A DIF block that does not fit is dropped and counted as an overrun.
+ *
+ * Returns:
+ * A pointer to an iec61883_dv object upon success or NULL on failure.
+ **/
+iec61883_dv_t
+iec61883_dv_recv_init_ring(raw1394handle_t handle, unsigned int size,
+		unsigned int watermark);
+
 /**
  * iec61883_dv_recv_start - start receiving a DV stream
  * @dv: pointer to iec61883_dv object
@@ -477,6 +810,151 @@ iec61883_dv_get_irq_interval(iec61883_dv_t dv);
 void
 iec61883_dv_set_irq_interval(iec61883_dv_t dv, unsigned int packets);
 
+/**
+ * iec61883_dv_get_dma_mode - get the DMA mode for reception
+ * @dv: pointer to iec61883_dv object
+ **/
+enum raw1394_iso_dma_recv_mode
+iec61883_dv_get_dma_mode(iec61883_dv_t dv);
+
+/**
+ * iec61883_dv_set_dma_mode - set the DMA mode for reception
+ * @dv: pointer to iec61883_dv object
+ * @mode: RAW1394_DMA_PACKET_PER_BUFFER, the default, or RAW1394_DMA_BUFFERFILL
+ *
+ * In buffer-fill mode the controller packs the received packets into the
+ * buffer back to back, rather than using a DMA descriptor per packet, and
+ * interrupts only when a whole interrupt interval of data arrived; raw1394
+ * splits the buffer into packets for the callback. Together with a larger
+ * interrupt interval this cuts the interrupt load of many streams. Drivers
+ * that do not support the mode make the recv_start function fail.
+ *
+ * This is an advanced option that can only be set after initialization and 
+ * before reception.
+ **/
+void
+iec61883_dv_set_dma_mode(iec61883_dv_t dv, enum raw1394_iso_dma_recv_mode mode);
+
+/**
+ * iec61883_dv_read - take received data from the ring
+ * @dv: pointer to an iec61883_dv object created with recv_init_ring
+ * @data: where to store the data
+ * @len: the most bytes to take
+ * @timeout: milliseconds to wait, -1 to wait without limit, 0 not to wait
+ *
+ * Waits until at least the watermark or @len bytes are in the ring, then
+ * takes what is there up to @len bytes. The handle must be serviced by
+ * another thread meanwhile, for example by an iec61883_runner_t.
+ *
+ * Returns:
+ * the number of bytes taken, or -1 (errno), EAGAIN if the ring stayed
+ * empty, EINVAL if the stream has no ring for reception
+ **/
+int
+iec61883_dv_read(iec61883_dv_t dv, void *data, unsigned int len, int timeout);
+
+/**
+ * iec61883_dv_write - put data to transmit into the ring
+ * @dv: pointer to an iec61883_dv object created with xmit_init_ring
+ * @data: the data
+ * @len: the bytes to put
+ * @timeout: milliseconds to wait, -1 to wait without limit, 0 not to wait
+ *
+ * Waits until the watermark or @len bytes are free, then puts as much as
+ * fits. Prefill the ring before starting transmission to avoid underruns.
+ *
+ * Returns:
+ * the number of bytes put, or -1 (errno), EAGAIN if the ring stayed
+ * full, EINVAL if the stream has no ring for transmission
+ **/
+int
+iec61883_dv_write(iec61883_dv_t dv, const void *data, unsigned int len, int timeout);
+
+/**
+ * iec61883_dv_get_ring_stats - get the fill level and error counts
+ * @dv: pointer to iec61883_dv object
+ * @stats: receives the state of the ring
+ *
+ * Returns:
+ * 0 for success or -1 (errno) if the stream has no ring
+ **/
+int
+iec61883_dv_get_ring_stats(iec61883_dv_t dv, struct iec61883_ring_stats *stats);
+
+/**
+ * iec61883_dv_get_stats - get what the stream handled so far
+ * @dv: pointer to iec61883_dv object
+ * @stats: receives a snapshot of the counters
+ * @reset: if non-zero, the counters restart from zero at the next packet
+ *
+ * The counters are updated by the stream without locks and may be read
+ * from any thread, for example once a second by a monitor.
+ *
+ * Returns:
+ * 0 for success
+ **/
+int
+iec61883_dv_get_stats(iec61883_dv_t dv, struct iec61883_stats *stats, int reset);
+
+/**
+ * iec61883_dv_set_profiling - measure the time budget of the stream
+ * @dv: pointer to iec61883_dv object
+ * @enable: non-zero to start measuring, 0 to stop
+ *
+ * While enabled, each packet also records the time spent in the library
+ * and in the callback, each batch its duration against the interrupt
+ * interval, and the first packet of each batch how many cycles it is from
+ * the bus cycle, which takes a read of the cycle timer. Disabled, this
+ * costs a test per packet. Set the interrupt interval first.
+ **/
+void
+iec61883_dv_set_profiling(iec61883_dv_t dv, int enable);
+
+/**
+ * iec61883_dv_get_profile - get the measurements of the stream
+ * @dv: pointer to iec61883_dv object
+ * @profile: receives a snapshot of the histograms
+ * @reset: if non-zero, the histograms and the statistics of the stream
+ * restart from zero at the next packet
+ *
+ * May be called from any thread.
+ **/
+void
+iec61883_dv_get_profile(iec61883_dv_t dv, struct iec61883_profile *profile, int reset);
+
+/**
+ * iec61883_dv_set_trace - keep a trace of the last packets of the stream
+ * @dv: pointer to iec61883_dv object
+ * @records: how many packets to keep, rounded up to a power of two, or 0
+ * to stop tracing. At 8000 packets a second, 32768 keep 4 seconds in 1 MB.
+ * @error_file: if not NULL, recording stops when a callback fails, and the
+ * trace is written to this file, as with iec61883_dv_dump_trace(), when
+ * the stream is stopped or closed
+ *
+ * Each packet is recorded as a struct iec61883_trace_record, overwriting
+ * the oldest one. Call this while the stream is stopped; the previous
+ * trace, if any, is discarded.
+ *
+ * Returns:
+ * 0 for success or -1 with errno set
+ **/
+int
+iec61883_dv_set_trace(iec61883_dv_t dv, unsigned int records, const char *error_file);
+
+/**
+ * iec61883_dv_dump_trace - write the trace of the stream to a file
+ * @dv: pointer to iec61883_dv object
+ * @filename: the file to create or replace
+ *
+ * May be called from any thread while the stream runs. The records the
+ * stream overwrites while they are copied are left out.
+ *
+ * Returns:
+ * 0 for success or -1 with errno set, EINVAL if tracing is off
+ **/
+int
+iec61883_dv_dump_trace(iec61883_dv_t dv, const char *filename);
+
 /**
  * iec61883_dv_get_synch - get behavior on close
  * @dv: pointer to iec61883_dv object
@@ -647,8 +1125,73 @@ iec61883_dv_fb_get_callback_data(iec61883_dv_fb_t dvfb);
 /* size of a MPEG-2 Transport Stream packet */
 #define IEC61883_MPEG2_TSP_SIZE 188
 
+/* size of a MPEG-2 Transport Stream packet prefixed by a 4 byte timestamp */
+#define IEC61883_MPEG2_TSP_SPH_SIZE 192
+
+enum iec61883_mpeg2_timestamp {
+	IEC61883_MPEG2_TIMESTAMP_NONE = 0, /* 188 byte packets paced by PCR */
+	IEC61883_MPEG2_TIMESTAMP_SPH,      /* IEC 61883-4 source packet header */
+	IEC61883_MPEG2_TIMESTAMP_M2TS      /* 27 MHz arrival time stamp (BDAV) */
+};
+
 typedef struct iec61883_mpeg2* iec61883_mpeg2_t;
 
+/* maximum number of PIDs that the receive analyzer tracks individually */
+#define IEC61883_MPEG2_MAX_PIDS 64
+
+/**
+ * struct iec61883_mpeg2_pid_stats - receive analyzer counters for one PID
+ * @pid: the program ID
+ * @packets: number of transport stream packets received
+ * @cc_errors: number of continuity counter errors
+ * @pcr_count: number of PCRs received
+ * @pcr_interval: time between the last two PCRs in microseconds
+ * @pcr_interval_max: largest PCR interval in microseconds
+ * @pcr_interval_errors: number of PCR intervals over 100 milliseconds
+ * @pcr_jitter: PCR jitter of the last PCR in nanoseconds
+ * @pcr_jitter_max: largest absolute PCR jitter in nanoseconds
+ * @bitrate: bits per second over the last second
+ *
+ * PCR interval and jitter are measured against the arrival time of the
+ * packets, which is the isochronous cycle time in the source packet header.
+ * Jitter is the difference between the arrival time and the PCR distance
+ * from one PCR to the next.
+ */
+struct iec61883_mpeg2_pid_stats {
+	int pid;
+	unsigned long long packets;
+	unsigned int cc_errors;
+	unsigned int pcr_count;
+	unsigned int pcr_interval;
+	unsigned int pcr_interval_max;
+	unsigned int pcr_interval_errors;
+	int pcr_jitter;
+	unsigned int pcr_jitter_max;
+	unsigned int bitrate;
+};
+
+/**
+ * struct iec61883_mpeg2_analysis - receive analyzer counters
+ * @packets: number of transport stream packets received
+ * @sync_errors: number of packets without the 0x47 sync byte
+ * @transport_errors: number of packets with transport_error_indicator set
+ * @cc_errors: number of continuity counter errors on all PIDs
+ * @untracked_packets: packets on PIDs beyond IEC61883_MPEG2_MAX_PIDS
+ * @bitrate: bits per second over the last second
+ * @n_pids: number of valid entries in @pid
+ * @pid: per PID counters in order of first appearance
+ */
+struct iec61883_mpeg2_analysis {
+	unsigned long long packets;
+	unsigned int sync_errors;
+	unsigned int transport_errors;
+	unsigned int cc_errors;
+	unsigned int untracked_packets;
+	unsigned int bitrate;
+	unsigned int n_pids;
+	struct iec61883_mpeg2_pid_stats pid[IEC61883_MPEG2_MAX_PIDS];
+};
+
 typedef int 
 (*iec61883_mpeg2_recv_t)(unsigned char *data, int len, unsigned int dropped, 
 	void *callback_data);
@@ -685,6 +1228,66 @@ iec61883_mpeg2_xmit_init(raw1394handle_t handle,
 		iec61883_mpeg2_xmit_t get_data,
 		void *callback_data);
 
+/**
+ * iec61883_mpeg2_xmit_init_file - setup transmission of a MPEG2-TS file
+ * @handle: the libraw1394 handle to use for all operations
+ * @filename: the transport stream to transmit
+ *
+ * The file is memory mapped and transport stream packets are taken directly
+ * from the mapping; no callback is involved. If a timestamp mode is set
+ * with iec61883_mpeg2_set_timestamp_mode(), the file must consist of
+ * IEC61883_MPEG2_TSP_SPH_SIZE byte packets. Transmission ends with an
+ * error at the end of the file. The file is unmapped by
+ * iec61883_mpeg2_close().
+ *
+ * Returns:
+ * A pointer to an iec61883_mpeg2 object upon success or NULL for failure.
+ **/
+iec61883_mpeg2_t
+iec61883_mpeg2_xmit_init_file(raw1394handle_t handle, const char *filename);
+
+/**
+ * iec61883_mpeg2_xmit_init_ring - setup transmission of MPEG2-TS from a ring
+ * @handle: the libraw1394 handle to use for all operations
+ * @size: the size of the ring in bytes
+ * @watermark: bytes of free space that wake a blocked writer, 0 for a
+ * quarter of the ring
+ *
+ * Instead of calling back for each packet, the stream takes transport
+ * stream packets from a ring the library owns and that the application
+ * fills with iec61883_mpeg2_write() from a thread of its own. A
+ * timestamp mode must be set with iec61883_mpeg2_set_timestamp_mode()
+ * before starting, as PCR pacing reads ahead of what a ring can hold,
+ * and the ring is fed IEC61883_MPEG2_TSP_SPH_SIZE byte packets. While no
+ * packet is ready, cycles go out empty and underruns are counted; a
+ * packet written late goes out as soon as it is there.
+ *
+ * Returns:
+ * A pointer to an iec61883_mpeg2 object upon success or NULL for failure.
+ **/
+iec61883_mpeg2_t
+iec61883_mpeg2_xmit_init_ring(raw1394handle_t handle, unsigned int size,
+		unsigned int watermark);
+
+/**
+ * iec61883_mpeg2_recv_init_ring - setup reception of MPEG2-TS into a ring
+ * @handle: the libraw1394 handle to use for all operations
+ * @size: the size of the ring in bytes
+ * @watermark: bytes of data that wake a blocked reader, 0 for a quarter
+ * of the ring
+ *
+ * The transport stream packets received are stored in a ring the library
+ * owns and that the application drains with iec61883_mpeg2_read() from a
+ * thread of its own. A packet that does not fit is dropped and counted as
+ * an overrun.
+ *
+ * Returns:
+ * A pointer to an iec61883_mpeg2 object upon success or NULL for failure.
+ **/
+iec61883_mpeg2_t
+iec61883_mpeg2_recv_init_ring(raw1394handle_t handle, unsigned int size,
+		unsigned int watermark);
+
 /**
  * iec61883_mpeg2_recv_start - start receiving MPEG2-TS
  * @mpeg2: pointer to iec61883_mpeg2 object
@@ -702,6 +1305,11 @@ iec61883_mpeg2_recv_start(iec61883_mpeg2_t mpeg2, int channel);
  * @pid: the program ID of the transport stream to select
  * @channel: isochronous channel number
  *
+ * The transmission rate is derived from the PCR carried on @pid. With -1,
+ * the PCR_PID of the program selected with iec61883_mpeg2_set_program() is
+ * looked up in the PAT and PMT at the start of the stream. If they are not
+ * found, the first PID that carries a PCR is used.
+ *
  * Returns:
  * 0 for success or -1 for failure
  **/
@@ -784,25 +1392,170 @@ void
 iec61883_mpeg2_set_irq_interval(iec61883_mpeg2_t mpeg2, unsigned int packets);
 
 /**
- * iec61883_mpeg2_get_synch - get behavior on close
+ * iec61883_mpeg2_get_dma_mode - get the DMA mode for reception
  * @mpeg2: pointer to iec61883_mpeg2 object
- *
- * If synch is not zero, then when stopping reception all packets in
- * raw1394 buffers are flushed and invoking your callback function and when
- * stopping transmission all packets in the raw1394 buffers are sent before
- * the close function returns.
  **/
-int
-iec61883_mpeg2_get_synch(iec61883_mpeg2_t mpeg2);
+enum raw1394_iso_dma_recv_mode
+iec61883_mpeg2_get_dma_mode(iec61883_mpeg2_t mpeg2);
 
 /**
- * iec61883_mpeg2_set_synch - set behavior on close
+ * iec61883_mpeg2_set_dma_mode - set the DMA mode for reception
  * @mpeg2: pointer to iec61883_mpeg2 object
- * @synch: 1 if you want sync behaviour, 0 otherwise
+ * @mode: RAW1394_DMA_PACKET_PER_BUFFER, the default, or RAW1394_DMA_BUFFERFILL
  *
- * If synch is not zero, then when stopping reception all packets in
- * raw1394 buffers are flushed and invoking your callback function and when
- * stopping transmission all packets in the raw1394 buffers are sent before
+ * In buffer-fill mode the controller packs the received packets into the
+ * buffer back to back, rather than using a DMA descriptor per packet, and
+ * interrupts only when a whole interrupt interval of data arrived; raw1394
+ * splits the buffer into packets for the callback. Together with a larger
+ * interrupt interval this cuts the interrupt load of many streams. Drivers
+ * that do not support the mode make the recv_start function fail.
+ *
+ * This is an advanced option that can only be set after initialization and 
+ * before reception.
+ **/
+void
+iec61883_mpeg2_set_dma_mode(iec61883_mpeg2_t mpeg2, enum raw1394_iso_dma_recv_mode mode);
+
+/**
+ * iec61883_mpeg2_read - take received data from the ring
+ * @mpeg2: pointer to an iec61883_mpeg2 object created with recv_init_ring
+ * @data: where to store the data
+ * @len: the most bytes to take
+ * @timeout: milliseconds to wait, -1 to wait without limit, 0 not to wait
+ *
+ * Waits until at least the watermark or @len bytes are in the ring, then
+ * takes what is there up to @len bytes. The handle must be serviced by
+ * another thread meanwhile, for example by an iec61883_runner_t.
+ *
+ * Returns:
+ * the number of bytes taken, or -1 (errno), EAGAIN if the ring stayed
+ * empty, EINVAL if the stream has no ring for reception
+ **/
+int
+iec61883_mpeg2_read(iec61883_mpeg2_t mpeg2, void *data, unsigned int len, int timeout);
+
+/**
+ * iec61883_mpeg2_write - put data to transmit into the ring
+ * @mpeg2: pointer to an iec61883_mpeg2 object created with xmit_init_ring
+ * @data: the data
+ * @len: the bytes to put
+ * @timeout: milliseconds to wait, -1 to wait without limit, 0 not to wait
+ *
+ * Waits until the watermark or @len bytes are free, then puts as much as
+ * fits. Prefill the ring before starting transmission to avoid underruns.
+ *
+ * Returns:
+ * the number of bytes put, or -1 (errno), EAGAIN if the ring stayed
+ * full, EINVAL if the stream has no ring for transmission
+ **/
+int
+iec61883_mpeg2_write(iec61883_mpeg2_t mpeg2, const void *data, unsigned int len, int timeout);
+
+/**
+ * iec61883_mpeg2_get_ring_stats - get the fill level and error counts
+ * @mpeg2: pointer to iec61883_mpeg2 object
+ * @stats: receives the state of the ring
+ *
+ * Returns:
+ * 0 for success or -1 (errno) if the stream has no ring
+ **/
+int
+iec61883_mpeg2_get_ring_stats(iec61883_mpeg2_t mpeg2, struct iec61883_ring_stats *stats);
+
+/**
+ * iec61883_mpeg2_get_stats - get what the stream handled so far
+ * @mpeg2: pointer to iec61883_mpeg2 object
+ * @stats: receives a snapshot of the counters
+ * @reset: if non-zero, the counters restart from zero at the next packet
+ *
+ * The counters are updated by the stream without locks and may be read
+ * from any thread, for example once a second by a monitor.
+ *
+ * Returns:
+ * 0 for success
+ **/
+int
+iec61883_mpeg2_get_stats(iec61883_mpeg2_t mpeg2, struct iec61883_stats *stats, int reset);
+
+/**
+ * iec61883_mpeg2_set_profiling - measure the time budget of the stream
+ * @mpeg2: pointer to iec61883_mpeg2 object
+ * @enable: non-zero to start measuring, 0 to stop
+ *
+ * While enabled, each packet also records the time spent in the library
+ * and in the callback, each batch its duration against the interrupt
+ * interval, and the first packet of each batch how many cycles it is from
+ * the bus cycle, which takes a read of the cycle timer. Disabled, this
+ * costs a test per packet. Set the interrupt interval first.
+ **/
+void
+iec61883_mpeg2_set_profiling(iec61883_mpeg2_t mpeg2, int enable);
+
+/**
+ * iec61883_mpeg2_get_profile - get the measurements of the stream
+ * @mpeg2: pointer to iec61883_mpeg2 object
+ * @profile: receives a snapshot of the histograms
+ * @reset: if non-zero, the histograms and the statistics of the stream
+ * restart from zero at the next packet
+ *
+ * May be called from any thread.
+ **/
+void
+iec61883_mpeg2_get_profile(iec61883_mpeg2_t mpeg2, struct iec61883_profile *profile, int reset);
+
+/**
+ * iec61883_mpeg2_set_trace - keep a trace of the last packets of the stream
+ * @mpeg2: pointer to iec61883_mpeg2 object
+ * @records: how many packets to keep, rounded up to a power of two, or 0
+ * to stop tracing. At 8000 packets a second, 32768 keep 4 seconds in 1 MB.
+ * @error_file: if not NULL, recording stops when a callback fails, and the
+ * trace is written to this file, as with iec61883_mpeg2_dump_trace(), when
+ * the stream is stopped or closed
+ *
+ * Each packet is recorded as a struct iec61883_trace_record, overwriting
+ * the oldest one. Call this while the stream is stopped; the previous
+ * trace, if any, is discarded.
+ *
+ * Returns:
+ * 0 for success or -1 with errno set
+ **/
+int
+iec61883_mpeg2_set_trace(iec61883_mpeg2_t mpeg2, unsigned int records, const char *error_file);
+
+/**
+ * iec61883_mpeg2_dump_trace - write the trace of the stream to a file
+ * @mpeg2: pointer to iec61883_mpeg2 object
+ * @filename: the file to create or replace
+ *
+ * May be called from any thread while the stream runs. The records the
+ * stream overwrites while they are copied are left out.
+ *
+ * Returns:
+ * 0 for success or -1 with errno set, EINVAL if tracing is off
+ **/
+int
+iec61883_mpeg2_dump_trace(iec61883_mpeg2_t mpeg2, const char *filename);
+
+/**
+ * iec61883_mpeg2_get_synch - get behavior on close
+ * @mpeg2: pointer to iec61883_mpeg2 object
+ *
+ * If synch is not zero, then when stopping reception all packets in
+ * raw1394 buffers are flushed and invoking your callback function and when
+ * stopping transmission all packets in the raw1394 buffers are sent before
+ * the close function returns.
+ **/
+int
+iec61883_mpeg2_get_synch(iec61883_mpeg2_t mpeg2);
+
+/**
+ * iec61883_mpeg2_set_synch - set behavior on close
+ * @mpeg2: pointer to iec61883_mpeg2 object
+ * @synch: 1 if you want sync behaviour, 0 otherwise
+ *
+ * If synch is not zero, then when stopping reception all packets in
+ * raw1394 buffers are flushed and invoking your callback function and when
+ * stopping transmission all packets in the raw1394 buffers are sent before
  * the close function returns.
  **/
 void
@@ -850,9 +1603,109 @@ iec61883_mpeg2_get_dropped(iec61883_mpeg2_t mpeg2);
 void *
 iec61883_mpeg2_get_callback_data(iec61883_mpeg2_t mpeg2);
 
+/**
+ * iec61883_mpeg2_get_timestamp_mode - get the transmit pacing mode
+ * @mpeg2: pointer to iec61883_mpeg2 object
+ *
+ * Returns:
+ * One of enum iec61883_mpeg2_timestamp.
+ **/
+int
+iec61883_mpeg2_get_timestamp_mode(iec61883_mpeg2_t mpeg2);
+
+/**
+ * iec61883_mpeg2_set_timestamp_mode - set the transmit pacing mode
+ * @mpeg2: pointer to iec61883_mpeg2 object
+ * @mode: one of enum iec61883_mpeg2_timestamp
+ *
+ * With IEC61883_MPEG2_TIMESTAMP_NONE (the default) the transmission rate is
+ * derived from the PCR of the selected program. In the other modes your
+ * transmit callback must supply IEC61883_MPEG2_TSP_SPH_SIZE bytes per packet:
+ * a 4 byte big endian timestamp followed by the transport stream packet.
+ * Each packet is then sent in the isochronous cycle given by its timestamp
+ * relative to the first packet, and its intra-cycle offset is preserved in
+ * the source packet header. No PCR analysis is performed and the pid
+ * argument of iec61883_mpeg2_xmit_start() is ignored.
+ *
+ * IEC61883_MPEG2_TIMESTAMP_SPH expects the 25 bit cycle count/offset format
+ * of IEC 61883-4 as captured from the bus; IEC61883_MPEG2_TIMESTAMP_M2TS
+ * expects the 30 bit 27 MHz arrival time stamp used in .m2ts files.
+ *
+ * This is an advanced option that can only be set after initialization and 
+ * before transmission.
+ **/
+void
+iec61883_mpeg2_set_timestamp_mode(iec61883_mpeg2_t mpeg2, int mode);
+
+/**
+ * iec61883_mpeg2_get_program - get the program to transmit
+ * @mpeg2: pointer to iec61883_mpeg2 object
+ *
+ * Returns:
+ * The program_number whose PCR paces transmission, or -1 for the first
+ * program in the PAT.
+ **/
+int
+iec61883_mpeg2_get_program(iec61883_mpeg2_t mpeg2);
+
+/**
+ * iec61883_mpeg2_set_program - select the program of a multi-program stream
+ * @mpeg2: pointer to iec61883_mpeg2 object
+ * @program: the program_number as listed in the PAT, or -1 for the first
+ *
+ * This only applies when iec61883_mpeg2_xmit_start() is called with a pid
+ * of -1. The whole transport stream is still transmitted; only the clock
+ * used for pacing is taken from the selected program.
+ *
+ * This is an advanced option that can only be set after initialization and 
+ * before transmission.
+ **/
+void
+iec61883_mpeg2_set_program(iec61883_mpeg2_t mpeg2, int program);
+
+/**
+ * iec61883_mpeg2_set_analyzer - enable or disable the receive analyzer
+ * @mpeg2: pointer to iec61883_mpeg2 object
+ * @enable: 1 to analyze received packets, 0 otherwise
+ *
+ * The analyzer checks every received transport stream packet before it is
+ * passed to your callback. It tracks the continuity counter, PCR interval,
+ * PCR jitter and bitrate per PID in fixed-size counters; no memory is
+ * allocated while receiving. Enabling it resets all counters.
+ *
+ * This is an advanced option that can only be set after initialization and 
+ * before reception.
+ *
+ * Returns:
+ * 0 for success or -1 for failure (errno available)
+ **/
+int
+iec61883_mpeg2_set_analyzer(iec61883_mpeg2_t mpeg2, int enable);
+
+/**
+ * iec61883_mpeg2_get_analysis - get a snapshot of the receive analyzer
+ * @mpeg2: pointer to iec61883_mpeg2 object
+ * @analysis: pointer to the structure that receives the counters
+ * @reset: if not zero, the counters restart from zero after the snapshot
+ *
+ * This may be called from any thread while receiving, also from the
+ * receive callback; the snapshot is consistent with respect to whole
+ * transport stream packets.
+ *
+ * Returns:
+ * 0 for success or -1 if the analyzer is not enabled
+ **/
+int
+iec61883_mpeg2_get_analysis(iec61883_mpeg2_t mpeg2,
+	struct iec61883_mpeg2_analysis *analysis, int reset);
+
 
 /*******************************************************************************
  * Connection Management Procedures
+ *
+ * On a handle given to iec61883_handle_init(), the functions here cache
+ * plug register values per bus generation; otherwise every access reads
+ * the register.
  **/
 
 enum iec61883_pcr_overhead_id {
@@ -892,6 +1745,65 @@ int
 iec61883_cmp_calc_bandwidth (raw1394handle_t handle, nodeid_t output, int plug,
 	int speed);
 
+/**
+ * Bandwidth planning
+ *
+ * A session of streams can be checked against the bandwidth left on the
+ * bus before any of them is started. Each stream is described by its
+ * format and speed; its allocation units are computed from the largest
+ * packet it sends, with the same formula as iec61883_cmp_calc_bandwidth().
+ */
+
+enum iec61883_stream_type {
+	IEC61883_STREAM_AMDTP,
+	IEC61883_STREAM_DV,
+	IEC61883_STREAM_MPEG2
+};
+
+struct iec61883_stream_plan {
+	int type;               /* enum iec61883_stream_type */
+	int speed;              /* RAW1394_ISO_SPEED_100 to RAW1394_ISO_SPEED_400 */
+	int overhead_id;        /* enum iec61883_pcr_overhead_id */
+	int rate;               /* AMDTP: sampling rate in Hz */
+	int dimension;          /* AMDTP: number of channels */
+	int mode;               /* AMDTP: enum iec61883_cip_mode */
+	unsigned int bitrate;   /* MPEG-2: transport stream bits per second */
+	int payload;            /* filled in: quadlets per packet */
+	int bandwidth;          /* filled in: bandwidth allocation units */
+};
+
+/**
+ * iec61883_cmp_plan_bandwidth - compute the bandwidth of a session
+ * @streams: the streams; their payload and bandwidth are filled in
+ * @n_streams: the number of streams
+ *
+ * DV has the same packet size for 525-60 and 625-50 systems, so it needs
+ * no parameters besides the speed.
+ *
+ * Returns:
+ * the total bandwidth allocation units, or -1 (errno) if a stream is
+ * not valid
+ **/
+int
+iec61883_cmp_plan_bandwidth (struct iec61883_stream_plan *streams, int n_streams);
+
+/**
+ * iec61883_cmp_admit - check whether a session fits on the bus
+ * @handle: a libraw1394 handle
+ * @streams: the streams, as for iec61883_cmp_plan_bandwidth()
+ * @n_streams: the number of streams
+ * @available: receives the units available at the IRM, may be NULL
+ *
+ * This reads BANDWIDTH_AVAILABLE once; nothing is allocated, so the
+ * answer only holds until another node allocates bandwidth.
+ *
+ * Returns:
+ * 1 if the session fits, 0 if it does not, or -1 (errno) on failure
+ **/
+int
+iec61883_cmp_admit (raw1394handle_t handle, struct iec61883_stream_plan *streams,
+	int n_streams, int *available);
+
 /**
  * iec61883_cmp_connect - establish or overlay connection automatically
  * @handle: a libraw1394 handle
@@ -995,85 +1907,373 @@ iec61883_cmp_disconnect (raw1394handle_t handle, nodeid_t output, int oplug,
 int
 iec61883_cmp_normalize_output (raw1394handle_t handle, nodeid_t node);
 
-/*
- * The following CMP functions are lower level routines used by the above 
- * connection procedures exposed here in case the above procedures do not fit 
- * your use cases.
- */
+/**
+ * iec61883_cmp_allocate_channel - allocate an isochronous channel with the IRM
+ * @handle: a libraw1394 handle
+ * @preferred: the channel to use if it is free, or -1 for the lowest free
+ *
+ * The channels available registers are read once and the channel is claimed
+ * with a single compare-swap lock; further locks are only needed when
+ * another node modifies the register at the same time. The broadcast
+ * channel 63 is never allocated. Release the channel with
+ * raw1394_channel_modify() or iec61883_cmp_free_channels().
+ *
+ * Returns:
+ * the channel number on success or -1 on failure (errno is ENOSPC when no
+ * channel is free)
+ **/
 int
-iec61883_cmp_create_p2p (raw1394handle_t handle, 
-	nodeid_t output_node, int output_plug,
-	nodeid_t input_node, int input_plug,	
-	unsigned int channel, unsigned int speed);
+iec61883_cmp_allocate_channel (raw1394handle_t handle, int preferred);
 
+/**
+ * iec61883_cmp_allocate_channels - allocate several isochronous channels
+ * @handle: a libraw1394 handle
+ * @count: the number of channels to allocate, 1 to 63
+ * @channels: an array of @count ints that receives the channel numbers
+ *
+ * Either all or none of the channels are allocated. This takes at most one
+ * compare-swap per IRM register in the absence of contention.
+ *
+ * Returns:
+ * 0 on success or -1 on failure (errno is ENOSPC when not enough channels
+ * are free)
+ **/
 int
-iec61883_cmp_create_p2p_output (raw1394handle_t handle, 
-	nodeid_t output_node, int output_plug,
-	unsigned int channel, unsigned int speed);
+iec61883_cmp_allocate_channels (raw1394handle_t handle, int count, int *channels);
 
+/**
+ * iec61883_cmp_free_channels - release several isochronous channels
+ * @handle: a libraw1394 handle
+ * @count: the number of channels in @channels
+ * @channels: the channel numbers to release
+ *
+ * Returns:
+ * 0 on success or -1 on failure
+ **/
 int
-iec61883_cmp_create_p2p_input (raw1394handle_t handle,
-	nodeid_t input_node, int input_plug,
-	unsigned int channel);
+iec61883_cmp_free_channels (raw1394handle_t handle, int count, const int *channels);
 
-int
-iec61883_cmp_create_bcast (raw1394handle_t handle, 
-	nodeid_t output_node, int output_plug,
-	nodeid_t input_node, int input_plug,
-	unsigned int channel, unsigned int speed);
+/**
+ * Asynchronous connection management
+ *
+ * The engine below performs the same connections as iec61883_cmp_connect()
+ * and iec61883_cmp_disconnect(), but with asynchronous transactions so that
+ * the plug reads and compare-swaps of many connections are in flight at the
+ * same time. Only the IRM register updates are serialized, as every
+ * connection competes for the same registers.
+ */
 
-int
-iec61883_cmp_create_bcast_output (raw1394handle_t handle, 
-	nodeid_t output_node, int output_plug,
-	unsigned int channel, unsigned int speed);
-		
-int
-iec61883_cmp_create_bcast_input (raw1394handle_t handle,
-	nodeid_t input_node, int input_plug,
-	unsigned int channel);
+typedef struct iec61883_cmp_async* iec61883_cmp_async_t;
+
+struct iec61883_cmp_async_result {
+	int id;             /* as returned when the request was queued */
+	int error;          /* 0 on success, otherwise an errno value */
+	nodeid_t output;
+	int oplug;          /* plug used, or -1 */
+	nodeid_t input;
+	int iplug;          /* plug used, or -1 */
+	int channel;        /* isochronous channel, or -1 on failure */
+	int bandwidth;      /* bandwidth allocation units allocated */
+};
 
-int
-iec61883_cmp_overlay_p2p (raw1394handle_t handle, 
-	nodeid_t output_node, int output_plug,
-	nodeid_t input_node, int input_plug);
+/**
+ * iec61883_cmp_async_done_t - connection completion callback
+ * @cmp: the engine
+ * @result: the outcome of a connect or disconnect request; only valid
+ * during the callback.
+ * @callback_data: the opaque pointer supplied to iec61883_cmp_async_init()
+ *
+ * Called from iec61883_cmp_async_iterate(). New requests may be queued
+ * from the callback.
+ */
+typedef void
+(*iec61883_cmp_async_done_t)(iec61883_cmp_async_t cmp,
+	const struct iec61883_cmp_async_result *result, void *callback_data);
 
-int
-iec61883_cmp_overlay_p2p_output (raw1394handle_t handle, 
-	nodeid_t output_node, int output_plug);
+/**
+ * iec61883_cmp_async_init - create an asynchronous connection engine
+ * @handle: a libraw1394 handle, which must use the default tag handler
+ * @done: the completion callback
+ * @callback_data: opaque data passed to @done
+ *
+ * The engine issues its transactions on @handle; use a handle that is
+ * not also used for isochronous streaming.
+ *
+ * Returns:
+ * the engine or NULL on failure
+ **/
+iec61883_cmp_async_t
+iec61883_cmp_async_init (raw1394handle_t handle,
+	iec61883_cmp_async_done_t done, void *callback_data);
 
+/**
+ * iec61883_cmp_async_connect - queue a connection
+ * @cmp: the engine
+ * @output: node id of the transmitter
+ * @oplug: the output plug to use, or -1 to find the first online plug
+ * @input: node id of the receiver
+ * @iplug: the input plug to use, or -1 to find the first online plug
+ * @bandwidth: 0 to skip bandwidth allocation
+ * @channel: -1 for a new connection, otherwise the channel of a connection
+ * to re-establish, as for iec61883_cmp_reconnect()
+ *
+ * The connection is made as by iec61883_cmp_connect(), except that no
+ * bandwidth is allocated when only @input has plugs. The result is
+ * reported through the completion callback.
+ *
+ * Returns:
+ * a request id or -1 on failure. Ids count up from 0 for each engine.
+ **/
 int
-iec61883_cmp_overlay_p2p_input (raw1394handle_t handle,
-	nodeid_t input_node, int input_plug);
-		
-int
-iec61883_cmp_overlay_bcast (raw1394handle_t handle, 
-	nodeid_t output_node, int output_plug,
-	nodeid_t input_node, int input_plug);
+iec61883_cmp_async_connect (iec61883_cmp_async_t cmp, nodeid_t output, int oplug,
+	nodeid_t input, int iplug, int bandwidth, int channel);
 
 /**
- * iec61883_plug_impr_init - Initialise hosting of local input plug registers.
- * @h: A raw1394 handle.
- * @data_rate: an enum iec61883_datarate
+ * iec61883_cmp_async_disconnect - queue a disconnection
+ * @cmp: the engine
+ * @output: node id of the transmitter
+ * @oplug: the output plug, or -1 to locate it by @channel
+ * @input: node id of the receiver
+ * @iplug: the input plug, or -1 to locate it by @channel
+ * @channel: the isochronous channel in use
+ * @bandwidth: the number of bandwidth allocation units to release when needed
  *
- * Initially, no plugs are available; call iec61883_plug_add_ipcr() to add
- * plugs.
+ * See iec61883_cmp_disconnect().
  *
- * Returns: 
- * 0 for success, -EINVAL if data_rate is invalid, or or -1 (errno) on 
- * libraw1394 failure.
+ * Returns:
+ * a request id (>= 0) or -1 on failure
  **/
 int
-iec61883_plug_impr_init (raw1394handle_t h, unsigned int data_rate);
+iec61883_cmp_async_disconnect (iec61883_cmp_async_t cmp, nodeid_t output, int oplug,
+	nodeid_t input, int iplug, unsigned int channel, unsigned int bandwidth);
 
 /**
- * ice61883_plug_impr_clear - Set the number of input plugs to zero.
- * @h: A raw1394 handle.
+ * iec61883_cmp_async_pending - get the number of unfinished requests
+ * @cmp: the engine
  **/
-void
-iec61883_plug_impr_clear (raw1394handle_t h);
+int
+iec61883_cmp_async_pending (iec61883_cmp_async_t cmp);
 
-/** 
- * iec61883_plug_impr_close - Stop hosting local input plugs.
+/**
+ * iec61883_cmp_async_get_fd - get a file descriptor to poll
+ * @cmp: the engine
+ *
+ * The descriptor becomes readable when a response has arrived; then call
+ * iec61883_cmp_async_iterate(). Poll it no longer than
+ * iec61883_cmp_async_get_timeout().
+ **/
+int
+iec61883_cmp_async_get_fd (iec61883_cmp_async_t cmp);
+
+/**
+ * iec61883_cmp_async_get_timeout - get when a busy transaction is due
+ * @cmp: the engine
+ *
+ * A transaction acknowledged busy is sent again after a delay that
+ * follows the retry policy of the handle (see iec61883_set_retry_policy()),
+ * from within iec61883_cmp_async_iterate().
+ *
+ * Returns:
+ * the milliseconds until the next one is due, 0 if one is due now, or -1
+ * if none is waiting
+ **/
+int
+iec61883_cmp_async_get_timeout (iec61883_cmp_async_t cmp);
+
+/**
+ * iec61883_cmp_async_iterate - process one event
+ * @cmp: the engine
+ *
+ * Sends the busy transactions that are due, then blocks until an event
+ * arrives on the handle or the next busy transaction is due, so call it
+ * when the file descriptor is readable, when the timeout has passed or
+ * while iec61883_cmp_async_pending() is non-zero.
+ *
+ * Returns:
+ * 0 on success or -1 on failure (errno available)
+ **/
+int
+iec61883_cmp_async_iterate (iec61883_cmp_async_t cmp);
+
+/**
+ * iec61883_cmp_async_close - destroy the engine
+ * @cmp: the engine
+ *
+ * Runs the engine until all queued requests have completed, which are
+ * still reported through the callback, then frees it.
+ **/
+void
+iec61883_cmp_async_close (iec61883_cmp_async_t cmp);
+
+/**
+ * Connection registry
+ *
+ * Once enabled on a handle, connections made on it by iec61883_cmp_connect()
+ * and iec61883_cmp_reconnect() are recorded, with the GUIDs of both nodes,
+ * until iec61883_cmp_disconnect(). After every bus reset the registry
+ * restores them all with the asynchronous engine: channel and bandwidth
+ * are reclaimed from the IRM in order of priority, then plugs that lost
+ * their connection are connected again. Node ids are resolved again by GUID.
+ */
+
+struct iec61883_cmp_restore_report {
+	unsigned int generation;     /* bus generation restored for */
+	int restored;                /* connections restored */
+	int failed;
+	unsigned int recovery_time;  /* microseconds, from the bus reset event */
+};
+
+/**
+ * iec61883_cmp_restore_report_t - restoration report callback
+ * @handle: the raw1394 handle
+ * @report: the outcome of restoring after a bus reset
+ * @callback_data: the opaque pointer supplied to iec61883_cmp_registry_enable()
+ */
+typedef void
+(*iec61883_cmp_restore_report_t)(raw1394handle_t handle,
+	const struct iec61883_cmp_restore_report *report, void *callback_data);
+
+/**
+ * iec61883_cmp_registry_enable - record connections and restore them after bus resets
+ * @handle: a libraw1394 handle, which must use the default tag handler
+ * @report: called after each restoration, may be NULL
+ * @callback_data: opaque data passed to @report
+ *
+ * This installs a bus reset handler that calls the previously installed
+ * one first, so install your own handler before calling this. Restoration
+ * runs inside raw1394_loop_iterate() on @handle, the call that handles
+ * the bus reset event, and blocks it until all connections are restored
+ * or have failed: the GUIDs of the nodes are read with synchronous
+ * transactions, and the plugs are restored with a nested
+ * raw1394_loop_iterate() loop on @handle. Other callbacks of @handle,
+ * including iso handlers, can run inside that loop, and handling the
+ * reset takes as long as those transactions.
+ *
+ * The registry is part of the state of iec61883_handle_init(), which must
+ * be called on @handle first.
+ *
+ * Returns:
+ * 0 on success or -1 on failure (errno is ENOENT without that state)
+ **/
+int
+iec61883_cmp_registry_enable (raw1394handle_t handle,
+	iec61883_cmp_restore_report_t report, void *callback_data);
+
+/**
+ * iec61883_cmp_registry_disable - stop recording and restoring connections
+ * @handle: a libraw1394 handle
+ *
+ * Forgets the recorded connections and reinstalls the previous bus reset
+ * handler.
+ **/
+void
+iec61883_cmp_registry_disable (raw1394handle_t handle);
+
+/**
+ * iec61883_cmp_registry_set_priority - set the restoration priority of a connection
+ * @handle: a libraw1394 handle
+ * @channel: the isochronous channel of the recorded connections
+ * @priority: higher priorities are restored first, the default is 0
+ *
+ * Returns:
+ * 0 on success or -1 if no connection on @channel is recorded
+ **/
+int
+iec61883_cmp_registry_set_priority (raw1394handle_t handle, int channel, int priority);
+
+/**
+ * iec61883_cmp_restore - restore the recorded connections now
+ * @handle: a libraw1394 handle
+ * @report: receives the outcome, may be NULL
+ *
+ * This is what the bus reset handler installed by
+ * iec61883_cmp_registry_enable() does.
+ *
+ * Returns:
+ * 0 if all connections were restored or -1 otherwise
+ **/
+int
+iec61883_cmp_restore (raw1394handle_t handle, struct iec61883_cmp_restore_report *report);
+
+/*
+ * The following CMP functions are lower level routines used by the above 
+ * connection procedures exposed here in case the above procedures do not fit 
+ * your use cases.
+ */
+int
+iec61883_cmp_create_p2p (raw1394handle_t handle, 
+	nodeid_t output_node, int output_plug,
+	nodeid_t input_node, int input_plug,	
+	unsigned int channel, unsigned int speed);
+
+int
+iec61883_cmp_create_p2p_output (raw1394handle_t handle, 
+	nodeid_t output_node, int output_plug,
+	unsigned int channel, unsigned int speed);
+
+int
+iec61883_cmp_create_p2p_input (raw1394handle_t handle,
+	nodeid_t input_node, int input_plug,
+	unsigned int channel);
+
+int
+iec61883_cmp_create_bcast (raw1394handle_t handle, 
+	nodeid_t output_node, int output_plug,
+	nodeid_t input_node, int input_plug,
+	unsigned int channel, unsigned int speed);
+
+int
+iec61883_cmp_create_bcast_output (raw1394handle_t handle, 
+	nodeid_t output_node, int output_plug,
+	unsigned int channel, unsigned int speed);
+		
+int
+iec61883_cmp_create_bcast_input (raw1394handle_t handle,
+	nodeid_t input_node, int input_plug,
+	unsigned int channel);
+
+int
+iec61883_cmp_overlay_p2p (raw1394handle_t handle, 
+	nodeid_t output_node, int output_plug,
+	nodeid_t input_node, int input_plug);
+
+int
+iec61883_cmp_overlay_p2p_output (raw1394handle_t handle, 
+	nodeid_t output_node, int output_plug);
+
+int
+iec61883_cmp_overlay_p2p_input (raw1394handle_t handle,
+	nodeid_t input_node, int input_plug);
+		
+int
+iec61883_cmp_overlay_bcast (raw1394handle_t handle, 
+	nodeid_t output_node, int output_plug,
+	nodeid_t input_node, int input_plug);
+
+/**
+ * iec61883_plug_impr_init - Initialise hosting of local input plug registers.
+ * @h: A raw1394 handle.
+ * @data_rate: an enum iec61883_datarate
+ *
+ * Initially, no plugs are available; call iec61883_plug_add_ipcr() to add
+ * plugs. The plugs are kept with @h until iec61883_plug_impr_close().
+ *
+ * Returns: 
+ * 0 for success, -EINVAL if data_rate is invalid, or or -1 (errno) on 
+ * libraw1394 failure.
+ **/
+int
+iec61883_plug_impr_init (raw1394handle_t h, unsigned int data_rate);
+
+/**
+ * ice61883_plug_impr_clear - Set the number of input plugs to zero.
+ * @h: A raw1394 handle.
+ **/
+void
+iec61883_plug_impr_clear (raw1394handle_t h);
+
+/** 
+ * iec61883_plug_impr_close - Stop hosting local input plugs.
  * @h: A raw1394 handle.
  *
  * Returns: 
@@ -1104,7 +2304,7 @@ iec61883_plug_ipcr_add (raw1394handle_t h, unsigned int online);
  * @bcast_channel: the broacast channel base (0 - 63)
  *
  * Initially, no plugs are available; call iec61883_plug_add_opcr() to add
- * plugs.
+ * plugs. The plugs are kept with @h until iec61883_plug_ompr_close().
  *
  * Returns: 
  * 0 for success, -EINVAL if data_rate or bcast_channel is invalid, 
@@ -1149,6 +2349,796 @@ int
 iec61883_plug_opcr_add (raw1394handle_t h, unsigned int online,
 	unsigned int overhead_id, unsigned int payload);
 
+/**
+ * Local plug spaces
+ *
+ * A plug space hosts the output or input plug registers of the local node
+ * on the port of one handle, so each port can present its own plugs. The
+ * functions above manage one space per direction for each handle; use
+ * these to own the spaces yourself or to change plug registers safely
+ * while remote nodes lock them. All register updates are atomic
+ * compare-swaps, and the functions may be called from any thread.
+ */
+
+typedef struct iec61883_plug_space *iec61883_plug_space_t;
+
+/**
+ * iec61883_plug_space_init - start hosting local plug registers
+ * @h: a raw1394 handle, serving remote requests from its event loop
+ * @output: 1 for output plugs (oMPR, oPCR), 0 for input plugs (iMPR, iPCR)
+ * @data_rate: an enum iec61883_datarate
+ * @bcast_channel: the broadcast channel of output plugs, 0 for input plugs
+ *
+ * Initially, no plugs are available; see iec61883_plug_space_add().
+ *
+ * Returns:
+ * a plug space or NULL (errno) on failure, for example if the handle
+ * already hosts plugs of that direction
+ **/
+iec61883_plug_space_t
+iec61883_plug_space_init (raw1394handle_t h, int output, unsigned int data_rate,
+	unsigned int bcast_channel);
+
+/**
+ * iec61883_plug_space_close - stop hosting local plug registers
+ * @space: the plug space, which is freed
+ *
+ * Returns:
+ * 0 for success, -1 (errno) on error.
+ **/
+int
+iec61883_plug_space_close (iec61883_plug_space_t space);
+
+/**
+ * iec61883_plug_space_clear - set the number of plugs to zero
+ * @space: the plug space
+ **/
+void
+iec61883_plug_space_clear (iec61883_plug_space_t space);
+
+/**
+ * iec61883_plug_space_add - add a plug
+ * @space: the plug space
+ * @online: The initial state of the plug: online (1) or not (0).
+ * @overhead_id: one of enum iec61883_pcr_overhead_id, 0 for input plugs
+ * @payload: the maximum number of quadlets per packet, 0 for input plugs
+ *
+ * Returns: 
+ * plug number (>=0) on sucess, -EINVAL if a parameter is out of range,
+ * or -ENOSPC if maximum plugs reached.
+ **/
+int
+iec61883_plug_space_add (iec61883_plug_space_t space, unsigned int online,
+	unsigned int overhead_id, unsigned int payload);
+
+/**
+ * iec61883_plug_space_get - read a local plug register
+ * @space: the plug space
+ * @plug: the plug number, or -1 for the master plug register
+ * @value: receives the register, in host byte order as the plug structs
+ *
+ * Returns:
+ * 0 for success, -1 (errno) if @plug is out of range.
+ **/
+int
+iec61883_plug_space_get (iec61883_plug_space_t space, int plug, quadlet_t *value);
+
+/**
+ * iec61883_plug_space_compare_swap - atomically update a local plug register
+ * @space: the plug space
+ * @plug: the plug number, or -1 for the master plug register
+ * @compare: the expected register value
+ * @swap: the value to store if the register equals @compare
+ * @old: receives the previous register value, may be NULL
+ *
+ * As for a lock request from a remote node, the update took place if
+ * *@old equals @compare.
+ *
+ * Returns:
+ * 0 for success, -1 (errno) if @plug is out of range.
+ **/
+int
+iec61883_plug_space_compare_swap (iec61883_plug_space_t space, int plug,
+	quadlet_t compare, quadlet_t swap, quadlet_t *old);
+
+/**
+ * iec61883_plug_notify_t - local plug change callback
+ * @space: the plug space
+ * @plug: the plug number, or -1 for the master plug register
+ * @old_value: the register before the change
+ * @new_value: the register after the change
+ * @callback_data: the opaque pointer given to iec61883_plug_space_set_notify()
+ *
+ * This is called from the event loop of the space's handle, after the
+ * response to the lock was sent. For example, a transmitter may start its
+ * stream when n_p2p_connections of its oPCR becomes non-zero.
+ */
+typedef void
+(*iec61883_plug_notify_t)(iec61883_plug_space_t space, int plug,
+	quadlet_t old_value, quadlet_t new_value, void *callback_data);
+
+/**
+ * iec61883_plug_space_set_notify - get told when remote nodes change plugs
+ * @space: the plug space
+ * @notify: called for each lock by a remote node that changed a register,
+ * or NULL to stop notifications
+ * @callback_data: opaque data passed to @notify
+ **/
+void
+iec61883_plug_space_set_notify (iec61883_plug_space_t space,
+	iec61883_plug_notify_t notify, void *callback_data);
+
+struct iec61883_plug_event {
+	int plug;              /* plug number, or -1 for the master plug register */
+	nodeid_t source;       /* the node that locked the register */
+	quadlet_t old_value;
+	quadlet_t new_value;
+};
+
+/**
+ * iec61883_plug_space_get_event_fd - get a descriptor to wait for plug changes
+ * @space: the plug space
+ *
+ * From the first call on, changes made by remote nodes are also queued
+ * for iec61883_plug_space_read_event(), and the returned eventfd becomes
+ * readable while any are queued. This lets a thread other than the one
+ * running the handle's event loop wait for them. Up to 64 changes are
+ * queued; later ones are counted by iec61883_plug_space_get_events_lost().
+ *
+ * Returns:
+ * a file descriptor to poll, owned by @space, or -1 (errno) on failure
+ **/
+int
+iec61883_plug_space_get_event_fd (iec61883_plug_space_t space);
+
+/**
+ * iec61883_plug_space_read_event - get the next queued plug change
+ * @space: the plug space
+ * @event: receives the change
+ *
+ * Only one thread may read events of a space at a time.
+ *
+ * Returns:
+ * 1 if an event was read, 0 if there was none, or -1 (errno) on failure
+ **/
+int
+iec61883_plug_space_read_event (iec61883_plug_space_t space,
+	struct iec61883_plug_event *event);
+
+/**
+ * iec61883_plug_space_get_events_lost - get the number of changes not queued
+ * @space: the plug space
+ **/
+unsigned int
+iec61883_plug_space_get_events_lost (iec61883_plug_space_t space);
+
+
+/*******************************************************************************
+ * Multichannel receive
+ *
+ * Every stream started with its recv_start function takes an isochronous
+ * receive context of the controller, of which there are only a few. A
+ * multichannel receiver takes one context for any number of channels and
+ * passes each packet to the AMDTP, DV or MPEG-2 stream added for its
+ * channel, which then calls its callback as if it had been started itself.
+ * The streams must not also be started; only their callbacks and state are
+ * used. A stream whose callback fails is ignored from then on, while the
+ * other channels keep going. Like the streams, the receiver is serviced by
+ * raw1394_loop_iterate() on its handle.
+ **/
+
+typedef struct iec61883_mcrecv *iec61883_mcrecv_t;
+
+/**
+ * iec61883_mcrecv_init - create a multichannel receiver
+ * @handle: a raw1394 handle; its isochronous context is used when started
+ *
+ * Returns:
+ * the receiver or NULL (errno) on failure
+ **/
+iec61883_mcrecv_t
+iec61883_mcrecv_init (raw1394handle_t handle);
+
+/**
+ * iec61883_mcrecv_add_amdtp - receive a channel into a stream
+ * @mc: the receiver
+ * @amdtp: a stream created for receiving
+ * @channel: the isochronous channel, 0 to 63
+ *
+ * This can be done before or after the receiver is started. The same
+ * exists for the other stream types.
+ *
+ * Returns:
+ * 0 on success or -1 (errno), EBUSY if the channel already has a stream
+ **/
+int
+iec61883_mcrecv_add_amdtp (iec61883_mcrecv_t mc, iec61883_amdtp_t amdtp, int channel);
+
+int
+iec61883_mcrecv_add_dv (iec61883_mcrecv_t mc, iec61883_dv_t dv, int channel);
+
+int
+iec61883_mcrecv_add_dv_fb (iec61883_mcrecv_t mc, iec61883_dv_fb_t fb, int channel);
+
+int
+iec61883_mcrecv_add_mpeg2 (iec61883_mcrecv_t mc, iec61883_mpeg2_t mpeg2, int channel);
+
+/**
+ * iec61883_mcrecv_remove - stop receiving a channel
+ * @mc: the receiver
+ * @channel: the channel
+ *
+ * Returns:
+ * 0 on success or -1 (errno) if the channel has no stream
+ **/
+int
+iec61883_mcrecv_remove (iec61883_mcrecv_t mc, int channel);
+
+/**
+ * iec61883_mcrecv_get_failed - tell if the stream of a channel failed
+ * @mc: the receiver
+ * @channel: the channel
+ *
+ * Returns:
+ * 1 if the callback of the stream failed and its packets are ignored, 0
+ * if not, or -1 (errno) if the channel has no stream. Removing and adding
+ * the stream again resumes it.
+ **/
+int
+iec61883_mcrecv_get_failed (iec61883_mcrecv_t mc, int channel);
+
+/**
+ * iec61883_mcrecv_get_dropped - get the total packets dropped
+ * @mc: the receiver
+ *
+ * Drops are counted for the whole context since it was started; each
+ * stream also counts those reported to it.
+ **/
+unsigned int
+iec61883_mcrecv_get_dropped (iec61883_mcrecv_t mc);
+
+/**
+ * iec61883_mcrecv_set_buffers - set the size of the receive buffer
+ * @mc: the receiver
+ * @packets: the number of packets, shared by all channels
+ *
+ * Applies the next time the receiver is started.
+ **/
+void
+iec61883_mcrecv_set_buffers (iec61883_mcrecv_t mc, unsigned int packets);
+
+/**
+ * iec61883_mcrecv_set_irq_interval - set the interrupt interval
+ * @mc: the receiver
+ * @packets: the maximum packets between interrupts
+ *
+ * Applies the next time the receiver is started.
+ **/
+void
+iec61883_mcrecv_set_irq_interval (iec61883_mcrecv_t mc, unsigned int packets);
+
+/**
+ * iec61883_mcrecv_start - start receiving
+ * @mc: the receiver
+ *
+ * Returns:
+ * 0 on success or -1 (errno), EBUSY if the handle already has a stream
+ **/
+int
+iec61883_mcrecv_start (iec61883_mcrecv_t mc);
+
+/**
+ * iec61883_mcrecv_stop - stop receiving
+ * @mc: the receiver
+ **/
+void
+iec61883_mcrecv_stop (iec61883_mcrecv_t mc);
+
+/**
+ * iec61883_mcrecv_close - stop and destroy a multichannel receiver
+ * @mc: the receiver; the streams are left alone
+ **/
+void
+iec61883_mcrecv_close (iec61883_mcrecv_t mc);
+
+
+/*******************************************************************************
+ * Streaming thread
+ *
+ * A runner services a raw1394 handle from a dedicated thread, in place of
+ * a poll() and raw1394_loop_iterate() loop in the application. All
+ * callbacks of the streams and plugs on the handle then run on that
+ * thread.
+ **/
+
+struct iec61883_runner_options {
+	int priority;       /* SCHED_FIFO priority, or 0 for the default policy */
+	int cpu;            /* the CPU to run on, or -1 for any */
+	int lock_memory;    /* mlockall() the whole process on start */
+};
+
+typedef struct iec61883_runner *iec61883_runner_t;
+
+/**
+ * iec61883_runner_wakeup_t - runner wakeup callback
+ * @runner: the runner
+ * @callback_data: the opaque pointer given to iec61883_runner_init()
+ *
+ * Called on the runner's thread after iec61883_runner_wakeup(); several
+ * wakeups before it runs result in one call.
+ */
+typedef void
+(*iec61883_runner_wakeup_t)(iec61883_runner_t runner, void *callback_data);
+
+/**
+ * iec61883_runner_init - create a streaming thread for a handle
+ * @handle: the raw1394 handle to service
+ * @options: scheduling options, or NULL for the defaults of the process
+ * @wakeup: called on iec61883_runner_wakeup(), may be NULL
+ * @callback_data: opaque data passed to @wakeup
+ *
+ * The thread is not started yet.
+ *
+ * Returns:
+ * a runner or NULL (errno) on failure
+ **/
+iec61883_runner_t
+iec61883_runner_init (raw1394handle_t handle,
+	const struct iec61883_runner_options *options,
+	iec61883_runner_wakeup_t wakeup, void *callback_data);
+
+/**
+ * iec61883_runner_start - start the thread
+ * @runner: the runner
+ *
+ * A real-time priority usually needs CAP_SYS_NICE or an RLIMIT_RTPRIO,
+ * and locking memory CAP_IPC_LOCK or an RLIMIT_MEMLOCK.
+ *
+ * Returns:
+ * 0 on success or -1 (errno), for example EPERM if the scheduling options
+ * are not allowed, or EBUSY if it is running
+ **/
+int
+iec61883_runner_start (iec61883_runner_t runner);
+
+/**
+ * iec61883_runner_stop - stop the thread
+ * @runner: the runner
+ *
+ * From another thread this waits for the thread to end. From a callback
+ * on the runner's own thread it only asks the thread to end once the
+ * callback returns.
+ *
+ * Returns:
+ * 0 if the thread ran until asked to stop, or -1 with errno set to why it
+ * ended early, for example because raw1394_loop_iterate() failed
+ **/
+int
+iec61883_runner_stop (iec61883_runner_t runner);
+
+/**
+ * iec61883_runner_is_active - check whether the thread is servicing the handle
+ * @runner: the runner
+ *
+ * Returns:
+ * 1 if it is, 0 if it was not started, was stopped or ended on an error
+ **/
+int
+iec61883_runner_is_active (iec61883_runner_t runner);
+
+/**
+ * iec61883_runner_wakeup - run the wakeup callback on the runner's thread
+ * @runner: the runner
+ *
+ * This may be called from any thread, and from signal handlers.
+ *
+ * Returns:
+ * 0 on success or -1 (errno)
+ **/
+int
+iec61883_runner_wakeup (iec61883_runner_t runner);
+
+/**
+ * iec61883_runner_close - stop the thread if needed and destroy the runner
+ * @runner: the runner
+ *
+ * This must not be called from a callback on the runner's own thread,
+ * which cannot wait for itself; call iec61883_runner_stop() there and
+ * close the runner from another thread.
+ *
+ * Returns:
+ * 0 on success or -1 with errno EDEADLK, leaving the runner alone, when
+ * called from the runner's thread
+ **/
+int
+iec61883_runner_close (iec61883_runner_t runner);
+
+
+/*******************************************************************************
+ * Event loop for many handles
+ *
+ * Each stream needs a handle of its own. An event loop services many of
+ * them from one thread and one epoll set: each handle that is ready gets
+ * one raw1394_loop_iterate() per wakeup, in an order that rotates between
+ * wakeups. Handles must only be added and removed on the loop's thread,
+ * or while it is not running; callbacks on that thread may do both.
+ **/
+
+#define IEC61883_LOOP_MAX 64
+
+struct iec61883_loop_stats {
+	unsigned long iterations;
+	unsigned long long wait_total;     /* microseconds from wakeup to service */
+	unsigned int wait_max;
+	unsigned long long service_total;  /* microseconds in raw1394_loop_iterate() */
+	unsigned int service_max;
+	int error;                         /* errno if servicing failed, after which
+	                                      the handle is no longer polled */
+};
+
+typedef struct iec61883_loop *iec61883_loop_t;
+
+/**
+ * iec61883_loop_init - create an event loop
+ *
+ * Returns:
+ * the loop or NULL (errno) on failure
+ **/
+iec61883_loop_t
+iec61883_loop_init (void);
+
+/**
+ * iec61883_loop_add - service a handle
+ * @loop: the loop
+ * @handle: a raw1394 handle
+ *
+ * Returns:
+ * an id for the handle, or -1 (errno), ENOSPC if IEC61883_LOOP_MAX handles
+ * are registered
+ **/
+int
+iec61883_loop_add (iec61883_loop_t loop, raw1394handle_t handle);
+
+/**
+ * iec61883_loop_add_amdtp - service the handle of a stream
+ * @loop: the loop
+ * @amdtp: the stream
+ *
+ * The same exists for the other stream types.
+ *
+ * Returns:
+ * as iec61883_loop_add()
+ **/
+int
+iec61883_loop_add_amdtp (iec61883_loop_t loop, iec61883_amdtp_t amdtp);
+
+int
+iec61883_loop_add_dv (iec61883_loop_t loop, iec61883_dv_t dv);
+
+int
+iec61883_loop_add_dv_fb (iec61883_loop_t loop, iec61883_dv_fb_t fb);
+
+int
+iec61883_loop_add_mpeg2 (iec61883_loop_t loop, iec61883_mpeg2_t mpeg2);
+
+/**
+ * iec61883_loop_remove - stop servicing a handle
+ * @loop: the loop
+ * @id: as returned when the handle was added
+ *
+ * Returns:
+ * 0 on success or -1 (errno) if @id is not registered
+ **/
+int
+iec61883_loop_remove (iec61883_loop_t loop, int id);
+
+/**
+ * iec61883_loop_iterate - wait for and service ready handles once
+ * @loop: the loop
+ * @timeout: milliseconds to wait, or -1 to wait until a handle is ready
+ *
+ * Returns:
+ * the number of handles serviced, or -1 (errno) on failure
+ **/
+int
+iec61883_loop_iterate (iec61883_loop_t loop, int timeout);
+
+/**
+ * iec61883_loop_run - service handles until stopped
+ * @loop: the loop
+ *
+ * Returns:
+ * 0 after iec61883_loop_stop(), or -1 (errno) on failure
+ **/
+int
+iec61883_loop_run (iec61883_loop_t loop);
+
+/**
+ * iec61883_loop_stop - make iec61883_loop_run() return
+ * @loop: the loop
+ *
+ * This may be called from any thread, and from signal handlers.
+ **/
+int
+iec61883_loop_stop (iec61883_loop_t loop);
+
+/**
+ * iec61883_loop_get_stats - get the latency of servicing a handle
+ * @loop: the loop
+ * @id: as returned when the handle was added
+ * @stats: receives the statistics
+ * @reset: if non-zero, the statistics restart from zero after this
+ *
+ * This may be called from any thread while the loop runs.
+ *
+ * Returns:
+ * 0 on success or -1 (errno) if @id is not registered
+ **/
+int
+iec61883_loop_get_stats (iec61883_loop_t loop, int id, struct iec61883_loop_stats *stats,
+	int reset);
+
+/**
+ * iec61883_loop_close - destroy an event loop
+ * @loop: the loop; the handles are left alone
+ **/
+void
+iec61883_loop_close (iec61883_loop_t loop);
+
+
+/*******************************************************************************
+ * Bus scanner
+ *
+ * The scanner takes snapshots of the nodes on all ports: their GUIDs,
+ * unit directories and plug registers. Ports are scanned concurrently,
+ * and configuration ROMs are only read again from nodes that are new or
+ * whose ROM changed since the previous scan, so repeated scans mostly
+ * cost the plug register reads.
+ **/
+
+#define IEC61883_SCAN_MAX_UNITS 4
+
+struct iec61883_unit_info {
+	unsigned int spec_id;       /* unit_spec_id, 0x00a02d for AV/C */
+	unsigned int sw_version;
+};
+
+struct iec61883_node_info {
+	int port;
+	nodeid_t node;
+	octlet_t guid;
+	int error;                  /* 0, or errno of a failed read */
+	int rom_read;               /* 1 if the ROM was read rather than cached */
+	unsigned int vendor_id;
+	int n_units;
+	struct iec61883_unit_info units[IEC61883_SCAN_MAX_UNITS];
+	/* oMPR or iMPR, then PCR[0] to PCR[30], in host byte order;
+	   n_plugs is 0 for a node without plugs */
+	quadlet_t outputs[32];
+	quadlet_t inputs[32];
+};
+
+struct iec61883_port_info {
+	int port;
+	unsigned int generation;
+	nodeid_t local_id;
+	int n_nodes;
+	int error;                  /* 0, or errno if the port could not be scanned */
+};
+
+struct iec61883_topology {
+	int n_ports;
+	struct iec61883_port_info *ports;
+	int n_nodes;
+	struct iec61883_node_info *nodes;   /* ordered by port, then node */
+};
+
+typedef struct iec61883_scanner *iec61883_scanner_t;
+
+/**
+ * iec61883_scanner_init - create a bus scanner
+ *
+ * The ports present now are scanned; each gets its own raw1394 handle.
+ *
+ * Returns:
+ * a scanner or NULL (errno) on failure
+ **/
+iec61883_scanner_t
+iec61883_scanner_init (void);
+
+/**
+ * iec61883_scanner_scan - take a snapshot of all ports
+ * @scanner: the scanner
+ *
+ * Only one thread may scan with a scanner at a time. Nodes that could not
+ * be read are included with their error set.
+ *
+ * Returns:
+ * the topology, to free with iec61883_topology_free(), or NULL (errno)
+ **/
+struct iec61883_topology *
+iec61883_scanner_scan (iec61883_scanner_t scanner);
+
+/**
+ * iec61883_topology_free - free a snapshot
+ * @topology: as returned by iec61883_scanner_scan()
+ **/
+void
+iec61883_topology_free (struct iec61883_topology *topology);
+
+/**
+ * iec61883_scanner_close - destroy a bus scanner
+ * @scanner: the scanner
+ **/
+void
+iec61883_scanner_close (iec61883_scanner_t scanner);
+
+
+/*******************************************************************************
+ * Handle state
+ **/
+
+/**
+ * iec61883_handle_init - start the library state for a handle
+ * @handle: a raw1394 handle, normally just created
+ *
+ * The library can keep some state per raw1394 handle: cached plug register
+ * values of remote nodes, a retry policy, transaction counters and the
+ * connection registry. Without this call there is none; plug registers are
+ * read on every access and the default retry policy applies. Any state
+ * left by a destroyed handle that had the same address is discarded.
+ *
+ * Returns:
+ * 0 on success or -1 on failure (errno)
+ **/
+int
+iec61883_handle_init (raw1394handle_t handle);
+
+/**
+ * iec61883_handle_release - free the library state kept for a handle
+ * @handle: a raw1394 handle previously used with this library
+ *
+ * The state of iec61883_handle_init() lives until this is called, also
+ * when the handle is destroyed, so call it before raw1394_destroy_handle()
+ * on every handle given to iec61883_handle_init().
+ **/
+void
+iec61883_handle_release (raw1394handle_t handle);
+
+/**
+ * Transaction retry policy
+ *
+ * Asynchronous transactions made by the library (plug and IRM register
+ * access) are retried when the target acknowledges busy, and optionally
+ * when it does not respond in time. Delays grow exponentially from
+ * @initial_delay to @max_delay, each randomly shortened by up to half so
+ * that nodes retrying the same target do not stay in step.
+ */
+struct iec61883_retry_policy {
+	unsigned int max_tries;      /* attempts on busy, 0 for no limit */
+	unsigned int timeout_tries;  /* attempts on timeout, >= 1 */
+	unsigned int initial_delay;  /* microseconds before the first retry, >= 1 */
+	unsigned int max_delay;      /* microseconds, >= initial_delay */
+	unsigned int deadline;       /* microseconds per transaction, 0 for none */
+};
+
+struct iec61883_transaction_stats {
+	unsigned long transactions;
+	unsigned long failures;
+	unsigned long busy_retries;
+	unsigned long timeout_retries;
+	unsigned long deadline_expired;
+	unsigned long long latency_total;  /* microseconds, including retries */
+	unsigned int latency_max;
+	unsigned int latency_last;
+};
+
+/**
+ * iec61883_set_retry_policy - set how transactions on a handle are retried
+ * @handle: a raw1394 handle
+ * @policy: the new policy, or NULL to restore the default of 20 busy
+ * attempts, 2 timeout attempts, 20 to 2000 microsecond delays and a
+ * 100 millisecond deadline.
+ *
+ * Lock transactions are never repeated after a timeout, as the lock may
+ * have been performed.
+ *
+ * The policy is part of the state of iec61883_handle_init(), which must
+ * be called on @handle first.
+ *
+ * Returns:
+ * 0 on success or -1 on failure (errno is EINVAL for an invalid policy,
+ * ENOENT without that state)
+ **/
+int
+iec61883_set_retry_policy (raw1394handle_t handle,
+	const struct iec61883_retry_policy *policy);
+
+/**
+ * iec61883_get_retry_policy - get the retry policy of a handle
+ * @handle: a raw1394 handle
+ * @policy: receives the policy
+ **/
+void
+iec61883_get_retry_policy (raw1394handle_t handle,
+	struct iec61883_retry_policy *policy);
+
+/**
+ * iec61883_get_transaction_stats - get the transaction counters of a handle
+ * @handle: a raw1394 handle
+ * @stats: receives the counters
+ * @reset: if non-zero, the counters are cleared
+ *
+ * Can be called from any thread. Transactions are only counted on a handle
+ * given to iec61883_handle_init(); the counters are zero otherwise.
+ **/
+void
+iec61883_get_transaction_stats (raw1394handle_t handle,
+	struct iec61883_transaction_stats *stats, int reset);
+
+
+/*******************************************************************************
+ * Logging
+ *
+ * The warnings and errors of the library are queued without blocking, also
+ * from inside iso handlers, and passed to a sink outside of them: by
+ * default a thread, started when the first stream or handle is set up by
+ * the library, writes them to stderr every 100 ms. Each place in the library that logs passes at most ten
+ * messages a second and counts the rest.
+ **/
+
+enum iec61883_log_level {
+	IEC61883_LOG_ERROR,
+	IEC61883_LOG_WARNING,
+	IEC61883_LOG_DEBUG
+};
+
+/**
+ * iec61883_log_sink_t - log sink callback
+ * @level: an enum iec61883_log_level
+ * @message: the message, without the library prefix or a newline
+ * @callback_data: the opaque pointer given to iec61883_log_set_sink()
+ *
+ * Calls never overlap. The sink must not call iec61883_log_drain() or
+ * iec61883_log_set_thread().
+ */
+typedef void
+(*iec61883_log_sink_t)(int level, const char *message, void *callback_data);
+
+/**
+ * iec61883_log_set_sink - set where the messages of the library go
+ * @sink: the callback, or NULL for stderr
+ * @callback_data: passed to @sink
+ **/
+void
+iec61883_log_set_sink (iec61883_log_sink_t sink, void *callback_data);
+
+/**
+ * iec61883_log_set_thread - drain the log from a thread of the library
+ * @enable: non-zero to start the thread now, 0 to stop it
+ *
+ * Stop it to drain the log from a thread of the application with
+ * iec61883_log_drain() instead. Messages still queued when the process
+ * exits are delivered then.
+ *
+ * Returns:
+ * 0 for success or -1 with errno set if the thread cannot be started
+ **/
+int
+iec61883_log_set_thread (int enable);
+
+/**
+ * iec61883_log_drain - deliver the queued messages to the sink now
+ *
+ * Runs the sink on the calling thread. If the queue overflowed, a message
+ * with the number of messages lost follows.
+ *
+ * Returns:
+ * the number of messages delivered
+ **/
+int
+iec61883_log_drain (void);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,332 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Logging
+ *
+ * WARN, FAIL and DEBUG run inside iso handlers, so they only format the
+ * message into a bounded queue that any thread may add to without a lock;
+ * a message that finds the queue full is counted and dropped. The queue is
+ * drained into the sink by a thread that the first stream or handle set up
+ * by the library starts, never a handler, or by the application. Each place
+ * that logs passes at most LOG_BURST messages a second; the rest are counted
+ * and the count is added to the next message that passes.
+ *
+ * A child forked by a process with the thread has no thread; it starts its
+ * own with its first stream or handle.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "iec61883.h"
+#include "iec61883-private.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_SLOTS 128            /* a power of two */
+#define LOG_BURST 10
+#define LOG_DRAIN_INTERVAL 100   /* milliseconds */
+
+/* a slot is free for position pos when turn is pos - index, and holds the
+   message of pos when turn is pos - index + 1, so all zeros is empty */
+struct log_slot {
+	volatile unsigned int turn;
+	int level;
+	char text[IEC61883_LOG_MAX];
+};
+
+static struct log_slot g_slots[LOG_SLOTS];
+static volatile unsigned int g_enqueue_pos = 0;
+static unsigned int g_dequeue_pos = 0;
+static volatile unsigned int g_lost = 0;
+
+/* held while draining, so sink calls never overlap */
+static pthread_mutex_t g_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static iec61883_log_sink_t g_sink = NULL;
+static void *g_sink_data = NULL;
+
+static pthread_mutex_t g_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_thread_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t g_thread;
+static volatile int g_threaded = 1;
+static volatile int g_running = 0;
+static int g_stop = 0;
+static pthread_once_t g_start_once = PTHREAD_ONCE_INIT;
+
+static const char *
+log_level_name (int level)
+{
+	switch (level) {
+	case IEC61883_LOG_ERROR:
+		return "error";
+	case IEC61883_LOG_WARNING:
+		return "warning";
+	default:
+		return "debug";
+	}
+}
+
+static void
+log_deliver (int level, const char *message)
+{
+	if (g_sink)
+		g_sink (level, message, g_sink_data);
+	else
+		fprintf (stderr, "libiec61883 %s: %s\n", log_level_name (level), message);
+}
+
+int
+iec61883_log_drain (void)
+{
+	struct log_slot *slot;
+	unsigned int lost, index;
+	char text[64];
+	int n = 0;
+
+	pthread_mutex_lock (&g_drain_lock);
+	for (;;) {
+		index = g_dequeue_pos & (LOG_SLOTS - 1);
+		slot = &g_slots[index];
+		if (slot->turn != g_dequeue_pos - index + 1)
+			break;
+		__sync_synchronize ();
+		log_deliver (slot->level, slot->text);
+		__sync_synchronize ();
+		slot->turn = g_dequeue_pos - index + LOG_SLOTS;
+		g_dequeue_pos++;
+		n++;
+	}
+	lost = __sync_lock_test_and_set (&g_lost, 0);
+	if (lost > 0) {
+		snprintf (text, sizeof (text), "%u messages lost, the log queue was full", lost);
+		log_deliver (IEC61883_LOG_WARNING, text);
+		n++;
+	}
+	pthread_mutex_unlock (&g_drain_lock);
+
+	return n;
+}
+
+static void *
+log_thread (void *arg)
+{
+	struct timespec deadline;
+
+	pthread_mutex_lock (&g_thread_lock);
+	while (!g_stop) {
+		pthread_mutex_unlock (&g_thread_lock);
+		iec61883_log_drain ();
+		pthread_mutex_lock (&g_thread_lock);
+		clock_gettime (CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += LOG_DRAIN_INTERVAL * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		if (!g_stop)
+			pthread_cond_timedwait (&g_thread_cond, &g_thread_lock, &deadline);
+	}
+	pthread_mutex_unlock (&g_thread_lock);
+	iec61883_log_drain ();
+
+	return NULL;
+}
+
+/* with g_thread_lock held */
+static int
+log_thread_start (void)
+{
+	pthread_attr_t attr;
+	struct sched_param param;
+	int err;
+
+	if (g_running)
+		return 0;
+	g_stop = 0;
+	// the caller may be a real-time thread; do not inherit its policy
+	memset (&param, 0, sizeof (param));
+	pthread_attr_init (&attr);
+	pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy (&attr, SCHED_OTHER);
+	pthread_attr_setschedparam (&attr, &param);
+	err = pthread_create (&g_thread, &attr, log_thread, NULL);
+	pthread_attr_destroy (&attr);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	g_running = 1;
+	return 0;
+}
+
+/* with g_thread_lock held */
+static void
+log_thread_stop (void)
+{
+	if (!g_running)
+		return;
+	g_stop = 1;
+	pthread_cond_signal (&g_thread_cond);
+	pthread_mutex_unlock (&g_thread_lock);
+	pthread_join (g_thread, NULL);
+	pthread_mutex_lock (&g_thread_lock);
+	g_running = 0;
+}
+
+static void
+log_start_once (void)
+{
+	pthread_mutex_lock (&g_thread_lock);
+	// if there can be no thread, leave the queue to iec61883_log_drain()
+	if (g_threaded && log_thread_start () < 0)
+		g_threaded = 0;
+	pthread_mutex_unlock (&g_thread_lock);
+}
+
+void
+iec61883_log_start (void)
+{
+	pthread_once (&g_start_once, log_start_once);
+}
+
+int
+iec61883_log_set_thread (int enable)
+{
+	int result = 0;
+
+	pthread_mutex_lock (&g_thread_lock);
+	g_threaded = enable;
+	if (enable)
+		result = log_thread_start ();
+	else
+		log_thread_stop ();
+	pthread_mutex_unlock (&g_thread_lock);
+
+	return result;
+}
+
+void
+iec61883_log_set_sink (iec61883_log_sink_t sink, void *callback_data)
+{
+	pthread_mutex_lock (&g_drain_lock);
+	g_sink = sink;
+	g_sink_data = callback_data;
+	pthread_mutex_unlock (&g_drain_lock);
+}
+
+void
+iec61883_log_message (struct iec61883_log_site *site, int level, const char *format, ...)
+{
+	unsigned int second = iec61883_now_us () / 1000000;
+	unsigned int pos, index, turn, suppressed = 0;
+	struct log_slot *slot;
+	va_list ap;
+	int len;
+
+	if (site->second != second) {
+		site->second = second;
+		site->count = 0;
+		suppressed = __sync_lock_test_and_set (&site->suppressed, 0);
+	}
+	if (__sync_add_and_fetch (&site->count, 1) > LOG_BURST) {
+		__sync_add_and_fetch (&site->suppressed, 1);
+		return;
+	}
+
+	pos = g_enqueue_pos;
+	for (;;) {
+		index = pos & (LOG_SLOTS - 1);
+		slot = &g_slots[index];
+		turn = slot->turn;
+		if (turn == pos - index) {
+			if (__sync_bool_compare_and_swap (&g_enqueue_pos, pos, pos + 1))
+				break;
+			pos = g_enqueue_pos;
+		} else if ((int) (turn - (pos - index)) < 0) {
+			__sync_add_and_fetch (&g_lost, 1 + suppressed);
+			return;
+		} else {
+			pos = g_enqueue_pos;
+		}
+	}
+
+	va_start (ap, format);
+	len = vsnprintf (slot->text, IEC61883_LOG_MAX, format, ap);
+	va_end (ap);
+	if (suppressed > 0 && len >= 0 && len < IEC61883_LOG_MAX)
+		snprintf (slot->text + len, IEC61883_LOG_MAX - len,
+			" (%u similar messages suppressed)", suppressed);
+	slot->level = level;
+	__sync_synchronize ();
+	slot->turn = pos - index + 1;
+}
+
+/* the locks are taken across fork() so the child gets them in a known state */
+static void
+log_atfork_prepare (void)
+{
+	pthread_mutex_lock (&g_thread_lock);
+	pthread_mutex_lock (&g_drain_lock);
+}
+
+static void
+log_atfork_parent (void)
+{
+	pthread_mutex_unlock (&g_drain_lock);
+	pthread_mutex_unlock (&g_thread_lock);
+}
+
+/* only the forking thread exists in the child: the log thread is not there
+   to join, and the next stream or handle starts a new one */
+static void
+log_atfork_child (void)
+{
+	static const pthread_once_t once_init = PTHREAD_ONCE_INIT;
+
+	g_running = 0;
+	g_stop = 0;
+	g_start_once = once_init;
+	pthread_cond_init (&g_thread_cond, NULL);
+	pthread_mutex_unlock (&g_drain_lock);
+	pthread_mutex_unlock (&g_thread_lock);
+}
+
+static void __attribute__ ((constructor))
+log_init (void)
+{
+	pthread_atfork (log_atfork_prepare, log_atfork_parent, log_atfork_child);
+}
+
+/* what is still queued when the process exits or the library is unloaded */
+static void __attribute__ ((destructor))
+log_exit (void)
+{
+	pthread_mutex_lock (&g_thread_lock);
+	log_thread_stop ();
+	pthread_mutex_unlock (&g_thread_lock);
+	iec61883_log_drain ();
+}
@@ -0,0 +1,294 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Multichannel receive
+ *
+ * A controller has only a few isochronous receive contexts, and each
+ * stream started on its own handle takes one. Here a single context
+ * receives any number of channels and every packet is handed, by its
+ * channel, to the depacketizer of the stream added for that channel.
+ * The streams are only used for their callbacks and state; their own
+ * handles are not touched.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "iec61883.h"
+#include "iec61883-private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+/* the largest payload plus the CIP header, for all stream types */
+#define MCRECV_MAX_PACKET_SIZE (2048 + 8)
+
+enum mcrecv_type {
+	MCRECV_NONE = 0,
+	MCRECV_AMDTP,
+	MCRECV_DV,
+	MCRECV_MPEG2,
+};
+
+struct mcrecv_channel {
+	enum mcrecv_type type;
+	void *stream;
+	int failed;                 // the callback failed, packets are ignored
+};
+
+struct iec61883_mcrecv {
+	raw1394handle_t handle;
+	unsigned int buffer_packets;
+	unsigned int irq_interval;
+	int running;
+	unsigned int total_dropped;
+	struct mcrecv_channel channels[64];
+};
+
+iec61883_mcrecv_t
+iec61883_mcrecv_init (raw1394handle_t handle)
+{
+	struct iec61883_mcrecv *mc;
+
+	assert (handle != NULL);
+	iec61883_log_start ();
+	mc = calloc (1, sizeof (struct iec61883_mcrecv));
+	if (!mc) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	mc->handle = handle;
+	mc->buffer_packets = 1000;
+	mc->irq_interval = 250;
+	return mc;
+}
+
+static enum raw1394_iso_disposition
+mcrecv_handler (raw1394handle_t handle,
+		unsigned char *data,
+		unsigned int len,
+		unsigned char channel,
+		unsigned char tag,
+		unsigned char sy,
+		unsigned int cycle,
+		unsigned int dropped)
+{
+	struct iec61883_mcrecv *mc = iec61883_dispatch_get (handle);
+	enum raw1394_iso_disposition result = RAW1394_ISO_OK;
+	struct mcrecv_channel *ch;
+
+	assert (mc != NULL);
+	mc->total_dropped += dropped;
+	ch = &mc->channels[channel & 63];
+	if (ch->stream == NULL || ch->failed)
+		return dropped ? RAW1394_ISO_DEFER : RAW1394_ISO_OK;
+
+	switch (ch->type) {
+	case MCRECV_AMDTP:
+		result = iec61883_amdtp_recv_packet (ch->stream, data, len, channel,
+			tag, sy, cycle, dropped);
+		break;
+	case MCRECV_DV:
+		result = iec61883_dv_recv_packet (ch->stream, data, len, channel,
+			tag, sy, cycle, dropped);
+		break;
+	case MCRECV_MPEG2:
+		result = iec61883_mpeg2_recv_packet (ch->stream, data, len, channel,
+			tag, sy, cycle, dropped);
+		break;
+	default:
+		break;
+	}
+
+	// a failing stream must not stop the others on the context
+	if (result == RAW1394_ISO_ERROR) {
+		WARN ("Stream on channel %d failed, ignoring its packets", channel);
+		ch->failed = 1;
+		result = dropped ? RAW1394_ISO_DEFER : RAW1394_ISO_OK;
+	}
+	return result;
+}
+
+static int
+mcrecv_add (struct iec61883_mcrecv *mc, enum mcrecv_type type, void *stream, int channel)
+{
+	struct mcrecv_channel *ch;
+
+	assert (mc != NULL);
+	assert (stream != NULL);
+	if (channel < 0 || channel > 63) {
+		errno = EINVAL;
+		return -1;
+	}
+	ch = &mc->channels[channel];
+	if (ch->stream != NULL) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (mc->running && raw1394_iso_recv_listen_channel (mc->handle, channel) < 0)
+		return -1;
+	ch->type = type;
+	ch->failed = 0;
+	ch->stream = stream;
+	return 0;
+}
+
+int
+iec61883_mcrecv_add_amdtp (iec61883_mcrecv_t mc, iec61883_amdtp_t amdtp, int channel)
+{
+	assert (amdtp != NULL);
+	amdtp->total_dropped = 0;
+	amdtp->channel = channel;
+	amdtp->dimension = -1;	/* filled in from the first packet, as for recv_start */
+	return mcrecv_add (mc, MCRECV_AMDTP, amdtp, channel);
+}
+
+int
+iec61883_mcrecv_add_dv (iec61883_mcrecv_t mc, iec61883_dv_t dv, int channel)
+{
+	assert (dv != NULL);
+	dv->total_dropped = 0;
+	dv->channel = channel;
+	return mcrecv_add (mc, MCRECV_DV, dv, channel);
+}
+
+int
+iec61883_mcrecv_add_dv_fb (iec61883_mcrecv_t mc, iec61883_dv_fb_t fb, int channel)
+{
+	assert (fb != NULL);
+	return iec61883_mcrecv_add_dv (mc, fb->dv, channel);
+}
+
+int
+iec61883_mcrecv_add_mpeg2 (iec61883_mcrecv_t mc, iec61883_mpeg2_t mpeg2, int channel)
+{
+	assert (mpeg2 != NULL);
+	mpeg2->total_dropped = 0;
+	mpeg2->channel = channel;
+	return mcrecv_add (mc, MCRECV_MPEG2, mpeg2, channel);
+}
+
+int
+iec61883_mcrecv_remove (iec61883_mcrecv_t mc, int channel)
+{
+	assert (mc != NULL);
+	if (channel < 0 || channel > 63 || mc->channels[channel].stream == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (mc->running)
+		raw1394_iso_recv_unlisten_channel (mc->handle, channel);
+	memset (&mc->channels[channel], 0, sizeof (struct mcrecv_channel));
+	return 0;
+}
+
+int
+iec61883_mcrecv_get_failed (iec61883_mcrecv_t mc, int channel)
+{
+	assert (mc != NULL);
+	if (channel < 0 || channel > 63 || mc->channels[channel].stream == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	return mc->channels[channel].failed;
+}
+
+unsigned int
+iec61883_mcrecv_get_dropped (iec61883_mcrecv_t mc)
+{
+	assert (mc != NULL);
+	return mc->total_dropped;
+}
+
+void
+iec61883_mcrecv_set_buffers (iec61883_mcrecv_t mc, unsigned int packets)
+{
+	assert (mc != NULL);
+	mc->buffer_packets = packets;
+}
+
+void
+iec61883_mcrecv_set_irq_interval (iec61883_mcrecv_t mc, unsigned int packets)
+{
+	assert (mc != NULL);
+	mc->irq_interval = packets;
+}
+
+int
+iec61883_mcrecv_start (iec61883_mcrecv_t mc)
+{
+	int channel, result;
+
+	assert (mc != NULL);
+	if (mc->running) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (iec61883_dispatch_attach (mc->handle, mc) < 0)
+		return -1;
+	result = raw1394_iso_multichannel_recv_init (mc->handle,
+		mcrecv_handler,
+		mc->buffer_packets,
+		MCRECV_MAX_PACKET_SIZE,
+		mc->irq_interval);
+	if (result != 0) {
+		iec61883_dispatch_detach (mc->handle, mc);
+		return -1;
+	}
+
+	for (channel = 0; result == 0 && channel < 64; channel++)
+		if (mc->channels[channel].stream != NULL)
+			result = raw1394_iso_recv_listen_channel (mc->handle, channel);
+	mc->total_dropped = 0;
+	if (result == 0)
+		result = raw1394_iso_recv_start (mc->handle, -1, -1, 0);
+	if (result != 0) {
+		raw1394_iso_shutdown (mc->handle);
+		iec61883_dispatch_detach (mc->handle, mc);
+		return -1;
+	}
+	mc->running = 1;
+	return 0;
+}
+
+void
+iec61883_mcrecv_stop (iec61883_mcrecv_t mc)
+{
+	assert (mc != NULL);
+	if (!mc->running)
+		return;
+	mc->running = 0;
+	if (iec61883_dispatch_get (mc->handle) != mc)
+		return;
+	raw1394_iso_shutdown (mc->handle);
+	iec61883_dispatch_detach (mc->handle, mc);
+}
+
+void
+iec61883_mcrecv_close (iec61883_mcrecv_t mc)
+{
+	assert (mc != NULL);
+	iec61883_mcrecv_stop (mc);
+	free (mc);
+}
@@ -43,6 +43,7 @@ iec61883_mpeg2_xmit_init(raw1394handle_t handle,
 	struct iec61883_mpeg2 *mpeg;
 
 	assert (handle != NULL);
+	iec61883_log_start();
 	mpeg = malloc(sizeof(struct iec61883_mpeg2));
 	if (!mpeg) {
 		errno = ENOMEM;
@@ -50,6 +51,13 @@ iec61883_mpeg2_xmit_init(raw1394handle_t handle,
 	}
 
 	mpeg->tsbuffer = NULL;
+	mpeg->timestamp_mode = IEC61883_MPEG2_TIMESTAMP_NONE;
+	mpeg->analyzer = NULL;
+	mpeg->program = -1;
+	mpeg->source = NULL;
+	mpeg->ring = NULL;
+	mpeg->trace = NULL;
+	iec61883_stats_init (&mpeg->stats);
 	mpeg->handle = handle;
 	mpeg->put_data = NULL;
 	mpeg->get_data = get_data;
@@ -57,6 +65,7 @@ iec61883_mpeg2_xmit_init(raw1394handle_t handle,
 	mpeg->buffer_packets = 1000;
 	mpeg->prebuffer_packets = 1000;
 	mpeg->irq_interval = 250;
+	mpeg->dma_mode = RAW1394_DMA_PACKET_PER_BUFFER;
 	mpeg->synch = 0;
 	mpeg->speed = RAW1394_ISO_SPEED_200;
 
@@ -65,6 +74,49 @@ iec61883_mpeg2_xmit_init(raw1394handle_t handle,
 	return mpeg;
 }
 
+iec61883_mpeg2_t
+iec61883_mpeg2_xmit_init_file(raw1394handle_t handle, const char *filename)
+{
+	iec61883_filesrc_t source;
+	struct iec61883_mpeg2 *mpeg;
+
+	assert (filename != NULL);
+	source = iec61883_filesrc_open (filename, IEC61883_MPEG2_TSP_SIZE);
+	if (!source)
+		return NULL;
+
+	mpeg = iec61883_mpeg2_xmit_init (handle, iec61883_filesrc_read, source);
+	if (!mpeg) {
+		iec61883_filesrc_close (source);
+		return NULL;
+	}
+	mpeg->source = source;
+
+	return mpeg;
+}
+
+iec61883_mpeg2_t
+iec61883_mpeg2_xmit_init_ring(raw1394handle_t handle, unsigned int size,
+		unsigned int watermark)
+{
+	iec61883_ring_t ring;
+	struct iec61883_mpeg2 *mpeg;
+
+	ring = iec61883_ring_open (size, watermark, IEC61883_MPEG2_TSP_SIZE);
+	if (!ring)
+		return NULL;
+	/* the cycle goes out empty when the packet due is missing */
+	iec61883_ring_set_underrun_fails (ring, 1);
+	mpeg = iec61883_mpeg2_xmit_init (handle, iec61883_ring_get, ring);
+	if (!mpeg) {
+		iec61883_ring_close (ring);
+		return NULL;
+	}
+	mpeg->ring = ring;
+
+	return mpeg;
+}
+
 iec61883_mpeg2_t
 iec61883_mpeg2_recv_init(raw1394handle_t handle, 
 		iec61883_mpeg2_recv_t put_data,
@@ -72,6 +124,7 @@ iec61883_mpeg2_recv_init(raw1394handle_t handle,
 {
 	struct iec61883_mpeg2 *mpeg;
 
+	iec61883_log_start();
 	mpeg = malloc(sizeof(struct iec61883_mpeg2));
 	if (!mpeg) {
 		errno = ENOMEM;
@@ -79,12 +132,20 @@ iec61883_mpeg2_recv_init(raw1394handle_t handle,
 	}
 
 	mpeg->tsbuffer = NULL;
+	mpeg->timestamp_mode = IEC61883_MPEG2_TIMESTAMP_NONE;
+	mpeg->analyzer = NULL;
+	mpeg->program = -1;
+	mpeg->source = NULL;
+	mpeg->ring = NULL;
+	mpeg->trace = NULL;
+	iec61883_stats_init (&mpeg->stats);
 	mpeg->handle = handle;
 	mpeg->put_data = put_data;
 	mpeg->get_data = NULL;
 	mpeg->callback_data = callback_data;
 	mpeg->buffer_packets = 1000;
 	mpeg->irq_interval = 250;
+	mpeg->dma_mode = RAW1394_DMA_PACKET_PER_BUFFER;
 	mpeg->synch = 0;
 	mpeg->speed = RAW1394_ISO_SPEED_200;
 
@@ -93,8 +154,28 @@ iec61883_mpeg2_recv_init(raw1394handle_t handle,
 	return mpeg;
 }
 
+iec61883_mpeg2_t
+iec61883_mpeg2_recv_init_ring(raw1394handle_t handle, unsigned int size,
+		unsigned int watermark)
+{
+	iec61883_ring_t ring;
+	struct iec61883_mpeg2 *mpeg;
+
+	ring = iec61883_ring_open (size, watermark, IEC61883_MPEG2_TSP_SIZE);
+	if (!ring)
+		return NULL;
+	mpeg = iec61883_mpeg2_recv_init (handle, iec61883_ring_put, ring);
+	if (!mpeg) {
+		iec61883_ring_close (ring);
+		return NULL;
+	}
+	mpeg->ring = ring;
+
+	return mpeg;
+}
+
 static enum raw1394_iso_disposition
-mpeg2_recv_handler (raw1394handle_t handle, 
+mpeg2_recv_packet (struct iec61883_mpeg2 *mpeg, 
 		unsigned char *data,
 		unsigned int len, 
 		unsigned char channel,
@@ -103,14 +184,13 @@ mpeg2_recv_handler (raw1394handle_t handle,
 		unsigned int cycle, 
 		unsigned int dropped)
 {
-	struct iec61883_mpeg2 *mpeg = raw1394_get_userdata (handle);
 	enum raw1394_iso_disposition result = RAW1394_ISO_OK;
+	unsigned long long start;
 	
 	/* check fields of CIP header for valid packet */
 	unsigned short dbs_fn_qpc_sph = (htonl (* (unsigned long*) (data)) >> 10) & 0x3fff;
 	unsigned char fmt = (htonl (* (unsigned long*) (data + 4)) >> 24) & 0x3f;
 	
-	assert (mpeg != NULL);
 	mpeg->total_dropped += dropped;
 
 	if (mpeg->put_data != NULL && /* only if callback registered */
@@ -124,10 +204,14 @@ mpeg2_recv_handler (raw1394handle_t handle,
 
 		/* write each TSP in the iso packet minus SPH */
 		for (; len > IEC61883_MPEG2_TSP_SIZE; len -= TSP_SPH_SIZE, data += TSP_SPH_SIZE) {
-			if (mpeg->put_data (data, IEC61883_MPEG2_TSP_SIZE, dropped, mpeg->callback_data) < 0) {
+			if (mpeg->analyzer != NULL)
+				tsanalyzer_packet (mpeg->analyzer, data - 4);
+			start = iec61883_now_ns ();
+			if (mpeg->put_data (data, IEC61883_MPEG2_TSP_SIZE, dropped, mpeg->callback_data) < 0)
 				result = RAW1394_ISO_ERROR;
+			iec61883_stats_callback_end (&mpeg->stats, start, result == RAW1394_ISO_ERROR);
+			if (result == RAW1394_ISO_ERROR)
 				break;
-			}
 			dropped = 0; /* do not repeatedly report dropped */
 		}
 	}
@@ -137,25 +221,69 @@ mpeg2_recv_handler (raw1394handle_t handle,
 	return result;
 }
 
+enum raw1394_iso_disposition
+iec61883_mpeg2_recv_packet (struct iec61883_mpeg2 *mpeg,
+		unsigned char *data,
+		unsigned int len,
+		unsigned char channel,
+		unsigned char tag,
+		unsigned char sy,
+		unsigned int cycle,
+		unsigned int dropped)
+{
+	enum raw1394_iso_disposition result;
+
+	assert (mpeg != NULL);
+	iec61883_stats_packet_begin (&mpeg->stats, mpeg->handle, cycle);
+	if (tag == IEC61883_TAG_WITH_CIP)
+		iec61883_stats_dbc (&mpeg->stats, data, len);
+	result = mpeg2_recv_packet (mpeg, data, len, channel, tag, sy, cycle, dropped);
+	iec61883_stats_packet_end (&mpeg->stats, len, dropped);
+	if (mpeg->trace)
+		iec61883_trace_packet (mpeg->trace, mpeg->stats.last_packet, data, len,
+			channel, tag, cycle, dropped, 0, result);
+	return result;
+}
+
+static enum raw1394_iso_disposition
+mpeg2_recv_handler (raw1394handle_t handle, 
+		unsigned char *data,
+		unsigned int len, 
+		unsigned char channel,
+		unsigned char tag, 
+		unsigned char sy,
+		unsigned int cycle, 
+		unsigned int dropped)
+{
+	return iec61883_mpeg2_recv_packet (iec61883_dispatch_get (handle), data, len, channel,
+		tag, sy, cycle, dropped);
+}
+
 int
 iec61883_mpeg2_recv_start(struct iec61883_mpeg2 *mpeg, int channel)
 {
 	int result = 0;
 	
 	assert (mpeg != NULL);
+	if (iec61883_dispatch_attach (mpeg->handle, mpeg) < 0)
+		return -1;
 	result = raw1394_iso_recv_init (mpeg->handle, 
 		mpeg2_recv_handler,
 		mpeg->buffer_packets, 
 		MAX_PACKET_SIZE + 8,
 		channel,
-		RAW1394_DMA_PACKET_PER_BUFFER,
+		mpeg->dma_mode,
 		mpeg->irq_interval);
 	
 	if (result == 0) {
 		mpeg->total_dropped = 0;
 		mpeg->channel = channel;
 		result = raw1394_iso_recv_start (mpeg->handle, -1, -1, 0);
+		if (result != 0)
+			raw1394_iso_shutdown (mpeg->handle);
 	}
+	if (result != 0)
+		iec61883_dispatch_detach (mpeg->handle, mpeg);
 	return result;
 }
 
@@ -165,23 +293,32 @@ mpeg2_xmit_handler (raw1394handle_t handle, unsigned char *data,
                     unsigned char *sy, int cycle,
                     unsigned int dropped )
 {
-	struct iec61883_mpeg2 *mpeg = raw1394_get_userdata (handle);
+	struct iec61883_mpeg2 *mpeg = iec61883_dispatch_get (handle);
 	enum raw1394_iso_disposition result = RAW1394_ISO_OK;
+	unsigned long long start;
 	
 	assert (mpeg != NULL);
+	iec61883_stats_packet_begin (&mpeg->stats, handle, cycle);
 	mpeg->total_dropped += dropped;
 	
 	if ( mpeg->tsbuffer != NULL ) {
+		/* the buffer calls back for as many packets as the cycle takes */
+		start = iec61883_now_ns ();
 		*len = tsbuffer_send_iso_cycle (mpeg->tsbuffer, data, cycle, 
 			(raw1394_get_local_id (handle) & 0x3f), dropped);
 		if (*len == 0)
 			result = RAW1394_ISO_ERROR;
+		iec61883_stats_callback_end (&mpeg->stats, start, result == RAW1394_ISO_ERROR);
 	}
 	else
 		result = RAW1394_ISO_ERROR;
 
 	*tag = IEC61883_TAG_WITH_CIP;
 	*sy = 0;
+	iec61883_stats_packet_end (&mpeg->stats, *len, dropped);
+	if (mpeg->trace)
+		iec61883_trace_packet (mpeg->trace, mpeg->stats.last_packet, data, *len,
+			mpeg->channel, *tag, cycle, dropped, IEC61883_TRACE_XMIT, result);
 
 	return result;
 }
@@ -194,8 +331,29 @@ iec61883_mpeg2_xmit_start (struct iec61883_mpeg2 *mpeg, int pid, int channel)
 	
 	assert (mpeg != NULL);
 	if (mpeg->get_data != NULL) {
-		mpeg->tsbuffer = tsbuffer_init (mpeg->get_data, mpeg->callback_data, pid);
-		if (mpeg->tsbuffer != NULL) {
+		if (mpeg->source)
+			iec61883_filesrc_set_unit (mpeg->source,
+				mpeg->timestamp_mode != IEC61883_MPEG2_TIMESTAMP_NONE ?
+				IEC61883_MPEG2_TSP_SPH_SIZE : IEC61883_MPEG2_TSP_SIZE);
+		/* PCR pacing reads ahead, which a ring cannot always serve */
+		if (mpeg->ring && mpeg->timestamp_mode == IEC61883_MPEG2_TIMESTAMP_NONE) {
+			WARN ("Transmitting from a ring needs a timestamp mode");
+			errno = EINVAL;
+			return -1;
+		}
+		if (mpeg->ring)
+			iec61883_ring_set_unit (mpeg->ring,
+				mpeg->timestamp_mode != IEC61883_MPEG2_TIMESTAMP_NONE ?
+				IEC61883_MPEG2_TSP_SPH_SIZE : IEC61883_MPEG2_TSP_SIZE);
+		if (mpeg->timestamp_mode != IEC61883_MPEG2_TIMESTAMP_NONE)
+			mpeg->tsbuffer = tsbuffer_init_timestamped (mpeg->get_data,
+				mpeg->callback_data, mpeg->timestamp_mode, mpeg->ring != NULL);
+		else if (mpeg->source)
+			mpeg->tsbuffer = tsbuffer_init_file (mpeg->source, pid, mpeg->program);
+		else
+			mpeg->tsbuffer = tsbuffer_init (mpeg->get_data, mpeg->callback_data, pid,
+				mpeg->program);
+		if (mpeg->tsbuffer != NULL && iec61883_dispatch_attach (mpeg->handle, mpeg) == 0) {
 			if (raw1394_iso_xmit_init (mpeg->handle,
 										mpeg2_xmit_handler,
 										mpeg->buffer_packets,
@@ -205,8 +363,12 @@ iec61883_mpeg2_xmit_start (struct iec61883_mpeg2 *mpeg, int pid, int channel)
 										mpeg->irq_interval) == 0) {
 				mpeg->total_dropped = 0;
 				result = raw1394_iso_xmit_start (mpeg->handle, -1, mpeg->prebuffer_packets);
+				if (result != 0)
+					raw1394_iso_shutdown (mpeg->handle);
 			} else
 				result = -1;
+			if (result != 0)
+				iec61883_dispatch_detach (mpeg->handle, mpeg);
 		} else
 			result = -1;
 	} else
@@ -219,9 +381,14 @@ void
 iec61883_mpeg2_xmit_stop (struct iec61883_mpeg2 *mpeg)
 {
 	assert (mpeg != NULL);
-	if (mpeg->synch)
-		raw1394_iso_xmit_sync (mpeg->handle);
-	raw1394_iso_shutdown (mpeg->handle);
+	if (iec61883_dispatch_get (mpeg->handle) == mpeg) {
+		if (mpeg->synch)
+			raw1394_iso_xmit_sync (mpeg->handle);
+		raw1394_iso_shutdown (mpeg->handle);
+		// the handler looks the stream up until the context is shut down
+		iec61883_dispatch_detach (mpeg->handle, mpeg);
+		iec61883_trace_flush (mpeg->trace);
+	}
 	tsbuffer_close (mpeg->tsbuffer);
 	mpeg->tsbuffer = NULL;
 }
@@ -230,9 +397,14 @@ void
 iec61883_mpeg2_recv_stop (struct iec61883_mpeg2 *mpeg)
 {
 	assert (mpeg != NULL);
+	if (iec61883_dispatch_get (mpeg->handle) != mpeg)
+		return;
 	if (mpeg->synch)
 		raw1394_iso_recv_flush (mpeg->handle);
 	raw1394_iso_shutdown (mpeg->handle);
+	// the handler looks the stream up until the context is shut down
+	iec61883_dispatch_detach (mpeg->handle, mpeg);
+	iec61883_trace_flush (mpeg->trace);
 }
 
 void
@@ -243,6 +415,14 @@ iec61883_mpeg2_close (struct iec61883_mpeg2 *mpeg)
 		iec61883_mpeg2_recv_stop (mpeg);
 	else if (mpeg->get_data)
 		iec61883_mpeg2_xmit_stop (mpeg);
+	if (mpeg->analyzer)
+		tsanalyzer_close (mpeg->analyzer);
+	if (mpeg->source)
+		iec61883_filesrc_close (mpeg->source);
+	if (mpeg->ring)
+		iec61883_ring_close (mpeg->ring);
+	if (mpeg->trace)
+		iec61883_trace_close (mpeg->trace);
 	free (mpeg);
 }
 
@@ -288,6 +468,108 @@ iec61883_mpeg2_set_irq_interval(iec61883_mpeg2_t mpeg2, unsigned int packets)
 	mpeg2->irq_interval = packets;
 }
 
+enum raw1394_iso_dma_recv_mode
+iec61883_mpeg2_get_dma_mode(iec61883_mpeg2_t mpeg2)
+{
+	assert (mpeg2 != NULL);
+	return mpeg2->dma_mode;
+}
+
+void
+iec61883_mpeg2_set_dma_mode(iec61883_mpeg2_t mpeg2, enum raw1394_iso_dma_recv_mode mode)
+{
+	assert (mpeg2 != NULL);
+	mpeg2->dma_mode = mode;
+}
+
+int
+iec61883_mpeg2_read(iec61883_mpeg2_t mpeg2, void *data, unsigned int len, int timeout)
+{
+	assert (mpeg2 != NULL);
+	if (!mpeg2->ring || !mpeg2->put_data) {
+		errno = EINVAL;
+		return -1;
+	}
+	return iec61883_ring_read (mpeg2->ring, data, len, timeout);
+}
+
+int
+iec61883_mpeg2_write(iec61883_mpeg2_t mpeg2, const void *data, unsigned int len, int timeout)
+{
+	assert (mpeg2 != NULL);
+	if (!mpeg2->ring || !mpeg2->get_data) {
+		errno = EINVAL;
+		return -1;
+	}
+	return iec61883_ring_write (mpeg2->ring, data, len, timeout);
+}
+
+int
+iec61883_mpeg2_get_ring_stats(iec61883_mpeg2_t mpeg2, struct iec61883_ring_stats *stats)
+{
+	assert (mpeg2 != NULL);
+	assert (stats != NULL);
+	if (!mpeg2->ring) {
+		errno = EINVAL;
+		return -1;
+	}
+	iec61883_ring_get_stats (mpeg2->ring, stats);
+	return 0;
+}
+
+int
+iec61883_mpeg2_get_stats(iec61883_mpeg2_t mpeg2, struct iec61883_stats *stats, int reset)
+{
+	assert (mpeg2 != NULL);
+	assert (stats != NULL);
+	iec61883_stats_get (&mpeg2->stats, stats, reset);
+	return 0;
+}
+
+void
+iec61883_mpeg2_set_profiling(iec61883_mpeg2_t mpeg2, int enable)
+{
+	assert (mpeg2 != NULL);
+	iec61883_stats_set_profiling (&mpeg2->stats, enable, mpeg2->irq_interval);
+}
+
+void
+iec61883_mpeg2_get_profile(iec61883_mpeg2_t mpeg2, struct iec61883_profile *profile, int reset)
+{
+	assert (mpeg2 != NULL);
+	assert (profile != NULL);
+	iec61883_stats_get_profile (&mpeg2->stats, profile, reset);
+}
+
+int
+iec61883_mpeg2_set_trace(iec61883_mpeg2_t mpeg2, unsigned int records, const char *error_file)
+{
+	iec61883_trace_t trace = NULL;
+
+	assert (mpeg2 != NULL);
+	if (records > 0) {
+		trace = iec61883_trace_open (records, error_file);
+		if (!trace)
+			return -1;
+	}
+	if (mpeg2->trace)
+		iec61883_trace_close (mpeg2->trace);
+	mpeg2->trace = trace;
+	return 0;
+}
+
+int
+iec61883_mpeg2_dump_trace(iec61883_mpeg2_t mpeg2, const char *filename)
+{
+	assert (mpeg2 != NULL);
+	assert (filename != NULL);
+	if (!mpeg2->trace) {
+		errno = EINVAL;
+		return -1;
+	}
+	return iec61883_trace_dump (mpeg2->trace, filename);
+}
+
 int
 iec61883_mpeg2_get_synch(iec61883_mpeg2_t mpeg2)
 {
@@ -329,3 +611,63 @@ iec61883_mpeg2_get_callback_data (iec61883_mpeg2_t mpeg2)
 	assert (mpeg2 != NULL);
 	return mpeg2->callback_data;
 }
+
+int
+iec61883_mpeg2_get_timestamp_mode (iec61883_mpeg2_t mpeg2)
+{
+	assert (mpeg2 != NULL);
+	return mpeg2->timestamp_mode;
+}
+
+void
+iec61883_mpeg2_set_timestamp_mode (iec61883_mpeg2_t mpeg2, int mode)
+{
+	assert (mpeg2 != NULL);
+	mpeg2->timestamp_mode = mode;
+}
+
+int
+iec61883_mpeg2_get_program (iec61883_mpeg2_t mpeg2)
+{
+	assert (mpeg2 != NULL);
+	return mpeg2->program;
+}
+
+void
+iec61883_mpeg2_set_program (iec61883_mpeg2_t mpeg2, int program)
+{
+	assert (mpeg2 != NULL);
+	mpeg2->program = program;
+}
+
+int
+iec61883_mpeg2_set_analyzer (iec61883_mpeg2_t mpeg2, int enable)
+{
+	assert (mpeg2 != NULL);
+	if (mpeg2->analyzer) {
+		tsanalyzer_close (mpeg2->analyzer);
+		mpeg2->analyzer = NULL;
+	}
+	if (enable) {
+		mpeg2->analyzer = tsanalyzer_init ();
+		if (mpeg2->analyzer == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+iec61883_mpeg2_get_analysis (iec61883_mpeg2_t mpeg2,
+	struct iec61883_mpeg2_analysis *analysis, int reset)
+{
+	assert (mpeg2 != NULL);
+	assert (analysis != NULL);
+	if (mpeg2->analyzer == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	tsanalyzer_snapshot (mpeg2->analyzer, analysis, reset);
+	return 0;
+}
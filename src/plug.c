@@ -36,6 +36,9 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 
 #include <libraw1394/csr.h>
@@ -46,6 +49,73 @@
  * Please see the convenience macros defined in iec61883.h.
  */
 
+/* index of plug register a in struct iec61883_plug_cache, or -1 */
+static int
+plug_cache_index(nodeaddr_t a, int *side)
+{
+	if ((a & 3) != 0)
+		return -1;
+	if (a >= CSR_O_MPR && a <= CSR_O_PCR_0 + 4 * (IEC61883_PCR_MAX - 1))
+	{
+		*side = 0;
+		return (a - CSR_O_MPR) / 4;
+	}
+	if (a >= CSR_I_MPR && a <= CSR_I_PCR_0 + 4 * (IEC61883_PCR_MAX - 1))
+	{
+		*side = 1;
+		return (a - CSR_I_MPR) / 4;
+	}
+	return -1;
+}
+
+
+/* the plug cache of node n, emptied if there was a bus reset */
+static struct iec61883_plug_cache *
+plug_cache(raw1394handle_t h, nodeid_t n)
+{
+	struct iec61883_context *ctx = iec61883_context_get( h );
+	struct iec61883_plug_cache *cache;
+	unsigned int generation;
+
+	if (!ctx)
+		return NULL;
+	generation = raw1394_get_generation( h );
+	cache = &ctx->plugs[n & 0x3f];
+	if (cache->node != n || cache->generation != generation)
+	{
+		cache->node = n;
+		cache->generation = generation;
+		cache->valid[0] = cache->valid[1] = 0;
+	}
+	return cache;
+}
+
+
+void
+iec61883_plug_cache_store(raw1394handle_t h, nodeid_t n, nodeaddr_t a, quadlet_t value)
+{
+	struct iec61883_plug_cache *cache;
+	int side, i = plug_cache_index( a, &side );
+
+	if (i >= 0 && (cache = plug_cache( h, n )) != NULL)
+	{
+		cache->regs[side][i] = value;
+		cache->valid[side] |= 1U << i;
+	}
+}
+
+
+static void
+plug_cache_forget(raw1394handle_t h, nodeid_t n, nodeaddr_t a)
+{
+	struct iec61883_plug_cache *cache;
+	int side, i = plug_cache_index( a, &side );
+
+	if (i >= 0 && (cache = plug_cache( h, n )) != NULL)
+		cache->valid[side] &= ~(1U << i);
+}
+
+
 int
 iec61883_plug_get(raw1394handle_t h, nodeid_t n, nodeaddr_t a, quadlet_t *value)
 {
@@ -54,7 +124,53 @@ iec61883_plug_get(raw1394handle_t h, nodeid_t n, nodeaddr_t a, quadlet_t *value)
   
 	result = iec61883_cooked_read( h, n, CSR_REGISTER_BASE + a, sizeof(quadlet_t), &temp);
 	if (result >= 0)
+	{
 		*value = ntohl(temp); /* endian conversion */
+		iec61883_plug_cache_store( h, n, a, *value );
+	}
+	return result;
+}
+
+
+int
+iec61883_plug_get_cached(raw1394handle_t h, nodeid_t n, nodeaddr_t a, quadlet_t *value)
+{
+	struct iec61883_plug_cache *cache;
+	int side, i = plug_cache_index( a, &side );
+
+	if (i >= 0 && (cache = plug_cache( h, n )) != NULL &&
+	    (cache->valid[side] & (1U << i)))
+	{
+		*value = cache->regs[side][i];
+		return 0;
+	}
+	return iec61883_plug_get( h, n, a, value );
+}
+
+
+int
+iec61883_plug_compare_swap(raw1394handle_t h, nodeid_t n, nodeaddr_t a,
+	quadlet_t compare, quadlet_t value)
+{
+	quadlet_t new;
+	int result;
+
+	/* convert endian */
+	result = iec61883_cooked_lock( h, n, CSR_REGISTER_BASE + a, EXTCODE_COMPARE_SWAP,
+		htonl(value), htonl(compare), &new);
+	if (result < 0)
+	{
+		plug_cache_forget( h, n, a );
+	}
+	else if (new != htonl(compare))
+	{
+		iec61883_plug_cache_store( h, n, a, ntohl(new) );
+		result = -EAGAIN;
+	}
+	else
+	{
+		iec61883_plug_cache_store( h, n, a, value );
+	}
 	return result;
 }
 
@@ -62,291 +178,697 @@ iec61883_plug_get(raw1394handle_t h, nodeid_t n, nodeaddr_t a, quadlet_t *value)
 int
 iec61883_plug_set(raw1394handle_t h, nodeid_t n, nodeaddr_t a, quadlet_t value)
 {
-	quadlet_t compare, swap, new;
+	quadlet_t compare;
 	int result;
 	
 	/* get the current register value for comparison */
 	result = iec61883_plug_get( h, n, a, &compare );
+	if (result >= 0)
+		result = iec61883_plug_compare_swap( h, n, a, compare, value );
+	return result;
+}
+
+
+int
+iec61883_plug_update(raw1394handle_t h, nodeid_t n, nodeaddr_t a, quadlet_t value)
+{
+	struct iec61883_plug_cache *cache;
+	int side, i = plug_cache_index( a, &side );
+
+	if (i >= 0 && (cache = plug_cache( h, n )) != NULL &&
+	    (cache->valid[side] & (1U << i)))
+		return iec61883_plug_compare_swap( h, n, a, cache->regs[side][i], value );
+	return iec61883_plug_set( h, n, a, value );
+}
+
+
+/* Read a master plug register and all of its PCRs with a single block read.
+   Devices that only implement quadlet access to their plug registers get
+   one read per plug instead. */
+static int
+plug_get_all(raw1394handle_t h, nodeid_t n, nodeaddr_t mpr, quadlet_t *regs, int cached)
+{
+	struct iec61883_plug_cache *cache = plug_cache( h, n );
+	int side = (mpr == CSR_O_MPR) ? 0 : 1;
+	int result, i, n_plugs;
+	quadlet_t mask;
+
+	/* n_plugs is the low 5 bits of both oMPR and iMPR */
+	if (cached && cache && (cache->valid[side] & 1))
+	{
+		n_plugs = cache->regs[side][0] & 0x1f;
+		mask = (n_plugs == IEC61883_PCR_MAX) ? ~0U : (2U << n_plugs) - 1;
+		if ((cache->valid[side] & mask) == mask)
+		{
+			memcpy( regs, cache->regs[side], (IEC61883_PCR_MAX + 1) * sizeof(quadlet_t) );
+			return 0;
+		}
+	}
+
+	result = iec61883_cooked_read( h, n, CSR_REGISTER_BASE + mpr,
+		(IEC61883_PCR_MAX + 1) * sizeof(quadlet_t), regs);
 	if (result >= 0)
 	{
-		/* convert endian */
-		compare = htonl(compare);
-		swap = htonl(value);
-		result = raw1394_lock( h, n, CSR_REGISTER_BASE + a, EXTCODE_COMPARE_SWAP, swap, compare, &new);
-		if (new != compare)
-			result = -EAGAIN;
+		for (i = 0; i <= IEC61883_PCR_MAX; i++)
+			regs[i] = ntohl(regs[i]);
+		if (cache)
+		{
+			n_plugs = regs[0] & 0x1f;
+			memcpy( cache->regs[side], regs, (IEC61883_PCR_MAX + 1) * sizeof(quadlet_t) );
+			cache->valid[side] = (n_plugs == IEC61883_PCR_MAX) ? ~0U : (2U << n_plugs) - 1;
+		}
+		return result;
 	}
-	return result;
+
+	DEBUG ("block read of plugs on node %d failed; reading quadlets", n & 0x3f);
+	memset( regs, 0, (IEC61883_PCR_MAX + 1) * sizeof(quadlet_t) );
+	result = iec61883_plug_get( h, n, mpr, &regs[0] );
+	if (result < 0)
+		return result;
+	
+	n_plugs = regs[0] & 0x1f;
+	for (i = 1; i <= n_plugs; i++)
+		if (iec61883_plug_get( h, n, mpr + 4 * i, &regs[i] ) < 0)
+			regs[i] = 0; /* appears offline */
+	return 0;
+}
+
+
+int
+iec61883_plug_get_outputs(raw1394handle_t h, nodeid_t n, quadlet_t *regs)
+{
+	return plug_get_all( h, n, CSR_O_MPR, regs, 1 );
+}
+
+
+int
+iec61883_plug_get_inputs(raw1394handle_t h, nodeid_t n, quadlet_t *regs)
+{
+	return plug_get_all( h, n, CSR_I_MPR, regs, 1 );
+}
+
+
+int
+iec61883_plug_read_outputs(raw1394handle_t h, nodeid_t n, quadlet_t *regs)
+{
+	return plug_get_all( h, n, CSR_O_MPR, regs, 0 );
+}
+
+
+int
+iec61883_plug_read_inputs(raw1394handle_t h, nodeid_t n, quadlet_t *regs)
+{
+	return plug_get_all( h, n, CSR_I_MPR, regs, 0 );
 }
 
 
+
 /* 
  * Local host plugs implementation
  *
  * This requires the address range mapping feature of libraw1394 1.0.
+ *
+ * Each plug space is the register file of one direction on one handle,
+ * hence one port. Remote lock requests are served from the thread running
+ * the handle's event loop while the application may change its own plugs
+ * from others, so every register update is an atomic compare-swap.
  */
 
-/* ARM context identifiers */
-static char g_arm_callback_context_out[] = "libiec61883 output context";
-static char g_arm_callback_context_in[] = "libiec61883 input context";
-static struct raw1394_arm_reqhandle g_arm_reqhandle_out;
-static struct raw1394_arm_reqhandle g_arm_reqhandle_in;
+#define PLUG_EVENTS 64
+
+struct iec61883_plug_space {
+	raw1394handle_t handle;
+	int output;
+	struct raw1394_arm_reqhandle reqhandle;
+	pthread_mutex_t lock;          /* serialises adding and clearing plugs */
+	volatile quadlet_t regs[IEC61883_PCR_MAX + 1];   /* MPR, then PCRs */
+	quadlet_t response[4 + IEC61883_PCR_MAX + 1];    /* header and data */
+
+	/* changes made by remote nodes, see space_changed() */
+	iec61883_plug_notify_t notify;
+	void *notify_data;
+	int event_fd;
+	struct iec61883_plug_event events[PLUG_EVENTS];
+	volatile unsigned int event_head;    /* written by the event loop */
+	volatile unsigned int event_tail;    /* written by the reader */
+	volatile unsigned int events_lost;
+};
+
+static nodeaddr_t
+space_base (struct iec61883_plug_space *space)
+{
+	return CSR_REGISTER_BASE + (space->output ? CSR_O_MPR : CSR_I_MPR);
+}
 
-/* register space */
+static quadlet_t
+space_swap (struct iec61883_plug_space *space, int i, quadlet_t compare, quadlet_t swap)
+{
+	return __sync_val_compare_and_swap (&space->regs[i], compare, swap);
+}
 
-/* Please note that this is host global. Each port (host adapter)
-   does not get its own register space. Also, this is only intended
-   for use by a single application. It appears that when multiple processes
-   host these plugs, it still works; as long as the application uses the
-   plug access functions above, then it should work. */
-static struct output_registers {
-	struct iec61883_oMPR mpr;
-	struct iec61883_oPCR pcr[IEC61883_PCR_MAX];
-} g_data_out;
+/* tell the application about a lock that changed a register */
+static void
+space_changed (struct iec61883_plug_space *space, nodeid_t source, int offset,
+		quadlet_t old, quadlet_t new)
+{
+	unsigned int head = space->event_head;
+	struct iec61883_plug_event *event;
+	uint64_t one = 1;
+
+	if (space->notify)
+		space->notify (space, offset - 1, old, new, space->notify_data);
+	if (space->event_fd < 0)
+		return;
+	if (head - space->event_tail == PLUG_EVENTS) {
+		space->events_lost++;
+		return;
+	}
+	event = &space->events[head % PLUG_EVENTS];
+	event->plug = offset - 1;
+	event->source = source;
+	event->old_value = old;
+	event->new_value = new;
+	__sync_synchronize ();
+	space->event_head = head + 1;
+	/* this can only fail when the counter is huge, and then it is readable */
+	if (write (space->event_fd, &one, sizeof (one)) < 0)
+		return;
+}
 
-static struct input_registers {
-	struct iec61883_iMPR mpr;
-	struct iec61883_iPCR pcr[IEC61883_PCR_MAX];
-} g_data_in;
+
+/** Send a response packet for a request to the register space.
+ *
+ *  The packet is built in the space's response buffer, in host byte
+ *  order except for data. It is copied to the kernel before the send
+ *  returns, and requests are only handled by the event loop of the
+ *  space's handle, so one buffer serves all responses.
+ *
+ * \param handle   A raw1394 handle.
+ * \param arm_req  The request to respond to.
+ * \param space    The register space, holding the response buffer.
+ * \param tcode    The transaction code of the response.
+ * \param rcode    The response code.
+ * \param quadlet3 The fourth header quadlet: the data of a quadlet read
+ *                 response, otherwise data_length and extended tcode.
+ * \param n_data   The number of data quadlets in the response buffer.
+ */
+static void
+arm_respond(raw1394handle_t handle, struct raw1394_arm_request *arm_req,
+		struct iec61883_plug_space *space, int tcode, int rcode,
+		quadlet_t quadlet3, int n_data)
+{
+	quadlet_t *response = space->response;
+
+	response[0] = 
+		((arm_req->source_nodeid & 0xFFFF) << 16) +
+		((arm_req->tlabel        & 0x3F)   << 10) +
+		((tcode & 0xF) << 4);
+	response[1] = 
+		((arm_req->destination_nodeid & 0xFFFF) << 16) +
+		((rcode & 0xF) << 12);
+	response[2] = 0;
+	response[3] = quadlet3;
+
+	raw1394_start_async_send(handle, (4 + n_data) * sizeof(quadlet_t), 16, 0,
+		response, 0);
+}
 
 
-/** Send an async packet in response to a register read.
+/** Respond to a register read.
  *
+ *  Quadlet reads of one register and block reads of any whole registers,
+ *  up to the entire MPR and PCR range, are answered in one packet.
  *  This function handles host to bus endian conversion.
  *
  * \param handle  A raw1394 handle.
  * \param arm_req A pointer to an arm_request struct from the ARM callback
  *                handler.
- * \param a       The CSR offset address of the register.
- * \param data    The base address of the register space to read.
- * \return        0 for success, -1 on error.
+ * \param length  The number of bytes requested.
+ * \param space   The register space to read.
  */
-static int
+static void
 do_arm_read(raw1394handle_t handle, struct raw1394_arm_request *arm_req, 
-		nodeaddr_t a, quadlet_t *data)
-{
-	quadlet_t *response;
-	int num=4, offset;
-	
-	/* allocate response packet */
-	response = malloc(num * sizeof(quadlet_t));
-	if (!response)
-		FAIL("unable to allocate response packet");
-	memset(response, 0x00, num * sizeof(quadlet_t));
+		unsigned int length, struct iec61883_plug_space *space)
+{
+	int block = (arm_req->tcode == 5);
+	int n_data = block ? length / 4 : 1;
+	int offset, i;
 	
-	/* fill data of response */
-	response[0] = 
-		((arm_req->source_nodeid & 0xFFFF) << 16) +
-		((arm_req->tlabel        & 0x3F)   << 10) +
-		(6 << 4); /* tcode = 6 */
-	response[1] = ((arm_req->destination_nodeid & 0xFFFF) << 16);
-		/* rcode = resp_complete implied */
+	offset = (arm_req->destination_offset - space_base (space))/4;
+	if (offset < 0 || n_data < 1 || offset + n_data > IEC61883_PCR_MAX + 1 ||
+		(length & 3) != 0) {
+		arm_respond (handle, arm_req, space, block ? 7 : 6, RCODE_ADDRESS_ERROR, 0, 0);
+		return;
+	}
 	
-	DEBUG ("      destination_offset=%d", 
-		arm_req->destination_offset - CSR_REGISTER_BASE - a);
-	offset = (arm_req->destination_offset - CSR_REGISTER_BASE - a)/4;
-	response[3] = htonl(data[offset]);
-	
-	DEBUG("      response: 0x%8.8X",response[0]);
-	DEBUG("                0x%8.8X",response[1]);
-	DEBUG("                0x%8.8X",response[2]);
-	DEBUG("                0x%8.8X",response[3]);
-
-	/* send response */
-	raw1394_start_async_send(handle, 16 , 16, 0, response, 0);
-
-	free (response);
-	return 0;
-}
+	if (block) {
+		for (i = 0; i < n_data; i++)
+			space->response[4 + i] = htonl(space->regs[offset + i]);
+		arm_respond (handle, arm_req, space, 7, RCODE_COMPLETE, (n_data * 4) << 16,
+			n_data);
+	} else {
+		arm_respond (handle, arm_req, space, 6, RCODE_COMPLETE,
+			htonl(space->regs[offset]), 0);
+	}
+}
 
 
 /** Update a local register value, and send a response packet.
  *
- *  This function performs a compare/swap lock operation only.
+ *  This function performs a compare/swap lock operation only, atomically
+ *  with respect to other threads changing the register space.
  *  This function handles host to bus endian conversion.
  *
  * \param handle  A raw1394 handle.
  * \param arm_req A pointer to an arm_request struct from the ARM callback
  *                handler.
- * \param a       The CSR offset address of the register.
- * \param data    The base address of the register space to update.
- * \return        0 for success, -1 on error.
+ * \param length  The number of bytes requested.
+ * \param space   The register space to update.
  */
-static int
+static void
 do_arm_lock(raw1394handle_t handle, struct raw1394_arm_request *arm_req,
-		nodeaddr_t a, quadlet_t *data)
-{
-	quadlet_t *response = NULL;
-	int num, offset;
-	int rcode = RCODE_COMPLETE;
-	int requested_length = 4;
-			
-	if (arm_req->extended_transaction_code == EXTCODE_COMPARE_SWAP)
-	{
-		quadlet_t arg_q, data_q, old_q, new_q;
-		
-		/* allocate response packet */
-		num = 4 + requested_length;
-		response = malloc(num * sizeof(quadlet_t));
-		if (!response)
-			FAIL("unable to allocate response packet");
-		memset(response, 0x00, num * sizeof(quadlet_t));
-		
-		/* load data */
-		offset = (arm_req->destination_offset - CSR_REGISTER_BASE - a)/4;
-		response[4] = htonl(data[offset]);
-		
-		/* compare */
-		arg_q  = *(quadlet_t *) (&arm_req->buffer[0]);
-		data_q = *(quadlet_t *) (&arm_req->buffer[4]);
-		old_q = *(quadlet_t *) (&response[4]);
-		new_q = (old_q == arg_q) ? data_q : old_q;
-
-		/* swap */
-		data[offset] = ntohl(new_q);
-		
+		unsigned int length, struct iec61883_plug_space *space)
+{
+	int extcode = arm_req->extended_transaction_code & 0xFF;
+	int offset;
+	quadlet_t arg_q, data_q, old_q;
+
+	offset = (arm_req->destination_offset - space_base (space))/4;
+	if (offset < 0 || offset > IEC61883_PCR_MAX) {
+		arm_respond (handle, arm_req, space, 0xB, RCODE_ADDRESS_ERROR, extcode, 0);
+		return;
+	}
+	if (extcode != EXTCODE_COMPARE_SWAP || length != 4) {
+		arm_respond (handle, arm_req, space, 0xB, RCODE_TYPE_ERROR, extcode, 0);
+		return;
 	}
+		
+	/* compare and swap */
+	memcpy (&arg_q, &arm_req->buffer[0], sizeof (quadlet_t));
+	memcpy (&data_q, &arm_req->buffer[4], sizeof (quadlet_t));
+	old_q = space_swap (space, offset, ntohl(arg_q), ntohl(data_q));
+	space->response[4] = htonl(old_q);
+	arm_respond (handle, arm_req, space, 0xB, RCODE_COMPLETE, (4 << 16) + extcode, 1);
+
+	if (old_q == ntohl(arg_q) && old_q != ntohl(data_q))
+		space_changed (space, arm_req->source_nodeid, offset, old_q, ntohl(data_q));
+}
+
+
+/* local plug ARM handler, kept free of allocation and stdio */
+static int
+iec61883_arm_callback (raw1394handle_t handle, 
+	struct raw1394_arm_request_response *arm_req_resp,
+	unsigned int requested_length,
+	void *pcontext, byte_t request_type)
+{
+	struct raw1394_arm_request  *arm_req  = arm_req_resp->request;
+	struct iec61883_plug_space *space = pcontext;
+	
+	if (request_type == RAW1394_ARM_READ && (arm_req->tcode == 4 || arm_req->tcode == 5))
+		do_arm_read( handle, arm_req, requested_length, space );
+	else if (request_type == RAW1394_ARM_LOCK)
+		do_arm_lock( handle, arm_req, requested_length, space );
 	else
-	{
-		rcode = RCODE_TYPE_ERROR;
-		requested_length = 0;
+		/* only reads and locks are registered, so this is a write */
+		arm_respond( handle, arm_req, space, 2, RCODE_TYPE_ERROR, 0, 0 );
+	return 0;
+}
+
+
+iec61883_plug_space_t
+iec61883_plug_space_init (raw1394handle_t h, int output, unsigned int data_rate,
+		unsigned int bcast_channel)
+{
+	struct iec61883_plug_space *space;
+	quadlet_t mpr = 0;
+
+	assert (h != NULL);
+
+	/* validate parameters */
+	if (data_rate >> 2 != 0 || bcast_channel >> 6 != 0) {
+		errno = EINVAL;
+		return NULL;
 	}
+	
+	/* initialize data */
+	iec61883_log_start ();
+	space = calloc (1, sizeof (struct iec61883_plug_space));
+	if (!space) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	space->handle = h;
+	space->output = (output != 0);
+	space->event_fd = -1;
+	pthread_mutex_init (&space->lock, NULL);
+	if (output) {
+		((struct iec61883_oMPR *) &mpr)->data_rate = data_rate;
+		((struct iec61883_oMPR *) &mpr)->bcast_channel = bcast_channel;
+	} else {
+		((struct iec61883_iMPR *) &mpr)->data_rate = data_rate;
+	}
+	space->regs[0] = mpr;
 
-	/* fill data of response */
-	response[0] = 
-		((arm_req->source_nodeid & 0xFFFF) << 16) +
-		((arm_req->tlabel        & 0x3F)   << 10) +
-		(0xB << 4); /* tcode = B */
-	response[1] = 
-		((arm_req->destination_nodeid & 0xFFFF) << 16) +
-		((rcode & 0xF) << 12);
-	response[3] = 
-		((requested_length & 0xFFFF) << 16) +
-		(arm_req->extended_transaction_code & 0xFF);
+	/* initialize host environment */
+	space->reqhandle.arm_callback = (arm_req_callback_t) iec61883_arm_callback;
+	space->reqhandle.pcontext = space;
 
-	DEBUG("      response: 0x%8.8X",response[0]);
-	DEBUG("                0x%8.8X",response[1]);
-	DEBUG("                0x%8.8X",response[2]);
-	DEBUG("                0x%8.8X",response[3]);
-	DEBUG("                0x%8.8X",response[4]);
+	/* register callback */
+	if (raw1394_arm_register (h, space_base (space), sizeof (space->regs),
+		(byte_t *) space->regs, (unsigned long) &space->reqhandle, 
+		0, 0, ( RAW1394_ARM_READ | RAW1394_ARM_LOCK ) ) < 0) {
+		pthread_mutex_destroy (&space->lock);
+		free (space);
+		return NULL;
+	}
+	return space;
+}
 
-	/* send response */
-	raw1394_start_async_send(handle, requested_length + 16, 16, 0, response, 0);
 
-	free (response);
-	return 0;
+int
+iec61883_plug_space_close (iec61883_plug_space_t space)
+{
+	int result;
+
+	assert (space != NULL);
+	result = raw1394_arm_unregister (space->handle, space_base (space));
+	if (space->event_fd >= 0)
+		close (space->event_fd);
+	pthread_mutex_destroy (&space->lock);
+	free (space);
+	return result;
 }
 
 
-/* local plug ARM handler */
-static int
-iec61883_arm_callback (raw1394handle_t handle, 
-	struct raw1394_arm_request_response *arm_req_resp,
-	unsigned int requested_length,
-	void *pcontext, byte_t request_type)
+/* set the number of plugs, keeping the other MPR fields */
+static void
+space_set_n_plugs (struct iec61883_plug_space *space, unsigned int n_plugs)
 {
-	struct raw1394_arm_request  *arm_req  = arm_req_resp->request;
-	
-	DEBUG( "request type=%d tcode=%d length=%d", request_type, arm_req->tcode, requested_length);
-	DEBUG( "context = %s", (char *) pcontext);
-	fflush(stdout);
-	
-	if (pcontext == g_arm_callback_context_out && requested_length == 4)
-	{
-		if (request_type == RAW1394_ARM_READ && arm_req->tcode == 4)
-		{
-			do_arm_read( handle, arm_req, CSR_O_MPR, (quadlet_t *) &g_data_out );
-		}
-		else if (request_type == RAW1394_ARM_LOCK)
-		{
-			do_arm_lock( handle, arm_req, CSR_O_MPR, (quadlet_t *) &g_data_out );
-		}
-		else
-		{
-			/* error response */
-		}
-	}
-	else if (pcontext == g_arm_callback_context_in && requested_length == 4)
-	{
-		if (request_type == RAW1394_ARM_READ)
-		{
-			do_arm_read( handle, arm_req, CSR_I_MPR, (quadlet_t *) &g_data_in  );
-		}
-		else if (request_type == RAW1394_ARM_LOCK)
-		{
-			do_arm_lock( handle, arm_req, CSR_I_MPR, (quadlet_t *) &g_data_in );
-		}
+	quadlet_t old, new;
+
+	do {
+		old = new = space->regs[0];
+		if (space->output)
+			((struct iec61883_oMPR *) &new)->n_plugs = n_plugs;
 		else
-		{
-			/* error response */
-		}
-	}
-	else
-	{
-		/* error response */
-	}
-	fflush(stdout);
-	return 0;
+			((struct iec61883_iMPR *) &new)->n_plugs = n_plugs;
+	} while (space_swap (space, 0, old, new) != old);
+}
+
+
+void
+iec61883_plug_space_clear (iec61883_plug_space_t space)
+{
+	assert (space != NULL);
+	pthread_mutex_lock (&space->lock);
+	space_set_n_plugs (space, 0);
+	pthread_mutex_unlock (&space->lock);
 }
 
 
 int
-iec61883_plug_impr_init (raw1394handle_t h, unsigned int data_rate)
+iec61883_plug_space_add (iec61883_plug_space_t space, unsigned int online,
+		unsigned int overhead_id, unsigned int payload)
 {
+	quadlet_t mpr, pcr = 0;
+	int i;
+
+	assert (space != NULL);
+
 	/* validate parameters */
-	if (data_rate >> 2 != 0)
-		errno = -EINVAL;
+	if (online >> 1 != 0 || overhead_id >> 4 != 0 || payload >> 10 != 0)
+		return -EINVAL;
+	if (!space->output && (overhead_id != 0 || payload != 0))
+		return -EINVAL;
+
+	if (space->output) {
+		((struct iec61883_oPCR *) &pcr)->online = online;
+		((struct iec61883_oPCR *) &pcr)->overhead_id = overhead_id;
+		((struct iec61883_oPCR *) &pcr)->payload = payload;
+	} else {
+		((struct iec61883_iPCR *) &pcr)->online = online;
+	}
+
+	pthread_mutex_lock (&space->lock);
+	mpr = space->regs[0];
+	i = space->output ? ((struct iec61883_oMPR *) &mpr)->n_plugs :
+		((struct iec61883_iMPR *) &mpr)->n_plugs;
+	if (i + 1 > IEC61883_PCR_MAX) {
+		pthread_mutex_unlock (&space->lock);
+		return -ENOSPC;
+	}
+
+	/* the plug is complete before it is counted */
+	space->regs[1 + i] = pcr;
+	__sync_synchronize ();
+	space_set_n_plugs (space, i + 1);
+	pthread_mutex_unlock (&space->lock);
 	
-	/* initialize data */
-	memset (&g_data_in, 0, sizeof (g_data_in));
-	g_data_in.mpr.data_rate = data_rate;
+	/* return which plug is added */
+	return i;
+}
 
-	/* initialize host environment */
-	memset (&g_arm_reqhandle_in, 0, sizeof(g_arm_reqhandle_in));
-	g_arm_reqhandle_in.arm_callback = (arm_req_callback_t) iec61883_arm_callback;
-	g_arm_reqhandle_in.pcontext = g_arm_callback_context_in;
 
-	/* register callback */
-	return raw1394_arm_register( h, CSR_REGISTER_BASE + CSR_I_MPR, sizeof(g_data_in),
-		(byte_t *) &g_data_in, (unsigned long) &g_arm_reqhandle_in, 
-		0, 0, ( RAW1394_ARM_READ | RAW1394_ARM_LOCK ) );
+int
+iec61883_plug_space_get (iec61883_plug_space_t space, int plug, quadlet_t *value)
+{
+	assert (space != NULL);
+	assert (value != NULL);
+	if (plug < -1 || plug >= IEC61883_PCR_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	*value = space->regs[1 + plug];
+	return 0;
+}
+
+
+int
+iec61883_plug_space_compare_swap (iec61883_plug_space_t space, int plug,
+		quadlet_t compare, quadlet_t swap, quadlet_t *old)
+{
+	quadlet_t result;
+
+	assert (space != NULL);
+	if (plug < -1 || plug >= IEC61883_PCR_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	result = space_swap (space, 1 + plug, compare, swap);
+	if (old)
+		*old = result;
+	return 0;
+}
+
+
+void
+iec61883_plug_space_set_notify (iec61883_plug_space_t space,
+		iec61883_plug_notify_t notify, void *callback_data)
+{
+	assert (space != NULL);
+	space->notify_data = callback_data;
+	space->notify = notify;
+}
+
+
+int
+iec61883_plug_space_get_event_fd (iec61883_plug_space_t space)
+{
+	int fd;
+
+	assert (space != NULL);
+	if (space->event_fd < 0) {
+		fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fd < 0)
+			return -1;
+		/* only one thread may create it */
+		if (!__sync_bool_compare_and_swap (&space->event_fd, -1, fd))
+			close (fd);
+	}
+	return space->event_fd;
+}
+
+
+int
+iec61883_plug_space_read_event (iec61883_plug_space_t space,
+		struct iec61883_plug_event *event)
+{
+	unsigned int tail;
+	uint64_t count;
+
+	assert (space != NULL);
+	assert (event != NULL);
+	tail = space->event_tail;
+	if (tail == space->event_head) {
+		/* clear the descriptor, then look again for an event that raced it */
+		if (space->event_fd >= 0 &&
+			read (space->event_fd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+			return -1;
+		if (tail == space->event_head)
+			return 0;
+	}
+	__sync_synchronize ();
+	*event = space->events[tail % PLUG_EVENTS];
+	__sync_synchronize ();
+	space->event_tail = tail + 1;
+	return 1;
+}
+
+
+unsigned int
+iec61883_plug_space_get_events_lost (iec61883_plug_space_t space)
+{
+	assert (space != NULL);
+	return space->events_lost;
+}
+
+
+/*
+ * The original interface keeps one space per direction for each handle,
+ * from iec61883_plug_[io]mpr_init() until iec61883_plug_[io]mpr_close().
+ */
+
+struct default_spaces {
+	raw1394handle_t handle;
+	iec61883_plug_space_t space[2];   /* input, output */
+	struct default_spaces *next;
+};
+
+static pthread_mutex_t g_default_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct default_spaces *g_default_spaces = NULL;
+
+/* with g_default_lock held; the entry of h, created if create is set */
+static struct default_spaces *
+default_spaces (raw1394handle_t h, int create)
+{
+	struct default_spaces *d;
+
+	for (d = g_default_spaces; d; d = d->next)
+		if (d->handle == h)
+			return d;
+	if (!create)
+		return NULL;
+	d = calloc (1, sizeof (struct default_spaces));
+	if (!d) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	d->handle = h;
+	d->next = g_default_spaces;
+	g_default_spaces = d;
+	return d;
+}
+
+/* with g_default_lock held; forget h once it has no spaces */
+static void
+default_spaces_prune (struct default_spaces *d)
+{
+	struct default_spaces **p;
+
+	if (d->space[0] || d->space[1])
+		return;
+	for (p = &g_default_spaces; *p; p = &(*p)->next) {
+		if (*p == d) {
+			*p = d->next;
+			free (d);
+			return;
+		}
+	}
+}
+
+static iec61883_plug_space_t
+default_space (raw1394handle_t h, int output)
+{
+	struct default_spaces *d;
+	iec61883_plug_space_t space;
+
+	pthread_mutex_lock (&g_default_lock);
+	d = default_spaces (h, 0);
+	space = d ? d->space[output] : NULL;
+	pthread_mutex_unlock (&g_default_lock);
+	return space;
+}
+
+static int
+default_space_init (raw1394handle_t h, int output, unsigned int data_rate,
+		unsigned int bcast_channel)
+{
+	struct default_spaces *d;
+	int result = -1;
+
+	pthread_mutex_lock (&g_default_lock);
+	d = default_spaces (h, 1);
+	if (d) {
+		if (d->space[output])
+			iec61883_plug_space_close (d->space[output]);
+		d->space[output] = iec61883_plug_space_init (h, output, data_rate, bcast_channel);
+		result = d->space[output] ? 0 : -1;
+		default_spaces_prune (d);
+	}
+	pthread_mutex_unlock (&g_default_lock);
+	return result;
+}
+
+static void
+default_space_clear (raw1394handle_t h, int output)
+{
+	iec61883_plug_space_t space = default_space (h, output);
+
+	if (space)
+		iec61883_plug_space_clear (space);
+}
+
+static int
+default_space_close (raw1394handle_t h, int output)
+{
+	struct default_spaces *d;
+	int result;
+
+	pthread_mutex_lock (&g_default_lock);
+	d = default_spaces (h, 0);
+	if (!d || !d->space[output]) {
+		pthread_mutex_unlock (&g_default_lock);
+		errno = EINVAL;
+		return -1;
+	}
+	result = iec61883_plug_space_close (d->space[output]);
+	d->space[output] = NULL;
+	default_spaces_prune (d);
+	pthread_mutex_unlock (&g_default_lock);
+	return result;
+}
+
+
+int
+iec61883_plug_impr_init (raw1394handle_t h, unsigned int data_rate)
+{
+	return default_space_init (h, 0, data_rate, 0);
 }
 
 
 void
 iec61883_plug_impr_clear (raw1394handle_t h)
 {
-	g_data_in.mpr.n_plugs = 0;
+	default_space_clear (h, 0);
 }
 
 
 int
 iec61883_plug_impr_close (raw1394handle_t h)
 {
-	g_data_in.mpr.n_plugs = 0;
-	return raw1394_arm_unregister(h, CSR_REGISTER_BASE + CSR_I_MPR);
+	return default_space_close (h, 0);
 }
 
 
 int
 iec61883_plug_ipcr_add (raw1394handle_t h, unsigned int online)
 {
-	int i = g_data_in.mpr.n_plugs;
-	
-	/* validate parameters */
-	if (g_arm_reqhandle_in.arm_callback == NULL)
+	iec61883_plug_space_t space = default_space (h, 0);
+
+	if (!space)
 		return -EPERM;
-	if (i + 1 > IEC61883_PCR_MAX)
-		return -ENOSPC;
-	if (online >> 1 != 0)
-		return -EINVAL;
-	
-	/* update data */
-	g_data_in.pcr[i].online = online;
-	g_data_in.mpr.n_plugs++;
-	
-	/* return which plug is added */
-	return i;
+	return iec61883_plug_space_add (space, online, 0, 0);
 }
 
 
@@ -354,41 +876,21 @@ int
 iec61883_plug_ompr_init (raw1394handle_t h, unsigned int data_rate,
 		unsigned int bcast_channel)
 {
-	/* validate parameters */
-	if (data_rate >> 2 != 0)
-		errno = -EINVAL;
-	if (bcast_channel >> 6 != 0)
-		errno = -EINVAL;
-	
-	/* initialize data */
-	memset (&g_data_out, 0, sizeof (g_data_out));
-	g_data_out.mpr.data_rate = data_rate;
-	g_data_out.mpr.bcast_channel = bcast_channel;
-
-	/* initialize host environment */
-	memset (&g_arm_reqhandle_out, 0, sizeof(g_arm_reqhandle_out));
-	g_arm_reqhandle_out.arm_callback = (arm_req_callback_t) iec61883_arm_callback;
-	g_arm_reqhandle_out.pcontext = g_arm_callback_context_out;
-
-	/* register callback */
-	return raw1394_arm_register( h, CSR_REGISTER_BASE + CSR_O_MPR, sizeof(g_data_out),
-		(byte_t *) &g_data_out, (unsigned long) &g_arm_reqhandle_out, 
-		0, 0, ( RAW1394_ARM_READ | RAW1394_ARM_LOCK ) );
+	return default_space_init (h, 1, data_rate, bcast_channel);
 }
 
 
 void
 iec61883_plug_ompr_clear (raw1394handle_t h)
 {
-	g_data_out.mpr.n_plugs = 0;
+	default_space_clear (h, 1);
 }
 
 
 int
 iec61883_plug_ompr_close (raw1394handle_t h)
 {
-	g_data_out.mpr.n_plugs = 0;
-	return raw1394_arm_unregister(h, CSR_REGISTER_BASE + CSR_O_MPR);
+	return default_space_close (h, 1);
 }
 
 
@@ -396,28 +898,9 @@ int
 iec61883_plug_opcr_add (raw1394handle_t h, unsigned int online,
 		unsigned int overhead_id, unsigned int payload)
 {
-	int i = g_data_out.mpr.n_plugs;
-	
-	/* validate parameters */
-	if (g_arm_reqhandle_out.arm_callback == NULL)
+	iec61883_plug_space_t space = default_space (h, 1);
+
+	if (!space)
 		return -EPERM;
-	if (i + 1 > IEC61883_PCR_MAX)
-		return -ENOSPC;
-	if (online >> 1 != 0)
-		return -EINVAL;
-	if (overhead_id >> 4 != 0)
-		return -EINVAL;
-	if (payload >> 10 != 0)
-		return -EINVAL;
-	
-	/* update plug */
-	g_data_out.pcr[i].online = online;
-	g_data_out.pcr[i].overhead_id = overhead_id;
-	g_data_out.pcr[i].payload = payload;
-	
-	/* increment the number of plugs available */
-	g_data_out.mpr.n_plugs++;
-	
-	/* return which plug is added */
-	return i;
+	return iec61883_plug_space_add (space, online, overhead_id, payload);
 }
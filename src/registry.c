@@ -0,0 +1,479 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Connection registry
+ *
+ * A bus reset clears the IRM registers and, per IEC 61883-1, makes nodes
+ * drop connections that are not re-established within one second. The
+ * registry remembers the connections made through cmp.c on a handle and
+ * restores them from the bus reset handler: first every channel and its
+ * bandwidth are reclaimed in order of priority, so that the most important
+ * connections win if the bus is now oversubscribed, then the plugs are
+ * checked and repaired. All of it goes through the asynchronous engine of
+ * cmpasync.c, so the transactions of all connections are in flight at once.
+ * The nodes are found again by GUID from a single scan of the bus, with a
+ * block read of the GUID of every node in flight at the same time.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "iec61883.h"
+#include "iec61883-private.h"
+#include "cooked.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <libraw1394/csr.h>
+#include <netinet/in.h>
+
+#define GUID_HI 0x0c
+#define GUID_LO 0x10
+
+#define MAX_NODES 63
+
+struct iec61883_connection {
+	struct iec61883_connection *next;
+	octlet_t output_guid;
+	octlet_t input_guid;
+	nodeid_t output;        // node ids in the last generation seen
+	nodeid_t input;
+	int oplug;
+	int iplug;
+	int channel;
+	int bandwidth;
+	int priority;
+	int error;              // outcome of the last restoration
+};
+
+static int
+node_guid (raw1394handle_t handle, nodeid_t node, octlet_t *guid)
+{
+	quadlet_t hi, lo;
+
+	if (iec61883_cooked_read (handle, node, CSR_REGISTER_BASE + CSR_CONFIG_ROM + GUID_HI,
+			sizeof (quadlet_t), &hi) < 0 ||
+		iec61883_cooked_read (handle, node, CSR_REGISTER_BASE + CSR_CONFIG_ROM + GUID_LO,
+			sizeof (quadlet_t), &lo) < 0)
+		return -1;
+	*guid = ((octlet_t) ntohl (hi) << 32) | ntohl (lo);
+	return 0;
+}
+
+// the GUIDs of the nodes on the bus, read once per restoration
+struct bus_guids;
+
+struct guid_read {
+	struct raw1394_reqhandle reqhandle;
+	struct bus_guids *bus;
+	int node;
+	int error;
+	quadlet_t buffer[2];
+};
+
+struct bus_guids {
+	int count;
+	int pending;            // reads in flight
+	int valid[MAX_NODES];
+	octlet_t guid[MAX_NODES];
+	struct guid_read reads[MAX_NODES];
+};
+
+static int
+guid_read_done (raw1394handle_t handle, void *data, raw1394_errcode_t err)
+{
+	struct guid_read *r = data;
+	struct bus_guids *bus = r->bus;
+
+	bus->pending--;
+	r->error = raw1394_errcode_to_errno (err);
+	if (r->error == 0) {
+		bus->guid[r->node] = ((octlet_t) ntohl (r->buffer[0]) << 32) | ntohl (r->buffer[1]);
+		bus->valid[r->node] = 1;
+	}
+	return 0;
+}
+
+// read the GUID of every node, all block reads at once; returns NULL on
+// failure, or a table that may lack nodes that did not answer
+static struct bus_guids *
+scan_guids (raw1394handle_t handle)
+{
+	struct bus_guids *bus = calloc (1, sizeof (struct bus_guids));
+	struct guid_read *r;
+	int n;
+
+	if (bus == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	bus->count = raw1394_get_nodecount (handle);
+	if (bus->count > MAX_NODES)
+		bus->count = MAX_NODES;
+	for (n = 0; n < bus->count; n++) {
+		r = &bus->reads[n];
+		r->reqhandle.callback = guid_read_done;
+		r->reqhandle.data = r;
+		r->bus = bus;
+		r->node = n;
+		r->error = EIO;
+		if (raw1394_start_read (handle, 0xffc0 | n,
+				CSR_REGISTER_BASE + CSR_CONFIG_ROM + GUID_HI, sizeof (r->buffer),
+				r->buffer, (unsigned long) &r->reqhandle) == 0)
+			bus->pending++;
+	}
+	while (bus->pending > 0)
+		if (raw1394_loop_iterate (handle) < 0 && errno != EINTR)
+			break;
+	if (bus->pending > 0) {
+		// the reads in flight point into the table
+		WARN ("%s: leaking a scan with %d reads in flight", __FUNCTION__, bus->pending);
+		errno = EIO;
+		return NULL;
+	}
+
+	// nodes without block reads of the ROM; nodes that did not respond
+	// are not asked again
+	for (n = 0; n < bus->count; n++)
+		if (!bus->valid[n] && bus->reads[n].error != ETIMEDOUT &&
+			node_guid (handle, 0xffc0 | n, &bus->guid[n]) == 0)
+			bus->valid[n] = 1;
+	return bus;
+}
+
+// find the node with guid, trying its previous node id first
+static int
+resolve_node (const struct bus_guids *bus, octlet_t guid, nodeid_t hint, nodeid_t *node)
+{
+	int n = hint & 0x3f;
+
+	if (n < bus->count && bus->valid[n] && bus->guid[n] == guid) {
+		*node = 0xffc0 | n;
+		return 0;
+	}
+	for (n = 0; n < bus->count; n++) {
+		if (bus->valid[n] && bus->guid[n] == guid) {
+			*node = 0xffc0 | n;
+			return 0;
+		}
+	}
+	errno = ENODEV;
+	return -1;
+}
+
+static int
+same_plug (int registered, int plug)
+{
+	return plug < 0 || registered < 0 || registered == plug;
+}
+
+void
+iec61883_registry_add (raw1394handle_t handle, nodeid_t output, int oplug,
+	nodeid_t input, int iplug, int channel, int bandwidth)
+{
+	struct iec61883_context *ctx = iec61883_context_get (handle);
+	struct iec61883_connection *c, **tail;
+
+	if (ctx == NULL || !ctx->registry_enabled)
+		return;
+
+	// a reconnection updates its entry
+	for (tail = &ctx->connections; (c = *tail); tail = &c->next) {
+		if (c->output == output && c->input == input && c->channel == channel &&
+			same_plug (c->oplug, oplug) && same_plug (c->iplug, iplug)) {
+			c->oplug = oplug;
+			c->iplug = iplug;
+			if (bandwidth > c->bandwidth)
+				c->bandwidth = bandwidth;
+			return;
+		}
+	}
+
+	c = calloc (1, sizeof (struct iec61883_connection));
+	if (c == NULL) {
+		WARN ("Out of memory recording the connection on channel %d", channel);
+		return;
+	}
+	if (node_guid (handle, output, &c->output_guid) < 0 ||
+		node_guid (handle, input, &c->input_guid) < 0) {
+		WARN ("Failed to read the GUIDs of the nodes connected on channel %d", channel);
+		free (c);
+		return;
+	}
+	c->output = output;
+	c->input = input;
+	c->oplug = oplug;
+	c->iplug = iplug;
+	c->channel = channel;
+	c->bandwidth = bandwidth;
+	*tail = c;
+}
+
+void
+iec61883_registry_remove (raw1394handle_t handle, nodeid_t output, int oplug,
+	nodeid_t input, int iplug, int channel)
+{
+	struct iec61883_context *ctx = iec61883_context_get (handle);
+	struct iec61883_connection *c, **p;
+
+	if (ctx == NULL)
+		return;
+	for (p = &ctx->connections; (c = *p); p = &c->next) {
+		if (c->output == output && c->input == input && c->channel == channel &&
+			same_plug (c->oplug, oplug) && same_plug (c->iplug, iplug)) {
+			*p = c->next;
+			free (c);
+			return;
+		}
+	}
+}
+
+struct restore_state {
+	struct iec61883_connection **entry;   // indexed by engine request id, NULL when done
+	int restored;
+};
+
+static void
+restore_done (iec61883_cmp_async_t cmp, const struct iec61883_cmp_async_result *result,
+	void *callback_data)
+{
+	struct restore_state *st = callback_data;
+	struct iec61883_connection *c = st->entry[result->id];
+
+	st->entry[result->id] = NULL;
+	c->error = result->error;
+	if (result->error) {
+		WARN ("Failed to restore the connection on channel %d: %s", c->channel,
+			strerror (result->error));
+	} else {
+		c->oplug = result->oplug;
+		c->iplug = result->iplug;
+		st->restored++;
+	}
+}
+
+static int
+registry_restore (struct iec61883_context *ctx, unsigned long long start,
+	struct iec61883_cmp_restore_report *report)
+{
+	raw1394handle_t handle = ctx->handle;
+	struct iec61883_connection *c, **order = NULL;
+	struct restore_state st;
+	struct bus_guids *bus = NULL;
+	iec61883_cmp_async_t cmp = NULL;
+	unsigned long long claimed = 0;
+	int bandwidth[64];
+	int n = 0, queued = 0, i, j, result = 0;
+
+	memset (&st, 0, sizeof (st));
+	memset (bandwidth, 0, sizeof (bandwidth));
+	for (c = ctx->connections; c; c = c->next) {
+		n++;
+		if (c->bandwidth > bandwidth[c->channel])
+			bandwidth[c->channel] = c->bandwidth;
+	}
+	if (n > 0) {
+		order = calloc (n, sizeof (*order));
+		st.entry = calloc (n, sizeof (*st.entry));
+		bus = scan_guids (handle);
+		cmp = iec61883_cmp_async_init (handle, restore_done, &st);
+		if (order == NULL || st.entry == NULL || bus == NULL || cmp == NULL) {
+			result = -1;
+			goto out;
+		}
+	}
+
+	// highest priority first, in the order made among equals
+	for (i = 0, c = ctx->connections; c; c = c->next, i++) {
+		for (j = i; j > 0 && order[j - 1]->priority < c->priority; j--)
+			order[j] = order[j - 1];
+		order[j] = c;
+	}
+
+	for (i = 0; i < n; i++) {
+		int claim;
+
+		c = order[i];
+		if (resolve_node (bus, c->output_guid, c->output, &c->output) < 0 ||
+			resolve_node (bus, c->input_guid, c->input, &c->input) < 0) {
+			c->error = ENODEV;
+			WARN ("A node connected on channel %d is gone", c->channel);
+			continue;
+		}
+		// one claim per channel for its largest bandwidth, overlays just check plugs
+		claim = !(claimed & (1ULL << c->channel));
+		claimed |= 1ULL << c->channel;
+
+		// ids count up from 0, and a request may complete while it is queued
+		st.entry[queued] = c;
+		if (iec61883_cmp_async_restore (cmp, c->output, c->oplug, c->input, c->iplug,
+				c->channel, bandwidth[c->channel], claim) < 0) {
+			c->error = errno;
+			st.entry[queued] = NULL;
+		} else {
+			queued++;
+		}
+	}
+
+	while (queued > 0 && iec61883_cmp_async_pending (cmp) > 0)
+		if (iec61883_cmp_async_iterate (cmp) < 0)
+			break;
+
+	// what did not complete when the loop failed is not restored
+	for (i = 0; i < queued; i++) {
+		if (st.entry[i]) {
+			st.entry[i]->error = EIO;
+			WARN ("Gave up restoring the connection on channel %d", st.entry[i]->channel);
+		}
+	}
+	if (st.restored < n) {
+		errno = EIO;
+		result = -1;
+	}
+
+out:
+	if (report) {
+		report->generation = raw1394_get_generation (handle);
+		report->restored = st.restored;
+		report->failed = n - st.restored;
+		report->recovery_time = iec61883_now_us () - start;
+	}
+	if (cmp)
+		iec61883_cmp_async_close (cmp);
+	free (bus);
+	free (st.entry);
+	free (order);
+	return result;
+}
+
+static int
+registry_bus_reset (raw1394handle_t handle, unsigned int generation)
+{
+	unsigned long long start = iec61883_now_us ();
+	struct iec61883_context *ctx = iec61883_context_get (handle);
+	struct iec61883_cmp_restore_report report;
+
+	if (ctx == NULL)
+		return 0;
+	if (ctx->registry_prev_reset)
+		ctx->registry_prev_reset (handle, generation);
+	else
+		raw1394_update_generation (handle, generation);
+
+	// a bus reset while restoring is handled by the outer call
+	if (ctx->restoring) {
+		ctx->restore_again = 1;
+		return 0;
+	}
+	ctx->restoring = 1;
+	do {
+		ctx->restore_again = 0;
+		registry_restore (ctx, start, &report);
+	} while (ctx->restore_again);
+	ctx->restoring = 0;
+
+	if (ctx->registry_report)
+		ctx->registry_report (handle, &report, ctx->registry_data);
+	return 0;
+}
+
+void
+iec61883_registry_release (struct iec61883_context *ctx)
+{
+	struct iec61883_connection *c;
+
+	if (ctx->registry_enabled && !ctx->stale)
+		raw1394_set_bus_reset_handler (ctx->handle, ctx->registry_prev_reset);
+	ctx->registry_enabled = 0;
+	while ((c = ctx->connections)) {
+		ctx->connections = c->next;
+		free (c);
+	}
+}
+
+int
+iec61883_cmp_registry_enable (raw1394handle_t handle,
+	iec61883_cmp_restore_report_t report, void *callback_data)
+{
+	struct iec61883_context *ctx;
+
+	assert (handle != NULL);
+	ctx = iec61883_context_get (handle);
+	if (ctx == NULL)
+		return -1;
+	ctx->registry_report = report;
+	ctx->registry_data = callback_data;
+	if (!ctx->registry_enabled) {
+		ctx->registry_prev_reset = raw1394_set_bus_reset_handler (handle, registry_bus_reset);
+		ctx->registry_enabled = 1;
+	}
+	return 0;
+}
+
+void
+iec61883_cmp_registry_disable (raw1394handle_t handle)
+{
+	struct iec61883_context *ctx;
+
+	assert (handle != NULL);
+	ctx = iec61883_context_get (handle);
+	if (ctx)
+		iec61883_registry_release (ctx);
+}
+
+int
+iec61883_cmp_registry_set_priority (raw1394handle_t handle, int channel, int priority)
+{
+	struct iec61883_context *ctx;
+	struct iec61883_connection *c;
+	int found = 0;
+
+	assert (handle != NULL);
+	ctx = iec61883_context_get (handle);
+	if (ctx == NULL)
+		return -1;
+	for (c = ctx->connections; c; c = c->next) {
+		if (c->channel == channel) {
+			c->priority = priority;
+			found = 1;
+		}
+	}
+	if (!found) {
+		errno = ENOENT;
+		return -1;
+	}
+	return 0;
+}
+
+int
+iec61883_cmp_restore (raw1394handle_t handle, struct iec61883_cmp_restore_report *report)
+{
+	struct iec61883_context *ctx;
+
+	assert (handle != NULL);
+	ctx = iec61883_context_get (handle);
+	if (ctx == NULL)
+		return -1;
+	return registry_restore (ctx, iec61883_now_us (), report);
+}
@@ -0,0 +1,337 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Stream ring
+ *
+ * A single producer, single consumer byte ring between the isochronous
+ * handler and an application thread. The handler side never blocks: what
+ * does not fit is counted as an overrun, what is missing as an underrun.
+ * The application side may block; it then sets a flag and sleeps on an
+ * eventfd, which the handler only writes when the flag is set and the
+ * watermark is reached, so a busy stream costs no system call per packet.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "iec61883.h"
+#include "iec61883-private.h"
+#include "ring.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+struct iec61883_ring
+{
+	unsigned char *buffer;
+	unsigned int size;              // a power of two
+	unsigned int watermark;
+	unsigned int unit;
+	volatile unsigned int head;     // advanced by the producer
+	volatile unsigned int tail;     // advanced by the consumer
+	volatile unsigned int overruns;
+	volatile unsigned int underruns;
+
+	// the application waits for want bytes to be ready
+	int event_fd;
+	volatile int waiting;
+	volatile unsigned int want;
+
+	int underrun_fails;
+};
+
+iec61883_ring_t
+iec61883_ring_open( unsigned int size, unsigned int watermark, unsigned int unit )
+{
+	struct iec61883_ring *self;
+	unsigned int n = 1;
+
+	if ( size == 0 || size > 0x40000000 )
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	while ( n < size )
+		n <<= 1;
+
+	self = calloc( 1, sizeof( struct iec61883_ring ) );
+	if ( self == NULL || ( self->buffer = malloc( n ) ) == NULL )
+	{
+		free( self );
+		errno = ENOMEM;
+		return NULL;
+	}
+	self->event_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	if ( self->event_fd < 0 )
+	{
+		int err = errno;
+		free( self->buffer );
+		free( self );
+		errno = err;
+		return NULL;
+	}
+	self->size = n;
+	self->watermark = watermark > 0 && watermark <= n ? watermark : n / 4;
+	self->unit = unit;
+
+	return self;
+}
+
+void
+iec61883_ring_close( iec61883_ring_t self )
+{
+	if ( self )
+	{
+		close( self->event_fd );
+		free( self->buffer );
+		free( self );
+	}
+}
+
+void
+iec61883_ring_set_unit( iec61883_ring_t self, unsigned int unit )
+{
+	self->unit = unit;
+}
+
+void
+iec61883_ring_set_underrun_fails( iec61883_ring_t self, int fails )
+{
+	self->underrun_fails = fails;
+}
+
+static void
+ring_copy_in( struct iec61883_ring *self, unsigned int pos, const unsigned char *data,
+	unsigned int len )
+{
+	unsigned int offset = pos & ( self->size - 1 );
+	unsigned int first = self->size - offset;
+
+	if ( first > len )
+		first = len;
+	memcpy( self->buffer + offset, data, first );
+	memcpy( self->buffer, data + first, len - first );
+}
+
+static void
+ring_copy_out( struct iec61883_ring *self, unsigned int pos, unsigned char *data,
+	unsigned int len )
+{
+	unsigned int offset = pos & ( self->size - 1 );
+	unsigned int first = self->size - offset;
+
+	if ( first > len )
+		first = len;
+	memcpy( data, self->buffer + offset, first );
+	memcpy( data + first, self->buffer, len - first );
+}
+
+// wake the application if it waits for what is now ready
+static void
+ring_wake( struct iec61883_ring *self, unsigned int ready )
+{
+	uint64_t one = 1;
+
+	// pairs with the barrier in ring_wait()
+	__sync_synchronize();
+	if ( self->waiting && ready >= self->want )
+	{
+		self->waiting = 0;
+		// this can only fail when the counter is huge, and then it is readable
+		if ( write( self->event_fd, &one, sizeof( one ) ) < 0 )
+			return;
+	}
+}
+
+int
+iec61883_ring_put( unsigned char *data, int len, unsigned int dropped, void *callback_data )
+{
+	iec61883_ring_t self = callback_data;
+	unsigned int head = self->head;
+
+	if ( len <= 0 )
+		return 0;
+	if ( self->size - ( head - self->tail ) < (unsigned int) len )
+	{
+		self->overruns++;
+		return 0;
+	}
+	ring_copy_in( self, head, data, len );
+	__sync_synchronize();
+	self->head = head + len;
+	ring_wake( self, head + len - self->tail );
+
+	return 0;
+}
+
+int
+iec61883_ring_get( unsigned char *data, int n, unsigned int dropped, void *callback_data )
+{
+	iec61883_ring_t self = callback_data;
+	unsigned int tail = self->tail;
+	unsigned int len = (unsigned int) n * self->unit;
+
+	if ( n <= 0 )
+		return 0;
+	if ( self->head - tail < len )
+	{
+		self->underruns++;
+		if ( self->underrun_fails )
+			return -1;
+		// keep the stream going rather than stall the bus
+		memset( data, 0, len );
+		return 0;
+	}
+	__sync_synchronize();
+	ring_copy_out( self, tail, data, len );
+	__sync_synchronize();
+	self->tail = tail + len;
+	ring_wake( self, self->size - ( self->head - tail - len ) );
+
+	return 0;
+}
+
+// sleep until ready() reaches want bytes, or until the deadline passes;
+// returns 0 when woken or timed out, -1 on error
+static int
+ring_wait( struct iec61883_ring *self, int reading, unsigned int want,
+	unsigned long long deadline, int timeout )
+{
+	struct pollfd pfd;
+	uint64_t count;
+	unsigned int ready;
+	int result;
+
+	self->want = want;
+	self->waiting = 1;
+	// pairs with the barrier in ring_wake(); look again after raising the flag
+	__sync_synchronize();
+	ready = reading ? self->head - self->tail : self->size - ( self->head - self->tail );
+	if ( ready >= want )
+	{
+		self->waiting = 0;
+		return 0;
+	}
+
+	if ( timeout > 0 )
+	{
+		unsigned long long now = iec61883_now_us();
+		timeout = now < deadline ? ( deadline - now + 999 ) / 1000 : 0;
+	}
+	pfd.fd = self->event_fd;
+	pfd.events = POLLIN;
+	result = poll( &pfd, 1, timeout );
+	self->waiting = 0;
+	if ( result < 0 && errno != EINTR )
+		return -1;
+	if ( read( self->event_fd, &count, sizeof( count ) ) < 0 && errno != EAGAIN )
+		return -1;
+
+	return 0;
+}
+
+int
+iec61883_ring_read( iec61883_ring_t self, void *data, unsigned int len, int timeout )
+{
+	unsigned long long deadline = 0;
+	unsigned int want = len < self->watermark ? len : self->watermark;
+	unsigned int tail, level;
+
+	if ( len == 0 )
+		return 0;
+	if ( timeout > 0 )
+		deadline = iec61883_now_us() + (unsigned long long) timeout * 1000;
+	for ( ;; )
+	{
+		tail = self->tail;
+		level = self->head - tail;
+		if ( level >= want || level >= len )
+			break;
+		if ( timeout == 0 || ( timeout > 0 && iec61883_now_us() >= deadline ) )
+			break;
+		if ( ring_wait( self, 1, want, deadline, timeout ) < 0 )
+			return -1;
+	}
+	if ( level == 0 )
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	if ( level > len )
+		level = len;
+	__sync_synchronize();
+	ring_copy_out( self, tail, data, level );
+	__sync_synchronize();
+	self->tail = tail + level;
+
+	return level;
+}
+
+int
+iec61883_ring_write( iec61883_ring_t self, const void *data, unsigned int len, int timeout )
+{
+	unsigned long long deadline = 0;
+	unsigned int want = len < self->watermark ? len : self->watermark;
+	unsigned int head, space;
+
+	if ( len == 0 )
+		return 0;
+	if ( timeout > 0 )
+		deadline = iec61883_now_us() + (unsigned long long) timeout * 1000;
+	for ( ;; )
+	{
+		head = self->head;
+		space = self->size - ( head - self->tail );
+		if ( space >= want || space >= len )
+			break;
+		if ( timeout == 0 || ( timeout > 0 && iec61883_now_us() >= deadline ) )
+			break;
+		if ( ring_wait( self, 0, want, deadline, timeout ) < 0 )
+			return -1;
+	}
+	if ( space == 0 )
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	if ( space > len )
+		space = len;
+	ring_copy_in( self, head, data, space );
+	__sync_synchronize();
+	self->head = head + space;
+
+	return space;
+}
+
+void
+iec61883_ring_get_stats( iec61883_ring_t self, struct iec61883_ring_stats *stats )
+{
+	stats->size = self->size;
+	stats->level = self->head - self->tail;
+	stats->watermark = self->watermark;
+	stats->overruns = self->overruns;
+	stats->underruns = self->underruns;
+}
@@ -0,0 +1,63 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _IEC61883_RING_H
+#define _IEC61883_RING_H
+
+typedef struct iec61883_ring* iec61883_ring_t;
+
+struct iec61883_ring_stats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a ring of at least size bytes, moved by the stream in units of unit bytes;
+// an application blocked on it is woken once watermark bytes are ready
+iec61883_ring_t iec61883_ring_open( unsigned int size, unsigned int watermark,
+	unsigned int unit );
+void iec61883_ring_close( iec61883_ring_t self );
+void iec61883_ring_set_unit( iec61883_ring_t self, unsigned int unit );
+
+// a transmit underrun fills the missing units with zeros, or when fails is
+// set makes iec61883_ring_get() return -1, for a stream that sends no data
+void iec61883_ring_set_underrun_fails( iec61883_ring_t self, int fails );
+
+// receive callback (iec61883_mpeg2_recv_t and iec61883_dv_recv_t) that
+// stores len bytes, or counts an overrun; callback_data is the ring
+int iec61883_ring_put( unsigned char *data, int len, unsigned int dropped,
+	void *callback_data );
+
+// transmit callback (iec61883_mpeg2_xmit_t and iec61883_dv_xmit_t) that
+// takes n units, or counts an underrun; callback_data is the ring
+int iec61883_ring_get( unsigned char *data, int n, unsigned int dropped,
+	void *callback_data );
+
+// the application side; timeout in milliseconds, -1 to block, 0 to poll
+int iec61883_ring_read( iec61883_ring_t self, void *data, unsigned int len, int timeout );
+int iec61883_ring_write( iec61883_ring_t self, const void *data, unsigned int len,
+	int timeout );
+
+void iec61883_ring_get_stats( iec61883_ring_t self, struct iec61883_ring_stats *stats );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _IEC61883_RING_H */
@@ -0,0 +1,259 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Streaming thread
+ *
+ * A runner services one raw1394 handle from a thread of its own. The
+ * thread sleeps in poll() on the handle and on an eventfd, without a
+ * timeout; other threads write the eventfd to stop it or to have it call
+ * the wakeup callback, which is how work that must run on the handle's
+ * thread gets there.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "iec61883.h"
+#include "iec61883-private.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+struct iec61883_runner {
+	raw1394handle_t handle;
+	struct iec61883_runner_options options;
+	iec61883_runner_wakeup_t wakeup;
+	void *callback_data;
+
+	pthread_mutex_t lock;          /* serialises start and stop */
+	pthread_t thread;
+	int running;                   /* a thread was started and not joined */
+	int event_fd;
+	volatile int stop;
+	volatile int active;           /* the thread is servicing the handle */
+	volatile int wakeups;
+	int status;                    /* why the thread ended */
+};
+
+static const struct iec61883_runner_options default_options = { 0, -1, 0 };
+
+static void *
+runner_thread (void *arg)
+{
+	struct iec61883_runner *runner = arg;
+	struct pollfd pfd[2];
+	uint64_t count;
+
+	pfd[0].fd = raw1394_get_fd (runner->handle);
+	pfd[0].events = POLLIN | POLLPRI;
+	pfd[1].fd = runner->event_fd;
+	pfd[1].events = POLLIN;
+
+	runner->status = 0;
+	while (!runner->stop) {
+		if (poll (pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			runner->status = errno;
+			break;
+		}
+		if (pfd[1].revents & POLLIN) {
+			if (read (runner->event_fd, &count, sizeof (count)) < 0 && errno != EAGAIN) {
+				runner->status = errno;
+				break;
+			}
+			if (runner->stop)
+				break;
+			if (__sync_lock_test_and_set (&runner->wakeups, 0) && runner->wakeup)
+				runner->wakeup (runner, runner->callback_data);
+		}
+		if (pfd[0].revents & (POLLIN | POLLPRI)) {
+			errno = 0;
+			if (raw1394_loop_iterate (runner->handle) != 0) {
+				runner->status = errno ? errno : EIO;
+				break;
+			}
+		} else if (pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			runner->status = EIO;
+			break;
+		}
+	}
+	runner->active = 0;
+	return NULL;
+}
+
+iec61883_runner_t
+iec61883_runner_init (raw1394handle_t handle,
+	const struct iec61883_runner_options *options,
+	iec61883_runner_wakeup_t wakeup, void *callback_data)
+{
+	struct iec61883_runner *runner;
+
+	assert (handle != NULL);
+	runner = calloc (1, sizeof (struct iec61883_runner));
+	if (!runner) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	runner->event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (runner->event_fd < 0) {
+		free (runner);
+		return NULL;
+	}
+	runner->handle = handle;
+	runner->options = options ? *options : default_options;
+	runner->wakeup = wakeup;
+	runner->callback_data = callback_data;
+	pthread_mutex_init (&runner->lock, NULL);
+	return runner;
+}
+
+static int
+runner_signal (struct iec61883_runner *runner)
+{
+	uint64_t one = 1;
+
+	return write (runner->event_fd, &one, sizeof (one)) < 0 && errno != EAGAIN ? -1 : 0;
+}
+
+int
+iec61883_runner_start (iec61883_runner_t runner)
+{
+	pthread_attr_t attr;
+	struct sched_param param;
+	int result;
+
+	assert (runner != NULL);
+	pthread_mutex_lock (&runner->lock);
+	if (runner->running) {
+		pthread_mutex_unlock (&runner->lock);
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (runner->options.lock_memory && mlockall (MCL_CURRENT | MCL_FUTURE) < 0) {
+		pthread_mutex_unlock (&runner->lock);
+		return -1;
+	}
+
+	pthread_attr_init (&attr);
+	if (runner->options.priority > 0) {
+		memset (&param, 0, sizeof (param));
+		param.sched_priority = runner->options.priority;
+		pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+		pthread_attr_setschedparam (&attr, &param);
+	}
+	if (runner->options.cpu >= 0) {
+		cpu_set_t cpus;
+
+		CPU_ZERO (&cpus);
+		CPU_SET (runner->options.cpu, &cpus);
+		pthread_attr_setaffinity_np (&attr, sizeof (cpus), &cpus);
+	}
+
+	runner->stop = 0;
+	runner->active = 1;
+	result = pthread_create (&runner->thread, &attr, runner_thread, runner);
+	pthread_attr_destroy (&attr);
+	if (result != 0) {
+		runner->active = 0;
+		pthread_mutex_unlock (&runner->lock);
+		errno = result;
+		return -1;
+	}
+	runner->running = 1;
+	pthread_mutex_unlock (&runner->lock);
+	return 0;
+}
+
+int
+iec61883_runner_stop (iec61883_runner_t runner)
+{
+	int status;
+
+	assert (runner != NULL);
+
+	/* from a callback on the thread itself, just ask it to end */
+	if (runner->active && pthread_equal (pthread_self (), runner->thread)) {
+		runner->stop = 1;
+		return 0;
+	}
+
+	pthread_mutex_lock (&runner->lock);
+	if (!runner->running) {
+		pthread_mutex_unlock (&runner->lock);
+		return 0;
+	}
+	runner->stop = 1;
+	runner_signal (runner);
+	pthread_join (runner->thread, NULL);
+	runner->running = 0;
+	status = runner->status;
+	pthread_mutex_unlock (&runner->lock);
+
+	if (status != 0) {
+		errno = status;
+		return -1;
+	}
+	return 0;
+}
+
+int
+iec61883_runner_wakeup (iec61883_runner_t runner)
+{
+	assert (runner != NULL);
+	runner->wakeups = 1;
+	return runner_signal (runner);
+}
+
+int
+iec61883_runner_is_active (iec61883_runner_t runner)
+{
+	assert (runner != NULL);
+	return runner->active;
+}
+
+int
+iec61883_runner_close (iec61883_runner_t runner)
+{
+	assert (runner != NULL);
+
+	/* the thread would return into the freed runner */
+	if (runner->active && pthread_equal (pthread_self (), runner->thread)) {
+		errno = EDEADLK;
+		return -1;
+	}
+	iec61883_runner_stop (runner);
+	close (runner->event_fd);
+	pthread_mutex_destroy (&runner->lock);
+	free (runner);
+	return 0;
+}
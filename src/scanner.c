@@ -0,0 +1,384 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Bus scanner
+ *
+ * Each port is scanned by its own thread on its own handle, so the
+ * transactions of different buses overlap. The configuration ROM of a
+ * node only changes along with its generation field, so the unit
+ * directories are kept per port by GUID and only read again for nodes
+ * that are new or whose ROM changed. Plug registers change with every
+ * connection and are read on each scan, one block read per direction.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "iec61883.h"
+#include "iec61883-private.h"
+#include "cooked.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <libraw1394/csr.h>
+#include <netinet/in.h>
+
+#define MAX_PORTS 16
+
+#define ROM_BASE (CSR_REGISTER_BASE + CSR_CONFIG_ROM)
+
+/* configuration ROM directory keys */
+#define KEY_VENDOR_ID      0x03
+#define KEY_UNIT_DIRECTORY 0xd1
+#define KEY_SPECIFIER_ID   0x12
+#define KEY_SW_VERSION     0x13
+
+/* a directory entry may not point further than this into the ROM */
+#define ROM_SIZE 1024
+
+struct rom_info {
+	struct rom_info *next;
+	octlet_t guid;
+	quadlet_t bus_options;      // bus info block quadlet 2, with the ROM generation
+	unsigned int vendor_id;
+	int n_units;
+	struct iec61883_unit_info units[IEC61883_SCAN_MAX_UNITS];
+	int valid;                  // the directories above were read
+	int seen;                   // in the last scan
+};
+
+struct port_scan {
+	int port;
+	raw1394handle_t handle;
+	struct rom_info *roms;      // cache of this port, by GUID
+	pthread_t thread;
+
+	// results of the last scan
+	struct iec61883_port_info info;
+	struct iec61883_node_info *nodes;
+};
+
+struct iec61883_scanner {
+	int n_ports;
+	struct port_scan ports[MAX_PORTS];
+};
+
+static int
+rom_read (raw1394handle_t handle, nodeid_t node, unsigned int offset, quadlet_t *value)
+{
+	if (offset >= ROM_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (iec61883_cooked_read (handle, node, ROM_BASE + offset, sizeof (quadlet_t), value) < 0)
+		return -1;
+	*value = ntohl (*value);
+	return 0;
+}
+
+// bus options and GUID, in one block read where the node supports it
+static int
+read_bus_info (raw1394handle_t handle, nodeid_t node, quadlet_t *bus_options, octlet_t *guid)
+{
+	quadlet_t q[3];
+	int i;
+
+	if (iec61883_cooked_read (handle, node, ROM_BASE + 8, sizeof (q), q) == 0) {
+		for (i = 0; i < 3; i++)
+			q[i] = ntohl (q[i]);
+	} else {
+		for (i = 0; i < 3; i++)
+			if (rom_read (handle, node, 8 + 4 * i, &q[i]) < 0)
+				return -1;
+	}
+	*bus_options = q[0];
+	*guid = ((octlet_t) q[1] << 32) | q[2];
+	return 0;
+}
+
+static void
+read_unit (raw1394handle_t handle, nodeid_t node, unsigned int dir,
+	struct iec61883_unit_info *unit)
+{
+	quadlet_t q;
+	unsigned int i, length;
+
+	if (rom_read (handle, node, dir, &q) < 0)
+		return;
+	length = q >> 16;
+	for (i = 1; i <= length; i++) {
+		if (rom_read (handle, node, dir + 4 * i, &q) < 0)
+			return;
+		if ((q >> 24) == KEY_SPECIFIER_ID)
+			unit->spec_id = q & 0xffffff;
+		else if ((q >> 24) == KEY_SW_VERSION)
+			unit->sw_version = q & 0xffffff;
+	}
+}
+
+// vendor and unit directories from the root directory
+static int
+read_rom (raw1394handle_t handle, nodeid_t node, struct rom_info *rom)
+{
+	quadlet_t q;
+	unsigned int i, length, root;
+
+	rom->vendor_id = 0;
+	rom->n_units = 0;
+	memset (rom->units, 0, sizeof (rom->units));
+	if (rom_read (handle, node, 0, &q) < 0)
+		return -1;
+	// a minimal ROM has only the vendor id in its first quadlet
+	if ((q >> 24) == 1) {
+		rom->vendor_id = q & 0xffffff;
+		return 0;
+	}
+	root = 4 * (1 + (q >> 24));
+	if (rom_read (handle, node, root, &q) < 0)
+		return -1;
+	length = q >> 16;
+	for (i = 1; i <= length; i++) {
+		unsigned int entry = root + 4 * i;
+
+		if (rom_read (handle, node, entry, &q) < 0)
+			return -1;
+		if ((q >> 24) == KEY_VENDOR_ID)
+			rom->vendor_id = q & 0xffffff;
+		else if ((q >> 24) == KEY_UNIT_DIRECTORY &&
+			rom->n_units < IEC61883_SCAN_MAX_UNITS)
+			read_unit (handle, node, entry + 4 * (q & 0xffffff),
+				&rom->units[rom->n_units++]);
+	}
+	return 0;
+}
+
+static struct rom_info *
+rom_lookup (struct port_scan *ps, octlet_t guid)
+{
+	struct rom_info *rom;
+
+	for (rom = ps->roms; rom; rom = rom->next)
+		if (rom->guid == guid)
+			return rom;
+	rom = calloc (1, sizeof (struct rom_info));
+	if (rom) {
+		rom->guid = guid;
+		rom->next = ps->roms;
+		ps->roms = rom;
+	}
+	return rom;
+}
+
+// forget nodes that have left the bus
+static void
+rom_prune (struct port_scan *ps)
+{
+	struct rom_info *rom, **p = &ps->roms;
+
+	while ((rom = *p)) {
+		if (rom->seen) {
+			rom->seen = 0;
+			p = &rom->next;
+		} else {
+			*p = rom->next;
+			free (rom);
+		}
+	}
+}
+
+static void
+scan_node (struct port_scan *ps, nodeid_t node, struct iec61883_node_info *info)
+{
+	raw1394handle_t handle = ps->handle;
+	struct rom_info *rom = NULL;
+	quadlet_t bus_options;
+
+	memset (info, 0, sizeof (*info));
+	info->port = ps->port;
+	info->node = node;
+	if (read_bus_info (handle, node, &bus_options, &info->guid) < 0) {
+		info->error = errno;
+		return;
+	}
+
+	rom = rom_lookup (ps, info->guid);
+	if (rom == NULL) {
+		info->error = ENOMEM;
+		return;
+	}
+	if (!rom->valid || rom->bus_options != bus_options) {
+		rom->bus_options = bus_options;
+		rom->valid = (read_rom (handle, node, rom) == 0);
+		if (!rom->valid)
+			info->error = errno;
+		info->rom_read = 1;
+	}
+	rom->seen = 1;
+	info->vendor_id = rom->vendor_id;
+	info->n_units = rom->n_units;
+	memcpy (info->units, rom->units, sizeof (info->units));
+
+	// a node without plugs leaves n_plugs zero; the cache may be out of date
+	if (iec61883_plug_read_outputs (handle, node, info->outputs) < 0)
+		memset (info->outputs, 0, sizeof (info->outputs));
+	if (iec61883_plug_read_inputs (handle, node, info->inputs) < 0)
+		memset (info->inputs, 0, sizeof (info->inputs));
+}
+
+static void *
+scan_port (void *arg)
+{
+	struct port_scan *ps = arg;
+	int i, n;
+
+	free (ps->nodes);
+	ps->nodes = NULL;
+	memset (&ps->info, 0, sizeof (ps->info));
+	ps->info.port = ps->port;
+
+	if (ps->handle == NULL) {
+		ps->handle = raw1394_new_handle_on_port (ps->port);
+		if (ps->handle == NULL) {
+			ps->info.error = errno;
+			return NULL;
+		}
+	}
+
+	n = raw1394_get_nodecount (ps->handle);
+	ps->info.generation = raw1394_get_generation (ps->handle);
+	ps->info.local_id = raw1394_get_local_id (ps->handle);
+	ps->nodes = calloc (n > 0 ? n : 1, sizeof (struct iec61883_node_info));
+	if (ps->nodes == NULL) {
+		ps->info.error = ENOMEM;
+		return NULL;
+	}
+	for (i = 0; i < n; i++)
+		scan_node (ps, 0xffc0 | i, &ps->nodes[i]);
+	ps->info.n_nodes = n;
+	rom_prune (ps);
+	return NULL;
+}
+
+iec61883_scanner_t
+iec61883_scanner_init (void)
+{
+	struct iec61883_scanner *scanner;
+	struct raw1394_portinfo pinf[MAX_PORTS];
+	raw1394handle_t handle;
+	int i, n;
+
+	handle = raw1394_new_handle ();
+	if (handle == NULL)
+		return NULL;
+	n = raw1394_get_port_info (handle, pinf, MAX_PORTS);
+	raw1394_destroy_handle (handle);
+	if (n < 0)
+		return NULL;
+
+	scanner = calloc (1, sizeof (struct iec61883_scanner));
+	if (scanner == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	scanner->n_ports = n < MAX_PORTS ? n : MAX_PORTS;
+	for (i = 0; i < scanner->n_ports; i++)
+		scanner->ports[i].port = i;
+	return scanner;
+}
+
+struct iec61883_topology *
+iec61883_scanner_scan (iec61883_scanner_t scanner)
+{
+	struct iec61883_topology *topology;
+	struct iec61883_node_info *node;
+	int i, n_nodes = 0, started[MAX_PORTS];
+
+	assert (scanner != NULL);
+
+	for (i = 0; i < scanner->n_ports; i++) {
+		started[i] = pthread_create (&scanner->ports[i].thread, NULL,
+			scan_port, &scanner->ports[i]) == 0;
+		// without a thread, scan the port from here
+		if (!started[i])
+			scan_port (&scanner->ports[i]);
+	}
+	for (i = 0; i < scanner->n_ports; i++) {
+		if (started[i])
+			pthread_join (scanner->ports[i].thread, NULL);
+		n_nodes += scanner->ports[i].info.n_nodes;
+	}
+
+	topology = calloc (1, sizeof (struct iec61883_topology) +
+		scanner->n_ports * sizeof (struct iec61883_port_info) +
+		n_nodes * sizeof (struct iec61883_node_info));
+	if (topology == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	topology->n_ports = scanner->n_ports;
+	topology->ports = (struct iec61883_port_info *) (topology + 1);
+	topology->n_nodes = n_nodes;
+	topology->nodes = (struct iec61883_node_info *) (topology->ports + scanner->n_ports);
+
+	node = topology->nodes;
+	for (i = 0; i < scanner->n_ports; i++) {
+		struct port_scan *ps = &scanner->ports[i];
+
+		topology->ports[i] = ps->info;
+		if (ps->info.n_nodes > 0)
+			memcpy (node, ps->nodes, ps->info.n_nodes * sizeof (*node));
+		node += ps->info.n_nodes;
+	}
+	return topology;
+}
+
+void
+iec61883_topology_free (struct iec61883_topology *topology)
+{
+	free (topology);
+}
+
+void
+iec61883_scanner_close (iec61883_scanner_t scanner)
+{
+	int i;
+
+	assert (scanner != NULL);
+	for (i = 0; i < scanner->n_ports; i++) {
+		struct port_scan *ps = &scanner->ports[i];
+		struct rom_info *rom;
+
+		while ((rom = ps->roms)) {
+			ps->roms = rom->next;
+			free (rom);
+		}
+		if (ps->handle) {
+			iec61883_handle_release (ps->handle);
+			raw1394_destroy_handle (ps->handle);
+		}
+		free (ps->nodes);
+	}
+	free (scanner);
+}
@@ -0,0 +1,238 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Stream statistics
+ *
+ * The handler of a stream counts into a copy of its own and publishes it
+ * under the sequence count at the end of each packet, so a reader on
+ * another thread takes no lock and never waits for a slow callback.
+ * raw1394 does not say which packets came with one interrupt; packets
+ * handled less than half a cycle apart are taken as one batch.
+ *
+ * Profiling adds where the time of each packet goes, how long batches
+ * take against the interrupt interval, and how far the handler runs from
+ * the cycle of its packets. The bus cycle is read from the cycle timer
+ * once per batch, as that is a system call.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "iec61883.h"
+#include "iec61883-private.h"
+
+#include <string.h>
+
+#define BATCH_GAP_NS 62500
+#define CYCLE_NS 125000
+
+/* 0 in bucket 0, then [1, 2), [2, 4), ... and the rest in the last */
+static int
+log2_bucket (unsigned long long value, int buckets)
+{
+	int bucket = 0;
+
+	while (value > 0 && bucket < buckets - 1) {
+		value >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+void
+iec61883_stats_init (struct iec61883_stream_stats *s)
+{
+	memset (s, 0, sizeof (*s));
+	s->dbc_next = -1;
+}
+
+void
+iec61883_stats_set_profiling (struct iec61883_stream_stats *s, int enable,
+	unsigned int irq_interval)
+{
+	s->deadline = (unsigned long long) irq_interval * CYCLE_NS;
+	s->batch_start = 0;
+	s->profiling = enable;
+}
+
+/* where the bus is against the cycle of the packet at hand */
+static void
+profile_lateness (struct iec61883_stream_stats *s, raw1394handle_t handle, int cycle)
+{
+	u_int32_t cycle_timer;
+	u_int64_t local_time;
+	int lateness;
+
+	if (cycle < 0 || handle == NULL ||
+		raw1394_read_cycle_timer (handle, &cycle_timer, &local_time) < 0)
+		return;
+	lateness = ((int) ((cycle_timer >> 12) & 0x1fff) - (cycle & 0x1fff) + 8000) % 8000;
+	if (lateness >= 4000)
+		lateness -= 8000;
+	if (lateness >= 0) {
+		s->profile_work.late[log2_bucket (lateness, IEC61883_PROFILE_BUCKETS)]++;
+		if ((unsigned int) lateness > s->profile_work.late_max)
+			s->profile_work.late_max = lateness;
+	} else {
+		s->profile_work.early[log2_bucket (-lateness, IEC61883_PROFILE_BUCKETS)]++;
+	}
+}
+
+/* account the batch ended by the last packet */
+static void
+profile_batch_end (struct iec61883_stream_stats *s)
+{
+	unsigned long long elapsed;
+
+	if (s->batch_start == 0)
+		return;
+	elapsed = s->last_packet - s->batch_start;
+	s->profile_work.batch[log2_bucket (elapsed / 1000, IEC61883_PROFILE_BUCKETS)]++;
+	if (elapsed > s->profile_work.batch_max)
+		s->profile_work.batch_max = elapsed;
+	if (s->deadline > 0 && elapsed > s->deadline)
+		s->profile_work.deadline_misses++;
+}
+
+void
+iec61883_stats_packet_begin (struct iec61883_stream_stats *s, raw1394handle_t handle,
+	int cycle)
+{
+	unsigned long long now = iec61883_now_ns ();
+	int first;
+
+	if (s->reset && __sync_lock_test_and_set (&s->reset, 0)) {
+		memset (&s->work, 0, sizeof (s->work));
+		memset (&s->profile_work, 0, sizeof (s->profile_work));
+	}
+
+	first = (s->last_packet == 0 || now - s->last_packet > BATCH_GAP_NS);
+	if (first) {
+		s->work.batches++;
+		s->batch = 0;
+	}
+	if (++s->batch > s->work.batch_max)
+		s->work.batch_max = s->batch;
+
+	if (s->profiling) {
+		if (first) {
+			profile_batch_end (s);
+			s->batch_start = now;
+			profile_lateness (s, handle, cycle);
+		}
+		s->packet_start = now;
+		s->packet_callback = 0;
+	}
+}
+
+void
+iec61883_stats_packet_end (struct iec61883_stream_stats *s, unsigned int len,
+	unsigned int dropped)
+{
+	int profiling = s->profiling && s->packet_start != 0;
+
+	s->work.packets++;
+	s->work.bytes += len;
+	if (len <= 8)
+		s->work.empty_packets++;
+	s->work.dropped += dropped;
+	s->last_packet = iec61883_now_ns ();
+
+	if (profiling) {
+		unsigned long long elapsed = s->last_packet - s->packet_start;
+		unsigned long long library = elapsed - s->packet_callback;
+
+		s->profile_work.library[log2_bucket (library / 1000, IEC61883_PROFILE_BUCKETS)]++;
+		s->profile_work.library_total += library;
+		s->profile_work.callback_total += s->packet_callback;
+		if (elapsed > CYCLE_NS)
+			s->profile_work.cycle_overruns++;
+		s->packet_start = 0;
+	}
+
+	iec61883_seq_write_begin (&s->seq);
+	memcpy (&s->snapshot, &s->work, sizeof (s->snapshot));
+	if (profiling)
+		memcpy (&s->profile_snapshot, &s->profile_work, sizeof (s->profile_snapshot));
+	iec61883_seq_write_end (&s->seq);
+}
+
+void
+iec61883_stats_dbc (struct iec61883_stream_stats *s, const unsigned char *data,
+	unsigned int len)
+{
+	const struct iec61883_packet *packet = (const struct iec61883_packet *) data;
+
+	if (len < 8 || packet->dbs == 0)
+		return;
+	if (s->dbc_next >= 0 && packet->dbc != s->dbc_next)
+		s->work.dbc_discontinuities++;
+	/* an empty packet carries the count of the next data block */
+	s->dbc_next = (packet->dbc + (len - 8) / (packet->dbs * 4)) & 0xff;
+}
+
+void
+iec61883_stats_callback_end (struct iec61883_stream_stats *s, unsigned long long start,
+	int failed)
+{
+	unsigned long long elapsed = iec61883_now_ns () - start;
+
+	s->packet_callback += elapsed;
+	s->work.callback_histogram[log2_bucket (elapsed / 1000, IEC61883_STATS_HISTOGRAM)]++;
+	if (elapsed > 0xffffffff)
+		elapsed = 0xffffffff;
+	if (s->work.callbacks == 0 || elapsed < s->work.callback_min)
+		s->work.callback_min = (unsigned int) elapsed;
+	if (elapsed > s->work.callback_max)
+		s->work.callback_max = (unsigned int) elapsed;
+	s->work.callback_total += elapsed;
+	s->work.callbacks++;
+	if (failed)
+		s->work.callback_errors++;
+}
+
+void
+iec61883_stats_get (struct iec61883_stream_stats *s, struct iec61883_stats *stats,
+	int reset)
+{
+	unsigned int start;
+
+	do {
+		start = iec61883_seq_read_begin (&s->seq);
+		memcpy (stats, &s->snapshot, sizeof (*stats));
+	} while (iec61883_seq_read_retry (&s->seq, start));
+	if (reset)
+		s->reset = 1;
+}
+
+void
+iec61883_stats_get_profile (struct iec61883_stream_stats *s,
+	struct iec61883_profile *profile, int reset)
+{
+	unsigned int start;
+
+	do {
+		start = iec61883_seq_read_begin (&s->seq);
+		memcpy (profile, &s->profile_snapshot, sizeof (*profile));
+	} while (iec61883_seq_read_retry (&s->seq, start));
+	if (reset)
+		s->reset = 1;
+}
@@ -0,0 +1,207 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Packet trace
+ *
+ * The handler of a stream keeps a compact record of each packet in a ring
+ * that it overwrites, so the last seconds of a stream can be looked at
+ * after the fact. Recording is a few stores; the time is the one the
+ * statistics already took. A dump from another thread copies the ring and
+ * keeps only the records the handler cannot have overwritten meanwhile.
+ * A failing packet stops the recording when there is an error file, and
+ * the file is written later, when the application stops or closes the
+ * stream, so the handler never allocates or does file I/O.
+ * The file is a struct iec61883_trace_header followed by the records, in
+ * the byte order of the host.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "iec61883.h"
+#include "iec61883-private.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct iec61883_trace
+{
+	struct iec61883_trace_record *records;
+	unsigned int size;              // a power of two
+	volatile unsigned int head;     // the sequence of the next record
+	char *error_file;
+	volatile int failed;            // stopped at a failing packet, not yet written
+};
+
+iec61883_trace_t
+iec61883_trace_open( unsigned int records, const char *error_file )
+{
+	struct iec61883_trace *self;
+	unsigned int n = 2;
+
+	if ( records > 0x1000000 )
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	while ( n < records )
+		n <<= 1;
+
+	self = calloc( 1, sizeof( struct iec61883_trace ) );
+	if ( self == NULL ||
+		( self->records = calloc( n, sizeof( struct iec61883_trace_record ) ) ) == NULL ||
+		( error_file != NULL && ( self->error_file = strdup( error_file ) ) == NULL ) )
+	{
+		if ( self )
+			free( self->records );
+		free( self );
+		errno = ENOMEM;
+		return NULL;
+	}
+	self->size = n;
+
+	return self;
+}
+
+void
+iec61883_trace_close( iec61883_trace_t self )
+{
+	if ( self )
+	{
+		iec61883_trace_flush( self );
+		free( self->error_file );
+		free( self->records );
+		free( self );
+	}
+}
+
+void
+iec61883_trace_packet( iec61883_trace_t self, unsigned long long time,
+	const unsigned char *data, unsigned int len, int channel, int tag, int cycle,
+	unsigned int dropped, int flags, enum raw1394_iso_disposition disposition )
+{
+	unsigned int head = self->head;
+	struct iec61883_trace_record *record = &self->records[ head & ( self->size - 1 ) ];
+
+	if ( self->failed )
+		return;
+	record->time = time;
+	record->sequence = head;
+	record->dropped = dropped;
+	if ( tag == IEC61883_TAG_WITH_CIP && len >= 8 )
+	{
+		memcpy( record->cip, data, sizeof( record->cip ) );
+		flags |= IEC61883_TRACE_CIP;
+	}
+	else
+	{
+		record->cip[0] = record->cip[1] = 0;
+	}
+	if ( dropped )
+		flags |= IEC61883_TRACE_DROPPED;
+	record->len = len;
+	record->cycle = cycle;
+	record->channel = channel;
+	record->tag = tag;
+	record->flags = flags;
+	record->disposition = disposition;
+	__sync_synchronize();
+	self->head = head + 1;
+
+	// keep what led up to the failure for iec61883_trace_flush()
+	if ( disposition == RAW1394_ISO_ERROR && self->error_file != NULL )
+		self->failed = 1;
+}
+
+void
+iec61883_trace_flush( iec61883_trace_t self )
+{
+	if ( self == NULL || !self->failed )
+		return;
+	if ( iec61883_trace_dump( self, self->error_file ) == 0 )
+	{
+		WARN( "Stream failed, packet trace written to %s", self->error_file );
+	}
+	else
+	{
+		WARN( "Stream failed, cannot write packet trace to %s", self->error_file );
+	}
+	self->failed = 0;
+}
+
+int
+iec61883_trace_dump( iec61883_trace_t self, const char *filename )
+{
+	struct iec61883_trace_header header;
+	struct iec61883_trace_record *copy;
+	unsigned int first, last, count, i, mask = self->size - 1;
+	FILE *file;
+	int result = 0;
+
+	copy = malloc( self->size * sizeof( struct iec61883_trace_record ) );
+	if ( copy == NULL )
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	last = self->head;
+	__sync_synchronize();
+	memcpy( copy, self->records, self->size * sizeof( struct iec61883_trace_record ) );
+	__sync_synchronize();
+
+	// what was written during the copy, and the record being written now,
+	// replaced records older than size - 1 from the current head
+	first = self->head - mask;
+	if ( (int) ( last - first ) < 0 )
+		first = last;
+	// slots never written still hold sequence 0
+	while ( first != last && copy[ first & mask ].sequence != first )
+		first++;
+	count = last - first;
+
+	file = fopen( filename, "wb" );
+	if ( file == NULL )
+	{
+		int err = errno;
+		free( copy );
+		errno = err;
+		return -1;
+	}
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, IEC61883_TRACE_MAGIC, sizeof( header.magic ) );
+	header.version = IEC61883_TRACE_VERSION;
+	header.record_size = sizeof( struct iec61883_trace_record );
+	header.records = count;
+	header.packets = last;
+	if ( fwrite( &header, sizeof( header ), 1, file ) != 1 )
+		result = -1;
+	for ( i = 0; result == 0 && i < count; i++ )
+		if ( fwrite( &copy[ ( first + i ) & mask ], sizeof( struct iec61883_trace_record ), 1, file ) != 1 )
+			result = -1;
+	if ( fclose( file ) != 0 )
+		result = -1;
+	free( copy );
+
+	return result;
+}
@@ -0,0 +1,54 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _IEC61883_TRACE_H
+#define _IEC61883_TRACE_H
+
+#include <libraw1394/raw1394.h>
+
+typedef struct iec61883_trace* iec61883_trace_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a trace of the last records packets, at least two; when error_file is not
+// NULL recording stops at a failing packet, and iec61883_trace_flush() or
+// iec61883_trace_close() write the trace there
+iec61883_trace_t iec61883_trace_open( unsigned int records, const char *error_file );
+void iec61883_trace_close( iec61883_trace_t self );
+
+// record a packet as the handler leaves it; time in nanoseconds, flags are
+// IEC61883_TRACE_XMIT and the like
+void iec61883_trace_packet( iec61883_trace_t self, unsigned long long time,
+	const unsigned char *data, unsigned int len, int channel, int tag, int cycle,
+	unsigned int dropped, int flags, enum raw1394_iso_disposition disposition );
+
+// write the trace, oldest record first, to filename; may be called from any thread
+int iec61883_trace_dump( iec61883_trace_t self, const char *filename );
+
+// write the trace to the error file if a packet failed since the last time,
+// and record again; not from the handler, and self may be NULL
+void iec61883_trace_flush( iec61883_trace_t self );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _IEC61883_TRACE_H */
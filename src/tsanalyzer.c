@@ -0,0 +1,258 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "iec61883.h"
+#include "iec61883-private.h"
+#include "tsanalyzer.h"
+
+// # of 24.576MHz ticks in one second of cycle time; SPH time wraps here
+#define TICKS_PER_SECOND (8000 * 3072)
+
+// PCR clock wraps after 2^33 * 300 units of 1 / 27MHz
+#define PCR_WRAP (((unsigned long long) 1 << 33) * 300)
+
+// ISO 13818-1 limit between two PCRs of a program
+#define PCR_INTERVAL_LIMIT_US 100000
+
+#define NULL_PID 0x1fff
+
+typedef unsigned char u8;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+typedef signed long long s64;
+
+struct pid_state
+{
+	int last_cc;       // -1 until the first packet
+	int have_pcr;
+	u64 last_pcr;
+	u64 last_pcr_arrival;
+	u32 window_packets;
+};
+
+struct tsanalyzer
+{
+	// published counters, guarded by seq
+	volatile unsigned int seq;
+	struct iec61883_mpeg2_analysis stats;
+	volatile int reset_request;
+
+	// PID to (index + 1) in stats.pid and state, 0 if not yet seen
+	u8 slot[ 8192 ];
+	struct pid_state state[ IEC61883_MPEG2_MAX_PIDS ];
+
+	// arrival time in 24.576MHz ticks, unwrapped from the SPH
+	int have_arrival;
+	u32 last_sph_ticks;
+	u64 arrival;
+
+	// bitrate measurement window
+	u64 window_start;
+	u32 window_packets;
+};
+
+static void
+tsanalyzer_reset (tsanalyzer_t this)
+{
+	memset (&this->stats, 0, sizeof (this->stats));
+	memset (this->slot, 0, sizeof (this->slot));
+	memset (this->state, 0, sizeof (this->state));
+	this->window_start = this->arrival;
+	this->window_packets = 0;
+}
+
+tsanalyzer_t
+tsanalyzer_init (void)
+{
+	return (tsanalyzer_t) calloc (1, sizeof (struct tsanalyzer));
+}
+
+void
+tsanalyzer_close (tsanalyzer_t this)
+{
+	free (this);
+}
+
+// returns the PCR clock, in units of 1 / 27MHz
+static u64
+get_pcr (const u8 *pcr)
+{
+	u64 base = ((u64) pcr[0] << 25) | (pcr[1] << 17) | (pcr[2] << 9) |
+		(pcr[3] << 1) | (pcr[4] >> 7);
+
+	return base * 300 + (((pcr[4] & 0x1) << 8) | pcr[5]);
+}
+
+static void
+update_bitrates (tsanalyzer_t this)
+{
+	u64 elapsed = this->arrival - this->window_start;
+	unsigned int i;
+
+	if (elapsed < TICKS_PER_SECOND)
+		return;
+
+	this->stats.bitrate = (u64) this->window_packets * 188 * 8 * TICKS_PER_SECOND / elapsed;
+	for (i = 0; i < this->stats.n_pids; i++) {
+		this->stats.pid[i].bitrate = (u64) this->state[i].window_packets * 188 * 8 *
+			TICKS_PER_SECOND / elapsed;
+		this->state[i].window_packets = 0;
+	}
+	this->window_packets = 0;
+	this->window_start = this->arrival;
+}
+
+static void
+check_pcr (struct iec61883_mpeg2_pid_stats *stats, struct pid_state *state,
+	const u8 *ts, u64 arrival)
+{
+	u64 pcr = get_pcr (&ts[6]);
+
+	stats->pcr_count++;
+	// discontinuity_indicator: the PCR timeline restarts
+	if (state->have_pcr && (ts[5] & 0x80) == 0) {
+		u64 delta_pcr = (pcr + PCR_WRAP - state->last_pcr) % PCR_WRAP;
+		u64 delta_arrival = arrival - state->last_pcr_arrival;
+		s64 jitter = (s64) delta_arrival - (s64) (delta_pcr * 1024 / 1125);
+		unsigned int interval = delta_arrival * 125 / 3072;
+		unsigned int abs_jitter;
+
+		stats->pcr_interval = interval;
+		if (interval > stats->pcr_interval_max)
+			stats->pcr_interval_max = interval;
+		if (interval > PCR_INTERVAL_LIMIT_US)
+			stats->pcr_interval_errors++;
+
+		stats->pcr_jitter = jitter * 15625 / 384; // ticks to nanoseconds
+		abs_jitter = stats->pcr_jitter < 0 ? -stats->pcr_jitter : stats->pcr_jitter;
+		if (abs_jitter > stats->pcr_jitter_max)
+			stats->pcr_jitter_max = abs_jitter;
+	}
+	state->have_pcr = 1;
+	state->last_pcr = pcr;
+	state->last_pcr_arrival = arrival;
+}
+
+static void
+analyze_packet (tsanalyzer_t this, const unsigned char *tsp)
+{
+	u32 sph = (tsp[0] << 24) | (tsp[1] << 16) | (tsp[2] << 8) | tsp[3];
+	u32 sph_ticks = ((sph >> 12) & 0x1fff) * 3072 + (sph & 0xfff);
+	const u8 *ts = tsp + 4;
+	int pid, cc, has_payload, has_adaptation, discontinuity;
+	struct iec61883_mpeg2_pid_stats *stats;
+	struct pid_state *state;
+	int i;
+
+	if (this->have_arrival)
+		this->arrival += (sph_ticks + TICKS_PER_SECOND - this->last_sph_ticks) % TICKS_PER_SECOND;
+	else
+		this->window_start = this->arrival;
+	this->have_arrival = 1;
+	this->last_sph_ticks = sph_ticks;
+
+	this->stats.packets++;
+	this->window_packets++;
+	update_bitrates (this);
+
+	if (ts[0] != 0x47) {
+		this->stats.sync_errors++;
+		return;
+	}
+	if (ts[1] & 0x80)
+		this->stats.transport_errors++;
+
+	pid = ((ts[1] << 8) | ts[2]) & 0x1fff;
+	i = this->slot[pid];
+	if (i == 0) {
+		if (this->stats.n_pids == IEC61883_MPEG2_MAX_PIDS) {
+			this->stats.untracked_packets++;
+			return;
+		}
+		i = this->stats.n_pids++;
+		this->slot[pid] = i + 1;
+		this->stats.pid[i].pid = pid;
+		this->state[i].last_cc = -1;
+	} else {
+		i--;
+	}
+	stats = &this->stats.pid[i];
+	state = &this->state[i];
+
+	stats->packets++;
+	state->window_packets++;
+	if (pid == NULL_PID)
+		return;
+
+	cc = ts[3] & 0x0f;
+	has_payload = ts[3] & 0x10;
+	has_adaptation = (ts[3] & 0x20) && ts[4] > 0;
+	discontinuity = has_adaptation && (ts[5] & 0x80);
+
+	if (state->last_cc >= 0 && !discontinuity) {
+		int expected = has_payload ? (state->last_cc + 1) & 0x0f : state->last_cc;
+
+		// a single duplicate packet is allowed
+		if (cc != expected && !(has_payload && cc == state->last_cc)) {
+			stats->cc_errors++;
+			this->stats.cc_errors++;
+		}
+	}
+	state->last_cc = cc;
+
+	// the flags byte and the 6 byte PCR must fit in adaptation_field_length
+	if (has_adaptation && ts[4] >= 7 && (ts[5] & 0x10))
+		check_pcr (stats, state, ts, this->arrival);
+}
+
+// only the update is under the sequence count, never the callback of the
+// stream, so a reader waits at most for one packet
+void
+tsanalyzer_packet (tsanalyzer_t this, const unsigned char *tsp)
+{
+	iec61883_seq_write_begin (&this->seq);
+	if (this->reset_request) {
+		tsanalyzer_reset (this);
+		this->reset_request = 0;
+	}
+	analyze_packet (this, tsp);
+	iec61883_seq_write_end (&this->seq);
+}
+
+void
+tsanalyzer_snapshot (tsanalyzer_t this, struct iec61883_mpeg2_analysis *analysis,
+	int reset)
+{
+	unsigned int start;
+
+	do {
+		start = iec61883_seq_read_begin (&this->seq);
+		memcpy (analysis, &this->stats, sizeof (*analysis));
+	} while (iec61883_seq_read_retry (&this->seq, start));
+
+	if (reset)
+		this->reset_request = 1;
+}
@@ -0,0 +1,52 @@
+/*
+ * libiec61883 - Linux IEEE 1394 streaming media library.
+ * Copyright (C) 2004 Kristian Hogsberg, Dan Dennedy, and Dan Maas.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _TSANALYZER_H
+#define _TSANALYZER_H
+
+#include "iec61883.h"
+
+struct tsanalyzer;
+typedef struct tsanalyzer* tsanalyzer_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+tsanalyzer_t
+tsanalyzer_init (void);
+
+void
+tsanalyzer_close (tsanalyzer_t self);
+
+// account one received source packet: 4 byte SPH followed by the TS packet;
+// readers see the counters as of a whole packet
+void
+tsanalyzer_packet (tsanalyzer_t self, const unsigned char *tsp);
+
+// copy the current counters; reset is carried out by the next tsanalyzer_packet
+void
+tsanalyzer_snapshot (tsanalyzer_t self, struct iec61883_mpeg2_analysis *analysis,
+	int reset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _TSANALYZER_H */
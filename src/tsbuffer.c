@@ -27,13 +27,23 @@
 #include <netinet/in.h>
 #include <string.h>
 
+#include "iec61883.h"
+#include "iec61883-private.h"
 #include "deque.h"
+#include "filesrc.h"
 #include "tsbuffer.h"
 
 // max # of packets to look ahead for PCRs
 // reasonable values: 1000 - 10000
 #define MAX_PCR_LOOKAHEAD 20000
 
+// max # of packets to wait for the PAT and PMT of the selected program
+// before falling back to the first PID that carries a PCR
+#define MAX_PSI_LOOKAHEAD 5000
+
+// PSI sections are at most 1024 bytes (ISO 13818-1 2.4.4.11)
+#define MAX_PSI_SECTION 1024
+
 // # of PCRs to average over when estimating bitrate
 // reasonable values: 1-100
 #define PCR_SMOOTH_INTERVAL 5
@@ -42,6 +52,13 @@
 // valid range is 0-10; good values are 5-15
 #define SYT_OFFSET 7
 
+// max # of TSPs in one ISO packet (968 byte packets, see mpeg2.c)
+#define MAX_TSP_PER_CYCLE 5
+
+// # of 24.576MHz ticks in one ISO cycle and in one second of cycle time
+#define TICKS_PER_CYCLE 3072
+#define TICKS_PER_SECOND (8000 * TICKS_PER_CYCLE)
+
 // leave this off for now; I don't think it's needed with the new algorithm
 #define ENABLE_PCR_DRIFT_CORRECTION 0
 
@@ -107,7 +124,7 @@ struct TSP_packet
 struct buf_cycle
 {
 	struct CIP_header header;
-	struct TSP_packet packet[ 3 ]; // up to three TSP packets
+	struct TSP_packet packet[ MAX_TSP_PER_CYCLE ];
 };
 
 // 188-byte MPEG-2 TS packet
@@ -163,6 +180,22 @@ ts_has_pcr( struct mpeg2_ts *ts, int pid )
 	return 0;
 }
 
+// MPEG-2 CRC32 as used by PSI sections; returns 0 over an intact section
+static u32
+psi_crc32( const u8 *data, u32 len )
+{
+	u32 crc = 0xffffffff;
+	int i;
+
+	while ( len-- > 0 )
+	{
+		crc ^= *data++ << 24;
+		for ( i = 0; i < 8; i++ )
+			crc = ( crc & 0x80000000 ) ? ( crc << 1 ) ^ 0x04c11db7 : crc << 1;
+	}
+
+	return crc;
+}
 
 
 /** tsbuffer ******************************************************************/
@@ -174,6 +207,7 @@ struct tsbuffer
 	iec61883_mpeg2_xmit_t read_packet;
 	void *callback_data;
 	unsigned int dropped;
+	iec61883_filesrc_t source; // if set, queued packets point into its mapping
 
 	// PCR state machine
 	u64 last_pcr;  // last PCR seen
@@ -191,12 +225,155 @@ struct tsbuffer
 
 	int selected_pid;
 
+	// PAT/PMT parsing to find the PCR PID when selected_pid is -1
+	int selected_program; // program_number to play, -1 for the first in the PAT
+	int psi_pid;          // PID of the wanted section: 0 for PAT, then the PMT; -1 when done
+	u32 psi_packets;      // # of packets read while looking for PSI
+	u32 psi_len;          // # of bytes in psi_section, 0 when not within a section
+	u8 psi_section[ MAX_PSI_SECTION ];
+
 	// ISO continuity counter
 	u32 iso_counter;
+
+	// timestamped input (enum iec61883_mpeg2_timestamp)
+	int timestamp_mode;
+	struct TSP_packet pending;  // next packet to send; sph is the raw input stamp
+	int have_pending;
+	u32 last_stamp;     // raw stamp of the previous input packet
+	u64 stamp_elapsed;  // input clock units since the first packet, unwrapped
+	u64 base_ticks;     // cycle time ticks at which stamp_elapsed == 0 is due
+	u64 iso_cycles;     // unwrapped ISO cycle count; iso_cycles % 8000 == cycle
+	u32 last_iso_cycle;
+	int started;
+	int live;           // a failed read is an underrun, not the end
 };
 
-tsbuffer_t
-tsbuffer_init (iec61883_mpeg2_xmit_t read_cb, void *callback_data, int pid)
+// a complete section has been collected in psi_section
+static void
+tsbuffer_parse_section (tsbuffer_t this)
+{
+	u8 *section = this->psi_section;
+	u32 len = this->psi_len;
+	u32 i;
+
+	if ( psi_crc32( section, len ) != 0 )
+		return;
+
+	if ( this->psi_pid == 0 && section[ 0 ] == 0x00 )
+	{
+		// PAT: program_number and program_map_PID pairs follow the 8 byte
+		// header up to the CRC
+		for ( i = 8; i + 4 <= len - 4; i += 4 )
+		{
+			int program = ( section[ i ] << 8 ) | section[ i + 1 ];
+			int pid = ( ( section[ i + 2 ] << 8 ) | section[ i + 3 ] ) & 0x1fff;
+
+			if ( program == 0 ) // network_PID
+				continue;
+			if ( this->selected_program == -1 || this->selected_program == program )
+			{
+				this->selected_program = program;
+				this->psi_pid = pid;
+				return;
+			}
+		}
+	}
+	else if ( section[ 0 ] == 0x02 &&
+	          ( ( section[ 3 ] << 8 ) | section[ 4 ] ) == this->selected_program )
+	{
+		// PMT: PCR_PID follows the 8 byte header
+		int pid = ( ( section[ 8 ] << 8 ) | section[ 9 ] ) & 0x1fff;
+
+		if ( pid != 0x1fff )
+			this->selected_pid = pid;
+		else
+			WARN ("program %d has no PCR; using the first PCR found",
+				this->selected_program);
+		this->psi_pid = -1;
+	}
+}
+
+// append payload bytes to the section being collected; returns the number
+// of bytes taken, fewer than len when the section ends before them
+static int
+tsbuffer_collect_section (tsbuffer_t this, const u8 *data, int len)
+{
+	u32 total, start = this->psi_len;
+	int avail = len;
+
+	if ( len > MAX_PSI_SECTION - (int) this->psi_len )
+		len = MAX_PSI_SECTION - this->psi_len;
+	memcpy( this->psi_section + this->psi_len, data, len );
+	this->psi_len += len;
+
+	if ( this->psi_len < 3 )
+		return avail;
+	total = 3 + ( ( ( this->psi_section[ 1 ] << 8 ) | this->psi_section[ 2 ] ) & 0x0fff );
+	if ( total > MAX_PSI_SECTION || total < 12 )
+	{
+		// the rest of the payload cannot be told apart from garbage
+		this->psi_len = 0;
+	}
+	else if ( this->psi_len >= total )
+	{
+		this->psi_len = total;
+		tsbuffer_parse_section( this );
+		this->psi_len = 0;
+		return total - start;
+	}
+	return avail;
+}
+
+static void
+tsbuffer_read_psi (tsbuffer_t this, struct mpeg2_ts *ts)
+{
+	u8 *payload = ts->ts_header + 4;
+	int len = 184;
+
+	if ( ts_get_pid( ts ) != this->psi_pid || ( ts->ts_header[ 3 ] & 0x10 ) == 0 )
+		return;
+	if ( ts->ts_header[ 3 ] & 0x20 )
+	{
+		len -= 1 + ts->adapt_len;
+		payload += 1 + ts->adapt_len;
+	}
+
+	if ( len > 0 && ( ts->ts_header[ 1 ] & 0x40 ) )
+	{
+		// payload_unit_start_indicator: pointer_field gives the section start
+		int pointer = payload[ 0 ];
+
+		if ( this->psi_len > 0 )
+			tsbuffer_collect_section( this, payload + 1, pointer < len - 1 ? pointer : len - 1 );
+		payload += 1 + pointer;
+		len -= 1 + pointer;
+		this->psi_len = 0;
+		// sections follow each other up to 0xFF stuffing
+		while ( len > 0 && payload[ 0 ] != 0xff && ts_get_pid( ts ) == this->psi_pid )
+		{
+			int used = tsbuffer_collect_section( this, payload, len );
+
+			payload += used;
+			len -= used;
+		}
+	}
+	else if ( len > 0 && this->psi_len > 0 )
+	{
+		tsbuffer_collect_section( this, payload, len );
+	}
+}
+
+// return a packet taken off ts_queue
+static void
+tsbuffer_release_ts (tsbuffer_t this, struct mpeg2_ts *ts)
+{
+	if (this->source == NULL)
+		free (ts);
+}
+
+static tsbuffer_t
+tsbuffer_create (iec61883_mpeg2_xmit_t read_cb, void *callback_data, int pid,
+	int program, iec61883_filesrc_t source)
 {
 	tsbuffer_t this = (tsbuffer_t) calloc (1, sizeof (struct tsbuffer));
 	if (this) {
@@ -207,10 +384,15 @@ tsbuffer_init (iec61883_mpeg2_xmit_t read_cb, void *callback_data, int pid)
 		this->tsp_accum = 0;
 		this->iso_counter = 0;
 		this->selected_pid = pid;
+		this->selected_program = program;
+		this->psi_pid = (pid == -1) ? 0 : -1;
+		this->psi_packets = 0;
+		this->psi_len = 0;
 		this->ts_queue = iec61883_deque_init();
 		this->read_packet = read_cb;
 		this->callback_data = callback_data;
 		this->dropped = 0;
+		this->source = source;
 		
 		// skip ahead to the first PCR
 		tsbuffer_read_to_next_pcr (this);
@@ -218,28 +400,56 @@ tsbuffer_init (iec61883_mpeg2_xmit_t read_cb, void *callback_data, int pid)
 	
 		// dump the useless packets that precede the first PCR
 		while (iec61883_deque_size (this->ts_queue) > 0)
-			free (iec61883_deque_pop_front (this->ts_queue));
+			tsbuffer_release_ts (this, iec61883_deque_pop_front (this->ts_queue));
 	
 		tsbuffer_refill (this);
 	}
 	return this;
 }
 
+tsbuffer_t
+tsbuffer_init (iec61883_mpeg2_xmit_t read_cb, void *callback_data, int pid,
+	int program)
+{
+	return tsbuffer_create (read_cb, callback_data, pid, program, NULL);
+}
+
+tsbuffer_t
+tsbuffer_init_file (iec61883_filesrc_t source, int pid, int program)
+{
+	return tsbuffer_create (iec61883_filesrc_read, source, pid, program, source);
+}
+
 
 void 
 tsbuffer_set_pid (tsbuffer_t this, int pid)
 {
 	this->selected_pid = pid;
+	if (pid != -1)
+		this->psi_pid = -1;
 }
 
 int
 tsbuffer_read_ts (tsbuffer_t this)
 {
-	struct mpeg2_ts* new_ts = calloc (1, sizeof (struct mpeg2_ts));
-	unsigned char *ts = (unsigned char*) new_ts;
+	struct mpeg2_ts* new_ts;
+	unsigned char *ts;
+
+	if (this->source) {
+		// no copy; the packet stays in the file mapping
+		new_ts = (struct mpeg2_ts*) iec61883_filesrc_next (this->source, 1);
+		if (new_ts == NULL)
+			return 0;
+		iec61883_deque_push_back (this->ts_queue, new_ts);
+		return 1;
+	}
 
-	if (this->read_packet (ts, 1, this->dropped, this->callback_data) < 0)
+	new_ts = calloc (1, sizeof (struct mpeg2_ts));
+	ts = (unsigned char*) new_ts;
+	if (this->read_packet (ts, 1, this->dropped, this->callback_data) < 0) {
+		free (new_ts);
 		return 0;
+	}
 	/* Do not necessarily indicate dropped packet on next call; rawiso handler 
 	   will set again when needed. */
 	this->dropped = 0;
@@ -254,17 +464,26 @@ tsbuffer_read_to_next_pcr (tsbuffer_t this)
 {
 	do {
 		if (iec61883_deque_size (this->ts_queue) > MAX_PCR_LOOKAHEAD) {
-			fprintf (stderr, "couldn't find a PCR within %d packets; giving up\n", MAX_PCR_LOOKAHEAD);
-			fprintf (stderr, "(try reducing PCR_SMOOTH_INTERVAL or increase MAX_PCR_LOOKAHEAD\n");
+			WARN ("couldn't find a PCR within %d packets; giving up "
+				"(try reducing PCR_SMOOTH_INTERVAL or increase MAX_PCR_LOOKAHEAD)",
+				MAX_PCR_LOOKAHEAD);
 			return 0;
 		}
 
 		if (tsbuffer_read_ts (this) == 0)
 			return 0;
-		if (this->selected_pid == -1 && ts_has_pcr(iec61883_deque_back (this->ts_queue), -1))
+		if (this->selected_pid == -1 && this->psi_pid >= 0) {
+			tsbuffer_read_psi (this, iec61883_deque_back (this->ts_queue));
+			if (this->psi_pid >= 0 && ++this->psi_packets > MAX_PSI_LOOKAHEAD) {
+				WARN ("couldn't find the PMT within %d packets; using the first PCR found", MAX_PSI_LOOKAHEAD);
+				this->psi_pid = -1;
+			}
+		}
+		if (this->selected_pid == -1 && this->psi_pid == -1 && ts_has_pcr(iec61883_deque_back (this->ts_queue), -1))
 			this->selected_pid = ts_get_pid (iec61883_deque_back (this->ts_queue));
 
-	} while (ts_has_pcr (iec61883_deque_back (this->ts_queue), this->selected_pid) == 0);
+	} while (this->selected_pid == -1 ||
+		ts_has_pcr (iec61883_deque_back (this->ts_queue), this->selected_pid) == 0);
 
 	return 1;
 }
@@ -344,6 +563,149 @@ tsbuffer_refill (tsbuffer_t this)
 	return 1;
 }
 
+/** timestamped input ********************************************************/
+
+// elapsed input clock units converted to 24.576MHz cycle time ticks
+static u64
+stamp_to_ticks (tsbuffer_t this, u64 elapsed)
+{
+	if (this->timestamp_mode == IEC61883_MPEG2_TIMESTAMP_M2TS)
+		return elapsed * 1024 / 1125;  // 24.576MHz / 27MHz
+	return elapsed;
+}
+
+// distance between two raw input stamps, in input clock units
+static u32
+stamp_delta (tsbuffer_t this, u32 stamp, u32 last)
+{
+	if (this->timestamp_mode == IEC61883_MPEG2_TIMESTAMP_M2TS)
+		return (stamp - last) & 0x3fffffff;
+	else {
+		u32 ticks = mpeg_ts_count (stamp) * TICKS_PER_CYCLE + mpeg_ts_offset (stamp);
+		u32 last_ticks = mpeg_ts_count (last) * TICKS_PER_CYCLE + mpeg_ts_offset (last);
+		return (ticks + TICKS_PER_SECOND - last_ticks) % TICKS_PER_SECOND;
+	}
+}
+
+// read the next timestamped packet into this->pending
+static int
+tsbuffer_read_timestamped (tsbuffer_t this)
+{
+	u32 stamp;
+
+	if (this->read_packet ((unsigned char*) &this->pending, 1, this->dropped,
+			this->callback_data) < 0) {
+		this->have_pending = 0;
+		return 0;
+	}
+	this->dropped = 0;
+
+	stamp = ntohl (this->pending.sph);
+	if (this->have_pending || this->started) {
+		u32 delta = stamp_delta (this, stamp, this->last_stamp);
+		this->stamp_elapsed += delta;
+		// a gap of a second or more is a discontinuity in the input;
+		// schedule the packet as if it followed immediately
+		if (stamp_to_ticks (this, delta) >= TICKS_PER_SECOND)
+			this->base_ticks = this->iso_cycles * TICKS_PER_CYCLE
+				- stamp_to_ticks (this, this->stamp_elapsed);
+	}
+	this->last_stamp = stamp;
+	this->have_pending = 1;
+
+	return 1;
+}
+
+tsbuffer_t
+tsbuffer_init_timestamped (iec61883_mpeg2_xmit_t read_cb, void *callback_data,
+	int mode, int live)
+{
+	tsbuffer_t this = (tsbuffer_t) calloc (1, sizeof (struct tsbuffer));
+	if (this) {
+		this->ts_queue = iec61883_deque_init();
+		this->read_packet = read_cb;
+		this->callback_data = callback_data;
+		this->selected_pid = -1;
+		this->timestamp_mode = mode;
+		this->live = live;
+
+		// nothing to analyze; just prime the first packet
+		if (tsbuffer_read_timestamped (this) == 0 && !live) {
+			tsbuffer_close (this);
+			return NULL;
+		}
+	}
+	return this;
+}
+
+// output one ISO cycle with every pending packet that is due in it
+static u32
+tsbuffer_send_timestamped (tsbuffer_t this, struct buf_cycle *cycle,
+	u32 iso_cycle, u8 src_node_id, unsigned int dropped)
+{
+	unsigned int n_tsps = 0;
+	u64 now;
+
+	this->dropped = dropped;
+
+	// nothing to send yet; an empty packet keeps the stream going
+	if (!this->have_pending && tsbuffer_read_timestamped (this) == 0) {
+		if (!this->live)
+			return 0;
+		if (this->started) {
+			this->iso_cycles += (iso_cycle + 8000 - this->last_iso_cycle) % 8000;
+			this->last_iso_cycle = iso_cycle;
+		}
+		fill_mpeg_cip_header (&cycle->header, src_node_id, this->iso_counter);
+		return sizeof (struct CIP_header);
+	}
+
+	if (!this->started) {
+		// the first packet goes out in this cycle
+		this->iso_cycles = iso_cycle;
+		this->base_ticks = this->iso_cycles * TICKS_PER_CYCLE;
+		this->started = 1;
+	} else {
+		this->iso_cycles += (iso_cycle + 8000 - this->last_iso_cycle) % 8000;
+	}
+	this->last_iso_cycle = iso_cycle;
+	now = this->iso_cycles * TICKS_PER_CYCLE;
+
+	// a second behind schedule; give up catching up and restart the clock
+	if (this->base_ticks + stamp_to_ticks (this, this->stamp_elapsed)
+			+ TICKS_PER_SECOND < now)
+		this->base_ticks = now - stamp_to_ticks (this, this->stamp_elapsed);
+
+	fill_mpeg_cip_header (&cycle->header, src_node_id, this->iso_counter);
+
+	while (n_tsps < MAX_TSP_PER_CYCLE) {
+		u64 due = this->base_ticks + stamp_to_ticks (this, this->stamp_elapsed);
+
+		if (due >= now + TICKS_PER_CYCLE)
+			break;
+
+		memcpy (cycle->packet[n_tsps].data, this->pending.data,
+			sizeof (this->pending.data));
+		// keep the offset within the cycle; late packets are sent as is
+		if (due < now)
+			due = now;
+		cycle->packet[n_tsps].sph = htonl (make_sph (
+			(due / TICKS_PER_CYCLE + SYT_OFFSET) % 8000, due % TICKS_PER_CYCLE));
+		n_tsps++;
+
+		if (tsbuffer_read_timestamped (this) == 0) {
+			if (!this->live)
+				return 0;
+			break;
+		}
+	}
+
+	// advance continuity counter by 8 per TSP in this cycle
+	this->iso_counter += 8 * n_tsps;
+
+	return sizeof (struct CIP_header) + n_tsps * sizeof (struct TSP_packet);
+}
+
 u32 
 tsbuffer_send_iso_cycle (tsbuffer_t this, void *data, 
 	u32 iso_cycle, u8 src_node_id, unsigned int dropped)
@@ -353,6 +715,10 @@ tsbuffer_send_iso_cycle (tsbuffer_t this, void *data,
 	unsigned int i;
 	struct buf_cycle *cycle = (struct buf_cycle*) data;
 		
+	if (this->timestamp_mode != IEC61883_MPEG2_TIMESTAMP_NONE)
+		return tsbuffer_send_timestamped (this, cycle, iso_cycle, src_node_id,
+			dropped);
+
 	this->dropped = dropped;
 
 top:
@@ -384,14 +750,14 @@ top:
 			if (ENABLE_PCR_DRIFT_CORRECTION) {
 				//if(pcr_drift_cycles % (5*PCR_DRIFT_INTERVAL*8000) == 0)
 				if ( ( drift > (s64) 27000000 ) | ( drift < (s64) -27000000) ) {
-					fprintf (stderr, "applying PCR correction of %lld\n", -drift);
+					WARN ("applying PCR correction of %lld", -drift);
 
 					// apply the drift correction
 					//this->last_pcr -= drift;
 					this->pcr_drift_ref = 0;
 					this->pcr_drift_cycles = 0;
 					while (iec61883_deque_size (this->ts_queue) > 0)
-						free (iec61883_deque_pop_front (this->ts_queue));
+						tsbuffer_release_ts (this, iec61883_deque_pop_front (this->ts_queue));
 					if (tsbuffer_refill (this) == 0)
 						return 0;
 					goto top;
@@ -414,7 +780,7 @@ top:
 			(char*) iec61883_deque_front (this->ts_queue), 
 			sizeof (struct mpeg2_ts));
 
-		free (iec61883_deque_pop_front (this->ts_queue));
+		tsbuffer_release_ts (this, iec61883_deque_pop_front (this->ts_queue));
 
 		// set timestamp to iso_cycle + SYT_OFFSET + 1000 offsets per TSP
 		// (since at most 3 TSP per packet; this will ensure monotonically
@@ -22,6 +22,7 @@
 #define _TSBUFFER_H
 
 #include "iec61883.h"
+#include "filesrc.h"
 
 struct tsbuffer;
 typedef struct tsbuffer* tsbuffer_t;
@@ -30,8 +31,23 @@ typedef struct tsbuffer* tsbuffer_t;
 extern "C" {
 #endif
 
+// with pid -1, the PCR PID of program (or the first program if -1) is
+// taken from the PAT and PMT
 tsbuffer_t
-tsbuffer_init (iec61883_mpeg2_xmit_t read_cb, void *callback_data, int pid);
+tsbuffer_init (iec61883_mpeg2_xmit_t read_cb, void *callback_data, int pid,
+	int program);
+
+// like tsbuffer_init, but packets are queued straight from the file mapping
+tsbuffer_t
+tsbuffer_init_file (iec61883_filesrc_t source, int pid, int program);
+
+// read_cb supplies 192-byte packets whose 4-byte prefix is a timestamp
+// in the format given by mode (enum iec61883_mpeg2_timestamp); with live
+// set, read_cb failing means no packet yet rather than the end of the
+// stream, and cycles go out empty until there is one
+tsbuffer_t
+tsbuffer_init_timestamped (iec61883_mpeg2_xmit_t read_cb, void *callback_data,
+	int mode, int live);
 	
 void
 tsbuffer_close (tsbuffer_t self);